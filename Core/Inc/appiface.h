@@ -18,6 +18,9 @@ struct appiface
 	volatile struct bl_params *bl;
 	struct actual *actual;
 	params_t *params;
+	mqueue_t *samples;
+	struct w25q_s *mem;
+	struct sim800l *mod;
 
 	params_t uparams;
 };
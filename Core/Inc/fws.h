@@ -17,6 +17,22 @@
 #define FWS_HEADER_SIZE  W25Q_SECTOR_SIZE
 #define FWS_PAYLOAD_ADDR (FWS_HEADER_ADDR + FWS_HEADER_SIZE)
 
+/*
+ * Staging area wear leveling: the payload starts at the least erased
+ * FWS_SHIFT_UNIT multiple (fws.shift) of the area and wraps around its end.
+ * Needs a bootloader that reads the payload by FWS_PAYLOAD_AT().
+ */
+//#define FWS_PAYLOAD_SHIFT
+#define FWS_SHIFT_UNIT W25Q_BLOCK_SIZE
+
+// Address of a payload byte, area - staging area size
+#ifdef FWS_PAYLOAD_SHIFT
+#define FWS_PAYLOAD_AT(fws, offset, area) \
+		(FWS_PAYLOAD_ADDR + ((fws)->shift + (offset)) % (area))
+#else
+#define FWS_PAYLOAD_AT(fws, offset, area) (FWS_PAYLOAD_ADDR + (offset))
+#endif
+
 #define FWS_WINBOND_MANUFACTURER_ID 0xEF
 
 #define FWS_CHECKSUM_INIT 0x5A5A5A5A
@@ -42,6 +58,7 @@ enum fws_status
  * @param size: Firmware size in bytes
  * @param checksum: Checksum
  * Sum of all firmware data (uint32_t) + FWS_CHECKSUM_INIT
+ * @param shift: Payload offset from FWS_PAYLOAD_ADDR if FWS_PAYLOAD_SHIFT
  */
 struct fws
 {
@@ -49,6 +66,9 @@ struct fws
 	uint32_t version;
 	uint32_t size;
 	uint32_t checksum;
+#ifdef FWS_PAYLOAD_SHIFT
+	uint32_t shift;
+#endif
 };
 
 /**
@@ -12,22 +12,54 @@
 
 #include "mfifo.h"
 
+/*
+ * Write combining: items are collected in RAM and written page by page.
+ * Items that are not written yet are lost on reset or power cut,
+ * MQUEUE_WCACHE_AGE limits the time an item can stay in RAM. Off: every
+ * item is on FLASH when mqueue_set_record() returns
+ */
+//#define MQUEUE_WCACHE
+#define MQUEUE_WCACHE_AGE pdMS_TO_TICKS(5 * 1000)
+
 struct item
 {
 	uint32_t value;
 	uint32_t timestamp;
 };
 
-typedef struct
+// Record queue element: record header and item
+#define MQUEUE_RECORD_SIZE MFIFO_RECORD_SIZE(sizeof(struct item))
+
+typedef struct mqueue
 {
 	struct mfifo mfifo;
+	struct mqueue *next;
 } mqueue_t;
 
 
 int mqueue_init(struct w25q_s *mem);
 mqueue_t *mqueue_create(size_t secnum);
+mqueue_t *mqueue_create_records(size_t secnum, size_t len);
+mqueue_t *mqueue_create_streams(size_t streams, size_t len);
 int mqueue_set(mqueue_t *queue, const void *element);
+int mqueue_set_record(mqueue_t *queue, uint8_t type, const void *data,
+		size_t len);
 int mqueue_get(mqueue_t *queue, void *element);
+int mqueue_set_many(mqueue_t *queue, const void *elements, size_t num);
+int mqueue_get_many(mqueue_t *queue, void *elements, size_t num);
+int mqueue_peek(mqueue_t *queue, void *elements, size_t num);
+int mqueue_commit(mqueue_t *queue, size_t num);
+int mqueue_peek_stream(mqueue_t *queue, uint8_t stream, void *records,
+		size_t num);
+int mqueue_commit_stream(mqueue_t *queue, uint8_t stream, size_t num);
 int mqueue_is_empty(mqueue_t *queue);
+int mqueue_count(mqueue_t *queue);
+int mqueue_count_stream(mqueue_t *queue, uint8_t stream);
+int mqueue_usage(mqueue_t *queue, struct mfifo_usage *usage);
+int mqueue_flush(mqueue_t *queue);
+void mqueue_flush_all(void);
+void mqueue_flush_expired(void);
+int mqueue_erase_ahead(void);
+uint32_t mqueue_erase_sync(void);
 
 #endif /* MQUEUE_H_ */
@@ -10,15 +10,13 @@
 #include <string.h>
 
 #include "cmsis_os.h"
+#include "crc.h"
 
 #define I2C_ADDRESS 0x70
 
 #define I2C_STATUS_CALIB_MASK 0x08 // 0000 1000
 #define I2C_STATUS_BUSY_MASK  0x80 // 1000 0000
 
-#define CRC_INITIAL_VALUE 0xFF
-#define CRC_POLYNOMIAL    0x31
-
 #define I2C_TIMEOUT 50
 
 #define POW2_20  1048576
@@ -75,25 +73,6 @@ int aht20_is_available(struct aht20 *sen)
 	return 0;
 }
 
-static uint8_t calc_crc8(uint8_t *data, size_t size)
-{
-	uint8_t crc = CRC_INITIAL_VALUE;
-
-	for (size_t i = 0; i < size; i++)
-	{
-		crc ^= data[i];
-		for (uint8_t bit = 0; bit < 8; bit++)
-		{
-			if (crc & 0x80)
-				crc = (crc << 1) ^ CRC_POLYNOMIAL;
-			else
-				crc = (crc << 1);
-		}
-	}
-
-	return crc;
-}
-
 /******************************************************************************/
 int aht20_read(struct aht20 *sen, int32_t *temp, int32_t *hum)
 {
@@ -148,7 +127,7 @@ int aht20_read(struct aht20 *sen, int32_t *temp, int32_t *hum)
 		return -1;
 
 	/* CRC */
-	if (calc_crc8(buf, 6) != buf[6])
+	if (crc8(CRC8_INIT, buf, 6) != buf[6])
 		return -1;
 
 	raw_hum = (uint32_t) buf[1] << 12 | (uint32_t) buf[2] << 4 | buf[3] >> 4;
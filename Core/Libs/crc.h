@@ -0,0 +1,36 @@
+/*
+ * CRC calculation (table-driven)
+ *
+ * Dmitry Proshutinsky <dproshutinsky@gmail.com>
+ * 2026
+ */
+
+#ifndef CRC_H_
+#define CRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC6_INIT 0x00
+#define CRC8_INIT 0xFF
+
+
+/*
+ * @brief: CRC-6 (reflected, polynomial 0x30), storage element checksum
+ * @param crc: initial value (CRC6_INIT)
+ * @param data: data buffer
+ * @param len: data buffer length (in bytes)
+ * @retval: 6-bit CRC value
+ */
+uint8_t crc6(uint8_t crc, const uint8_t *data, size_t len);
+
+/*
+ * @brief: CRC-8 (polynomial 0x31), AHT20 checksum
+ * @param crc: initial value (CRC8_INIT)
+ * @param data: data buffer
+ * @param len: data buffer length (in bytes)
+ * @retval: CRC value
+ */
+uint8_t crc8(uint8_t crc, const uint8_t *data, size_t len);
+
+#endif /* CRC_H_ */
@@ -9,15 +9,23 @@
 
 #include <string.h>
 
-#define CRC6_INIT 0x00
-#define CRC6_POLY 0x30
+#include "crc.h"
 
 #define MUTEX_TIMEOUT pdMS_TO_TICKS(100)
 
-#define sector_addr(addr) ((addr / MFIFO_SECTOR_SIZE) * MFIFO_SECTOR_SIZE)
-
 #define phys_element_size(m) (m->esize + sizeof(struct header))
 
+#define slots_page(m) (m->pagesize / phys_element_size(m))
+#define slots_sector(m) (slots_page(m) * (m->secsize / m->pagesize))
+#define slots_rectag(m) \
+	((sizeof(struct rectag) + phys_element_size(m) - 1) / phys_element_size(m))
+
+#define NO_SECTOR ((size_t) -1)
+#define ANY_STREAM (-1)
+
+#define RECTAG_WRITTEN 0x01 // "set" has left the sector
+#define RECTAG_READ    0x02 // "get" has left the sector
+
 struct header
 {
 	uint8_t wr : 1;
@@ -25,6 +33,33 @@ struct header
 	uint8_t cs : 6;
 };
 
+/*
+ * Sector tag (recovery), it takes first slots of every sector
+ * seq: sector number in order of writing, it grows every time the sector is
+ *     erased and opened by "set"
+ * nseq: ~seq, invalid (erased or partially programmed) tag protection
+ * flags: RECTAG_* bits, bit is cleared when the event has happened
+ */
+struct rectag
+{
+	uint32_t seq;
+	uint32_t nseq;
+	uint32_t flags;
+};
+
+
+static uint32_t slot_addr(struct mfifo *mfifo, size_t sector, size_t slot)
+{
+	return sector * mfifo->secsize +
+			(slot / slots_page(mfifo)) * mfifo->pagesize +
+			(slot % slots_page(mfifo)) * phys_element_size(mfifo);
+}
+
+// First element address inside a sector (right after the sector tag)
+inline static uint32_t data_offset(struct mfifo *mfifo)
+{
+	return slot_addr(mfifo, 0, slots_rectag(mfifo));
+}
 
 /******************************************************************************/
 int mfifo_init(struct mfifo *mfifo, struct w25q_s *mem, size_t pagesize,
@@ -36,7 +71,11 @@ int mfifo_init(struct mfifo *mfifo, struct w25q_s *mem, size_t pagesize,
 	if (addr % secsize)
 		return -MFIFO_ERR_INVALID_ARGUMENT;
 
-	if (secsize % pagesize)
+	if (!pagesize || (secsize % pagesize))
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if (pagesize < sizeof(struct rectag) ||
+			pagesize < (esize + sizeof(struct header)))
 		return -MFIFO_ERR_INVALID_ARGUMENT;
 
 	memset(mfifo, 0, sizeof(*mfifo));
@@ -47,16 +86,36 @@ int mfifo_init(struct mfifo *mfifo, struct w25q_s *mem, size_t pagesize,
 	mfifo->addr = addr;
 	mfifo->secnum = secnum;
 
-	mfifo->set = 0;
-	mfifo->get = 0;
+	if (slots_sector(mfifo) <= slots_rectag(mfifo))
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	mfifo->set = data_offset(mfifo);
+	mfifo->get = data_offset(mfifo);
+	mfifo->seq = 0;
+	mfifo->peek = mfifo->get;
+	mfifo->peeked = 0;
+
+	mfifo->erased = NO_SECTOR;
+	mfifo->erasing = NO_SECTOR;
+	mfifo->erase_ret = 0;
 
 	mfifo->mutex = xSemaphoreCreateMutex();
 	if (!mfifo->mutex)
 		return -MFIFO_ERR_ALLOC;
 
-	mfifo->buf = pvPortMalloc(phys_element_size(mfifo));
+	mfifo->emutex = xSemaphoreCreateMutex();
+	if (!mfifo->emutex)
+	{
+		vSemaphoreDelete(mfifo->mutex);
+		return -MFIFO_ERR_ALLOC;
+	}
+
+	// Page sized buffer: batch operations work with whole page runs,
+	// one more element is used to form records
+	mfifo->buf = pvPortMalloc(mfifo->pagesize + mfifo->esize);
 	if (!mfifo->buf)
 	{
+		vSemaphoreDelete(mfifo->emutex);
 		vSemaphoreDelete(mfifo->mutex);
 		return -MFIFO_ERR_ALLOC;
 	}
@@ -67,20 +126,24 @@ int mfifo_init(struct mfifo *mfifo, struct w25q_s *mem, size_t pagesize,
 inline static int phys_read(struct mfifo *mfifo, uint32_t addr, uint8_t *data,
 	size_t len)
 {
-	w25q_s_read_data(mfifo->mem, mfifo->addr + addr, data, len);
+	if (w25q_s_read_data(mfifo->mem, mfifo->addr + addr, data, len))
+		return -1;
 	return 0;
 }
 
 inline static int phys_write(struct mfifo *mfifo, uint32_t addr,
 	const uint8_t *data, size_t len)
 {
-	w25q_s_write_data(mfifo->mem, mfifo->addr + addr, (uint8_t *) data, len);
+	if (w25q_s_write_buffer(mfifo->mem, mfifo->addr + addr, (uint8_t *) data,
+			len))
+		return -1;
 	return 0;
 }
 
 inline static int phys_erase(struct mfifo *mfifo, uint32_t addr)
 {
-	w25q_s_sector_erase(mfifo->mem, mfifo->addr + addr);
+	if (w25q_s_sector_erase(mfifo->mem, mfifo->addr + addr))
+		return -1;
 	return 0;
 }
 
@@ -99,13 +162,162 @@ static uint32_t next_addr(struct mfifo *mfifo, uint32_t addr)
 	if (next / mfifo->secsize == mfifo->secnum)
 		next = 0;
 
+	// Skip sector tag
+	if ((next % mfifo->secsize) == 0)
+		next += data_offset(mfifo);
+
 	return next;
 }
 
-/******************************************************************************/
-int mfifo_recover(struct mfifo *mfifo)
+/*
+ * @retval: sector tag "seq" value or 0 if sector tag is not valid
+ */
+static uint32_t rectag_read(struct mfifo *mfifo, size_t sector,
+		uint32_t *flags)
+{
+	struct rectag tag;
+
+	if (phys_read(mfifo, sector * mfifo->secsize, (uint8_t *) &tag,
+			sizeof(tag)) < 0)
+		return 0;
+
+	if (!tag.seq || (tag.seq != ~tag.nseq))
+		return 0;
+
+	if (flags)
+		*flags = tag.flags;
+	return tag.seq;
+}
+
+static struct header header_read(struct mfifo *mfifo, size_t sector,
+		size_t slot)
+{
+	struct header header;
+
+	phys_read(mfifo, slot_addr(mfifo, sector, slot), (uint8_t *) &header,
+			sizeof(header));
+	return header;
+}
+
+// Last slot of the sector is followed by the first slot of the next sector
+inline static uint32_t slot_or_next(struct mfifo *mfifo, size_t sector,
+		size_t slot)
+{
+	if (slot < slots_sector(mfifo))
+		return slot_addr(mfifo, sector, slot);
+	return next_addr(mfifo, slot_addr(mfifo, sector, slot - 1));
+}
+
+/*
+ * Sectors are opened one after another around the area, so "seq" values form
+ * a sorted array rotated at the newest sector. Erased sectors are older than
+ * any other. Both fifo borders are found with binary searches: one sector tag
+ * or element header read per step
+ */
+static int recover(struct mfifo *mfifo)
 {
-	return -MFIFO_ERR_NOT_SUPPORTED; // TODO
+	size_t first = slots_rectag(mfifo);
+	size_t slots = slots_sector(mfifo);
+	size_t newest, sector;
+	size_t lo, hi, mid;
+	uint32_t seq, flags;
+	struct header header;
+
+	// Newest sector
+	seq = rectag_read(mfifo, 0, NULL);
+	if (seq)
+	{
+		lo = 0;
+		hi = mfifo->secnum - 1;
+		while (lo < hi)
+		{
+			mid = (lo + hi + 1) / 2;
+			if (rectag_read(mfifo, mid, NULL) >= seq)
+				lo = mid;
+			else
+				hi = mid - 1;
+		}
+		newest = lo;
+	}
+	else
+	{
+		// Sector 0 is erased: area is empty or "set" has just wrapped around
+		newest = mfifo->secnum - 1;
+	}
+
+	flags = 0;
+	seq = rectag_read(mfifo, newest, &flags);
+	if (!seq)
+		return 0; // Empty
+
+	// "set": first free slot of the newest sector
+	lo = slots;
+	if (flags & RECTAG_WRITTEN)
+	{
+		lo = first;
+		hi = slots;
+		while (lo < hi)
+		{
+			mid = (lo + hi) / 2;
+			header = header_read(mfifo, newest, mid);
+			if (!header.wr)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+	}
+	mfifo->set = slot_or_next(mfifo, newest, lo);
+	mfifo->seq = seq;
+
+	// "get" sector: oldest sector that has not been read out yet,
+	// sectors are checked from the oldest (newest + 1) to the newest one
+	lo = 0;
+	hi = mfifo->secnum;
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		sector = (newest + 1 + mid) % mfifo->secnum;
+		flags = 0;
+		if (rectag_read(mfifo, sector, &flags) && (flags & RECTAG_READ))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	// Everything was read
+	if (lo == mfifo->secnum)
+	{
+		mfifo->get = mfifo->set;
+		return 0;
+	}
+	sector = (newest + 1 + lo) % mfifo->secnum;
+
+	// Stream mode: records are read out of order, the sector is scanned later
+	if (mfifo->cursors)
+	{
+		// Full fifo: "set" waits at the sector, its first slot is read out
+		lo = first;
+		if (slot_addr(mfifo, sector, first) == mfifo->set)
+			lo++;
+		mfifo->get = slot_or_next(mfifo, sector, lo);
+		return 0;
+	}
+
+	// "get": first element that has not been read yet
+	lo = first;
+	hi = slots;
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		header = header_read(mfifo, sector, mid);
+		if (!header.wr && !header.rd)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	mfifo->get = slot_or_next(mfifo, sector, lo);
+
+	return 0;
 }
 
 inline static int is_empty(struct mfifo *mfifo)
@@ -126,28 +338,14 @@ int mfifo_is_empty(struct mfifo *mfifo)
 	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
 		return -MFIFO_ERR_LOCK;
 
-	ret = is_empty(mfifo);
+	ret = is_empty(mfifo) && !mfifo->staged;
 	xSemaphoreGive(mfifo->mutex);
 	return ret;
 }
 
-static uint8_t crc6(const uint8_t *data, size_t len)
+inline static uint32_t sector_base(struct mfifo *mfifo, uint32_t addr)
 {
-	uint8_t crc = CRC6_INIT;
-
-	for (int i = 0; i < len; i++)
-	{
-		crc ^= data[i];
-		for (int j = 0; j < 8; j++)
-		{
-			if ((crc & 1) == 0)
-				crc >>= 1;
-			else
-				crc = (crc >> 1) ^ CRC6_POLY;
-		}
-	}
-
-	return crc & 0x3F;
+	return (addr / mfifo->secsize) * mfifo->secsize;
 }
 
 inline static int is_diff_sectors(struct mfifo *mfifo, uint32_t addr,
@@ -158,21 +356,139 @@ inline static int is_diff_sectors(struct mfifo *mfifo, uint32_t addr,
 	return 0;
 }
 
+inline static int rectag_open(struct mfifo *mfifo)
+{
+	struct rectag tag;
+
+	tag.seq = mfifo->seq + 1;
+	tag.nseq = ~tag.seq;
+	tag.flags = 0xFFFFFFFF;
+
+	if (phys_write(mfifo, sector_base(mfifo, mfifo->set), (uint8_t *) &tag,
+			sizeof(tag)) < 0)
+		return -1;
+
+	mfifo->seq = tag.seq;
+	return 0;
+}
+
+inline static int rectag_flag(struct mfifo *mfifo, uint32_t addr,
+		uint32_t flag)
+{
+	uint32_t flags = ~flag;
+
+	return phys_write(mfifo, sector_base(mfifo, addr) +
+			offsetof(struct rectag, flags), (uint8_t *) &flags, sizeof(flags));
+}
+
 inline static int rectag_set(struct mfifo *mfifo)
 {
-	return -1; // TODO
+	return rectag_flag(mfifo, mfifo->set, RECTAG_WRITTEN);
 }
 
 inline static int rectag_get(struct mfifo *mfifo)
 {
-	return -1; // TODO
+	return rectag_flag(mfifo, mfifo->get, RECTAG_READ);
 }
 
-inline static int element_set(struct mfifo *mfifo, const void *element)
+/*
+ * @brief: sector that will be opened by "set" next
+ * @retval: sector number or NO_SECTOR if it still has elements to read
+ */
+static size_t ahead_sector(struct mfifo *mfifo)
+{
+	size_t sector = mfifo->set / mfifo->secsize;
+
+	// "set" is inside of an opened sector
+	if ((mfifo->set % mfifo->secsize) != data_offset(mfifo))
+	{
+		sector = (sector + 1) % mfifo->secnum;
+		if (sector == (mfifo->set / mfifo->secsize))
+			return NO_SECTOR; // The only sector
+	}
+
+	if ((mfifo->set != mfifo->get) &&
+			((mfifo->get / mfifo->secsize) == sector))
+		return NO_SECTOR;
+
+	return sector;
+}
+
+/*
+ * @brief: erase sector before opening it, the sector could be already erased
+ *     in advance (mfifo_erase_ahead())
+ */
+static int sector_erase(struct mfifo *mfifo, size_t sector)
+{
+	int ret = 0;
+
+	if (mfifo->erasing == sector)
+	{
+		// Wait for erase-ahead
+		xSemaphoreTake(mfifo->emutex, portMAX_DELAY);
+		xSemaphoreGive(mfifo->emutex);
+		mfifo->erasing = NO_SECTOR;
+
+		if (mfifo->erase_ret < 0)
+		{
+			ret = phys_erase(mfifo, sector * mfifo->secsize);
+			mfifo->erase_sync++;
+		}
+	}
+	else if (mfifo->erased != sector)
+	{
+		ret = phys_erase(mfifo, sector * mfifo->secsize);
+		mfifo->erase_sync++;
+	}
+
+	mfifo->erased = NO_SECTOR;
+	return ret;
+}
+
+/*
+ * @brief: number of elements that can be placed in one page run
+ * @param addr: first element address
+ * @param end: address that should not be reached by the run ("get" for "set"
+ *     runs, "set" for "get" runs)
+ * @param reach: run may end right before "end" (0) or at "end" (1)
+ */
+static size_t run_length(struct mfifo *mfifo, uint32_t addr, uint32_t end,
+		int reach)
+{
+	size_t num = slots_page(mfifo) - (addr % mfifo->pagesize) /
+			phys_element_size(mfifo);
+	size_t lim;
+
+	// "end" is further in the same page
+	if ((end > addr) && ((end / mfifo->pagesize) == (addr / mfifo->pagesize)))
+	{
+		lim = (end - addr) / phys_element_size(mfifo);
+		if (!reach)
+			lim--;
+		if (lim < num)
+			num = lim;
+	}
+	// "end" is right after the page
+	else if (!reach && (next_addr(mfifo, addr + (num - 1) *
+			phys_element_size(mfifo)) == end))
+	{
+		num--;
+	}
+
+	return num;
+}
+
+/*
+ * @brief: store elements in one page run (single page program)
+ * @retval: number of stored elements, negative error value on failure
+ */
+static int run_set(struct mfifo *mfifo, const uint8_t *elements, size_t num)
 {
-	uint8_t *payload = &mfifo->buf[sizeof(struct header)];
 	struct header header;
-	uint32_t next;
+	uint8_t *payload;
+	uint8_t type;
+	uint32_t last, next;
+	size_t len;
 	int ret;
 
 	// Get next "set"
@@ -181,7 +497,7 @@ inline static int element_set(struct mfifo *mfifo, const void *element)
 		return -MFIFO_ERR_NO_FREE_SPACE;
 
 	// Sector beginning
-	if ((mfifo->set % mfifo->secsize) == 0)
+	if ((mfifo->set % mfifo->secsize) == data_offset(mfifo))
 	{
 		// mfifo is not empty
 		// "set" and "get" in the same sector
@@ -194,38 +510,163 @@ inline static int element_set(struct mfifo *mfifo, const void *element)
 		// Erase
 		else
 		{
-			ret = phys_erase(mfifo, mfifo->set);
+			ret = sector_erase(mfifo, mfifo->set / mfifo->secsize);
 			if (ret < 0)
 				return -MFIFO_ERR_IO; // Can not erase sector
+
+			// Recovery
+			ret = rectag_open(mfifo);
+			if (ret < 0)
+				return -MFIFO_ERR_IO; // Can not write
 		}
 	}
 
-	// Copy payload to buffer
-	memcpy(payload, element, mfifo->esize);
+	len = run_length(mfifo, mfifo->set, mfifo->get, 0);
+	if (num > len)
+		num = len;
+
+	// Form elements
+	for (size_t i = 0; i < num; i++)
+	{
+		payload = &mfifo->buf[i * phys_element_size(mfifo) +
+				sizeof(struct header)];
+
+		memcpy(payload, &elements[i * mfifo->esize], mfifo->esize);
 
-	// Form header
-	header.wr = 0;
-	header.rd = 1;
-	header.cs = crc6(payload, mfifo->esize);
+		header.wr = 0;
+		header.rd = 1;
+		header.cs = crc6(CRC6_INIT, payload, mfifo->esize);
 
-	// Copy header to buffer
-	memcpy(mfifo->buf, &header, sizeof(struct header));
+		memcpy(payload - sizeof(struct header), &header, sizeof(header));
+	}
 
-	// Write element
-	ret = phys_write(mfifo, mfifo->set, mfifo->buf, phys_element_size(mfifo));
+	// Write elements
+	ret = phys_write(mfifo, mfifo->set, mfifo->buf,
+			num * phys_element_size(mfifo));
 	if (ret < 0)
 		return -MFIFO_ERR_IO; // Can not write
 
+	// Stream mode: unread records of every stream
+	for (size_t i = 0; mfifo->cursors && (i < num); i++)
+	{
+		type = elements[i * mfifo->esize]; // struct mfifo_record
+		if (type < mfifo->streams)
+			mfifo->cursors[type].count++;
+	}
+
+	last = mfifo->set + (num - 1) * phys_element_size(mfifo);
+	next = next_addr(mfifo, last);
+
 	// Recovery
-	if (is_diff_sectors(mfifo, mfifo->set, next))
+	if (is_diff_sectors(mfifo, last, next))
 		rectag_set(mfifo);
 
 	// Update "set"
 	mfifo->set = next;
 
+	return num;
+}
+
+inline static int element_set(struct mfifo *mfifo, const void *element)
+{
+	int ret = run_set(mfifo, element, 1);
+	if (ret < 0)
+		return ret;
+	return 0;
+}
+
+/*
+ * @brief: write staged elements (write combining)
+ * @retval: 0 on success, negative error value on failure
+ */
+static int flush(struct mfifo *mfifo)
+{
+	size_t done = 0;
+	int ret = 0;
+
+	while (done < mfifo->staged)
+	{
+		ret = run_set(mfifo, &mfifo->wcbuf[done * mfifo->esize],
+				mfifo->staged - done);
+		if (ret < 0)
+			break;
+		done += ret;
+	}
+
+	// Keep elements that were not written
+	mfifo->staged -= done;
+	if (mfifo->staged && done)
+		memmove(mfifo->wcbuf, &mfifo->wcbuf[done * mfifo->esize],
+				mfifo->staged * mfifo->esize);
+
+	if (ret < 0)
+		return ret;
+	return 0;
+}
+
+inline static int is_expired(struct mfifo *mfifo)
+{
+	if (!mfifo->staged || !mfifo->wcage)
+		return 0;
+	return (xTaskGetTickCount() - mfifo->wctick) >= mfifo->wcage;
+}
+
+/*
+ * @brief: number of elements that fit in the page run at "set"
+ */
+static size_t stage_room(struct mfifo *mfifo)
+{
+	if (next_addr(mfifo, mfifo->set) == mfifo->get)
+		return 0;
+
+	// Sector beginning, "set" and "get" in the same sector
+	if (((mfifo->set % mfifo->secsize) == data_offset(mfifo)) &&
+			(mfifo->set != mfifo->get) &&
+			((mfifo->set / mfifo->secsize) == (mfifo->get / mfifo->secsize)))
+		return 0;
+
+	return run_length(mfifo, mfifo->set, mfifo->get, 0);
+}
+
+/*
+ * @brief: add element to the RAM page buffer, the page is programmed when it
+ *     is full or when the oldest staged element is too old
+ * @retval: 0 on success, negative error value on failure
+ */
+static int element_stage(struct mfifo *mfifo, const void *element)
+{
+	size_t room = stage_room(mfifo);
+
+	if (mfifo->staged >= room)
+	{
+		// Previous flush has failed
+		if (flush(mfifo) < 0)
+			return -MFIFO_ERR_NO_FREE_SPACE;
+
+		room = stage_room(mfifo);
+		if (!room)
+			return -MFIFO_ERR_NO_FREE_SPACE;
+	}
+
+	memcpy(&mfifo->wcbuf[mfifo->staged * mfifo->esize], element,
+			mfifo->esize);
+	if (!mfifo->staged)
+		mfifo->wctick = xTaskGetTickCount();
+	mfifo->staged++;
+
+	if ((mfifo->staged >= room) || is_expired(mfifo))
+		return flush(mfifo);
+
 	return 0;
 }
 
+inline static int element_store(struct mfifo *mfifo, const void *element)
+{
+	if (mfifo->wcbuf)
+		return element_stage(mfifo, element);
+	return element_set(mfifo, element);
+}
+
 /******************************************************************************/
 int mfifo_set(struct mfifo *mfifo, const void *element)
 {
@@ -237,69 +678,1014 @@ int mfifo_set(struct mfifo *mfifo, const void *element)
 	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
 		return -MFIFO_ERR_LOCK;
 
-	ret = element_set(mfifo, element);
+	ret = element_store(mfifo, element);
 	xSemaphoreGive(mfifo->mutex);
 	return ret;
 }
 
-inline static int element_get(struct mfifo *mfifo, void *element)
+/******************************************************************************/
+int mfifo_set_record(struct mfifo *mfifo, uint8_t type, const void *data,
+		size_t len)
+{
+	struct mfifo_record *record;
+	int ret;
+
+	if (!mfifo || (!data && len))
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if ((len > UINT8_MAX) || (MFIFO_RECORD_SIZE(len) > mfifo->esize))
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
+		return -MFIFO_ERR_LOCK;
+
+	// Record takes one element, unused bytes are left erased
+	record = (struct mfifo_record *) &mfifo->buf[mfifo->pagesize];
+	memset(record, 0xFF, mfifo->esize);
+	record->type = type;
+	record->len = len;
+	if (len)
+		memcpy(record->data, data, len);
+
+	ret = element_store(mfifo, record);
+	xSemaphoreGive(mfifo->mutex);
+	return ret;
+}
+
+/******************************************************************************/
+int mfifo_set_many(struct mfifo *mfifo, const void *elements, size_t num)
+{
+	const uint8_t *p = elements;
+	size_t done = 0;
+	int ret = 0;
+
+	if (!mfifo || !elements || !num)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
+		return -MFIFO_ERR_LOCK;
+
+	// Keep order of elements
+	ret = flush(mfifo);
+
+	while ((ret >= 0) && (done < num))
+	{
+		ret = run_set(mfifo, &p[done * mfifo->esize], num - done);
+		if (ret < 0)
+			break;
+		done += ret;
+	}
+
+	xSemaphoreGive(mfifo->mutex);
+
+	if (done)
+		return done;
+	return ret;
+}
+
+/*
+ * @brief: read elements of one page run, storage is not changed
+ * @param addr: first element address
+ * @param elements: buffer for elements with valid CRC (can be NULL)
+ * @param valid: number of elements with valid CRC
+ * @retval: number of read elements, negative error value on failure
+ */
+static int run_read(struct mfifo *mfifo, uint32_t addr, uint8_t *elements,
+		size_t num, size_t *valid)
 {
-	uint8_t *payload = &mfifo->buf[sizeof(struct header)];
 	struct header header;
-	uint32_t next;
+	uint8_t *payload;
+	size_t len;
 	int ret;
 
-	if (is_empty(mfifo))
-		return -MFIFO_ERR_EMPTY;
+	len = run_length(mfifo, addr, mfifo->set, 1);
+	if (num > len)
+		num = len;
 
-	// Read element
-	ret = phys_read(mfifo, mfifo->get, mfifo->buf, phys_element_size(mfifo));
+	// Read elements
+	ret = phys_read(mfifo, addr, mfifo->buf, num * phys_element_size(mfifo));
 	if (ret < 0)
 		return -MFIFO_ERR_IO; // Can not read
 
-	// Copy header from buffer
-	memcpy(&header, mfifo->buf, sizeof(struct header));
+	*valid = 0;
+	for (size_t i = 0; i < num; i++)
+	{
+		payload = &mfifo->buf[i * phys_element_size(mfifo) +
+				sizeof(struct header)];
+
+		// Checksum
+		memcpy(&header, payload - sizeof(struct header), sizeof(header));
+		if (header.cs != crc6(CRC6_INIT, payload, mfifo->esize))
+			continue;
+
+		if (elements)
+			memcpy(&elements[*valid * mfifo->esize], payload, mfifo->esize);
+		(*valid)++;
+	}
+
+	return num;
+}
+
+/*
+ * @brief: mark elements of one page run as read (single header program)
+ * @info: storage is not read, only "rd" bits are programmed
+ * @retval: 0 on success, negative error value on failure
+ */
+static int run_commit(struct mfifo *mfifo, size_t num)
+{
+	struct header header;
+	uint32_t last, next;
+	size_t len;
+	int ret;
 
-	// Update header
+	header.wr = 1;
 	header.rd = 0;
+	header.cs = 0x3F;
+
+	len = (num - 1) * phys_element_size(mfifo) + sizeof(header);
+	memset(mfifo->buf, 0xFF, len);
+	for (size_t i = 0; i < num; i++)
+		memcpy(&mfifo->buf[i * phys_element_size(mfifo)], &header,
+				sizeof(header));
 
-	// Write header (for recovery)
-	ret = phys_write(mfifo, mfifo->get, (uint8_t *) &header, sizeof(header));
+	// Write headers (for recovery)
+	ret = phys_write(mfifo, mfifo->get, mfifo->buf, len);
 	if (ret < 0)
 		return -MFIFO_ERR_IO; // Can not write
 
-	// Get next "get"
-	next = next_addr(mfifo, mfifo->get);
+	last = mfifo->get + (num - 1) * phys_element_size(mfifo);
+	next = next_addr(mfifo, last);
 
 	// Recovery
-	if (is_diff_sectors(mfifo, mfifo->get, next))
+	if (is_diff_sectors(mfifo, last, next))
 		rectag_get(mfifo);
 
-	// Update "get"
+	// Update "get", last peek is not valid anymore
 	mfifo->get = next;
-
-	// Checksum
-	if (header.cs != crc6(payload, mfifo->esize))
-		return -MFIFO_ERR_INVALID_CRC; // Invalid CRC
-
-	// Copy payload from buffer
-	memcpy(element, payload, mfifo->esize);
+	mfifo->peek = next;
+	mfifo->peeked = 0;
 
 	return 0;
 }
 
-/******************************************************************************/
-int mfifo_get(struct mfifo *mfifo, void *element)
+/*
+ * @brief: get elements from one page run (single read, single header program)
+ * @param valid: number of copied elements (elements with invalid CRC are
+ *     skipped)
+ * @retval: number of taken elements, negative error value on failure
+ */
+static int run_get(struct mfifo *mfifo, uint8_t *elements, size_t num,
+		size_t *valid)
 {
 	int ret;
 
-	if (!mfifo || !element)
-		return -MFIFO_ERR_INVALID_ARGUMENT;
+	if (is_empty(mfifo))
+		return -MFIFO_ERR_EMPTY;
 
-	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
-		return -MFIFO_ERR_LOCK;
+	ret = run_read(mfifo, mfifo->get, elements, num, valid);
+	if (ret < 0)
+		return ret;
+	num = ret;
+
+	ret = run_commit(mfifo, num);
+	if (ret < 0)
+		return ret;
+
+	return num;
+}
+
+inline static int element_get(struct mfifo *mfifo, void *element)
+{
+	size_t valid;
+	int ret;
+
+	ret = run_get(mfifo, element, 1, &valid);
+	if (ret < 0)
+		return ret;
+
+	if (!valid)
+		return -MFIFO_ERR_INVALID_CRC; // Invalid CRC
+
+	return 0;
+}
+
+/******************************************************************************/
+int mfifo_get(struct mfifo *mfifo, void *element)
+{
+	int ret;
+
+	if (!mfifo || !element)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if (mfifo->cursors)
+		return -MFIFO_ERR_NOT_SUPPORTED;
+
+	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
+		return -MFIFO_ERR_LOCK;
+
+	ret = flush(mfifo);
+	if (ret < 0)
+	{
+		xSemaphoreGive(mfifo->mutex);
+		return ret;
+	}
 
 	ret = element_get(mfifo, element);
 	xSemaphoreGive(mfifo->mutex);
 	return ret;
 }
+
+/******************************************************************************/
+int mfifo_get_many(struct mfifo *mfifo, void *elements, size_t num)
+{
+	uint8_t *p = elements;
+	size_t done = 0;
+	size_t valid;
+	int ret = 0;
+
+	if (!mfifo || !elements || !num)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if (mfifo->cursors)
+		return -MFIFO_ERR_NOT_SUPPORTED;
+
+	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
+		return -MFIFO_ERR_LOCK;
+
+	ret = flush(mfifo);
+	if (ret < 0)
+	{
+		xSemaphoreGive(mfifo->mutex);
+		return ret;
+	}
+
+	while (done < num)
+	{
+		ret = run_get(mfifo, &p[done * mfifo->esize], num - done, &valid);
+		if (ret < 0)
+			break;
+		done += valid;
+	}
+
+	xSemaphoreGive(mfifo->mutex);
+
+	if (done)
+		return done;
+	return ret;
+}
+
+/*
+ * @brief: read elements starting from "get" without taking them
+ * @param elements: buffer for elements (can be NULL)
+ * @param end: address after the last read element
+ * @retval: number of elements with valid CRC, negative error value on failure
+ */
+static int walk(struct mfifo *mfifo, uint8_t *elements, size_t num,
+		uint32_t *end)
+{
+	uint32_t addr = mfifo->get;
+	size_t done = 0;
+	size_t valid;
+	int ret;
+
+	while ((done < num) && (addr != mfifo->set))
+	{
+		ret = run_read(mfifo, addr, elements ? &elements[done * mfifo->esize] :
+				NULL, num - done, &valid);
+		if (ret < 0)
+			return ret;
+
+		addr = next_addr(mfifo, addr + (ret - 1) * phys_element_size(mfifo));
+		done += valid;
+	}
+
+	*end = addr;
+	return done;
+}
+
+/******************************************************************************/
+int mfifo_peek(struct mfifo *mfifo, void *elements, size_t num)
+{
+	uint32_t end;
+	int ret;
+
+	if (!mfifo || !elements || !num)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if (mfifo->cursors)
+		return -MFIFO_ERR_NOT_SUPPORTED;
+
+	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
+		return -MFIFO_ERR_LOCK;
+
+	ret = flush(mfifo);
+	if (ret < 0)
+	{
+		xSemaphoreGive(mfifo->mutex);
+		return ret;
+	}
+
+	if (is_empty(mfifo))
+	{
+		xSemaphoreGive(mfifo->mutex);
+		return -MFIFO_ERR_EMPTY;
+	}
+
+	ret = walk(mfifo, elements, num, &end);
+	if (ret >= 0)
+	{
+		mfifo->peek = end;
+		mfifo->peeked = ret;
+	}
+
+	xSemaphoreGive(mfifo->mutex);
+	return ret;
+}
+
+/******************************************************************************/
+int mfifo_commit(struct mfifo *mfifo, size_t num)
+{
+	uint32_t end;
+	int ret = 0;
+
+	if (!mfifo)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if (mfifo->cursors)
+		return -MFIFO_ERR_NOT_SUPPORTED;
+
+	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
+		return -MFIFO_ERR_LOCK;
+
+	if (num > mfifo->peeked)
+	{
+		xSemaphoreGive(mfifo->mutex);
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+	}
+
+	// Part of peeked elements: find the end again
+	end = mfifo->peek;
+	if (num < mfifo->peeked)
+		ret = walk(mfifo, NULL, num, &end);
+
+	while ((ret >= 0) && (mfifo->get != end))
+		ret = run_commit(mfifo, run_length(mfifo, mfifo->get, end, 1));
+
+	mfifo->peek = mfifo->get;
+	mfifo->peeked = 0;
+
+	xSemaphoreGive(mfifo->mutex);
+
+	if (ret < 0)
+		return ret;
+	return 0;
+}
+
+/*
+ * @brief: record is waiting for its stream (stream mode)
+ * @param element: element header and payload
+ */
+static int is_pending(struct mfifo *mfifo, const uint8_t *element)
+{
+	const struct mfifo_record *record;
+	struct header header;
+
+	memcpy(&header, element, sizeof(header));
+	if (header.wr || !header.rd)
+		return 0;
+
+	record = (const struct mfifo_record *) &element[sizeof(header)];
+	if (record->type >= mfifo->streams)
+		return 0;
+
+	if (header.cs != crc6(CRC6_INIT, (const uint8_t *) record, mfifo->esize))
+		return 0;
+
+	return 1;
+}
+
+inline static int is_stream(struct mfifo *mfifo, const uint8_t *element,
+		int stream)
+{
+	const struct mfifo_record *record;
+
+	if (!is_pending(mfifo, element))
+		return 0;
+
+	record = (const struct mfifo_record *) &element[sizeof(struct header)];
+	return (stream == ANY_STREAM) || (record->type == stream);
+}
+
+/*
+ * @brief: find unread records of a stream, storage is not changed
+ * @param addr: address to start from
+ * @param stream: record type or ANY_STREAM
+ * @param records: buffer for records (can be NULL)
+ * @param first: address of the first found record ("set" if nothing found)
+ * @param end: address after the last found record ("set" if less than num
+ *     records were found)
+ * @retval: number of found records, negative error value on failure
+ */
+static int stream_walk(struct mfifo *mfifo, uint32_t addr, int stream,
+		uint8_t *records, size_t num, uint32_t *first, uint32_t *end)
+{
+	const uint8_t *element;
+	size_t done = 0;
+	size_t len;
+
+	*first = mfifo->set;
+
+	while (addr != mfifo->set)
+	{
+		len = run_length(mfifo, addr, mfifo->set, 1);
+		if (phys_read(mfifo, addr, mfifo->buf,
+				len * phys_element_size(mfifo)) < 0)
+			return -MFIFO_ERR_IO; // Can not read
+
+		for (size_t i = 0; i < len; i++)
+		{
+			element = &mfifo->buf[i * phys_element_size(mfifo)];
+			if (!is_stream(mfifo, element, stream))
+				continue;
+
+			if (!done)
+				*first = addr + i * phys_element_size(mfifo);
+			if (records)
+				memcpy(&records[done * mfifo->esize],
+						element + sizeof(struct header), mfifo->esize);
+
+			if (++done == num)
+			{
+				*end = next_addr(mfifo,
+						addr + i * phys_element_size(mfifo));
+				return done;
+			}
+		}
+
+		addr = next_addr(mfifo, addr + (len - 1) * phys_element_size(mfifo));
+	}
+
+	*end = addr;
+	return done;
+}
+
+/*
+ * @brief: mark unread records of a stream as read (one header program per
+ *     page), other elements are not changed
+ * @param addr: address to start from
+ * @param end: address after the last marked record
+ * @retval: 0 on success, negative error value on failure
+ */
+static int stream_mark(struct mfifo *mfifo, uint32_t addr, int stream,
+		size_t num, uint32_t *end)
+{
+	struct header header;
+	size_t lo, hi, len;
+	size_t found;
+	uint8_t *element;
+
+	header.wr = 1;
+	header.rd = 0;
+	header.cs = 0x3F;
+
+	while (num && (addr != mfifo->set))
+	{
+		len = run_length(mfifo, addr, mfifo->set, 1);
+		if (phys_read(mfifo, addr, mfifo->buf,
+				len * phys_element_size(mfifo)) < 0)
+			return -MFIFO_ERR_IO; // Can not read
+
+		// Records of the stream in this run
+		found = 0;
+		lo = len;
+		hi = 0;
+		for (size_t i = 0; (i < len) && (found < num); i++)
+		{
+			if (!is_stream(mfifo, &mfifo->buf[i * phys_element_size(mfifo)],
+					stream))
+				continue;
+
+			if (!found)
+				lo = i;
+			hi = i;
+			found++;
+		}
+
+		if (found)
+		{
+			// Only "rd" bits of found records are programmed
+			for (size_t i = lo; i <= hi; i++)
+			{
+				element = &mfifo->buf[i * phys_element_size(mfifo)];
+				if (is_stream(mfifo, element, stream))
+				{
+					memset(element, 0xFF, phys_element_size(mfifo));
+					memcpy(element, &header, sizeof(header));
+				}
+				else
+				{
+					memset(element, 0xFF, phys_element_size(mfifo));
+				}
+			}
+
+			if (phys_write(mfifo, addr + lo * phys_element_size(mfifo),
+					&mfifo->buf[lo * phys_element_size(mfifo)],
+					(hi - lo) * phys_element_size(mfifo) +
+					sizeof(header)) < 0)
+				return -MFIFO_ERR_IO; // Can not write
+
+			num -= found;
+			if (!num)
+			{
+				*end = next_addr(mfifo,
+						addr + hi * phys_element_size(mfifo));
+				return 0;
+			}
+		}
+
+		addr = next_addr(mfifo, addr + (len - 1) * phys_element_size(mfifo));
+	}
+
+	*end = addr;
+	return 0;
+}
+
+/*
+ * @brief: move "get" forward, sectors left behind are marked as read out
+ */
+static void get_move(struct mfifo *mfifo, uint32_t addr)
+{
+	while ((mfifo->get / mfifo->secsize) != (addr / mfifo->secsize))
+	{
+		// Recovery
+		rectag_get(mfifo);
+
+		mfifo->get = slot_addr(mfifo, (mfifo->get / mfifo->secsize + 1) %
+				mfifo->secnum, slots_rectag(mfifo));
+	}
+
+	mfifo->get = addr;
+}
+
+/*
+ * @brief: move "get" to the oldest stream cursor (stream mode)
+ */
+static void stream_get(struct mfifo *mfifo)
+{
+	uint32_t area = mfifo->secnum * mfifo->secsize;
+	uint32_t oldest = mfifo->set;
+	uint32_t dist, min;
+
+	min = (mfifo->set + area - mfifo->get) % area;
+	for (size_t i = 0; i < mfifo->streams; i++)
+	{
+		// Stream has nothing to read before "set"
+		if (mfifo->counted && !mfifo->cursors[i].count)
+			mfifo->cursors[i].get = mfifo->set;
+
+		dist = (mfifo->cursors[i].get + area - mfifo->get) % area;
+		if (dist < min)
+		{
+			min = dist;
+			oldest = mfifo->cursors[i].get;
+		}
+	}
+
+	get_move(mfifo, oldest);
+}
+
+/*
+ * @brief: "get" is the first unread record, all cursors start from it
+ * @info: unread records are counted later, see stream_count()
+ */
+static int stream_recover(struct mfifo *mfifo)
+{
+	uint32_t first, end;
+	int ret;
+
+	ret = stream_walk(mfifo, mfifo->get, ANY_STREAM, NULL, 1, &first, &end);
+	if (ret < 0)
+		return ret;
+
+	get_move(mfifo, first);
+
+	for (size_t i = 0; i < mfifo->streams; i++)
+	{
+		mfifo->cursors[i].get = mfifo->get;
+		mfifo->cursors[i].peek = mfifo->get;
+		mfifo->cursors[i].peeked = 0;
+		mfifo->cursors[i].count = 0;
+	}
+	mfifo->counted = 0;
+
+	return 0;
+}
+
+/*
+ * @brief: count unread records of every stream once after recovery, fifo is
+ *     scanned from "get" up to "set"
+ * @retval: 0 on success, negative error value on failure
+ */
+static int stream_count(struct mfifo *mfifo)
+{
+	const struct mfifo_record *record;
+	const uint8_t *element;
+	uint32_t addr = mfifo->get;
+	size_t len;
+
+	if (!mfifo->cursors || mfifo->counted)
+		return 0;
+
+	for (size_t i = 0; i < mfifo->streams; i++)
+		mfifo->cursors[i].count = 0;
+
+	while (addr != mfifo->set)
+	{
+		len = run_length(mfifo, addr, mfifo->set, 1);
+		if (phys_read(mfifo, addr, mfifo->buf,
+				len * phys_element_size(mfifo)) < 0)
+			return -MFIFO_ERR_IO; // Can not read
+
+		for (size_t i = 0; i < len; i++)
+		{
+			element = &mfifo->buf[i * phys_element_size(mfifo)];
+			if (!is_pending(mfifo, element))
+				continue;
+
+			record = (const struct mfifo_record *)
+					&element[sizeof(struct header)];
+			mfifo->cursors[record->type].count++;
+		}
+
+		addr = next_addr(mfifo, addr + (len - 1) * phys_element_size(mfifo));
+	}
+
+	mfifo->counted = 1;
+	return 0;
+}
+
+/******************************************************************************/
+int mfifo_recover(struct mfifo *mfifo)
+{
+	int ret;
+
+	if (!mfifo)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
+		return -MFIFO_ERR_LOCK;
+
+	mfifo->set = data_offset(mfifo);
+	mfifo->get = data_offset(mfifo);
+	mfifo->seq = 0;
+
+	ret = recover(mfifo);
+	if (!ret && mfifo->cursors)
+		ret = stream_recover(mfifo);
+	mfifo->peek = mfifo->get;
+	mfifo->peeked = 0;
+	mfifo->erased = NO_SECTOR;
+
+	xSemaphoreGive(mfifo->mutex);
+	return ret;
+}
+
+/******************************************************************************/
+int mfifo_streams(struct mfifo *mfifo, struct mfifo_cursor *cursors,
+		size_t num)
+{
+	if (!mfifo || !cursors || !num || (num > UINT8_MAX + 1))
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if (mfifo->esize < sizeof(struct mfifo_record))
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	for (size_t i = 0; i < num; i++)
+	{
+		cursors[i].get = mfifo->get;
+		cursors[i].peek = mfifo->get;
+		cursors[i].peeked = 0;
+		cursors[i].count = 0;
+	}
+
+	mfifo->cursors = cursors;
+	mfifo->streams = num;
+	mfifo->counted = 1;
+
+	return 0;
+}
+
+/******************************************************************************/
+int mfifo_peek_stream(struct mfifo *mfifo, uint8_t stream, void *records,
+		size_t num)
+{
+	struct mfifo_cursor *cursor;
+	uint32_t first, end;
+	int ret;
+
+	if (!mfifo || !records || !num || (stream >= mfifo->streams))
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
+		return -MFIFO_ERR_LOCK;
+
+	ret = flush(mfifo);
+	if (ret < 0)
+	{
+		xSemaphoreGive(mfifo->mutex);
+		return ret;
+	}
+
+	cursor = &mfifo->cursors[stream];
+	ret = stream_walk(mfifo, cursor->get, stream, records, num, &first, &end);
+	if (ret >= 0)
+	{
+		// There is nothing to read before the first found record
+		cursor->get = first;
+		cursor->peek = end;
+		cursor->peeked = ret;
+
+		// Records with invalid CRC are not counted anymore
+		if (!ret)
+			cursor->count = 0;
+	}
+
+	xSemaphoreGive(mfifo->mutex);
+
+	if (!ret)
+		return -MFIFO_ERR_EMPTY;
+	return ret;
+}
+
+/******************************************************************************/
+int mfifo_commit_stream(struct mfifo *mfifo, uint8_t stream, size_t num)
+{
+	struct mfifo_cursor *cursor;
+	uint32_t end;
+	int ret = 0;
+
+	if (!mfifo || (stream >= mfifo->streams))
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
+		return -MFIFO_ERR_LOCK;
+
+	cursor = &mfifo->cursors[stream];
+	if (num > cursor->peeked)
+	{
+		xSemaphoreGive(mfifo->mutex);
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+	}
+
+	// Streams without records let "get" move past them
+	ret = stream_count(mfifo);
+	if (ret < 0)
+	{
+		xSemaphoreGive(mfifo->mutex);
+		return ret;
+	}
+
+	end = cursor->get;
+	if (num)
+		ret = stream_mark(mfifo, cursor->get, stream, num, &end);
+
+	// All peeked records: the stream is read up to the peek end
+	if (num == cursor->peeked)
+		end = cursor->peek;
+
+	if (ret >= 0)
+	{
+		cursor->get = end;
+		cursor->count -= (num < cursor->count) ? num : cursor->count;
+		stream_get(mfifo);
+	}
+
+	cursor->peek = cursor->get;
+	cursor->peeked = 0;
+
+	xSemaphoreGive(mfifo->mutex);
+	return ret;
+}
+
+/*
+ * @brief: element position in the area (sector tags are not counted)
+ */
+static size_t slot_index(struct mfifo *mfifo, uint32_t addr)
+{
+	size_t offset = addr % mfifo->secsize;
+
+	return (addr / mfifo->secsize) *
+			(slots_sector(mfifo) - slots_rectag(mfifo)) +
+			(offset / mfifo->pagesize) * slots_page(mfifo) +
+			(offset % mfifo->pagesize) / phys_element_size(mfifo) -
+			slots_rectag(mfifo);
+}
+
+/*
+ * @brief: number of staged elements of a stream (ANY_STREAM - all of them)
+ */
+static size_t staged_count(struct mfifo *mfifo, int stream)
+{
+	size_t num = 0;
+
+	if (stream == ANY_STREAM)
+		return mfifo->staged;
+
+	for (size_t i = 0; i < mfifo->staged; i++)
+	{
+		if (mfifo->wcbuf[i * mfifo->esize] == stream) // struct mfifo_record
+			num++;
+	}
+
+	return num;
+}
+
+/*
+ * @brief: number of stored elements, storage is not accessed (stream mode:
+ *     after stream_count())
+ */
+static size_t count(struct mfifo *mfifo)
+{
+	size_t total = mfifo->secnum * (slots_sector(mfifo) - slots_rectag(mfifo));
+	size_t num = 0;
+
+	// Stream mode: elements before "set" can be read by some streams already
+	if (mfifo->cursors)
+	{
+		for (size_t i = 0; i < mfifo->streams; i++)
+			num += mfifo->cursors[i].count;
+	}
+	else
+	{
+		num = (slot_index(mfifo, mfifo->set) + total -
+				slot_index(mfifo, mfifo->get)) % total;
+	}
+
+	return num + staged_count(mfifo, ANY_STREAM);
+}
+
+/******************************************************************************/
+int mfifo_count(struct mfifo *mfifo)
+{
+	int ret;
+
+	if (!mfifo)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
+		return -MFIFO_ERR_LOCK;
+
+	ret = stream_count(mfifo);
+	if (!ret)
+		ret = count(mfifo);
+	xSemaphoreGive(mfifo->mutex);
+	return ret;
+}
+
+/******************************************************************************/
+int mfifo_count_stream(struct mfifo *mfifo, uint8_t stream)
+{
+	int ret;
+
+	if (!mfifo || (stream >= mfifo->streams))
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
+		return -MFIFO_ERR_LOCK;
+
+	ret = stream_count(mfifo);
+	if (!ret)
+		ret = mfifo->cursors[stream].count + staged_count(mfifo, stream);
+	xSemaphoreGive(mfifo->mutex);
+	return ret;
+}
+
+/******************************************************************************/
+int mfifo_usage(struct mfifo *mfifo, struct mfifo_usage *usage)
+{
+	size_t area, used;
+	size_t gsec, ssec;
+	int ret;
+
+	if (!mfifo || !usage)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
+		return -MFIFO_ERR_LOCK;
+
+	ret = stream_count(mfifo);
+	if (ret < 0)
+	{
+		xSemaphoreGive(mfifo->mutex);
+		return ret;
+	}
+
+	area = mfifo->secnum * mfifo->secsize;
+	gsec = mfifo->get / mfifo->secsize;
+	ssec = mfifo->set / mfifo->secsize;
+
+	// Sectors from "get" to "set", the sector at "set" is not opened yet if
+	// "set" is at its beginning
+	used = (ssec + mfifo->secnum - gsec) % mfifo->secnum;
+	if ((mfifo->set % mfifo->secsize) != data_offset(mfifo))
+		used++;
+	else if ((ssec == gsec) && !is_empty(mfifo))
+		used = mfifo->secnum; // Full
+
+	usage->count = count(mfifo);
+	usage->bytes = (mfifo->set + area - mfifo->get) % area +
+			mfifo->staged * phys_element_size(mfifo);
+	usage->free = mfifo->secnum - used;
+	usage->secnum = mfifo->secnum;
+
+	xSemaphoreGive(mfifo->mutex);
+	return 0;
+}
+
+/******************************************************************************/
+int mfifo_wcache(struct mfifo *mfifo, TickType_t age)
+{
+	if (!mfifo || mfifo->wcbuf)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	// Up to one page of elements
+	mfifo->wcbuf = pvPortMalloc(slots_page(mfifo) * mfifo->esize);
+	if (!mfifo->wcbuf)
+		return -MFIFO_ERR_ALLOC;
+
+	mfifo->wcage = age;
+	mfifo->staged = 0;
+
+	return 0;
+}
+
+/******************************************************************************/
+int mfifo_flush(struct mfifo *mfifo)
+{
+	int ret;
+
+	if (!mfifo)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
+		return -MFIFO_ERR_LOCK;
+
+	ret = flush(mfifo);
+	xSemaphoreGive(mfifo->mutex);
+	return ret;
+}
+
+/******************************************************************************/
+int mfifo_flush_expired(struct mfifo *mfifo)
+{
+	int ret = 0;
+
+	if (!mfifo)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
+		return -MFIFO_ERR_LOCK;
+
+	if (is_expired(mfifo))
+		ret = flush(mfifo);
+	xSemaphoreGive(mfifo->mutex);
+	return ret;
+}
+
+/******************************************************************************/
+int mfifo_erase_ahead(struct mfifo *mfifo)
+{
+	size_t sector;
+
+	if (!mfifo)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+
+	if (xSemaphoreTake(mfifo->mutex, MUTEX_TIMEOUT) == pdFALSE)
+		return -MFIFO_ERR_LOCK;
+
+	sector = ahead_sector(mfifo);
+	if ((sector == NO_SECTOR) || (sector == mfifo->erased))
+	{
+		xSemaphoreGive(mfifo->mutex);
+		return 0;
+	}
+
+	// "set" waits for this mutex if it reaches the sector during erase
+	xSemaphoreTake(mfifo->emutex, portMAX_DELAY);
+	mfifo->erasing = sector;
+	xSemaphoreGive(mfifo->mutex);
+
+	// mfifo is not locked during erase
+	mfifo->erase_ret = phys_erase(mfifo, sector * mfifo->secsize);
+	xSemaphoreGive(mfifo->emutex);
+
+	xSemaphoreTake(mfifo->mutex, portMAX_DELAY);
+
+	// "set" has not opened the sector yet
+	if (mfifo->erasing == sector && mfifo->erase_ret == 0)
+		mfifo->erased = sector;
+	mfifo->erasing = NO_SECTOR;
+
+	xSemaphoreGive(mfifo->mutex);
+	return mfifo->erase_ret < 0 ? -MFIFO_ERR_IO : 1;
+}
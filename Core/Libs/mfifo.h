@@ -29,12 +29,56 @@ enum mfifo_status
 	MFIFO_ERR_IO
 };
 
+/*
+ * @brief: record (mfifo_set_record()), every record takes one element: record
+ *     header and up to (element size - sizeof(struct mfifo_record)) bytes of
+ *     data, so records of different types share one fifo in arrival order
+ */
+struct mfifo_record
+{
+	uint8_t type;
+	uint8_t len; // Data length
+	uint8_t data[];
+};
+
+#define MFIFO_RECORD_SIZE(len) (sizeof(struct mfifo_record) + (len))
+
+/*
+ * @brief: stream read cursor (mfifo_streams())
+ * get: all records of the stream before this address are read
+ * peek: address after the last record returned by mfifo_peek_stream()
+ * peeked: number of records returned by mfifo_peek_stream()
+ */
+struct mfifo_cursor
+{
+	uint32_t get;
+	uint32_t peek;
+	size_t peeked;
+	size_t count; // Unread records
+};
+
+/*
+ * @brief: fifo fill level (mfifo_usage())
+ * count: stored elements (unread records in stream mode), staged included
+ * bytes: occupied storage bytes (page and sector tag gaps included)
+ * free: sectors that can be opened by "set"
+ * secnum: number of sectors
+ */
+struct mfifo_usage
+{
+	size_t count;
+	size_t bytes;
+	size_t free;
+	size_t secnum;
+};
+
 /*
  * @brief: mfifo handle
  */
 struct mfifo
 {
 	SemaphoreHandle_t mutex;
+	SemaphoreHandle_t emutex;
 	struct w25q_s *mem;
 
 	size_t pagesize;
@@ -47,6 +91,24 @@ struct mfifo
 
 	uint32_t set;
 	uint32_t get;
+	uint32_t seq;
+
+	uint32_t peek;
+	size_t peeked;
+
+	uint8_t *wcbuf;
+	size_t staged;
+	TickType_t wctick;
+	TickType_t wcage;
+
+	size_t erased;
+	size_t erasing;
+	int erase_ret; // Result of the last erase-ahead
+	uint32_t erase_sync;
+
+	struct mfifo_cursor *cursors;
+	size_t streams;
+	int counted; // Cursor counts are valid (stream_count())
 };
 
 
@@ -64,8 +126,41 @@ struct mfifo
 int mfifo_init(struct mfifo *mfifo, struct w25q_s *mem, size_t pagesize,
 		size_t secsize, size_t esize, uint32_t addr, size_t secnum);
 
+/*
+ * @brief: enable write combining: new elements are staged in RAM and written
+ *     with one page program when the page is full, on mfifo_flush() or when
+ *     the oldest staged element is older than "age"; reading operations write
+ *     staged elements first
+ * @info: staged elements are lost on reset
+ * @param mfifo: mfifo handle
+ * @param age: maximum age of staged elements in ticks (0 - no limit)
+ * @retval: 0 on success, negative error value on failure (enum mfifo_status)
+ */
+int mfifo_wcache(struct mfifo *mfifo, TickType_t age);
+
+/*
+ * @brief: enable stream mode: every record type (0 .. num - 1) is a stream
+ *     with its own read cursor, streams are read with mfifo_peek_stream() and
+ *     mfifo_commit_stream() independently; a sector is reused when all
+ *     streams have read it out
+ * @info: must be called before mfifo_recover(), mfifo_get(),
+ *     mfifo_get_many(), mfifo_peek() and mfifo_commit() are not supported in
+ *     stream mode; records of other types are skipped
+ * @param mfifo: mfifo handle
+ * @param cursors: array of num cursors, it must stay valid while mfifo is used
+ * @param num: number of streams
+ * @retval: 0 on success, negative error value on failure (enum mfifo_status)
+ */
+int mfifo_streams(struct mfifo *mfifo, struct mfifo_cursor *cursors,
+		size_t num);
+
 /*
  * @brief: recover fifo state after startup: find "set" and "get" addresses
+ * @info: uses sector tags, takes O(log(secnum) + log(elements per sector))
+ *     storage reads (stream mode: the "get" sector is scanned up to the first
+ *     unread record, unread records are counted later by the first
+ *     mfifo_count(), mfifo_count_stream(), mfifo_usage() or
+ *     mfifo_commit_stream() call); fifo is empty if nothing valid was found
  * @param mfifo: mfifo handle
  * @retval: 0 on success, negative error value on failure (enum mfifo_status)
  */
@@ -88,6 +183,31 @@ int mfifo_is_empty(struct mfifo *mfifo);
  */
 int mfifo_set(struct mfifo *mfifo, const void *element);
 
+/*
+ * @brief: store a new record in fifo
+ * @info: records are read with mfifo_get(), mfifo_get_many() and mfifo_peek()
+ *     as elements that start with struct mfifo_record
+ * @param mfifo: mfifo handle
+ * @param type: record type (user defined)
+ * @param data: record data (can be NULL if len is 0)
+ * @param len: record data length, MFIFO_RECORD_SIZE(len) must not exceed
+ *     element size
+ * @retval: 0 on success, negative error value on failure (enum mfifo_status)
+ */
+int mfifo_set_record(struct mfifo *mfifo, uint8_t type, const void *data,
+		size_t len);
+
+/*
+ * @brief: store several elements in fifo
+ * @info: elements are packed into one page program per page
+ * @param mfifo: mfifo handle
+ * @param elements: array of elements to store
+ * @param num: number of elements in array
+ * @retval: number of stored elements (can be less than num if there is no
+ *     free space), negative error value on failure (enum mfifo_status)
+ */
+int mfifo_set_many(struct mfifo *mfifo, const void *elements, size_t num);
+
 /*
  * @brief: get stored element
  * @param mfifo: mfifo handle
@@ -96,3 +216,126 @@ int mfifo_set(struct mfifo *mfifo, const void *element);
  * @retval: 0 on success, negative error value on failure (enum mfifo_status)
  */
 int mfifo_get(struct mfifo *mfifo, void *element);
+
+/*
+ * @brief: get several stored elements
+ * @info: elements are read with one read and one header program per page,
+ *     elements with invalid CRC are skipped
+ * @param mfifo: mfifo handle
+ * @param elements: buffer to store elements, size of buffer must be equal to
+ *     num * element size
+ * @param num: maximum number of elements to get
+ * @retval: number of copied elements, negative error value on failure
+ *     (enum mfifo_status)
+ */
+int mfifo_get_many(struct mfifo *mfifo, void *elements, size_t num);
+
+/*
+ * @brief: read stored elements without taking them out of fifo
+ * @info: elements with invalid CRC are skipped, every call starts from the
+ *     oldest element
+ * @param mfifo: mfifo handle
+ * @param elements: buffer to store elements, size of buffer must be equal to
+ *     num * element size
+ * @param num: maximum number of elements to read
+ * @retval: number of copied elements, negative error value on failure
+ *     (enum mfifo_status)
+ */
+int mfifo_peek(struct mfifo *mfifo, void *elements, size_t num);
+
+/*
+ * @brief: take elements returned by the last mfifo_peek() out of fifo
+ * @info: all taken elements are marked as read with one header program per
+ *     page, skipped elements with invalid CRC are taken too (num == 0 takes
+ *     only them when nothing valid was peeked)
+ * @param mfifo: mfifo handle
+ * @param num: number of elements to take, must not exceed the value returned
+ *     by the last mfifo_peek()
+ * @retval: 0 on success, negative error value on failure (enum mfifo_status)
+ */
+int mfifo_commit(struct mfifo *mfifo, size_t num);
+
+/*
+ * @brief: read records of one stream without taking them out of fifo
+ * @info: records with invalid CRC are skipped, every call starts from the
+ *     oldest unread record of the stream
+ * @param mfifo: mfifo handle
+ * @param stream: stream (record type)
+ * @param records: buffer to store records, size of buffer must be equal to
+ *     num * element size
+ * @param num: maximum number of records to read
+ * @retval: number of copied records, negative error value on failure
+ *     (enum mfifo_status)
+ */
+int mfifo_peek_stream(struct mfifo *mfifo, uint8_t stream, void *records,
+		size_t num);
+
+/*
+ * @brief: take records returned by the last mfifo_peek_stream() out of the
+ *     stream
+ * @info: records are marked as read with one header program per page, other
+ *     streams are not changed
+ * @param mfifo: mfifo handle
+ * @param stream: stream (record type)
+ * @param num: number of records to take, must not exceed the value returned
+ *     by the last mfifo_peek_stream()
+ * @retval: 0 on success, negative error value on failure (enum mfifo_status)
+ */
+int mfifo_commit_stream(struct mfifo *mfifo, uint8_t stream, size_t num);
+
+/*
+ * @brief: number of stored elements
+ * @info: counters are kept in the handle, storage is not accessed; stream
+ *     mode: number of unread records of all streams, the first call after
+ *     mfifo_recover() scans fifo from "get" to "set" to count them
+ * @param mfifo: mfifo handle
+ * @retval: number of elements, negative error value on failure
+ *     (enum mfifo_status)
+ */
+int mfifo_count(struct mfifo *mfifo);
+
+/*
+ * @brief: number of unread records of one stream (stream mode)
+ * @info: storage is not accessed, except for the first count after
+ *     mfifo_recover() (see mfifo_count())
+ * @param mfifo: mfifo handle
+ * @param stream: stream (record type)
+ * @retval: number of records, negative error value on failure
+ *     (enum mfifo_status)
+ */
+int mfifo_count_stream(struct mfifo *mfifo, uint8_t stream);
+
+/*
+ * @brief: fifo fill level: elements, occupied bytes and free sectors
+ * @info: storage is not accessed, except for the first count after
+ *     mfifo_recover() (see mfifo_count())
+ * @param mfifo: mfifo handle
+ * @param usage: fill level
+ * @retval: 0 on success, negative error value on failure (enum mfifo_status)
+ */
+int mfifo_usage(struct mfifo *mfifo, struct mfifo_usage *usage);
+
+/*
+ * @brief: write all staged elements (write combining)
+ * @param mfifo: mfifo handle
+ * @retval: 0 on success, negative error value on failure (enum mfifo_status)
+ */
+int mfifo_flush(struct mfifo *mfifo);
+
+/*
+ * @brief: write staged elements if the oldest of them is too old
+ * @param mfifo: mfifo handle
+ * @retval: 0 on success, negative error value on failure (enum mfifo_status)
+ */
+int mfifo_flush_expired(struct mfifo *mfifo);
+
+/*
+ * @brief: erase the sector that will be opened by "set" next, so storing
+ *     elements does not wait for erase (call it from a low priority task)
+ * @info: mfifo is not locked during erase, mfifo->erase_sync counts erases that
+ *     were still done by storing operations
+ * @param mfifo: mfifo handle
+ * @retval: 1 - sector was erased, 0 - nothing to do, negative error value on
+ *     failure (enum mfifo_status)
+ */
+int mfifo_erase_ahead(struct mfifo *mfifo);
@@ -16,6 +16,7 @@
 
 #include "sim800l.h"
 #include "params.h"
+#include "mqueue.h"
 #include "fws.h"
 
 #define DELAY_HTTP_MS 60000
@@ -25,8 +26,9 @@
 
 //#define FILE_PART_SIZE (1024 - 128) // TODO: Not enough RAM
 #define FILE_PART_SIZE 512
-#define FLASH_WRITE_SIZE 128 // Not 256 because of FILE_PART_SIZE value
-#define FLASH_READ_SIZE 32
+// Verification reads, two chunks of the heap
+#define FLASH_VERIFY_CHUNK 1024
+#define FLASH_ERASE_AHEAD W25Q_BLOCK_SIZE
 
 #define RETRIES 5
 
@@ -182,69 +184,137 @@ static int request_file(struct ota *ota, struct sim800l_http *http,
 	return sim800l_http(ota->mod, http, callback, DELAY_HTTP_MS);
 }
 
-static void mem_erase(struct w25q_s *mem, uint32_t addr, uint16_t size)
+/*
+ * @brief: Length of a payload range that is contiguous in the memory, the
+ * payload wraps around the end of the staging area
+ * @param offset: Payload offset
+ * @param size: Range size
+ */
+static uint32_t mem_span(const struct fws *fws, uint32_t offset,
+		uint32_t size)
 {
-	while (size)
-	{
-		w25q_s_sector_erase(mem, addr);
+#ifdef FWS_PAYLOAD_SHIFT
+	uint32_t wrap = APP_LENGTH - fws->shift;
 
-		if (size > W25Q_SECTOR_SIZE)
-			size -= W25Q_SECTOR_SIZE;
-		else
-			size = 0;
-		addr += W25Q_SECTOR_SIZE;
-	}
+	if (offset < wrap && size > wrap - offset)
+		return wrap - offset;
+#endif
+	return size;
 }
 
-static void mem_write(struct w25q_s *mem, uint32_t addr, uint8_t *buf,
-		uint16_t size)
+static int mem_erase(struct w25q_s *mem, const struct fws *fws,
+		uint32_t offset, uint32_t size)
 {
-	uint16_t ws;
+	uint32_t len;
+	int ret;
 
 	while (size)
 	{
-		if (size > FLASH_WRITE_SIZE)
-			ws = FLASH_WRITE_SIZE;
-		else
-			ws = size;
+		len = mem_span(fws, offset, size);
+		ret = w25q_s_erase(mem, FWS_PAYLOAD_AT(fws, offset, APP_LENGTH), len);
+		if (ret)
+			return ret;
+		offset += len;
+		size -= len;
+	}
 
-		w25q_s_write_data(mem, addr, buf, ws);
+	return 0;
+}
 
-		size -= ws;
-		addr += ws;
-		buf += ws;
-	}
+/*
+ * @brief: Erase ahead of the payload write pointer a FLASH_ERASE_AHEAD
+ * window at once, so erasing overlaps the download of the next parts
+ * @param erased: Payload bytes already erased, updated
+ * @param need: Payload bytes that must be erased
+ * @param size: Payload size
+ * @retval: 0 - success, negative enum w25q_status
+ */
+static int mem_erase_ahead(struct w25q_s *mem, const struct fws *fws,
+		uint32_t *erased, uint32_t need, uint32_t size)
+{
+	uint32_t end;
+	int ret;
+
+	if (*erased >= need || *erased >= size)
+		return 0;
+
+	// Up to the next FLASH_ERASE_AHEAD boundary for the largest erases
+	end = FWS_PAYLOAD_AT(fws, *erased, APP_LENGTH);
+	end = *erased + FLASH_ERASE_AHEAD - end % FLASH_ERASE_AHEAD;
+	if (end < need)
+		end = need;
+	if (end > size)
+		end = size;
+
+	ret = mem_erase(mem, fws, *erased, end - *erased);
+	if (ret)
+		return ret;
+
+	// Up to the sector boundary
+	end += (W25Q_SECTOR_SIZE - FWS_PAYLOAD_AT(fws, end, APP_LENGTH) %
+			W25Q_SECTOR_SIZE) % W25Q_SECTOR_SIZE;
+	*erased = end;
+	return 0;
 }
 
-static void mem_write_header(struct w25q_s *mem, struct fws *fws)
+/*
+ * @brief: Place the image in the staging area
+ */
+static void mem_place(struct w25q_s *mem, struct fws *fws)
 {
-	w25q_s_sector_erase(mem, FWS_HEADER_ADDR);
-	mem_write(mem, FWS_HEADER_ADDR, (uint8_t *) fws, sizeof(struct fws));
+#ifdef FWS_PAYLOAD_SHIFT
+	uint32_t size = (fws->size + 3) & ~3; // Expanded to a multiple of 4
+
+	// The least erased place, the staging area wears evenly
+	fws->shift = w25q_s_wear_least(mem, FWS_PAYLOAD_ADDR, APP_LENGTH, size,
+			FWS_SHIFT_UNIT) - FWS_PAYLOAD_ADDR;
+#endif
 }
 
-static uint32_t mem_checksum(struct w25q_s *mem, uint32_t addr, uint32_t size)
+static int mem_write(struct w25q_s *mem, uint32_t addr, uint8_t *buf,
+		uint32_t size)
 {
-	uint32_t checksum = FWS_CHECKSUM_INIT;
-	uint8_t buf[FLASH_READ_SIZE];
-	uint32_t ws;
+	return w25q_s_write_buffer(mem, addr, buf, size);
+}
+
+static int mem_write_payload(struct w25q_s *mem, const struct fws *fws,
+		uint32_t offset, uint8_t *buf, uint32_t size)
+{
+	uint32_t len;
+	int ret;
 
 	while (size)
 	{
-		if (size > FLASH_READ_SIZE)
-			ws = FLASH_READ_SIZE;
-		else
-			ws = size;
+		len = mem_span(fws, offset, size);
+		ret = mem_write(mem, FWS_PAYLOAD_AT(fws, offset, APP_LENGTH), buf,
+				len);
+		if (ret)
+			return ret;
+		offset += len;
+		buf += len;
+		size -= len;
+	}
+
+	return 0;
+}
 
-		w25q_s_read_data(mem, addr, buf, ws);
+static int mem_write_header(struct w25q_s *mem, struct fws *fws)
+{
+	int ret;
 
-		size -= ws;
-		addr += ws;
+	ret = w25q_s_sector_erase(mem, FWS_HEADER_ADDR);
+	if (ret)
+		return ret;
+	return mem_write(mem, FWS_HEADER_ADDR, (uint8_t *) fws,
+			sizeof(struct fws));
+}
 
-		for (uint32_t i = 0; i < ws; i += sizeof(uint32_t))
-			checksum += *((uint32_t *) &buf[i]);
-	}
+static void checksum_add(const uint8_t *data, uint32_t size, void *context)
+{
+	uint32_t *checksum = context;
 
-	return checksum;
+	for (uint32_t i = 0; i < size; i += sizeof(uint32_t))
+		*checksum += *((const uint32_t *) &data[i]);
 }
 
 static void strtolower(char *data)
@@ -256,22 +326,60 @@ static void strtolower(char *data)
 	}
 }
 
+/******************************************************************************/
+int ota_verify(struct w25q_s *mem, const struct fws *fws)
+{
+	uint32_t checksum = FWS_CHECKSUM_INIT;
+	uint32_t offset = 0;
+	uint32_t len;
+	uint8_t *buf;
+	int ret = 0;
+
+	buf = pvPortMalloc(2 * FLASH_VERIFY_CHUNK);
+	if (!buf)
+		return FWS_STATUS_ERR_NO_STORAGE;
+
+	// Both parts of a wrapped payload
+	while (!ret && offset < fws->size)
+	{
+		len = mem_span(fws, offset, fws->size - offset);
+		ret = w25q_s_read_stream(mem, FWS_PAYLOAD_AT(fws, offset, APP_LENGTH),
+				len, buf, FLASH_VERIFY_CHUNK, checksum_add, &checksum);
+		offset += len;
+	}
+	vPortFree(buf);
+
+	if (ret)
+		return FWS_STATUS_ERR_NO_STORAGE;
+	if (checksum != fws->checksum)
+		return FWS_STATUS_ERR_CHECKSUM_STORAGE;
+	return FWS_STATUS_SUCCESS;
+}
+
 /******************************************************************************/
 void ota_task(struct ota *ota)
 {
 	struct sim800l_http http;
+	struct w25q_geometry geo;
 	char filename[64];
 	struct fws fws;
 	uint32_t addr;
+	uint32_t erased;
 	int retries;
+	int merr;
 	int ret;
 
 	char url[OTA_URL_SIZE + 64];
 	char hmac[HMAC_BASE64_LEN];
 
-	if (w25q_s_get_manufacturer_id(ota->mem) != FWS_WINBOND_MANUFACTURER_ID)
+	// The storage layout needs the 4KB erase for the header
+	w25q_s_get_geometry(ota->mem, &geo);
+	if (!geo.capacity || geo.sector_size != W25Q_SECTOR_SIZE)
 		vTaskDelete(NULL);
 
+	// Bulk transfers give way to the sample writes
+	w25q_s_client(ota->mem, osPriorityLow);
+
 	ota->task = xTaskGetCurrentTaskHandle();
 	http.url = url;
 
@@ -321,25 +429,31 @@ startup:
 		if (fws.size > APP_LENGTH)
 			continue;
 
-		// Erase SPI FLASH
-		mem_erase(ota->mem, FWS_PAYLOAD_ADDR, fws.size);
-
-		// Updating
+		// Updating, SPI FLASH is erased just ahead of the written data
+		mem_place(ota->mem, &fws);
 		addr = 0;
+		erased = 0;
 		retries = RETRIES;
 		while (retries && addr < fws.size)
 		{
-			// Request newest firmware file
+			// Request newest firmware file, the bearer lingers for the next
+			if (addr + FILE_PART_SIZE < fws.size)
+				sim800l_http_hint(ota->mod, 0);
 			ret = request_file(ota, &http, filename, addr, FILE_PART_SIZE);
 			if (ret)
 			{
 				retries--;
 				continue; /* while */
 			}
+
+			// Erase SPI FLASH while the part is being downloaded
+			merr = mem_erase_ahead(ota->mem, &fws, &erased,
+					addr + FILE_PART_SIZE, fws.size);
+
 			ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(DELAY_SIM800L_MS));
 
 			// Error
-			if (!http.res_auth || !http.response)
+			if (merr || !http.res_auth || !http.response)
 			{
 				if (http.res_auth)
 					vPortFree(http.res_auth);
@@ -360,9 +474,15 @@ startup:
 				continue; /* while */
 			}
 
-			// Write data to SPI FLASH
-			mem_write(ota->mem, FWS_PAYLOAD_ADDR + addr,
-					(uint8_t *) http.response, http.rlen);
+			// Write data to SPI FLASH, the part is requested again on failure
+			if (mem_write_payload(ota->mem, &fws, addr,
+					(uint8_t *) http.response, http.rlen))
+			{
+				vPortFree(http.res_auth);
+				vPortFree(http.response);
+				retries--;
+				continue; /* while */
+			}
 
 			addr += http.rlen;
 			retries = RETRIES; // Reset retries
@@ -375,27 +495,25 @@ startup:
 		if (fws.size % sizeof(uint32_t))
 		{
 			int expand = sizeof(uint32_t) - fws.size % sizeof(uint32_t);
-			uint8_t byte = 0xFF;
+			uint8_t bytes[sizeof(uint32_t)] = {0xFF, 0xFF, 0xFF, 0xFF};
 
 			fws.size += expand;
-			while (expand)
-			{
-				mem_write(ota->mem, FWS_PAYLOAD_ADDR + addr, &byte, 1);
-				expand--;
-				addr++;
-
-			}
+			if (mem_write_payload(ota->mem, &fws, addr, bytes, expand))
+				continue;
+			addr += expand;
 		}
 
 		// Checksum
-		if (mem_checksum(ota->mem, FWS_PAYLOAD_ADDR, fws.size) != fws.checksum)
+		if (ota_verify(ota->mem, &fws) != FWS_STATUS_SUCCESS)
 			continue;
 
 		// Update SPI FLASH header
 		fws.loaded = 0;
-		mem_write_header(ota->mem, &fws);
+		if (mem_write_header(ota->mem, &fws))
+			continue;
 
 		// Reset
+		mqueue_flush_all();
 		osDelay(100); // ?
 		NVIC_SystemReset(); // --> BOOTLOADER
 	}
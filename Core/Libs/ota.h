@@ -14,6 +14,7 @@
 #include "sim800l.h"
 #include "hmac.h"
 #include "w25q_s.h"
+#include "fws.h"
 
 #define OTA_URL_SIZE 64
 
@@ -31,4 +32,13 @@ void ota_init(struct ota *ota, struct sim800l *mod, struct w25q_s *mem,
 		const uint8_t *secret, const char *url);
 void ota_task(struct ota *ota);
 
+/*
+ * @brief: Verify the staged firmware image against the header checksum,
+ * reading it in large double buffered chunks
+ * @param fws: Header of the image, fws->size is a multiple of 4
+ * @retval: FWS_STATUS_SUCCESS, FWS_STATUS_ERR_CHECKSUM_STORAGE or
+ * FWS_STATUS_ERR_NO_STORAGE if the memory or a buffer is not available
+ */
+int ota_verify(struct w25q_s *mem, const struct fws *fws);
+
 #endif /* OTA_H_ */
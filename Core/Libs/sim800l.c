@@ -17,11 +17,28 @@
 #define CMD_BUFFER_SIZE 96
 
 /*
- * Minimum functionality mode
- * Without this feature power consumption will be about 1 mA, but module will be
- * always connected to cellular network. Use only if SIM800L is used rarely
+ * GPRS bearer linger policy
+ * Attached and idle SIM800L draws several times less than during CREG polling
+ * and SAPBR open, so lingering pays off if the next HTTP request is expected
+ * within about LINGER_RATIO attach times
  */
-#define DISABLE_RF
+#define LINGER_RATIO 4
+#define LINGER_MIN_MS 50 // For tasks to create a new HTTP request right away
+#define LINGER_MARGIN_MS 2000
+#define ATTACH_MS 5000 // Until measured
+
+/*
+ * Radio policy between tasks
+ * Registered SIM800L sleeps at about 1 mA. Minimum functionality mode
+ * (AT+CFUN=0) saves most of it, but waking up re-registers with the network
+ * for seconds at tens of mA, so it pays off if the next task is expected in
+ * more than RF_OFF_RATIO wake-up latencies. UART sleep (AT+CSCLK=2) takes
+ * about 150 ms to leave and is skipped for tasks expected within RF_SLEEP_MS
+ */
+#define RF_OFF_RATIO 20
+#define RF_SLEEP_MS 2000
+#define RF_WAKE_OFF_MS 5000 // Until measured
+#define RF_REG_MS 30000
 
 #include "logger.h"
 #define TAG "SIM800L"
@@ -47,11 +64,39 @@ enum state
 	STATE_CREG,
 	STATE_GPRS_INIT,
 	STATE_GPRS_HTTP,
+	STATE_GPRS_LINGER,
 	STATE_GPRS_HTTP_TERM,
 	STATE_GPRS_DEINIT,
 	STATE_NETSCAN,
 };
 
+enum token
+{
+	TOKEN_TIMEOUT,
+	TOKEN_LINE, // Information response, URC or echo
+	TOKEN_OK,
+	TOKEN_ERROR, // "ERROR", "+CME ERROR: <n>", "+CMS ERROR: <n>"
+	TOKEN_PAYLOAD, // mod->payload bytes follow (read_payload())
+	TOKEN_URC, // Dispatched to the URC handler, not a response
+	TOKEN_EVENT, // URC aborted the command (mod->events)
+};
+
+enum event
+{
+	EVENT_RESET = 0x01, // Module restarted by itself or powers down
+	EVENT_NET_LOST = 0x02, // Network registration or bearer lost while online
+};
+
+enum flag
+{
+	FLAG_INIT = 0x01, // Module is initialized, "RDY" means restart
+	FLAG_SIM_READY = 0x02,
+	FLAG_SMS_READY = 0x04,
+	FLAG_HTTP = 0x08, // HTTP session is initialized (AT+HTTPINIT)
+	FLAG_USERDATA = 0x10, // HTTP session has "Authorization" header set
+	FLAG_NET_REG = 0x20, // Registered in network ("+CREG: 1", "+CREG: 5")
+};
+
 enum issue
 {
 	ISSUE_IDLE,
@@ -76,6 +121,82 @@ inline static void reset_unset(struct sim800l *mod)
 	HAL_GPIO_WritePin(mod->rst_port, mod->rst_pin, GPIO_PIN_SET);
 }
 
+inline static bool online(struct sim800l *mod)
+{
+	return mod->state == STATE_GPRS_INIT || mod->state == STATE_GPRS_HTTP;
+}
+
+static bool urc_ignore(struct sim800l *mod, const char *line, void *ctx)
+{
+	return true;
+}
+
+// "RDY"
+static bool urc_rdy(struct sim800l *mod, const char *line, void *ctx)
+{
+	if (mod->flags & FLAG_INIT)
+		mod->events |= EVENT_RESET;
+	return true;
+}
+
+// "+CPIN: READY", "+CPIN: NOT READY"
+static bool urc_cpin(struct sim800l *mod, const char *line, void *ctx)
+{
+	if (!strcmp(line, "+CPIN: READY"))
+		mod->flags |= FLAG_SIM_READY;
+	else
+		mod->flags &= ~(FLAG_SIM_READY | FLAG_SMS_READY);
+	return true;
+}
+
+// "SMS Ready"
+static bool urc_sms_ready(struct sim800l *mod, const char *line, void *ctx)
+{
+	mod->flags |= FLAG_SMS_READY;
+	return true;
+}
+
+// "UNDER-VOLTAGE WARNNING", "UNDER-VOLTAGE POWER DOWN", "NORMAL POWER DOWN"
+static bool urc_power(struct sim800l *mod, const char *line, void *ctx)
+{
+	if (strstr(line, "WARNNING"))
+		mod->voltage_alarms++;
+	if (strstr(line, "POWER DOWN"))
+		mod->events |= EVENT_RESET;
+	return true;
+}
+
+// "+CREG: <stat>" (AT+CREG=1), but not "+CREG: <n>,<stat>" (AT+CREG?)
+static bool urc_creg(struct sim800l *mod, const char *line, void *ctx)
+{
+	int stat;
+
+	if (strchr(line, ','))
+		return false;
+
+	// 1: registered, home network; 5: registered, roaming
+	stat = strtoul(line + 6, NULL, 10);
+	if (stat == 1 || stat == 5)
+	{
+		mod->flags |= FLAG_NET_REG;
+	}
+	else
+	{
+		mod->flags &= ~FLAG_NET_REG;
+		if (online(mod))
+			mod->events |= EVENT_NET_LOST;
+	}
+	return true;
+}
+
+// "+PDP: DEACT"
+static bool urc_pdp_deact(struct sim800l *mod, const char *line, void *ctx)
+{
+	if (online(mod))
+		mod->events |= EVENT_NET_LOST;
+	return true;
+}
+
 /******************************************************************************/
 void sim800l_init(struct sim800l *mod, UART_HandleTypeDef *uart,
 		GPIO_TypeDef *rst_port, uint16_t rst_pin, char *apn)
@@ -84,95 +205,431 @@ void sim800l_init(struct sim800l *mod, UART_HandleTypeDef *uart,
 	mod->uart = uart;
 	mod->rst_port = rst_port;
 	mod->rst_pin = rst_pin;
-	mod->stream = xStreamBufferCreate(SIM800L_BUFFER_SIZE, 1);
+	mod->rxsem = xSemaphoreCreateBinary();
 	mod->queue = xQueueCreate(SIM800L_TASK_QUEUE_SIZE,
 			sizeof(struct sim800l_task));
 
 	strncpy(mod->apn, apn, sizeof(mod->apn) - 1);
 	mod->apn[sizeof(mod->apn) - 1] = '\0';
 
+	mod->linger_max = pdMS_TO_TICKS(SIM800L_LINGER_MS);
+	mod->linger.attach = ATTACH_MS;
+	mod->rf.mode = SIM800L_RF_OFF;
+	mod->rf.wake_off = RF_WAKE_OFF_MS;
+
+	sim800l_urc(mod, "RDY", urc_rdy, NULL);
+	sim800l_urc(mod, "+CFUN:", urc_ignore, NULL);
+	sim800l_urc(mod, "+CPIN:", urc_cpin, NULL);
+	sim800l_urc(mod, "Call Ready", urc_ignore, NULL);
+	sim800l_urc(mod, "SMS Ready", urc_sms_ready, NULL);
+	sim800l_urc(mod, "UNDER-VOLTAGE", urc_power, NULL);
+	sim800l_urc(mod, "OVER-VOLTAGE", urc_power, NULL);
+	sim800l_urc(mod, "NORMAL POWER DOWN", urc_power, NULL);
+	sim800l_urc(mod, "+CREG:", urc_creg, NULL);
+	sim800l_urc(mod, "+PDP: DEACT", urc_pdp_deact, NULL);
+	sim800l_urc(mod, "CLOSED", urc_ignore, NULL);
+
 	reset_unset(mod);
 	task_done(mod);
 }
 
 /******************************************************************************/
-void sim800l_irq(struct sim800l *mod, const char *buf, size_t len)
+void sim800l_linger(struct sim800l *mod, timeout_t max)
 {
-	BaseType_t woken = pdFALSE;
-	xStreamBufferSendFromISR(mod->stream, buf, len, &woken);
+	mod->linger_max = pdMS_TO_TICKS(max);
 }
 
-inline static void clear_rx_buffer(struct sim800l *mod)
+/******************************************************************************/
+void sim800l_http_hint(struct sim800l *mod, timeout_t next)
 {
-	xStreamBufferReset(mod->stream);
-	mod->rxlen = 0;
+	taskENTER_CRITICAL();
+	mod->hint = xTaskGetTickCount() + pdMS_TO_TICKS(next);
+	mod->hinted = true;
+	taskEXIT_CRITICAL();
 }
 
-static bool wait_for_any(struct sim800l *mod, timeout_t timeout)
+/******************************************************************************/
+void sim800l_get_linger_stats(struct sim800l *mod,
+		struct sim800l_linger_stats *stats)
 {
-	size_t received;
+	taskENTER_CRITICAL();
+	*stats = mod->linger;
+	taskEXIT_CRITICAL();
+}
 
-	if (mod->rxlen >= SIM800L_BUFFER_SIZE)
-		return false;
+/******************************************************************************/
+void sim800l_rf_period(struct sim800l *mod, timeout_t period)
+{
+	mod->period = period;
+}
 
-	received = xStreamBufferReceive(mod->stream, &mod->rxb[mod->rxlen],
-			SIM800L_BUFFER_SIZE - mod->rxlen, pdMS_TO_TICKS(timeout));
-	mod->rxlen += received;
+/******************************************************************************/
+void sim800l_get_rf_stats(struct sim800l *mod, struct sim800l_rf_stats *stats)
+{
+	taskENTER_CRITICAL();
+	*stats = mod->rf;
+	taskEXIT_CRITICAL();
+}
 
-	if (!received)
-		return false;
+/******************************************************************************/
+int sim800l_urc(struct sim800l *mod, const char *prefix,
+		sim800l_urc_cb handler, void *ctx)
+{
+	if (mod->nurc >= SIM800L_URC_MAX)
+		return -1;
 
-	logger_add(&logger, TAG, false, (char *) mod->rxb, mod->rxlen);
+	mod->urc[mod->nurc].prefix = prefix;
+	mod->urc[mod->nurc].handler = handler;
+	mod->urc[mod->nurc].ctx = ctx;
+	mod->nurc++;
 
-	return true;
+	return 0;
+}
+
+/******************************************************************************/
+void sim800l_rx_start(struct sim800l *mod)
+{
+	// DMA starts from the beginning of the ring: skip to the next ring lap
+	mod->rxbase = (mod->rxhead + SIM800L_RING_SIZE - 1) &
+			~(SIM800L_RING_SIZE - 1);
+	mod->rxhead = mod->rxbase;
+	mod->rxpos = 0;
+
+	HAL_UARTEx_ReceiveToIdle_DMA(mod->uart, mod->ring, SIM800L_RING_SIZE);
+}
+
+/******************************************************************************/
+void sim800l_irq(struct sim800l *mod, size_t pos)
+{
+	BaseType_t woken = pdFALSE;
+	size_t len;
+
+	// Full event (and idle right after it) reports SIM800L_RING_SIZE, the
+	// same position as 0. Half event comes in between, so no lap is missed
+	pos &= SIM800L_RING_SIZE - 1;
+	len = (pos - mod->rxpos) & (SIM800L_RING_SIZE - 1);
+	mod->rxpos = pos;
+
+	if (!len)
+		return;
+
+	mod->rxhead += len;
+	xSemaphoreGiveFromISR(mod->rxsem, &woken);
+	portYIELD_FROM_ISR(woken);
 }
 
-/**
- * @note: timeout should be more then 0
+/*
+ * @brief: Bytes written by DMA so far, also those no event reported yet.
+ * Events come every half ring, so the position is at most that far ahead.
  */
-static bool wait_for_num(struct sim800l *mod, size_t num, timeout_t timeout)
+static uint32_t rx_written(struct sim800l *mod)
+{
+	uint32_t head, pos;
+
+	taskENTER_CRITICAL();
+	head = mod->rxhead;
+	pos = SIM800L_RING_SIZE - __HAL_DMA_GET_COUNTER(mod->uart->hdmarx);
+	pos = (pos - mod->rxpos) & (SIM800L_RING_SIZE - 1);
+	taskEXIT_CRITICAL();
+
+	return head + pos;
+}
+
+/*
+ * @brief: Wait for received data in the ring
+ * @param p: Pointer to the oldest unread byte
+ * @param start: Tick count of the operation start
+ * @param ticks: Operation timeout
+ * @retval: Number of contiguous bytes at p, 0 on timeout
+ */
+static size_t rx_peek(struct sim800l *mod, uint8_t **p, TickType_t start,
+		TickType_t ticks)
 {
-	TickType_t ticks = xTaskGetTickCount();
-	TickType_t left = pdMS_TO_TICKS(timeout);
 	TickType_t wait;
+	uint32_t head, tail, len;
 
-	if (num > SIM800L_BUFFER_SIZE)
+	for (;;)
+	{
+		head = mod->rxhead;
+
+		// Data before DMA restart or overwritten by DMA is lost
+		if ((int32_t) (mod->rxtail - mod->rxbase) < 0 ||
+				rx_written(mod) - mod->rxtail > SIM800L_RING_SIZE)
+		{
+			mod->rxtail = head;
+			mod->overruns++;
+			mod->llen = 0;
+			mod->payload = 0;
+		}
+
+		if (head != mod->rxtail)
+		{
+			tail = mod->rxtail & (SIM800L_RING_SIZE - 1);
+			len = head - mod->rxtail;
+			if (len > SIM800L_RING_SIZE - tail)
+				len = SIM800L_RING_SIZE - tail;
+
+			*p = &mod->ring[tail];
+			return len;
+		}
+
+		wait = xTaskGetTickCount() - start;
+		if (wait >= ticks)
+			return 0;
+		xSemaphoreTake(mod->rxsem, ticks - wait);
+	}
+}
+
+/*
+ * @brief: Release bytes returned by rx_peek()
+ * @retval: false if DMA overwrote them meanwhile (rx_peek() drops the data)
+ */
+static bool rx_consume(struct sim800l *mod, size_t len)
+{
+	if (rx_written(mod) - mod->rxtail > SIM800L_RING_SIZE)
 		return false;
 
-	while ((mod->rxlen < num) && left)
+	mod->rxtail += len;
+	return true;
+}
+
+/*
+ * @brief: Pass the line to the registered URC handler
+ * @retval: true if the line is consumed as URC
+ */
+static bool dispatch(struct sim800l *mod)
+{
+	struct sim800l_urc *urc;
+
+	for (size_t i = 0; i < mod->nurc; i++)
 	{
-		mod->rxlen += xStreamBufferReceive(mod->stream, &mod->rxb[mod->rxlen],
-				num - mod->rxlen, left);
-
-		wait = xTaskGetTickCount() - ticks;
-		if (left > wait)
-			left -= wait;
-		else
-			left = 0;
+		urc = &mod->urc[i];
+		if (strncmp(mod->line, urc->prefix, strlen(urc->prefix)))
+			continue;
+		if (urc->handler(mod, mod->line, urc->ctx))
+			return true;
 	}
 
-	logger_add(&logger, TAG, false, (char *) mod->rxb, mod->rxlen);
+	return false;
+}
 
-	if (mod->rxlen < num)
-		return false;
+static enum token classify(struct sim800l *mod)
+{
+	const char *line = mod->line;
+
+	if (!strcmp(line, "OK"))
+		return TOKEN_OK;
+
+	if (!strcmp(line, "ERROR") || !strncmp(line, "+CME ERROR:", 11) ||
+			!strncmp(line, "+CMS ERROR:", 11))
+		return TOKEN_ERROR;
+
+	// "+HTTPREAD: <len>\r\n" is followed by <len> bytes of raw data
+	if (!strncmp(line, "+HTTPREAD:", 10))
+	{
+		mod->payload = strtoul(line + 10, NULL, 10);
+		return TOKEN_PAYLOAD;
+	}
+
+	return TOKEN_LINE;
+}
+
+/*
+ * @brief: Get the next response line, every received byte is read once
+ *     Line text (without "\r\n") is in mod->line until the next call
+ *     Empty lines are skipped, unread payload of TOKEN_PAYLOAD is dropped
+ *     URCs are dispatched to handlers before return
+ * @param start: Tick count of the operation start
+ * @param timeout: Operation timeout in ms
+ * @retval: Token type, TOKEN_TIMEOUT on timeout, TOKEN_EVENT while
+ *     mod->events is set
+ */
+static enum token next_token(struct sim800l *mod, TickType_t start,
+		timeout_t timeout)
+{
+	TickType_t ticks = pdMS_TO_TICKS(timeout);
+	size_t len, i;
+	uint8_t *p;
+	bool eol;
+
+	for (;;)
+	{
+		if (mod->events)
+			return TOKEN_EVENT;
+
+		len = rx_peek(mod, &p, start, ticks);
+		if (!len)
+			return TOKEN_TIMEOUT;
+
+		if (mod->payload)
+		{
+			if (len > mod->payload)
+				len = mod->payload;
+			if (rx_consume(mod, len))
+				mod->payload -= len;
+			continue;
+		}
+
+		eol = false;
+		for (i = 0; i < len && !eol; i++)
+		{
+			if (p[i] == '\n')
+				eol = true;
+			else if (p[i] != '\r' && mod->llen < SIM800L_LINE_SIZE)
+				mod->line[mod->llen++] = p[i]; // Long lines are truncated
+		}
+
+		if (!rx_consume(mod, i))
+		{
+			mod->llen = 0;
+			continue;
+		}
+
+		if (!eol || !mod->llen)
+			continue;
+
+		mod->line[mod->llen] = '\0';
+		logger_add(&logger, TAG, false, mod->line, mod->llen);
+		mod->llen = 0;
+
+		if (dispatch(mod))
+			return mod->events ? TOKEN_EVENT : TOKEN_URC;
+
+		return classify(mod);
+	}
+}
+
+/*
+ * @brief: Read payload announced by TOKEN_PAYLOAD
+ * @param buf: Destination buffer (mod->payload bytes)
+ * @retval: true on success
+ */
+static bool read_payload(struct sim800l *mod, uint8_t *buf, TickType_t start,
+		timeout_t timeout)
+{
+	TickType_t ticks = pdMS_TO_TICKS(timeout);
+	uint32_t overruns = mod->overruns;
+	size_t len;
+	uint8_t *p;
+
+	while (mod->payload)
+	{
+		len = rx_peek(mod, &p, start, ticks);
+		if (!len || mod->overruns != overruns)
+			return false;
+
+		if (len > mod->payload)
+			len = mod->payload;
+		memcpy(buf, p, len);
+
+		if (!rx_consume(mod, len))
+			return false;
+		buf += len;
+		mod->payload -= len;
+	}
 
 	return true;
 }
 
-static bool compare_buffer_beginning(struct sim800l *mod, const char *sample,
+/*
+ * @brief: Wait for the final result code
+ * @param info: Information response prefix expected before "OK" or NULL
+ * @retval: TOKEN_OK (info line received), TOKEN_ERROR, TOKEN_TIMEOUT or
+ *     TOKEN_EVENT
+ */
+static enum token wait_final(struct sim800l *mod, const char *info,
 		timeout_t timeout)
 {
-	size_t len = strlen(sample);
+	TickType_t start = xTaskGetTickCount();
+	bool seen = !info;
+	enum token token;
 
-	if (!wait_for_num(mod, len, timeout))
-		return false;
+	for (;;)
+	{
+		token = next_token(mod, start, timeout);
+		switch (token)
+		{
+		case TOKEN_LINE:
+			if (info && !strncmp(mod->line, info, strlen(info)))
+				seen = true;
+			break;
 
-	if (strncmp((char *) mod->rxb, sample, len) != 0)
-		return false;
+		case TOKEN_OK:
+			return seen ? TOKEN_OK : TOKEN_ERROR;
+
+		case TOKEN_PAYLOAD:
+		case TOKEN_URC:
+			break;
+
+		case TOKEN_ERROR:
+		case TOKEN_TIMEOUT:
+		case TOKEN_EVENT:
+			return token;
+		}
+	}
+}
+
+inline static bool expect(struct sim800l *mod, const char *info,
+		timeout_t timeout)
+{
+	return wait_final(mod, info, timeout) == TOKEN_OK;
+}
+
+/*
+ * @brief: Wait for a line starting with prefix (after "OK" as well)
+ * @retval: true if the line is in mod->line, false on ERROR, timeout or
+ *     URC event
+ */
+static bool wait_line(struct sim800l *mod, const char *prefix,
+		timeout_t timeout)
+{
+	TickType_t start = xTaskGetTickCount();
+	enum token token;
+
+	for (;;)
+	{
+		token = next_token(mod, start, timeout);
+		if (token == TOKEN_ERROR || token == TOKEN_TIMEOUT ||
+				token == TOKEN_EVENT)
+			return false;
+		if (token == TOKEN_LINE && !strncmp(mod->line, prefix, strlen(prefix)))
+			return true;
+	}
+}
+
+/*
+ * @brief: Wait for module status flag reported by URC
+ * @retval: true if the flag is set, false on timeout or URC event
+ */
+static bool wait_flag(struct sim800l *mod, int flag, timeout_t timeout)
+{
+	TickType_t start = xTaskGetTickCount();
+	enum token token;
+
+	while (!(mod->flags & flag))
+	{
+		token = next_token(mod, start, timeout);
+		if (token == TOKEN_TIMEOUT || token == TOKEN_EVENT)
+			return false;
+	}
 
 	return true;
 }
 
+/*
+ * @brief: Drop everything received during timeout (URCs are dispatched)
+ */
+static void flush(struct sim800l *mod, timeout_t timeout)
+{
+	TickType_t start = xTaskGetTickCount();
+	enum token token;
+
+	do
+	{
+		token = next_token(mod, start, timeout);
+	} while (token != TOKEN_TIMEOUT && token != TOKEN_EVENT);
+}
+
 static void transmit_data(struct sim800l *mod, const uint8_t *buf, size_t len)
 {
 	if (len > SIM800L_BUFFER_SIZE)
@@ -185,7 +642,7 @@ static void transmit_data(struct sim800l *mod, const uint8_t *buf, size_t len)
 
 	logger_add(&logger, TAG, false, (char *) mod->txb, len);
 
-	clear_rx_buffer(mod); // ?
+	flush(mod, 0); // Stale responses, URCs are still dispatched
 	while (HAL_UART_Transmit_DMA(mod->uart, mod->txb, len) == HAL_BUSY);
 }
 
@@ -208,6 +665,20 @@ static void state(struct sim800l *mod, enum state new_state, enum status status)
 		}
 	}
 
+	// Unsolicited events
+	if (mod->events & EVENT_RESET)
+	{
+		logger_add_str(&logger, TAG, false, "restart");
+		mod->state = STATE_STARTUP;
+	}
+	else if (mod->events & EVENT_NET_LOST)
+	{
+		// Close HTTP session and bearer, the task is repeated after CREG
+		logger_add_str(&logger, TAG, false, "net lost");
+		mod->state = STATE_GPRS_HTTP_TERM;
+	}
+	mod->events = 0;
+
 	// Task timeout
 	if (mod->task.issue != ISSUE_IDLE)
 	{
@@ -224,91 +695,46 @@ static void state(struct sim800l *mod, enum state new_state, enum status status)
 // "\r\n+CBC: 0,61,3895\r\n\r\nOK\r\n"
 static bool parse_battery_charge(struct sim800l *mod, timeout_t timeout)
 {
-	const char *header = "+CBC:";
-	const char *ending = "\r\nOK\r\n";
-	char *p, *end;
-
-	while (wait_for_any(mod, timeout))
-	{
-		mod->rxb[mod->rxlen] = '\0';
-
-		p = strstr((char *) mod->rxb, header);
-		if (!p)
-			continue;
-
-		end = strstr(p, ending);
-		if (!end)
-			continue;
-
-		p = strstr(p, ",");
-		if (!p)
-			return false;
-
-		p++;
-		if (!*p)
-			return false;
+	char *p;
 
-		mod->bcl = strtoul(p, &p, 0);
-		if (!*p)
-			return false;
+	if (!wait_line(mod, "+CBC:", timeout))
+		return false;
 
-		p++;
-		if (!*p)
-			return false;
+	p = strchr(mod->line, ',');
+	if (!p)
+		return false;
 
-		mod->voltage = strtoul(p, NULL, 0);
+	mod->bcl = strtoul(p + 1, &p, 0);
+	if (*p != ',')
+		return false;
 
-		return true;
-	}
+	mod->voltage = strtoul(p + 1, NULL, 0);
 
-	return false;
+	return expect(mod, NULL, timeout);
 }
 
 // "\r\nOK\r\n\r\n+HTTPACTION: 0,200,293\r\n"
-// "\r\nOK\r\n 1,200,16\r\n" ?
 // @retval: HTTP status code on success or -1 on failure
 static int parse_http_action(struct sim800l *mod, int* len, timeout_t timeout)
 {
-	const char *header = "+HTTPACTION:";
-	const char *ending = "\r\n";
-	char *p, *end;
+	char *p;
 	int status;
 
-	while (wait_for_any(mod, timeout))
-	{
-		mod->rxb[mod->rxlen] = '\0';
-
-		p = strstr((char *) mod->rxb, header);
-		if (!p)
-			continue;
-
-		end = strstr(p, ending);
-		if (!end)
-			continue;
-
-		p = strstr(p, ",");
-		if (!p)
-			return -1;
-
-		p++;
-		if (!*p)
-			return -1;
-
-		status = strtoul(p, &p, 0);
-		if (!*p)
-			return -1;
+	if (!wait_line(mod, "+HTTPACTION:", timeout))
+		return -1;
 
-		p++;
-		if (!*p)
-			return -1;
+	p = strchr(mod->line, ',');
+	if (!p)
+		return -1;
 
-		if (len)
-			*len = strtoul(p, NULL, 0);
+	status = strtoul(p + 1, &p, 0);
+	if (*p != ',')
+		return -1;
 
-		return status;
-	}
+	if (len)
+		*len = strtoul(p + 1, NULL, 0);
 
-	return -1;
+	return status;
 }
 
 // \r\n+HTTPHEAD: 224
@@ -324,46 +750,27 @@ static int parse_http_action(struct sim800l *mod, int* len, timeout_t timeout)
 static int parse_http_head_auth(struct sim800l *mod, timeout_t timeout)
 {
 	struct sim800l_http *data = mod->task.data;
-	const char *header = "authorization:";
-	const char *ending = "\r\n";
-	char *p, *end;
+	char *p;
 	int len;
 
-	while (wait_for_any(mod, timeout))
-	{
-		mod->rxb[mod->rxlen] = '\0';
-
-		p = strstr((char *) mod->rxb, header);
-		if (!p)
-			continue;
-
-		end = strstr(p, ending);
-		if (!end)
-			continue;
-
-		p = strstr(p, " ");
-		if (!p)
-			return -1;
-
-		p++;
-		if (!*p)
-			return -1;
+	if (!wait_line(mod, "authorization:", timeout))
+		return -1;
 
-		if (p >= end)
-			return -1;
+	p = strchr(mod->line, ' ');
+	if (!p || !p[1])
+		return -1;
 
-		len = end - p;
-		data->res_auth = pvPortMalloc(len + 1);
-		if (!data->res_auth)
-			return -1;
+	p++;
+	len = strlen(p);
+	data->res_auth = pvPortMalloc(len + 1);
+	if (!data->res_auth)
+		return -1;
 
-		memcpy(data->res_auth, p, len);
-		data->res_auth[len] = '\0';
+	memcpy(data->res_auth, p, len + 1);
 
-		return len;
-	}
+	expect(mod, NULL, timeout);
 
-	return -1;
+	return len;
 }
 
 // \r\n+HTTPREAD: 293\r\n...\r\nOK\r\n
@@ -371,55 +778,40 @@ static int parse_http_head_auth(struct sim800l *mod, timeout_t timeout)
 static int parse_http_read(struct sim800l *mod, timeout_t timeout)
 {
 	struct sim800l_http *data = mod->task.data;
-	const char *header = "+HTTPREAD:";
-	const char *ending = "\r\n"; // To be sure len is valid
-	char *p, *end;
-	int len;
+	TickType_t start = xTaskGetTickCount();
+	enum token token;
+	size_t len;
 
-	while (wait_for_any(mod, timeout))
+	do
 	{
-		mod->rxb[mod->rxlen] = '\0';
-
-		p = strstr((char *) mod->rxb, header);
-		if (!p)
-			continue;
-
-		end = strstr(p, ending);
-		if (!end)
-			continue;
-
-		p = strstr(p, " ");
-		if (!p)
-			return -1;
-
-		p++;
-		if (!*p)
+		token = next_token(mod, start, timeout);
+		if (token == TOKEN_ERROR || token == TOKEN_TIMEOUT ||
+				token == TOKEN_EVENT)
 			return -1;
+	} while (token != TOKEN_PAYLOAD);
 
-		len = strtoul(p, &p, 0);
-		if (!*p)
-			return -1;
-
-		p = end + strlen(ending);
-		end = (char *) &mod->rxb[mod->rxlen];
-		if (p > end)
-			continue;
+	// Payload is copied from the ring straight to the response
+	len = mod->payload;
+	if (len > SIM800L_BUFFER_SIZE)
+		return -1;
 
-		if ((end - p) < len)
-			continue;
+	data->response = pvPortMalloc(len + 1);
+	if (!data->response)
+		return -1;
 
-		data->response = pvPortMalloc(len + 1);
-		if (!data->response)
-			return -1;
+	if (!read_payload(mod, (uint8_t *) data->response, start, timeout))
+	{
+		vPortFree(data->response);
+		data->response = NULL;
+		return -1;
+	}
 
-		memcpy(data->response, p, len);
-		data->response[len] = '\0';
-		data->rlen = len;
+	data->response[len] = '\0';
+	data->rlen = len;
 
-		return len;
-	}
+	expect(mod, NULL, timeout);
 
-	return -1;
+	return len;
 }
 
 // \r\n+HTTPSTATUS: POST,0,0,0\r\n\r\nOK\r\n
@@ -427,37 +819,22 @@ static int parse_http_read(struct sim800l *mod, timeout_t timeout)
 // @retval: HTTP status on success or -1 on failure
 static int parse_http_status(struct sim800l *mod, timeout_t timeout)
 {
-	const char *header = "+HTTPSTATUS:";
-	const char *ending = "\r\nOK\r\n";
-	char *p, *end;
+	char *p;
 	int status;
 
-	while (wait_for_any(mod, timeout))
-	{
-		mod->rxb[mod->rxlen] = '\0';
-
-		p = strstr((char *) mod->rxb, header);
-		if (!p)
-			continue;
-
-		end = strstr(p, ending);
-		if (!end)
-			continue;
-
-		p = strstr(p, ",");
-		if (!p)
-			return false;
+	if (!wait_line(mod, "+HTTPSTATUS:", timeout))
+		return -1;
 
-		p++;
-		if (!*p)
-			return false;
+	p = strchr(mod->line, ',');
+	if (!p)
+		return -1;
 
-		status = strtoul(p, NULL, 0);
+	status = strtoul(p + 1, NULL, 0);
 
-		return status;
-	}
+	if (!expect(mod, NULL, timeout))
+		return -1;
 
-	return -1;
+	return status;
 }
 
 static int32_t get_param_value(const char *line, const char *param, int base)
@@ -477,58 +854,26 @@ static int32_t get_param_value(const char *line, const char *param, int base)
 	return strtoul(p, NULL, base);
 }
 
-static void shift_buffer_left(struct sim800l *mod, size_t len)
-{
-	uint8_t *p = mod->rxb + len;
-
-	for (size_t i = 0; i < mod->rxlen - len; i++)
-		mod->rxb[i] = p[i];
-	mod->rxlen -= len;
-}
-
+// Operator:"MTS",MCC:250,MNC:01,Rxlev:30,Cellid:1A2B,Arfcn:10,Lac:0F0F,Bsic:1
 static int parse_net_scan(struct sim800l *mod, timeout_t timeout)
 {
 	struct sim800l_netscan *data = mod->task.data;
-	const char *ending = "OK\r\n";
-	const char *delim = "\r\n";
-	size_t len;
-	char *p;
+	TickType_t start = xTaskGetTickCount();
 
-	while (wait_for_any(mod, timeout))
+	for (;;)
 	{
-		for (;;)
+		switch (next_token(mod, start, timeout))
 		{
-			mod->rxb[mod->rxlen] = '\0';
-
-			p = strstr((char *) mod->rxb, delim);
-			if (!p)
-				break; /* for */
+		case TOKEN_OK:
+			mod->task.callback(SIM800L_NETSCAN_DONE, mod->task.data);
+			return 0;
 
-			p += strlen(delim);
-			len = p - (char *) mod->rxb;
-
-			if (!strncmp((char *) mod->rxb, ending, strlen(ending)))
-			{
-				mod->task.callback(SIM800L_NETSCAN_DONE, mod->task.data);
-				return 0;
-			}
-
-			// "\r\n" only
-			if (len == strlen(delim))
-			{
-				shift_buffer_left(mod, len);
-				continue; /* for */
-			}
-
-			// Parameters line
-			mod->rxb[len - 1] = '\0';
-
-			// Parameters
-			data->mcc = get_param_value((char *) mod->rxb, "MCC", 10);
-			data->mnc = get_param_value((char *) mod->rxb, "MNC", 10);
-			data->lac = get_param_value((char *) mod->rxb, "Lac", 16);
-			data->cid = get_param_value((char *) mod->rxb, "Cellid", 16);
-			data->lev = get_param_value((char *) mod->rxb, "Rxlev", 10);
+		case TOKEN_LINE:
+			data->mcc = get_param_value(mod->line, "MCC", 10);
+			data->mnc = get_param_value(mod->line, "MNC", 10);
+			data->lac = get_param_value(mod->line, "Lac", 16);
+			data->cid = get_param_value(mod->line, "Cellid", 16);
+			data->lev = get_param_value(mod->line, "Rxlev", 10);
 
 			if (data->mcc >= 0 && data->mnc >= 0 && data->lac >= 0 &&
 					data->cid >= 0 && data->lev >= 0)
@@ -536,13 +881,123 @@ static int parse_net_scan(struct sim800l *mod, timeout_t timeout)
 				data->lev = data->lev - 113;
 				mod->task.callback(0, mod->task.data);
 			}
+			break;
 
-			// <--
-			shift_buffer_left(mod, len);
+		case TOKEN_PAYLOAD:
+		case TOKEN_URC:
+			break;
+
+		case TOKEN_ERROR:
+		case TOKEN_TIMEOUT:
+		case TOKEN_EVENT:
+			return -1;
 		}
 	}
+}
 
-	return -1;
+/*
+ * @brief: Account the time since the previous HTTP request, once per task
+ * (retries of the task find http_end cleared)
+ */
+static void http_begin(struct sim800l *mod)
+{
+	uint32_t gap;
+
+	if (!mod->http_end)
+		return;
+
+	gap = (mod->task_ticks - mod->http_end) * portTICK_PERIOD_MS;
+	if (mod->linger.gap)
+		gap = (3 * mod->linger.gap + gap) / 4;
+	mod->linger.gap = gap;
+	mod->http_end = 0;
+}
+
+/*
+ * @brief: Bearer linger window after an HTTP request
+ * @retval: Ticks to wait for the next HTTP request
+ */
+static TickType_t linger_window(struct sim800l *mod)
+{
+	TickType_t now = xTaskGetTickCount();
+	TickType_t limit, next;
+
+	limit = pdMS_TO_TICKS(LINGER_RATIO * mod->linger.attach);
+	if (limit > mod->linger_max)
+		limit = mod->linger_max;
+
+	// Expected time to the next request: hint or average gap
+	taskENTER_CRITICAL();
+	if (mod->hinted)
+	{
+		next = 0;
+		if ((int32_t) (mod->hint - now) > 0)
+			next = mod->hint - now;
+		mod->hinted = false;
+	}
+	else if (mod->linger.gap)
+	{
+		next = pdMS_TO_TICKS(mod->linger.gap);
+	}
+	else
+	{
+		next = portMAX_DELAY; // Unknown
+	}
+	taskEXIT_CRITICAL();
+
+	if (next > limit)
+		return pdMS_TO_TICKS(LINGER_MIN_MS);
+
+	next += pdMS_TO_TICKS(LINGER_MARGIN_MS);
+	if (next > limit)
+		next = limit;
+	if (next < pdMS_TO_TICKS(LINGER_MIN_MS))
+		next = pdMS_TO_TICKS(LINGER_MIN_MS);
+
+	return next;
+}
+
+/*
+ * @brief: Radio policy for the idle interval that is starting now
+ */
+static enum sim800l_rf rf_policy(struct sim800l *mod)
+{
+	uint32_t next = mod->period;
+
+	// Expected time to the next task: period or shorter average interval
+	if (mod->rf.interval && (!next || mod->rf.interval < next))
+		next = mod->rf.interval;
+
+	if (!next)
+		return SIM800L_RF_OFF; // Unknown: assume SIM800L is used rarely
+	if (next < RF_SLEEP_MS)
+		return SIM800L_RF_ON;
+	if (next / RF_OFF_RATIO < mod->rf.wake_off)
+		return SIM800L_RF_SLEEP;
+	return SIM800L_RF_OFF;
+}
+
+/*
+ * @brief: Account the idle interval and the wake-to-ready latency
+ * @param idle: Start of the idle interval
+ * @param reg: The module registered after SIM800L_RF_OFF, only then the
+ * latency is the cost of the mode
+ */
+static void rf_wake(struct sim800l *mod, TickType_t idle, bool reg)
+{
+	uint32_t interval, wake;
+
+	interval = (mod->task_ticks - idle) * portTICK_PERIOD_MS;
+	wake = (xTaskGetTickCount() - mod->task_ticks) * portTICK_PERIOD_MS;
+
+	taskENTER_CRITICAL();
+	if (mod->rf.interval)
+		interval = (3 * mod->rf.interval + interval) / 4;
+	mod->rf.interval = interval;
+	mod->rf.wake = wake;
+	if (mod->rf.mode == SIM800L_RF_OFF && reg)
+		mod->rf.wake_off = (3 * mod->rf.wake_off + wake) / 4;
+	taskEXIT_CRITICAL();
 }
 
 inline static void upd_voltage_data(struct sim800l *mod)
@@ -596,8 +1051,8 @@ inline static bool get_http_res_auth_get(struct sim800l *mod)
 void sim800l_task(struct sim800l *mod)
 {
 	char cmd[CMD_BUFFER_SIZE];
-	TickType_t ticks;
-	bool done;
+	TickType_t ticks, idle;
+	bool done, reg;
 
 	for (;;)
 	{
@@ -608,6 +1063,9 @@ void sim800l_task(struct sim800l *mod)
 			break;
 
 		case STATE_RESET:
+			mod->flags = 0;
+			mod->events = 0;
+			mod->reg_wait = 0;
 			reset_set(mod);
 			osDelay(200);
 			reset_unset(mod);
@@ -623,7 +1081,7 @@ void sim800l_task(struct sim800l *mod)
 			while ((xTaskGetTickCount() - ticks) < pdMS_TO_TICKS(2000))
 			{
 				transmit(mod, "AT");
-				if (compare_buffer_beginning(mod, "AT\r\r\nOK\r\n", 500))
+				if (expect(mod, NULL, 500))
 				{
 					state(mod, STATE_FLUSH, STATUS_OK);
 					done = true;
@@ -635,27 +1093,38 @@ void sim800l_task(struct sim800l *mod)
 			break;
 
 		case STATE_FLUSH:
-			// TODO: Wait for something?
-			// "AT\r\r\nOK\r\n\r\nRDY\r\n\r\n+CFUN: 1\r\n\r\n+CPIN: READY\r\n"
-			wait_for_num(mod, SIM800L_BUFFER_SIZE, 3000);
+			// "RDY", "+CFUN: 1", "+CPIN: READY", "Call Ready", "SMS Ready"
+			wait_flag(mod, FLAG_SMS_READY, 3000);
 			state(mod, STATE_ECHO_OFF, STATUS_OK);
 			break;
 
 		case STATE_ECHO_OFF:
 			transmit(mod, "ATE0");
-			if (compare_buffer_beginning(mod, "ATE0\r\r\nOK\r\n", 500))
-				state(mod, STATE_DEL_SMS, STATUS_OK);
-			else
+			if (!expect(mod, NULL, 500))
+			{
+				state(mod, STATE_STARTUP, STATUS_ERROR);
+				break;
+			}
+
+			// Registration URC "+CREG: <stat>"
+			transmit(mod, "AT+CREG=1");
+			if (!expect(mod, NULL, 500))
+			{
 				state(mod, STATE_STARTUP, STATUS_ERROR);
+				break;
+			}
+
+			state(mod, STATE_DEL_SMS, STATUS_OK);
 			break;
 
 		case STATE_DEL_SMS:
 			// TODO: ?
 			transmit(mod, "AT+CMGDA=6");
-			if (compare_buffer_beginning(mod, "\r\nOK\r\n", 5000))
-				state(mod, STATE_IDLE, STATUS_OK);
-			else if (compare_buffer_beginning(mod, "\r\nERROR\r\n", 1))
+			if (wait_final(mod, NULL, 5000) != TOKEN_TIMEOUT)
+			{
+				mod->flags |= FLAG_INIT;
 				state(mod, STATE_IDLE, STATUS_OK);
+			}
 			else
 				state(mod, STATE_STARTUP, STATUS_ERROR);
 			break;
@@ -678,25 +1147,43 @@ void sim800l_task(struct sim800l *mod)
 				break;
 			}
 
-			// No new task: sleep and wait
-#ifdef DISABLE_RF
-			transmit(mod, "AT+CFUN=0");
-			if (!compare_buffer_beginning(mod,
-					"\r\n+CPIN: NOT READY\r\n\r\nOK\r\n", 10000))
+			// No new task: radio policy until the next one
+			idle = xTaskGetTickCount();
+			mod->rf.mode = rf_policy(mod);
+			if (mod->rf.mode == SIM800L_RF_ON)
 			{
-				state(mod, STATE_STARTUP, STATUS_ERROR);
-				break;
+				if (xQueueReceive(mod->queue, &mod->task,
+						pdMS_TO_TICKS(RF_SLEEP_MS)))
+				{
+					mod->task_ticks = xTaskGetTickCount();
+					rf_wake(mod, idle, false);
+					state(mod, STATE_DO_TASK, STATUS_OK);
+					break;
+				}
+				mod->rf.mode = SIM800L_RF_SLEEP; // Expected task is late
+			}
+
+			if (mod->rf.mode == SIM800L_RF_OFF)
+			{
+				transmit(mod, "AT+CFUN=0");
+				if (!expect(mod, NULL, 10000))
+				{
+					state(mod, STATE_STARTUP, STATUS_ERROR);
+					break;
+				}
 			}
-#endif /* DISABLE_RF */
 
 			transmit(mod, "AT+CSCLK=2");
-			if (!compare_buffer_beginning(mod, "\r\nOK\r\n", 500))
+			if (!expect(mod, NULL, 500))
 			{
 				state(mod, STATE_STARTUP, STATUS_ERROR);
 				break;
 			}
 
-			logger_add_str(&logger, TAG, false, "sleep...");
+			if (mod->rf.mode == SIM800L_RF_OFF)
+				logger_add_str(&logger, TAG, false, "rf off, sleep...");
+			else
+				logger_add_str(&logger, TAG, false, "sleep...");
 
 			// Wait for the task
 			xQueueReceive(mod->queue, &mod->task, portMAX_DELAY);
@@ -706,22 +1193,36 @@ void sim800l_task(struct sim800l *mod)
 			osDelay(150);
 
 			transmit(mod, "AT+CSCLK=0");
-			if (!compare_buffer_beginning(mod, "\r\nOK\r\n", 500))
+			if (!expect(mod, NULL, 500))
 			{
 				state(mod, STATE_STARTUP, STATUS_ERROR);
 				break;
 			}
 
-#ifdef DISABLE_RF
-			transmit(mod, "AT+CFUN=1");
-			if (!compare_buffer_beginning(mod,
-					"\r\n+CPIN: READY\r\n\r\nOK\r\n\r\nSMS Ready\r\n", 10000))
+			reg = false;
+			if (mod->rf.mode == SIM800L_RF_OFF)
 			{
-				state(mod, STATE_STARTUP, STATUS_ERROR);
-				break;
+				mod->flags &= ~(FLAG_SMS_READY | FLAG_NET_REG);
+				transmit(mod, "AT+CFUN=1");
+				if (!expect(mod, NULL, 10000) ||
+						!wait_flag(mod, FLAG_SMS_READY, 10000))
+				{
+					state(mod, STATE_STARTUP, STATUS_ERROR);
+					break;
+				}
+
+				// Registration is a part of the wake-up cost of the tasks
+				// that need it, the wait counts in STATE_CREG
+				if (mod->task.issue == ISSUE_HTTP ||
+						mod->task.issue == ISSUE_NETSCAN)
+				{
+					ticks = xTaskGetTickCount();
+					reg = wait_flag(mod, FLAG_NET_REG, RF_REG_MS);
+					mod->reg_wait = xTaskGetTickCount() - ticks;
+				}
 			}
-#endif /* DISABLE_RF */
 
+			rf_wake(mod, idle, reg);
 			state(mod, STATE_DO_TASK, STATUS_OK);
 			break;
 
@@ -738,6 +1239,9 @@ void sim800l_task(struct sim800l *mod)
 				break;
 
 			case ISSUE_HTTP:
+				http_begin(mod);
+				mod->reused = false;
+				mod->attach_start = xTaskGetTickCount();
 				state(mod, STATE_CREG, STATUS_OK);
 				break;
 
@@ -763,14 +1267,14 @@ void sim800l_task(struct sim800l *mod)
 			break;
 
 		case STATE_CREG:
-			ticks = xTaskGetTickCount();
+			ticks = xTaskGetTickCount() - mod->reg_wait;
+			mod->reg_wait = 0;
 			done = false;
 
 			while ((xTaskGetTickCount() - ticks) < pdMS_TO_TICKS(30000))
 			{
 				transmit(mod, "AT+CREG?");
-				if (compare_buffer_beginning(mod,
-						"\r\n+CREG: 0,1\r\n\r\nOK\r\n", 5000))
+				if (expect(mod, "+CREG: 1,1", 5000))
 				{
 					done = true;
 					break; /* while */
@@ -791,7 +1295,7 @@ void sim800l_task(struct sim800l *mod)
 
 		case STATE_GPRS_INIT:
 			transmit(mod, "AT+SAPBR=3,1,CONTYPE,GPRS");
-			if (!compare_buffer_beginning(mod, "\r\nOK\r\n", 500))
+			if (!expect(mod, NULL, 500))
 			{
 				state(mod, STATE_IDLE, STATUS_ERROR);
 				break;
@@ -800,14 +1304,14 @@ void sim800l_task(struct sim800l *mod)
 			strcpy(cmd, "AT+SAPBR=3,1,APN,");
 			strcat(cmd, mod->apn);
 			transmit(mod, cmd);
-			if (!compare_buffer_beginning(mod, "\r\nOK\r\n", 500))
+			if (!expect(mod, NULL, 500))
 			{
 				state(mod, STATE_IDLE, STATUS_ERROR);
 				break;
 			}
 
 			transmit(mod, "AT+SAPBR=1,1");
-			if (!compare_buffer_beginning(mod, "\r\nOK\r\n", 20000))
+			if (!expect(mod, NULL, 20000))
 			{
 				state(mod, STATE_IDLE, STATUS_ERROR);
 				break;
@@ -816,36 +1320,46 @@ void sim800l_task(struct sim800l *mod)
 			// TODO: Copy IP
 			// "\r\n+SAPBR: 1,1,\"10.68.222.113\"\r\n\r\nOK\r\n"
 			transmit(mod, "AT+SAPBR=2,1");
-			if (!compare_buffer_beginning(mod, "\r\n+SAPBR: 1,1", 20000))
+			if (!expect(mod, "+SAPBR: 1,1", 20000))
 			{
 				state(mod, STATE_IDLE, STATUS_ERROR);
 				break;
 			}
 
+			ticks = (xTaskGetTickCount() - mod->attach_start) *
+					portTICK_PERIOD_MS;
+			mod->linger.attach = (3 * mod->linger.attach + ticks) / 4;
+
 			state(mod, STATE_GPRS_HTTP, STATUS_OK);
 			break;
 
 		case STATE_GPRS_HTTP:
-			transmit(mod, "AT+HTTPINIT");
-			if (!compare_buffer_beginning(mod, "\r\nOK\r\n", 2000))
+			// The session is kept while the bearer lingers
+			if (!(mod->flags & FLAG_HTTP))
 			{
-				state(mod, STATE_IDLE, STATUS_ERROR);
-				break;
-			}
+				transmit(mod, "AT+HTTPINIT");
+				if (!expect(mod, NULL, 2000))
+				{
+					state(mod, STATE_GPRS_HTTP_TERM, STATUS_ERROR);
+					break;
+				}
+				mod->flags |= FLAG_HTTP;
+				mod->flags &= ~FLAG_USERDATA;
 
-			transmit(mod, "AT+HTTPPARA=CID,1");
-			if (!compare_buffer_beginning(mod, "\r\nOK\r\n", 2000))
-			{
-				state(mod, STATE_IDLE, STATUS_ERROR);
-				break;
+				transmit(mod, "AT+HTTPPARA=CID,1");
+				if (!expect(mod, NULL, 2000))
+				{
+					state(mod, STATE_GPRS_HTTP_TERM, STATUS_ERROR);
+					break;
+				}
 			}
 
 			strcpy(cmd, "AT+HTTPPARA=URL,");
 			strcat(cmd, get_http_url(mod));
 			transmit(mod, cmd);
-			if (!compare_buffer_beginning(mod, "\r\nOK\r\n", 2000))
+			if (!expect(mod, NULL, 2000))
 			{
-				state(mod, STATE_IDLE, STATUS_ERROR);
+				state(mod, STATE_GPRS_HTTP_TERM, STATUS_ERROR);
 				break;
 			}
 
@@ -858,20 +1372,32 @@ void sim800l_task(struct sim800l *mod)
 				strcpy(cmd, "AT+HTTPPARA=USERDATA,Authorization: ");
 				strcat(cmd, get_http_req_auth(mod));
 				transmit(mod, cmd);
-				if (!compare_buffer_beginning(mod, "\r\nOK\r\n", 2000))
+				if (!expect(mod, NULL, 2000))
 				{
-					state(mod, STATE_IDLE, STATUS_ERROR);
+					state(mod, STATE_GPRS_HTTP_TERM, STATUS_ERROR);
 					break;
 				}
+				mod->flags |= FLAG_USERDATA;
+			}
+			else if (mod->flags & FLAG_USERDATA)
+			{
+				// Set by the previous request of the session
+				transmit(mod, "AT+HTTPPARA=USERDATA,");
+				if (!expect(mod, NULL, 2000))
+				{
+					state(mod, STATE_GPRS_HTTP_TERM, STATUS_ERROR);
+					break;
+				}
+				mod->flags &= ~FLAG_USERDATA;
 			}
 
 			// HTTP POST
 			if (get_http_method(mod))
 			{
 				transmit(mod, "AT+HTTPPARA=CONTENT,application/json");
-				if (!compare_buffer_beginning(mod, "\r\nOK\r\n", 500))
+				if (!expect(mod, NULL, 500))
 				{
-					state(mod, STATE_IDLE, STATUS_ERROR);
+					state(mod, STATE_GPRS_HTTP_TERM, STATUS_ERROR);
 					break;
 				}
 
@@ -879,16 +1405,16 @@ void sim800l_task(struct sim800l *mod)
 				utoa(get_http_request_len(mod), &cmd[strlen(cmd)], 10);
 				strcat(cmd, ",1000");
 				transmit(mod, cmd);
-				if (!compare_buffer_beginning(mod, "\r\nDOWNLOAD\r\n", 1000))
+				if (!wait_line(mod, "DOWNLOAD", 1000))
 				{
-					state(mod, STATE_IDLE, STATUS_ERROR);
+					state(mod, STATE_GPRS_HTTP_TERM, STATUS_ERROR);
 					break;
 				}
 
 				transmit(mod, get_http_request(mod));
-				if (!compare_buffer_beginning(mod, "\r\nOK\r\n", 500))
+				if (!expect(mod, NULL, 500))
 				{
-					state(mod, STATE_IDLE, STATUS_ERROR);
+					state(mod, STATE_GPRS_HTTP_TERM, STATUS_ERROR);
 					break;
 				}
 			}
@@ -913,16 +1439,50 @@ void sim800l_task(struct sim800l *mod)
 			}
 
 			transmit(mod, "AT+HTTPREAD");
-			if (parse_http_read(mod, 1000) > 0)
+			if (parse_http_read(mod, 1000) <= 0)
 			{
-				mod->task.callback(0, mod->task.data);
-				task_done(mod);
+				state(mod, STATE_GPRS_HTTP_TERM, STATUS_OK);
+				break;
+			}
+
+			// The lingering bearer saved the attach only if it worked
+			if (mod->reused)
+			{
+				mod->linger.reuses++;
+				mod->linger.saved += mod->linger.attach;
+				mod->reused = false;
 			}
 
+			mod->task.callback(0, mod->task.data);
+			task_done(mod);
+			mod->http_end = xTaskGetTickCount();
+
+			state(mod, STATE_GPRS_LINGER, STATUS_OK);
+			break;
+
+		case STATE_GPRS_LINGER:
+			// Keep the bearer and the HTTP session for the next request
+			if (xQueueReceive(mod->queue, &mod->task, linger_window(mod)))
+			{
+				mod->task_ticks = xTaskGetTickCount();
+				if (mod->task.issue == ISSUE_HTTP)
+				{
+					http_begin(mod);
+					mod->reused = true;
+					logger_add_str(&logger, TAG, false, "bearer reused");
+
+					state(mod, STATE_GPRS_HTTP, STATUS_OK);
+					break;
+				}
+			}
+
+			// Timeout or another task (done after the bearer is closed)
 			state(mod, STATE_GPRS_HTTP_TERM, STATUS_OK);
 			break;
 
 		case STATE_GPRS_HTTP_TERM:
+			mod->flags &= ~(FLAG_HTTP | FLAG_USERDATA);
+
 			// TODO: Check in while loop with timeout
 			transmit(mod, "AT+HTTPSTATUS?");
 			if (parse_http_status(mod, 500))
@@ -932,34 +1492,18 @@ void sim800l_task(struct sim800l *mod)
 			}
 
 			transmit(mod, "AT+HTTPTERM");
-			if (!compare_buffer_beginning(mod, "\r\nOK\r\n", 2000))
+			if (!expect(mod, NULL, 2000))
 			{
 				state(mod, STATE_GPRS_DEINIT, STATUS_ERROR);
 				break;
 			}
 
-			// Get the next task now
-			// Continue to send HTTP while connected to the Internet
-			if (mod->task.issue == ISSUE_IDLE)
-			{
-				// 50ms for tasks to create a new HTTP request
-				if (xQueueReceive(mod->queue, &mod->task, pdMS_TO_TICKS(50)))
-				{
-					mod->task_ticks = xTaskGetTickCount();
-					if (mod->task.issue == ISSUE_HTTP)
-					{
-						state(mod, STATE_GPRS_HTTP, STATUS_OK);
-						break;
-					}
-				}
-			}
-
 			state(mod, STATE_GPRS_DEINIT, STATUS_OK);
 			break;
 
 		case STATE_GPRS_DEINIT:
 			transmit(mod, "AT+SAPBR=0,1");
-			if (compare_buffer_beginning(mod, "\r\nOK\r\n", 10000))
+			if (expect(mod, NULL, 10000))
 				state(mod, STATE_IDLE, STATUS_OK);
 			else
 				state(mod, STATE_IDLE, STATUS_ERROR);
@@ -967,7 +1511,7 @@ void sim800l_task(struct sim800l *mod)
 
 		case STATE_NETSCAN:
 			transmit(mod, "AT+CNETSCAN=1");
-			if (!compare_buffer_beginning(mod, "\r\nOK\r\n", 500))
+			if (!expect(mod, NULL, 500))
 			{
 				state(mod, STATE_IDLE, STATUS_ERROR);
 				break;
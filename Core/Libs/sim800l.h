@@ -14,21 +14,59 @@
 
 #include "cmsis_os.h"
 #include "queue.h"
-#include "stream_buffer.h"
+#include "semphr.h"
 
 #define SIM800L_BUFFER_SIZE 1024
-#define SIM800L_UART_BUFFER_SIZE 128
+/*
+ * Circular UART DMA buffer. DMA keeps running across half/full/idle events,
+ * so the parser only has to read the data before it is overwritten
+ * Must be a power of 2
+ */
+#define SIM800L_RING_SIZE 1024
+// Longer response lines are truncated (HTTP payload is not limited by this)
+#define SIM800L_LINE_SIZE 128
 
 #define SIM800L_TASK_QUEUE_SIZE 10
 
 #define SIM800L_APN_SIZE 32
 
+#define SIM800L_URC_MAX 16
+
+// Upper limit of the GPRS bearer linger window after an HTTP request, ms
+#define SIM800L_LINGER_MS 30000
+
 #define SIM800L_NETSCAN_DONE 1
 
 typedef uint64_t timeout_t;
 
 typedef void (*sim800l_cb)(int, void *);
 
+struct sim800l;
+
+/*
+ * @brief: URC handler, called from SIM800L task
+ * @param mod: struct sim800l handle
+ * @param line: Response line (without "\r\n")
+ * @param ctx: Handler context
+ * @retval: true if the line is consumed as URC, false to pass it to the
+ *     command response parser (e.g. "+CREG: 1,1" is a response to "AT+CREG?")
+ */
+typedef bool (*sim800l_urc_cb)(struct sim800l *mod, const char *line,
+		void *ctx);
+
+/*
+ * @brief: Unsolicited result code registry entry
+ * prefix: line beginning
+ * handler: user handler
+ * ctx: user handler context
+ */
+struct sim800l_urc
+{
+	const char *prefix;
+	sim800l_urc_cb handler;
+	void *ctx;
+};
+
 /*
  * @brief: SIM800L task structure
  * TODO: fields description
@@ -41,6 +79,46 @@ struct sim800l_task
 	void *data;
 };
 
+/*
+ * @brief: GPRS bearer linger statistics
+ * attach: average bearer attach time (CREG + SAPBR), ms
+ * gap: average time between HTTP requests, ms (0: unknown)
+ * reuses: HTTP requests served by a lingering bearer
+ * saved: attach time saved by reuses, ms
+ */
+struct sim800l_linger_stats
+{
+	uint32_t attach;
+	uint32_t gap;
+	uint32_t reuses;
+	uint32_t saved;
+};
+
+/*
+ * @brief: Radio policy between tasks
+ */
+enum sim800l_rf
+{
+	SIM800L_RF_ON, // Registered and awake
+	SIM800L_RF_SLEEP, // Registered, UART sleep (AT+CSCLK=2)
+	SIM800L_RF_OFF, // Minimum functionality (AT+CFUN=0) and UART sleep
+};
+
+/*
+ * @brief: Radio policy statistics
+ * mode: last decision (enum sim800l_rf)
+ * wake: last wake-to-ready latency, ms
+ * wake_off: average wake-to-registered latency after SIM800L_RF_OFF, ms
+ * interval: average idle interval between tasks, ms (0: unknown)
+ */
+struct sim800l_rf_stats
+{
+	uint32_t mode;
+	uint32_t wake;
+	uint32_t wake_off;
+	uint32_t interval;
+};
+
 /*
  * @brief: Base SIM800L structure
  * TODO: fields description
@@ -51,16 +129,41 @@ struct sim800l
 	GPIO_TypeDef *rst_port;
 	uint16_t rst_pin;
 
-	StreamBufferHandle_t stream;
+	uint8_t ring[SIM800L_RING_SIZE];
+	volatile uint32_t rxhead; // Bytes written by DMA (IRQ)
+	volatile uint32_t rxbase; // rxhead of the last DMA (re)start (IRQ)
+	uint32_t rxtail; // Bytes consumed by the task
+	uint16_t rxpos; // Last DMA position in ring (IRQ)
+	uint32_t overruns;
+	SemaphoreHandle_t rxsem;
 	xQueueHandle queue;
 
 	int state;
 	int errors;
 
 	uint8_t txb[SIM800L_BUFFER_SIZE + 1]; // + 1 for additional '\r'
-	uint8_t rxb[SIM800L_BUFFER_SIZE + 1]; // + 1 for additional '\0'
 
-	size_t rxlen;
+	char line[SIM800L_LINE_SIZE + 1]; // Last response line, '\0' terminated
+	size_t llen; // Length of the line being received
+	size_t payload; // Raw data bytes left after the last line
+
+	struct sim800l_urc urc[SIM800L_URC_MAX];
+	size_t nurc;
+	int events; // Unsolicited events that abort the current command
+	int flags; // Module status reported by URCs
+	uint32_t voltage_alarms; // UNDER-/OVER-VOLTAGE warnings
+
+	TickType_t linger_max;
+	TickType_t hint; // Expected tick of the next HTTP request
+	volatile bool hinted;
+	TickType_t attach_start;
+	TickType_t http_end; // End of the last HTTP request (0: none, accounted)
+	bool reused; // The HTTP task runs on a lingering bearer
+	struct sim800l_linger_stats linger;
+
+	uint32_t period; // Expected interval between tasks, ms (0: unknown)
+	struct sim800l_rf_stats rf;
+	TickType_t reg_wait; // Waited for registration after SIM800L_RF_OFF
 
 	TickType_t task_ticks;
 	struct sim800l_task task;
@@ -128,12 +231,67 @@ void sim800l_init(struct sim800l *mod, UART_HandleTypeDef *uart,
 		GPIO_TypeDef *rst_port, uint16_t rst_pin, char *apn);
 
 /*
- * @brief: Copy data from UART interrupt handler
+ * @brief: Start circular DMA reception into the ring (also after UART error)
+ * @param mod: struct sim800l handle
+ */
+void sim800l_rx_start(struct sim800l *mod);
+
+/*
+ * @brief: Account data from UART interrupt handler (half, full, idle events)
+ * @param mod: struct sim800l handle
+ * @param pos: DMA position in ring reported by HAL_UARTEx_RxEventCallback
+ */
+void sim800l_irq(struct sim800l *mod, size_t pos);
+
+/*
+ * @brief: Register an unsolicited result code handler
+ *     Lines starting with prefix are passed to the handler and are not seen
+ *     by command response parsers. Register before the task is started
+ * @param mod: struct sim800l handle
+ * @param prefix: Line beginning (static string)
+ * @param handler: URC handler
+ * @param ctx: URC handler context
+ * @retval: 0 on success, -1 on failure (registry is full)
+ */
+int sim800l_urc(struct sim800l *mod, const char *prefix,
+		sim800l_urc_cb handler, void *ctx);
+
+/*
+ * @brief: Set the upper limit of the GPRS bearer linger window
+ * @param mod: struct sim800l handle
+ * @param max: Linger window limit in ms (0: close the bearer right away)
+ */
+void sim800l_linger(struct sim800l *mod, timeout_t max);
+
+/*
+ * @brief: Hint the time of the next HTTP request to the linger policy
+ *     The hint is used once, when the current HTTP request is done
+ * @param mod: struct sim800l handle
+ * @param next: Expected time to the next HTTP request in ms
+ */
+void sim800l_http_hint(struct sim800l *mod, timeout_t next);
+
+/*
+ * @brief: Get GPRS bearer linger statistics
+ * @param mod: struct sim800l handle
+ * @param stats: Statistics
+ */
+void sim800l_get_linger_stats(struct sim800l *mod,
+		struct sim800l_linger_stats *stats);
+
+/*
+ * @brief: Set the expected interval between tasks for the radio policy
+ * @param mod: struct sim800l handle
+ * @param period: Interval in ms (0: unknown)
+ */
+void sim800l_rf_period(struct sim800l *mod, timeout_t period);
+
+/*
+ * @brief: Get radio policy statistics
  * @param mod: struct sim800l handle
- * @param buf: data buffer
- * @param len: data buffer length (in bytes)
+ * @param stats: Statistics
  */
-void sim800l_irq(struct sim800l *mod, const char *buf, size_t len);
+void sim800l_get_rf_stats(struct sim800l *mod, struct sim800l_rf_stats *stats);
 
 /*
  * @brief: SIM800L task
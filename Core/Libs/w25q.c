@@ -2,7 +2,7 @@
  * W25Q Serial FLASH memory
  *
  * Dmitry Proshutinsky <dproshutinsky@gmail.com>
- * 2024-2025
+ * 2024-2026
  */
 
 #include "w25q.h"
@@ -18,6 +18,7 @@
 #define W25Q_CMD_PAGE_PROGRAM       0x02
 #define W25Q_CMD_SECTOR_ERASE       0x20
 #define W25Q_CMD_BLOCK_ERASE        0xD8
+#define W25Q_CMD_BLOCK32_ERASE      0x52
 #define W25Q_CMD_CHIP_ERASE         0xC7
 #define W25Q_CMD_READ_STATUS_REG1   0x05
 #define W25Q_CMD_WRITE_STATUS_REG1  0x01
@@ -26,13 +27,29 @@
 #define W25Q_CMD_READ_STATUS_REG3   0x15
 #define W25Q_CMD_WRITE_STATUS_REG3  0x11
 #define W25Q_CMD_POWER_DOWN         0xB9
+#define W25Q_CMD_ERASE_SUSPEND      0x75
+#define W25Q_CMD_ERASE_RESUME       0x7A
+#define W25Q_CMD_FAST_READ_4B       0x0C
+#define W25Q_CMD_PAGE_PROGRAM_4B    0x12
+#define W25Q_CMD_SECTOR_ERASE_4B    0x21
+#define W25Q_CMD_BLOCK_ERASE_4B     0xDC
+#define W25Q_CMD_READ_SFDP          0x5A
+
+#define W25Q_ADDR3_LIMIT (16 * 1024 * 1024)
+#define W25Q_HEADER_SIZE 6 // Command, 4-byte address and dummy byte
+
+#define SFDP_SIGNATURE    0x50444653 // "SFDP"
+#define SFDP_BFPT_ID      0xFF00     // Basic Flash Parameter Table
+#define SFDP_BFPT_DWORDS  11         // Up to the JESD216A timings
 
 #define W25Q_BUSY_FLAG_MASK 0x01
+#define W25Q_SUS_FLAG_MASK  0x80 // Status register 2
 
 #define BLOCK_ERASE_TIMEOUT 5000
 #define CHIP_ERASE_TIMEOUT  (5 * 60 * 1000)
 #define BUSY_TIMEOUT        1000
 #define SPI_TIMEOUT         100
+#define SUSPEND_TIMEOUT     1 // tSUS is 20 us
 
 enum capacity
 {
@@ -49,6 +66,60 @@ enum capacity
 };
 
 
+static const uint16_t sfdp_erase_units[] = {1, 16, 128, 1000};   // ms
+static const uint32_t sfdp_chip_units[] = {16, 256, 4000, 64000}; // ms
+
+
+static uint8_t cmd_addr4(uint8_t cmd)
+{
+	switch (cmd)
+	{
+	case W25Q_CMD_FAST_READ:
+		return W25Q_CMD_FAST_READ_4B;
+	case W25Q_CMD_PAGE_PROGRAM:
+		return W25Q_CMD_PAGE_PROGRAM_4B;
+	case W25Q_CMD_SECTOR_ERASE:
+		return W25Q_CMD_SECTOR_ERASE_4B;
+	case W25Q_CMD_BLOCK_ERASE:
+		return W25Q_CMD_BLOCK_ERASE_4B;
+	default:
+		return cmd;
+	}
+}
+
+/*
+ * @brief: Fill a command header with a 3-byte address, or with the 4-byte
+ * address variant of the command if [address, end) reaches past 16 MB.
+ * The device stays in 3-byte mode, so the bootloader reads it as before.
+ * A 4-byte only device takes 4-byte addresses with every command.
+ * @retval: Header size
+ */
+static uint16_t set_header(struct w25q *mem, uint8_t *header, uint8_t cmd,
+		uint32_t address, uint32_t end)
+{
+	uint16_t len = 0;
+
+	if (mem->geo.addr == W25Q_ADDR_4)
+	{
+		header[len++] = cmd;
+		header[len++] = address >> 24;
+	}
+	else if (end <= W25Q_ADDR3_LIMIT)
+	{
+		header[len++] = cmd;
+	}
+	else
+	{
+		header[len++] = cmd_addr4(cmd);
+		header[len++] = address >> 24;
+	}
+	header[len++] = address >> 16;
+	header[len++] = address >> 8;
+	header[len++] = address;
+
+	return len;
+}
+
 inline static void cs_low(struct w25q *mem)
 {
 	HAL_GPIO_WritePin(mem->cs_port, mem->cs_pin, GPIO_PIN_RESET);
@@ -103,6 +174,103 @@ static void write_enable(struct w25q *mem)
 	cs_high(mem);
 }
 
+/*
+ * @retval: W25Q_OK, or W25Q_ERR_TIMEOUT if still busy after timeout ms
+ */
+static int wait_busy(struct w25q *mem, uint32_t timeout)
+{
+	int ret = W25Q_OK;
+	uint32_t ms;
+
+	delay();
+	ms = HAL_GetTick();
+	while (spi_read_status_reg(mem, W25Q_CMD_READ_STATUS_REG1) &
+			W25Q_BUSY_FLAG_MASK)
+	{
+		if ((HAL_GetTick() - ms) > timeout)
+		{
+			ret = W25Q_ERR_TIMEOUT;
+			break;
+		}
+	}
+
+	mem->stats.busy_ms += HAL_GetTick() - ms;
+	return ret;
+}
+
+static void complete(struct w25q *mem, int status)
+{
+	w25q_cb callback = mem->callback;
+
+	mem->state = W25Q_STATE_IDLE;
+	if (callback)
+		callback(status, mem->context);
+}
+
+static int submit(struct w25q *mem, uint8_t *header, uint16_t hsize,
+		w25q_cb callback, void *context)
+{
+	if (mem->state != W25Q_STATE_IDLE)
+		return W25Q_ERR_BUSY;
+
+	mem->callback = callback;
+	mem->context = context;
+	mem->state = W25Q_STATE_XFER;
+
+	cs_low(mem);
+	if (HAL_SPI_Transmit(mem->spi, header, hsize, SPI_TIMEOUT) != HAL_OK)
+	{
+		cs_high(mem);
+		mem->state = W25Q_STATE_IDLE;
+		return W25Q_ERR_SPI;
+	}
+
+	return W25Q_OK;
+}
+
+static void busy_start(struct w25q *mem, uint32_t timeout)
+{
+	mem->timeout = timeout;
+	mem->start = HAL_GetTick();
+	mem->state = W25Q_STATE_BUSY;
+}
+
+/*
+ * @brief: Start programming the rest of mem->data up to the page boundary
+ */
+static int program_next(struct w25q *mem)
+{
+	uint8_t header[W25Q_HEADER_SIZE];
+	uint16_t hsize;
+	uint8_t *data = mem->data;
+	uint32_t size = mem->geo.page_size - mem->address % mem->geo.page_size;
+
+	if (size > mem->remaining)
+		size = mem->remaining;
+
+	hsize = set_header(mem, header, W25Q_CMD_PAGE_PROGRAM, mem->address,
+			mem->address + size);
+
+	mem->address += size;
+	mem->data += size;
+	mem->remaining -= size;
+	mem->stats.programs++;
+	mem->stats.program_bytes += size;
+
+	write_enable(mem);
+
+	mem->state = W25Q_STATE_XFER;
+	cs_low(mem);
+	if (HAL_SPI_Transmit(mem->spi, header, hsize, SPI_TIMEOUT) != HAL_OK ||
+			HAL_SPI_Transmit_DMA(mem->spi, data, size) != HAL_OK)
+	{
+		cs_high(mem);
+		return W25Q_ERR_SPI;
+	}
+
+	return W25Q_OK;
+}
+
 static void power_down(struct w25q *mem)
 {
 	uint8_t header = W25Q_CMD_POWER_DOWN;
@@ -125,6 +293,203 @@ static void release_power_down(struct w25q *mem)
 	delay();
 }
 
+static size_t jedec_capacity(struct w25q *mem)
+{
+	uint32_t capacity = spi_read_id(mem) & 0xFF;
+
+	switch((enum capacity) capacity)
+	{
+	case W25Q_CAPACITY_2:
+		return 2 * 64 * 1024;
+	case W25Q_CAPACITY_4:
+		return 4 * 64 * 1024;
+	case W25Q_CAPACITY_8:
+		return 8 * 64 * 1024;
+	case W25Q_CAPACITY_16:
+		return 16 * 64 * 1024;
+	case W25Q_CAPACITY_32:
+		return 32 * 64 * 1024;
+	case W25Q_CAPACITY_64:
+		return 64 * 64 * 1024;
+	case W25Q_CAPACITY_128:
+		return 128 * 64 * 1024;
+	case W25Q_CAPACITY_256:
+		return 256 * 64 * 1024;
+	case W25Q_CAPACITY_512:
+		return 512 * 64 * 1024;
+	case W25Q_CAPACITY_1024:
+		return 1024 * 64 * 1024;
+	default:
+		return 0;
+	}
+}
+
+static void sfdp_read(struct w25q *mem, uint32_t address, void *data,
+		uint16_t size)
+{
+	uint8_t header[5];
+
+	header[0] = W25Q_CMD_READ_SFDP;
+	header[1] = address >> 16;
+	header[2] = address >> 8;
+	header[3] = address;
+	header[4] = 0x00; // Dummy
+
+	cs_low(mem);
+	HAL_SPI_Transmit(mem->spi, header, sizeof(header), SPI_TIMEOUT);
+	HAL_SPI_Receive(mem->spi, data, size, SPI_TIMEOUT);
+	cs_high(mem);
+}
+
+/*
+ * @brief: Maximum time of an SFDP typical time field (count and units) with
+ * the 2 * (multiplier + 1) factor
+ */
+static uint32_t sfdp_time(uint32_t count, uint32_t unit, uint32_t mult)
+{
+	return 2 * (mult + 1) * (count + 1) * unit;
+}
+
+/*
+ * @brief: Parse the JESD216A Basic Flash Parameter Table into the geometry.
+ * A JESD216 table has no erase and program timings and is not used.
+ * @retval: 0 - success, -1 - no SFDP or an older revision
+ */
+static int sfdp_probe(struct w25q *mem)
+{
+	struct w25q_geometry *geo = &mem->geo;
+	struct w25q_erase_type type;
+	uint32_t dw[SFDP_BFPT_DWORDS];
+	uint32_t hdr[4];
+	uint32_t len;
+	uint32_t mult;
+	uint32_t v;
+	size_t n = 0;
+
+	// SFDP header and the first parameter header, which is the BFPT
+	sfdp_read(mem, 0, hdr, sizeof(hdr));
+	if (hdr[0] != SFDP_SIGNATURE ||
+			((hdr[2] & 0xFF) | (hdr[3] >> 16 & 0xFF00)) != SFDP_BFPT_ID)
+		return -1;
+
+	len = hdr[2] >> 24;
+	if (len < SFDP_BFPT_DWORDS)
+		return -1;
+
+	sfdp_read(mem, hdr[3] & 0xFFFFFF, dw, sizeof(dw));
+
+	// Density in bits
+	v = dw[1] & 0x7FFFFFFF;
+	if (!(dw[1] & 0x80000000))
+		geo->capacity = (v + 1) / 8;
+	else if (v >= 3 && v < 35)
+		geo->capacity = 1UL << (v - 3);
+	else
+		return -1;
+
+	switch (dw[0] >> 17 & 0x03)
+	{
+	case 0:
+		geo->addr = W25Q_ADDR_3;
+		break;
+	case 1:
+		geo->addr = W25Q_ADDR_3_4;
+		break;
+	default:
+		geo->addr = W25Q_ADDR_4;
+		break;
+	}
+
+	// Erase types 1-4
+	mult = dw[9] & 0x0F;
+	for (size_t i = 0; i < W25Q_ERASE_TYPES; i++)
+	{
+		v = dw[7 + i / 2] >> (i % 2 * 16);
+		if (!(v & 0xFF) || (v & 0xFF) >= 32)
+			continue;
+
+		type.size = 1UL << (v & 0xFF);
+		type.cmd = v >> 8;
+		v = dw[9] >> (4 + i * 7);
+		type.timeout = sfdp_time(v & 0x1F, sfdp_erase_units[v >> 5 & 0x03],
+				mult) + 1;
+
+		// Largest first
+		v = n++;
+		while (v && geo->erase[v - 1].size < type.size)
+		{
+			geo->erase[v] = geo->erase[v - 1];
+			v--;
+		}
+		geo->erase[v] = type;
+	}
+	if (!n)
+		return -1;
+
+	for (; n < W25Q_ERASE_TYPES; n++)
+		memset(&geo->erase[n], 0, sizeof(geo->erase[n]));
+	geo->sector_size = geo->erase[0].size;
+	for (size_t i = 1; i < W25Q_ERASE_TYPES && geo->erase[i].size; i++)
+		geo->sector_size = geo->erase[i].size;
+
+	mult = dw[10] & 0x0F;
+	geo->page_size = 1UL << (dw[10] >> 4 & 0x0F);
+	// us, rounded up to ms
+	v = sfdp_time(dw[10] >> 8 & 0x1F, dw[10] & (1 << 13) ? 64 : 8, mult);
+	geo->program_timeout = (v + 999) / 1000 + 1;
+	geo->chip_erase_timeout = sfdp_time(dw[10] >> 24 & 0x1F,
+			sfdp_chip_units[dw[10] >> 29 & 0x03], mult) + 1;
+
+	geo->sfdp = 1;
+	return 0;
+}
+
+/*
+ * @brief: Winbond geometry and worst-case timings
+ */
+static void set_defaults(struct w25q_geometry *geo)
+{
+	memset(geo, 0, sizeof(*geo));
+	geo->page_size = W25Q_PAGE_SIZE;
+	geo->sector_size = W25Q_SECTOR_SIZE;
+	geo->program_timeout = BUSY_TIMEOUT;
+	geo->chip_erase_timeout = CHIP_ERASE_TIMEOUT;
+	geo->addr = W25Q_ADDR_3_4;
+	geo->erase[0].size = W25Q_BLOCK_SIZE;
+	geo->erase[0].cmd = W25Q_CMD_BLOCK_ERASE;
+	geo->erase[0].timeout = BLOCK_ERASE_TIMEOUT;
+	geo->erase[1].size = W25Q_BLOCK32_SIZE;
+	geo->erase[1].cmd = W25Q_CMD_BLOCK32_ERASE;
+	geo->erase[1].timeout = BLOCK_ERASE_TIMEOUT;
+	geo->erase[2].size = W25Q_SECTOR_SIZE;
+	geo->erase[2].cmd = W25Q_CMD_SECTOR_ERASE;
+	geo->erase[2].timeout = BUSY_TIMEOUT;
+}
+
+/*
+ * @brief: Erase type of the unit size usable at address. Above 16 MB only
+ * the commands with a 4-byte address variant are.
+ * @retval: Erase type or NULL
+ */
+static const struct w25q_erase_type *erase_type(struct w25q *mem,
+		uint32_t address, uint32_t unit)
+{
+	const struct w25q_erase_type *type;
+
+	for (size_t i = 0; i < W25Q_ERASE_TYPES; i++)
+	{
+		type = &mem->geo.erase[i];
+		if (!type->size || type->size != unit)
+			continue;
+		if (mem->geo.addr == W25Q_ADDR_3_4 && address >= W25Q_ADDR3_LIMIT &&
+				cmd_addr4(type->cmd) == type->cmd)
+			continue;
+		return type;
+	}
+
+	return NULL;
+}
+
 /******************************************************************************/
 void w25q_init(struct w25q *mem, SPI_HandleTypeDef *spi, GPIO_TypeDef *cs_port,
 		uint16_t cs_pin)
@@ -133,6 +498,28 @@ void w25q_init(struct w25q *mem, SPI_HandleTypeDef *spi, GPIO_TypeDef *cs_port,
 	mem->spi = spi;
 	mem->cs_port = cs_port;
 	mem->cs_pin = cs_pin;
+	set_defaults(&mem->geo);
+}
+
+/******************************************************************************/
+int w25q_probe(struct w25q *mem)
+{
+	release_power_down(mem);
+
+	set_defaults(&mem->geo);
+	if (sfdp_probe(mem))
+	{
+		set_defaults(&mem->geo);
+		mem->geo.capacity = jedec_capacity(mem);
+	}
+
+	return mem->geo.capacity ? 0 : -1;
+}
+
+/******************************************************************************/
+void w25q_get_geometry(struct w25q *mem, struct w25q_geometry *geo)
+{
+	memcpy(geo, &mem->geo, sizeof(*geo));
 }
 
 /******************************************************************************/
@@ -152,66 +539,90 @@ void w25q_hw_deinit(struct w25q *mem)
 }
 
 /******************************************************************************/
-// 4KB
-void w25q_sector_erase(struct w25q *mem, uint32_t address)
+int w25q_erase(struct w25q *mem, uint32_t address, uint32_t unit)
 {
-	uint8_t header[4];
-	uint32_t ms;
+	const struct w25q_erase_type *type = erase_type(mem, address, unit);
+	uint8_t header[W25Q_HEADER_SIZE];
+	uint16_t hsize;
 
-	header[0] = W25Q_CMD_SECTOR_ERASE;
-	header[1] = address >> 16;
-	header[2] = address >> 8;
-	header[3] = address;
+	if (!type)
+		return W25Q_ERR_ARG;
+
+	hsize = set_header(mem, header, type->cmd, address, address + 1);
 
 	write_enable(mem);
 
 	cs_low(mem);
-	HAL_SPI_Transmit(mem->spi, header, 4, SPI_TIMEOUT);
+	HAL_SPI_Transmit(mem->spi, header, hsize, SPI_TIMEOUT);
 	cs_high(mem);
 
-	delay();
-	ms = HAL_GetTick();
-	while (spi_read_status_reg(mem, W25Q_CMD_READ_STATUS_REG1) &
-			W25Q_BUSY_FLAG_MASK)
-	{
-		if ((HAL_GetTick() - ms) > BUSY_TIMEOUT)
-			return;
-	}
+	mem->stats.erases++;
+
+	return wait_busy(mem, type->timeout);
+}
+
+/******************************************************************************/
+// 4KB
+int w25q_sector_erase(struct w25q *mem, uint32_t address)
+{
+	return w25q_erase(mem, address, W25Q_SECTOR_SIZE);
 }
 
 /******************************************************************************/
 // 64KB
-void w25q_block_erase(struct w25q *mem, uint32_t address)
+int w25q_block_erase(struct w25q *mem, uint32_t address)
 {
-	uint8_t header[4];
-	uint32_t ms;
+	return w25q_erase(mem, address, W25Q_BLOCK_SIZE);
+}
 
-	header[0] = W25Q_CMD_BLOCK_ERASE;
-	header[1] = address >> 16;
-	header[2] = address >> 8;
-	header[3] = address;
+/******************************************************************************/
+// 32KB, below 16MB only
+int w25q_block32_erase(struct w25q *mem, uint32_t address)
+{
+	return w25q_erase(mem, address, W25Q_BLOCK32_SIZE);
+}
 
-	write_enable(mem);
+/******************************************************************************/
+uint32_t w25q_erase_unit(struct w25q *mem, uint32_t address, uint32_t size)
+{
+	uint32_t unit;
 
-	cs_low(mem);
-	HAL_SPI_Transmit(mem->spi, header, 4, SPI_TIMEOUT);
-	cs_high(mem);
+	for (size_t i = 0; i < W25Q_ERASE_TYPES; i++)
+	{
+		unit = mem->geo.erase[i].size;
+		if (unit && !(address % unit) && size >= unit &&
+				erase_type(mem, address, unit))
+			return unit;
+	}
 
-	delay();
-	ms = HAL_GetTick();
-	while (spi_read_status_reg(mem, W25Q_CMD_READ_STATUS_REG1) &
-			W25Q_BUSY_FLAG_MASK)
+	return mem->geo.sector_size;
+}
+
+/******************************************************************************/
+int w25q_erase_range(struct w25q *mem, uint32_t address, uint32_t size)
+{
+	uint32_t end = address + size;
+	uint32_t unit;
+	int ret;
+
+	address -= address % mem->geo.sector_size;
+	while (address < end)
 	{
-		if ((HAL_GetTick() - ms) > BLOCK_ERASE_TIMEOUT)
-			return;
+		unit = w25q_erase_unit(mem, address, end - address);
+		ret = w25q_erase(mem, address, unit);
+		if (ret)
+			return ret;
+
+		address += unit;
 	}
+
+	return W25Q_OK;
 }
 
 /******************************************************************************/
 void w25q_chip_erase(struct w25q *mem)
 {
 	uint8_t header = W25Q_CMD_CHIP_ERASE;
-	uint32_t ms;
 
 	write_enable(mem);
 
@@ -219,97 +630,299 @@ void w25q_chip_erase(struct w25q *mem)
 	HAL_SPI_Transmit(mem->spi, &header, 1, SPI_TIMEOUT);
 	cs_high(mem);
 
-	delay();
-	ms = HAL_GetTick();
-	while (spi_read_status_reg(mem, W25Q_CMD_READ_STATUS_REG1) &
-			W25Q_BUSY_FLAG_MASK)
-	{
-		if ((HAL_GetTick() - ms) > CHIP_ERASE_TIMEOUT)
-			return;
-	}
+	mem->stats.erases++;
+
+	wait_busy(mem, mem->geo.chip_erase_timeout);
 }
 
 /******************************************************************************/
 void w25q_read_data(struct w25q *mem, uint32_t address, uint8_t *data,
 		uint16_t size)
 {
-	uint8_t header[5];
-	header[0] = W25Q_CMD_FAST_READ;
-	header[1] = address >> 16;
-	header[2] = address >> 8;
-	header[3] = address;
-	header[4] = 0x00;
+	uint8_t header[W25Q_HEADER_SIZE];
+	uint16_t hsize;
+
+	hsize = set_header(mem, header, W25Q_CMD_FAST_READ, address,
+			address + size);
+	header[hsize++] = 0x00; // Dummy
 
 	cs_low(mem);
-	HAL_SPI_Transmit(mem->spi, header, 5, SPI_TIMEOUT);
+	HAL_SPI_Transmit(mem->spi, header, hsize, SPI_TIMEOUT);
 	HAL_SPI_Receive(mem->spi, data, size, SPI_TIMEOUT);
 	cs_high(mem);
+
+	mem->stats.reads++;
+	mem->stats.read_bytes += size;
 }
 
 /******************************************************************************/
-// Up to W25Q_PAGE_SIZE bytes
+// Up to a page
 void w25q_write_data(struct w25q *mem, uint32_t address, uint8_t *data,
 		uint16_t size)
 {
-	uint8_t header[4];
-	uint32_t ms;
+	uint8_t header[W25Q_HEADER_SIZE];
+	uint16_t hsize;
 
-	header[0] = W25Q_CMD_PAGE_PROGRAM;
-	header[1] = address >> 16;
-	header[2] = address >> 8;
-	header[3] = address;
+	hsize = set_header(mem, header, W25Q_CMD_PAGE_PROGRAM, address,
+			address + size);
 
 	write_enable(mem);
 
 	cs_low(mem);
-	HAL_SPI_Transmit(mem->spi, header, 4, SPI_TIMEOUT);
+	HAL_SPI_Transmit(mem->spi, header, hsize, SPI_TIMEOUT);
 	HAL_SPI_Transmit(mem->spi, data, size, SPI_TIMEOUT);
 	cs_high(mem);
 
-	delay();
-	ms = HAL_GetTick();
-	while (spi_read_status_reg(mem, W25Q_CMD_READ_STATUS_REG1) &
-			W25Q_BUSY_FLAG_MASK)
+	mem->stats.programs++;
+	mem->stats.program_bytes += size;
+
+	wait_busy(mem, mem->geo.program_timeout);
+}
+
+/******************************************************************************/
+// Any length and alignment, split on page boundaries
+void w25q_write_buffer(struct w25q *mem, uint32_t address, uint8_t *data,
+		uint32_t size)
+{
+	uint32_t ws;
+
+	while (size)
 	{
-		if ((HAL_GetTick() - ms) > BUSY_TIMEOUT)
-			return;
+		ws = mem->geo.page_size - address % mem->geo.page_size;
+		if (ws > size)
+			ws = size;
+
+		w25q_write_data(mem, address, data, ws);
+
+		size -= ws;
+		address += ws;
+		data += ws;
 	}
 }
 
 /******************************************************************************/
 size_t w25q_get_capacity(struct w25q *mem)
 {
-	uint32_t capacity = spi_read_id(mem) & 0xFF;
+	if (mem->geo.capacity)
+		return mem->geo.capacity;
+	return jedec_capacity(mem);
+}
 
-	switch((enum capacity) capacity)
+/******************************************************************************/
+uint8_t w25q_get_manufacturer_id(struct w25q *mem)
+{
+	return spi_read_id(mem) >> 16;
+}
+
+/******************************************************************************/
+void w25q_get_stats(struct w25q *mem, struct w25q_stats *stats)
+{
+	memcpy(stats, &mem->stats, sizeof(*stats));
+}
+
+/******************************************************************************/
+int w25q_read_data_async(struct w25q *mem, uint32_t address, uint8_t *data,
+		uint16_t size, w25q_cb callback, void *context)
+{
+	uint8_t header[W25Q_HEADER_SIZE];
+	uint16_t hsize;
+	int ret;
+
+	hsize = set_header(mem, header, W25Q_CMD_FAST_READ, address,
+			address + size);
+	header[hsize++] = 0x00; // Dummy
+
+	ret = submit(mem, header, hsize, callback, context);
+	if (ret)
+		return ret;
+
+	mem->op = W25Q_OP_READ;
+	mem->stats.reads++;
+	mem->stats.read_bytes += size;
+
+	if (HAL_SPI_Receive_DMA(mem->spi, data, size) != HAL_OK)
 	{
-	case W25Q_CAPACITY_2:
-		return 2 * 64 * 1024;
-	case W25Q_CAPACITY_4:
-		return 4 * 64 * 1024;
-	case W25Q_CAPACITY_8:
-		return 8 * 64 * 1024;
-	case W25Q_CAPACITY_16:
-		return 16 * 64 * 1024;
-	case W25Q_CAPACITY_32:
-		return 32 * 64 * 1024;
-	case W25Q_CAPACITY_64:
-		return 64 * 64 * 1024;
-	case W25Q_CAPACITY_128:
-		return 128 * 64 * 1024;
-	case W25Q_CAPACITY_256:
-		return 256 * 64 * 1024;
-	case W25Q_CAPACITY_512:
-		return 256 * 64 * 1024; // NOTE: 16 MB only
-	case W25Q_CAPACITY_1024:
-		return 256 * 64 * 1024; // NOTE: 16 MB only
-	default:
+		cs_high(mem);
+		mem->state = W25Q_STATE_IDLE;
+		return W25Q_ERR_SPI;
+	}
+
+	return W25Q_OK;
+}
+
+/******************************************************************************/
+// Up to a page
+int w25q_write_data_async(struct w25q *mem, uint32_t address, uint8_t *data,
+		uint16_t size, w25q_cb callback, void *context)
+{
+	return w25q_write_buffer_async(mem, address, data, size, callback,
+			context);
+}
+
+/******************************************************************************/
+int w25q_write_buffer_async(struct w25q *mem, uint32_t address,
+		uint8_t *data, uint32_t size, w25q_cb callback, void *context)
+{
+	int ret;
+
+	if (mem->state != W25Q_STATE_IDLE)
+		return W25Q_ERR_BUSY;
+
+	mem->callback = callback;
+	mem->context = context;
+	mem->op = W25Q_OP_PROGRAM;
+	mem->address = address;
+	mem->data = data;
+	mem->remaining = size;
+
+	ret = program_next(mem);
+	if (ret)
+		mem->state = W25Q_STATE_IDLE;
+
+	return ret;
+}
+
+/******************************************************************************/
+// 4KB
+int w25q_sector_erase_async(struct w25q *mem, uint32_t address,
+		w25q_cb callback, void *context)
+{
+	return w25q_erase_async(mem, address, W25Q_SECTOR_SIZE, callback,
+			context);
+}
+
+/******************************************************************************/
+int w25q_erase_async(struct w25q *mem, uint32_t address, uint32_t unit,
+		w25q_cb callback, void *context)
+{
+	uint8_t header[W25Q_HEADER_SIZE];
+	uint16_t hsize;
+	const struct w25q_erase_type *type = erase_type(mem, address, unit);
+	int ret;
+
+	if (!type)
+		return W25Q_ERR_ARG;
+
+	hsize = set_header(mem, header, type->cmd, address, address + 1);
+
+	if (mem->state != W25Q_STATE_IDLE)
+		return W25Q_ERR_BUSY;
+
+	write_enable(mem);
+
+	ret = submit(mem, header, hsize, callback, context);
+	if (ret)
+		return ret;
+
+	cs_high(mem);
+	mem->op = W25Q_OP_ERASE;
+	mem->stats.erases++;
+	busy_start(mem, type->timeout);
+
+	return W25Q_OK;
+}
+
+/******************************************************************************/
+void w25q_spi_irq(struct w25q *mem, int status)
+{
+	if (mem->state != W25Q_STATE_XFER)
+		return;
+
+	cs_high(mem);
+
+	if (status == W25Q_OK && mem->op == W25Q_OP_PROGRAM)
+		busy_start(mem, mem->geo.program_timeout);
+	else
+		complete(mem, status);
+}
+
+/******************************************************************************/
+int w25q_poll(struct w25q *mem)
+{
+	uint32_t ms;
+
+	if (mem->state == W25Q_STATE_IDLE)
 		return 0;
+	// The busy bit is clear while the erase is suspended
+	if (mem->state != W25Q_STATE_BUSY || mem->suspended)
+		return 1;
+
+	ms = HAL_GetTick() - mem->start;
+	if (spi_read_status_reg(mem, W25Q_CMD_READ_STATUS_REG1) &
+			W25Q_BUSY_FLAG_MASK)
+	{
+		if (ms <= mem->timeout)
+			return 1;
+
+		mem->stats.busy_ms += ms;
+		complete(mem, W25Q_ERR_TIMEOUT);
+	}
+	else if (mem->op == W25Q_OP_PROGRAM && mem->remaining)
+	{
+		mem->stats.busy_ms += ms;
+		if (program_next(mem))
+			complete(mem, W25Q_ERR_SPI);
 	}
+	else
+	{
+		mem->stats.busy_ms += ms;
+		complete(mem, W25Q_OK);
+	}
+
+	// The callback may have submitted the next operation
+	return mem->state != W25Q_STATE_IDLE;
 }
 
 /******************************************************************************/
-uint8_t w25q_get_manufacturer_id(struct w25q *mem)
+int w25q_suspend(struct w25q *mem)
 {
-	return spi_read_id(mem) >> 16;
+	uint8_t header = W25Q_CMD_ERASE_SUSPEND;
+
+	if (mem->state != W25Q_STATE_BUSY || mem->op != W25Q_OP_ERASE)
+		return W25Q_ERR_BUSY;
+	if (mem->suspended)
+		return W25Q_OK;
+
+	cs_low(mem);
+	HAL_SPI_Transmit(mem->spi, &header, 1, SPI_TIMEOUT);
+	cs_high(mem);
+
+	wait_busy(mem, SUSPEND_TIMEOUT);
+
+	if (spi_read_status_reg(mem, W25Q_CMD_READ_STATUS_REG2) &
+			W25Q_SUS_FLAG_MASK)
+	{
+		mem->suspended = 1;
+		mem->suspended_at = HAL_GetTick();
+	}
+
+	return W25Q_OK;
+}
+
+/******************************************************************************/
+void w25q_resume(struct w25q *mem)
+{
+	uint8_t header = W25Q_CMD_ERASE_RESUME;
+
+	if (!mem->suspended)
+		return;
+
+	cs_low(mem);
+	HAL_SPI_Transmit(mem->spi, &header, 1, SPI_TIMEOUT);
+	cs_high(mem);
+
+	mem->start += HAL_GetTick() - mem->suspended_at;
+	mem->suspended = 0;
+}
+
+/******************************************************************************/
+void w25q_abort(struct w25q *mem)
+{
+	w25q_resume(mem);
+
+	if (mem->state == W25Q_STATE_XFER)
+		HAL_SPI_Abort(mem->spi);
+
+	cs_high(mem);
+	mem->state = W25Q_STATE_IDLE;
 }
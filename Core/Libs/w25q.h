@@ -10,31 +10,215 @@
 
 #include "stm32f4xx_hal.h"
 
-#define W25Q_PAGE_SIZE   256
-#define W25Q_SECTOR_SIZE 4096
+// Winbond defaults, the actual ones are in struct w25q_geometry
+#define W25Q_PAGE_SIZE    256
+#define W25Q_SECTOR_SIZE  4096
+#define W25Q_BLOCK32_SIZE (32 * 1024)
+#define W25Q_BLOCK_SIZE   (64 * 1024)
+
+#define W25Q_ERASE_TYPES 4
+
+typedef void (*w25q_cb)(int, void *);
+
+enum w25q_status
+{
+	W25Q_OK = 0,
+	W25Q_ERR_BUSY = -1,
+	W25Q_ERR_SPI = -2,
+	W25Q_ERR_TIMEOUT = -3,
+	W25Q_ERR_ARG = -4
+};
+
+enum w25q_state
+{
+	W25Q_STATE_IDLE = 0,
+	W25Q_STATE_XFER,  // DMA data phase, CS is low
+	W25Q_STATE_BUSY   // Program or erase in progress, waiting for w25q_poll()
+};
+
+enum w25q_op
+{
+	W25Q_OP_READ = 0,
+	W25Q_OP_PROGRAM,
+	W25Q_OP_ERASE
+};
+
+/*
+ * @brief: transfer statistics, baseline for storage optimizations
+ * reads, read_bytes: read commands and received data bytes
+ * programs, program_bytes: page program commands and sent data bytes
+ * erases: sector, block and chip erase commands
+ * busy_ms: time spent waiting for program and erase completion
+ */
+struct w25q_stats
+{
+	uint32_t reads;
+	uint32_t read_bytes;
+	uint32_t programs;
+	uint32_t program_bytes;
+	uint32_t erases;
+	uint32_t busy_ms;
+};
+
+enum w25q_addr
+{
+	W25Q_ADDR_3 = 0,  // 3-byte addresses only
+	W25Q_ADDR_3_4,    // 4-byte address commands above 16 MB
+	W25Q_ADDR_4       // 4-byte addresses only
+};
+
+struct w25q_erase_type
+{
+	uint32_t size;    // 0 - not supported
+	uint32_t timeout; // Maximum erase time, ms
+	uint8_t cmd;
+};
+
+/*
+ * @brief: Geometry and timings, read from SFDP by w25q_probe() or Winbond
+ * defaults with the capacity from the JEDEC ID
+ * sector_size: smallest erase size
+ * erase: supported erase types, largest first
+ */
+struct w25q_geometry
+{
+	uint32_t capacity;
+	uint32_t page_size;
+	uint32_t sector_size;
+	uint32_t program_timeout;
+	uint32_t chip_erase_timeout;
+	uint8_t addr;
+	uint8_t sfdp;
+	struct w25q_erase_type erase[W25Q_ERASE_TYPES];
+};
 
 struct w25q
 {
 	SPI_HandleTypeDef *spi;
 	GPIO_TypeDef *cs_port;
 	uint16_t cs_pin;
+
+	struct w25q_geometry geo;
+	struct w25q_stats stats;
+
+	// Asynchronous operation in progress
+	volatile uint8_t state;
+	uint8_t op;
+	uint8_t suspended;
+	uint32_t suspended_at;
+	uint32_t start;
+	uint32_t timeout;
+	w25q_cb callback;
+	void *context;
+	uint8_t *data;
+	uint32_t address;
+	uint32_t remaining;
 };
 
 
 void w25q_init(struct w25q *mem, SPI_HandleTypeDef *spi, GPIO_TypeDef *cs_port,
 		uint16_t cs_pin);
 
+/*
+ * @brief: Wake up the memory and read its geometry and timings from SFDP,
+ * falling back to Winbond defaults
+ * @retval: 0 - success, -1 - unknown memory
+ */
+int w25q_probe(struct w25q *mem);
+void w25q_get_geometry(struct w25q *mem, struct w25q_geometry *geo);
+
 void w25q_hw_init(struct w25q *mem);
 void w25q_hw_deinit(struct w25q *mem);
 
-void w25q_sector_erase(struct w25q *mem, uint32_t address);
-void w25q_block_erase(struct w25q *mem, uint32_t address);
+// W25Q_OK, W25Q_ERR_ARG if the size is not an erase type of the memory, or
+// W25Q_ERR_TIMEOUT if the erase is not done within the time of its type
+int w25q_sector_erase(struct w25q *mem, uint32_t address);
+int w25q_block_erase(struct w25q *mem, uint32_t address);
+int w25q_block32_erase(struct w25q *mem, uint32_t address);
 void w25q_chip_erase(struct w25q *mem);
+
+/*
+ * @brief: Erase one unit of a supported erase type size
+ * @retval: W25Q_OK or negative enum w25q_status
+ */
+int w25q_erase(struct w25q *mem, uint32_t address, uint32_t unit);
+
+/*
+ * @brief: Largest supported erase unit that is aligned at address and fits
+ * in size. Taking it repeatedly covers a range with the fewest erase
+ * commands.
+ * @retval: Erase type size, the smallest one if none fits
+ */
+uint32_t w25q_erase_unit(struct w25q *mem, uint32_t address, uint32_t size);
+
+/*
+ * @brief: Erase the sectors covering [address, address + size)
+ * @retval: W25Q_OK or the error of the first failed erase, the following
+ * units are not erased
+ */
+int w25q_erase_range(struct w25q *mem, uint32_t address, uint32_t size);
 void w25q_read_data(struct w25q *mem, uint32_t address, uint8_t *data,
 		uint16_t size);
 void w25q_write_data(struct w25q *mem, uint32_t address, uint8_t *data,
 		uint16_t size);
+void w25q_write_buffer(struct w25q *mem, uint32_t address, uint8_t *data,
+		uint32_t size);
 size_t w25q_get_capacity(struct w25q *mem);
 uint8_t w25q_get_manufacturer_id(struct w25q *mem);
+void w25q_get_stats(struct w25q *mem, struct w25q_stats *stats);
+
+/*
+ * @brief: Asynchronous operations. The command header is sent in place, the
+ * data phase runs over SPI DMA and the busy bit is checked by w25q_poll()
+ * instead of spinning. The callback gets enum w25q_status and the context;
+ * it is called from the SPI DMA interrupt for reads and from the
+ * w25q_poll() caller for programs and erases.
+ * @retval: W25Q_OK if submitted, or negative enum w25q_status
+ */
+int w25q_read_data_async(struct w25q *mem, uint32_t address, uint8_t *data,
+		uint16_t size, w25q_cb callback, void *context);
+int w25q_write_data_async(struct w25q *mem, uint32_t address, uint8_t *data,
+		uint16_t size, w25q_cb callback, void *context);
+int w25q_write_buffer_async(struct w25q *mem, uint32_t address,
+		uint8_t *data, uint32_t size, w25q_cb callback, void *context);
+int w25q_sector_erase_async(struct w25q *mem, uint32_t address,
+		w25q_cb callback, void *context);
+// unit: Erase type size, see struct w25q_geometry
+int w25q_erase_async(struct w25q *mem, uint32_t address, uint32_t unit,
+		w25q_cb callback, void *context);
+
+/*
+ * @brief: Call from HAL_SPI_TxCpltCallback, HAL_SPI_RxCpltCallback and
+ * HAL_SPI_ErrorCallback of the W25Q SPI
+ * @param status: W25Q_OK or W25Q_ERR_SPI
+ */
+void w25q_spi_irq(struct w25q *mem, int status);
+
+/*
+ * @brief: Check the busy bit of a pending program or erase, complete it when
+ * the memory is ready or the operation timed out. Call periodically.
+ * @retval: 1 while an operation is pending, 0 when idle
+ */
+int w25q_poll(struct w25q *mem);
+
+/*
+ * @brief: Suspend a pending erase so the memory can be read. Reading the
+ * sector being erased returns undefined data. The erase may also have just
+ * finished, then mem->suspended stays 0 and w25q_poll() completes it.
+ * @retval: W25Q_OK if the memory can be read, or W25Q_ERR_BUSY if no erase
+ * is pending
+ */
+int w25q_suspend(struct w25q *mem);
+
+/*
+ * @brief: Resume a suspended erase, the suspended time does not count
+ * towards the erase timeout
+ */
+void w25q_resume(struct w25q *mem);
+
+/*
+ * @brief: Drop the pending operation without calling its callback
+ */
+void w25q_abort(struct w25q *mem);
 
 #endif /* W25Q_H_ */
@@ -0,0 +1,1038 @@
+/*
+ * W25Q Serial FLASH memory with a prioritized lock
+ *
+ * Dmitry Proshutinsky <dproshutinsky@gmail.com>
+ * 2026
+ */
+
+#include "w25q_s.h"
+
+#include <string.h>
+
+#define POLL_PERIOD   pdMS_TO_TICKS(1)
+#define DONE_TIMEOUT  pdMS_TO_TICKS(2000)
+#define ERASE_TIMEOUT pdMS_TO_TICKS(12000)
+// An erase runs at least this long between two suspends to make progress
+#define SUSPEND_GAP   pdMS_TO_TICKS(1)
+// Shorter reads are cheaper in place than DMA plus a context switch
+#define DMA_READ_MIN  32
+
+#define WEAR_SLOTS 2
+
+/*
+ * Saved wear table, followed by the counters. It is written after them, so
+ * an interrupted save leaves the other slot the newest valid one.
+ */
+struct wear_tag
+{
+	uint32_t seq;
+	uint32_t nseq; // ~seq
+	uint32_t units;
+	uint32_t unit;
+};
+
+
+static void give(SemaphoreHandle_t sem)
+{
+	BaseType_t woken = pdFALSE;
+
+	if (xPortIsInsideInterrupt())
+	{
+		xSemaphoreGiveFromISR(sem, &woken);
+		portYIELD_FROM_ISR(woken);
+	}
+	else
+	{
+		xSemaphoreGive(sem);
+	}
+}
+
+static void done(int status, void *context)
+{
+	struct w25q_s *smem = context;
+
+	smem->status = status;
+	give(smem->done);
+}
+
+static void erase_done(int status, void *context)
+{
+	struct w25q_s *smem = context;
+
+	smem->erase_status = status;
+	smem->erasing = 0;
+	give(smem->erased);
+}
+
+inline static int is_async(void)
+{
+	return xTaskGetSchedulerState() == taskSCHEDULER_RUNNING;
+}
+
+/*
+ * @brief: Client of the calling task, registered on first use with the task
+ * priority
+ * @retval: Client or NULL if there are W25Q_S_CLIENTS already
+ */
+static struct w25q_s_client *client(struct w25q_s *smem)
+{
+	TaskHandle_t task = xTaskGetCurrentTaskHandle();
+	struct w25q_s_client *c = NULL;
+
+	vTaskSuspendAll();
+	for (size_t i = 0; i < smem->nclients; i++)
+	{
+		if (smem->clients[i].task == task)
+		{
+			c = &smem->clients[i];
+			break;
+		}
+	}
+
+	if (!c && smem->nclients < W25Q_S_CLIENTS)
+	{
+		c = &smem->clients[smem->nclients++];
+		c->task = task;
+		c->prio = uxTaskPriorityGet(NULL);
+		c->base = c->prio;
+		c->waiting = 0;
+		c->grant = xSemaphoreCreateBinaryStatic(&c->grant_buf);
+	}
+	xTaskResumeAll();
+
+	return c;
+}
+
+/*
+ * @brief: Waiting client to serve next, called in a critical section.
+ * A client gains a priority level per W25Q_S_AGING ticks of waiting, the
+ * longest waiting of equals goes first.
+ */
+static struct w25q_s_client *next(struct w25q_s *smem)
+{
+	TickType_t now = xTaskGetTickCount();
+	struct w25q_s_client *best = NULL;
+	struct w25q_s_client *c;
+	UBaseType_t bprio = 0;
+	UBaseType_t prio;
+
+	for (size_t i = 0; i < smem->nclients; i++)
+	{
+		c = &smem->clients[i];
+		if (!c->waiting)
+			continue;
+
+		prio = c->prio + (now - c->since) / W25Q_S_AGING;
+		if (!best || prio > bprio ||
+				(prio == bprio && now - c->since > now - best->since))
+		{
+			best = c;
+			bprio = prio;
+		}
+	}
+
+	return best;
+}
+
+/*
+ * @brief: Priority inheritance, called in a critical section. The holder
+ * runs at the highest task priority of the waiting clients if that is
+ * above its current one. Its current priority may be inherited from a
+ * kernel mutex, the base priority restored on unlock is the one of its
+ * registration.
+ */
+static void inherit(struct w25q_s *smem)
+{
+	struct w25q_s_client *own = NULL;
+	struct w25q_s_client *c;
+	UBaseType_t prio = 0;
+	UBaseType_t p;
+
+	if (!smem->holder)
+		return;
+
+	for (size_t i = 0; i < smem->nclients; i++)
+	{
+		c = &smem->clients[i];
+		if (c->task == smem->holder)
+			own = c;
+		if (!c->waiting)
+			continue;
+		p = uxTaskPriorityGet(c->task);
+		if (p > prio)
+			prio = p;
+	}
+
+	// Not a client, its base priority is unknown
+	if (!own)
+		return;
+	if (prio <= uxTaskPriorityGet(smem->holder))
+		return;
+
+	if (!smem->boosted)
+	{
+		smem->holder_prio = own->base;
+		smem->boosted = 1;
+	}
+	vTaskPrioritySet(smem->holder, prio);
+}
+
+inline static int is_waited(struct w25q_s *smem)
+{
+	for (size_t i = 0; i < smem->nclients; i++)
+		if (smem->clients[i].waiting)
+			return 1;
+	return 0;
+}
+
+/*
+ * @brief: Resume or poll the erase in progress at a transaction boundary on
+ * behalf of the poll timer, which skips its ticks while the lock is held
+ */
+static void service(struct w25q_s *smem)
+{
+	if (!smem->erasing)
+		return;
+
+	if (smem->mem.suspended)
+	{
+		w25q_resume(&smem->mem);
+		smem->resumed = xTaskGetTickCount();
+	}
+	else
+	{
+		w25q_poll(&smem->mem);
+	}
+}
+
+/*
+ * @brief: Give the memory to waiting clients between two transactions of a
+ * long operation
+ * @retval: 0 - locked again, -1 - timeout
+ */
+static int yield(struct w25q_s *smem)
+{
+	service(smem);
+	if (!is_waited(smem))
+		return 0;
+
+	w25q_s_unlock(smem);
+	return w25q_s_lock(smem, W25Q_S_OP_TIMEOUT);
+}
+
+/*
+ * @brief: A program is polled on behalf of the task holding the lock, an
+ * erase owns no lock and is serviced under it, skipping the tick if busy
+ */
+static void poll(TimerHandle_t timer)
+{
+	struct w25q_s *smem = pvTimerGetTimerID(timer);
+
+	if (!smem->erasing)
+	{
+		if (!w25q_poll(&smem->mem))
+			xTimerStop(timer, 0);
+	}
+	else if (!w25q_s_lock(smem, 0))
+	{
+		w25q_s_unlock(smem); // Serviced on unlock
+	}
+}
+
+static int wait(struct w25q_s *smem, int ret, int busy, TickType_t timeout)
+{
+	if (ret)
+		return ret;
+
+	if (busy)
+		xTimerStart(smem->poll, 0);
+
+	if (xSemaphoreTake(smem->done, timeout) == pdFALSE)
+	{
+		w25q_abort(&smem->mem);
+		return W25Q_ERR_TIMEOUT;
+	}
+
+	return smem->status;
+}
+
+/*
+ * @brief: Take the lock once no erase is in progress
+ * @retval: 0 - locked, -1 - timeout
+ */
+static int lock_idle(struct w25q_s *smem)
+{
+	TickType_t start = xTaskGetTickCount();
+
+	if (w25q_s_lock(smem, W25Q_S_OP_TIMEOUT))
+		return -1;
+
+	while (smem->erasing)
+	{
+		w25q_s_unlock(smem);
+		if (xTaskGetTickCount() - start > ERASE_TIMEOUT)
+			return -1;
+
+		vTaskDelay(POLL_PERIOD);
+		if (w25q_s_lock(smem, W25Q_S_OP_TIMEOUT))
+			return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * @brief: yield() for programs, which also wait for an erase started by a
+ * client meanwhile
+ */
+static int yield_idle(struct w25q_s *smem)
+{
+	if (yield(smem))
+		return -1;
+	if (!smem->erasing)
+		return 0;
+
+	w25q_s_unlock(smem);
+	return lock_idle(smem);
+}
+
+/*
+ * @brief: Suspend the erase in progress, the lock is held
+ */
+static void suspend(struct w25q_s *smem)
+{
+	TickType_t ran = xTaskGetTickCount() - smem->resumed;
+
+	if (smem->mem.suspended)
+		return;
+
+	if (ran < SUSPEND_GAP)
+		vTaskDelay(SUSPEND_GAP - ran);
+
+	w25q_suspend(&smem->mem);
+}
+
+/*
+ * @brief: Read from the memory, the lock is held
+ * @retval: W25Q_OK or negative enum w25q_status
+ */
+static int mem_read(struct w25q_s *smem, uint32_t address, uint8_t *data,
+		uint16_t size)
+{
+	int ret;
+
+	if (smem->erasing)
+	{
+		suspend(smem);
+		w25q_read_data(&smem->mem, address, data, size);
+	}
+	else if (is_async() && size >= DMA_READ_MIN)
+	{
+		ret = w25q_read_data_async(&smem->mem, address, data, size, done,
+				smem);
+		return wait(smem, ret, 0, DONE_TIMEOUT);
+	}
+	else
+	{
+		w25q_read_data(&smem->mem, address, data, size);
+	}
+
+	return W25Q_OK;
+}
+
+inline static uint8_t *line_data(struct w25q_s *smem,
+		struct w25q_s_line *line)
+{
+	return &smem->cache[(line - smem->lines) * W25Q_PAGE_SIZE];
+}
+
+/*
+ * @brief: Cached line of the page, or the least recently used line to
+ * replace if the page is not cached
+ * @retval: 1 - hit, 0 - miss
+ */
+static int cache_find(struct w25q_s *smem, uint32_t page,
+		struct w25q_s_line **line)
+{
+	struct w25q_s_line *lru = smem->lines;
+
+	for (size_t i = 0; i < smem->nlines; i++)
+	{
+		if (smem->lines[i].used && smem->lines[i].page == page)
+		{
+			*line = &smem->lines[i];
+			return 1;
+		}
+		if (smem->lines[i].used < lru->used)
+			lru = &smem->lines[i];
+	}
+
+	*line = lru;
+	return 0;
+}
+
+/*
+ * @brief: Read through the cache, the lock is held. Pages missed while an
+ * erase is in progress are not cached, the erased range may be among them.
+ * @retval: W25Q_OK or negative enum w25q_status
+ */
+static int cache_read(struct w25q_s *smem, uint32_t address, uint8_t *data,
+		uint16_t size)
+{
+	struct w25q_s_line *line;
+	uint32_t page;
+	uint16_t offset;
+	uint16_t len;
+	int ret;
+
+	while (size)
+	{
+		page = address - address % W25Q_PAGE_SIZE;
+		offset = address - page;
+		len = W25Q_PAGE_SIZE - offset;
+		if (len > size)
+			len = size;
+
+		if (cache_find(smem, page, &line))
+		{
+			smem->hits++;
+		}
+		else if (smem->erasing)
+		{
+			smem->misses++;
+			ret = mem_read(smem, address, data, len);
+			if (ret)
+				return ret;
+			line = NULL;
+		}
+		else
+		{
+			smem->misses++;
+			line->used = 0;
+			ret = mem_read(smem, page, line_data(smem, line),
+					W25Q_PAGE_SIZE);
+			if (ret)
+				return ret;
+			line->page = page;
+		}
+
+		if (line)
+		{
+			line->used = ++smem->stamp;
+			memcpy(data, line_data(smem, line) + offset, len);
+		}
+
+		size -= len;
+		address += len;
+		data += len;
+	}
+
+	return W25Q_OK;
+}
+
+/*
+ * @brief: Drop cached pages in [address, address + size), the lock is held
+ */
+static void cache_invalidate(struct w25q_s *smem, uint32_t address,
+		uint32_t size)
+{
+	for (size_t i = 0; i < smem->nlines; i++)
+	{
+		if (smem->lines[i].page + W25Q_PAGE_SIZE > address &&
+				smem->lines[i].page < address + size)
+			smem->lines[i].used = 0;
+	}
+}
+
+/*
+ * @brief: Count an erase of [address, address + size), the lock is held
+ */
+static void wear_count(struct w25q_s *smem, uint32_t address, uint32_t size)
+{
+	size_t first;
+	size_t last;
+
+	if (!smem->wear || !size)
+		return;
+
+	first = address / smem->wunit;
+	last = (address + size - 1) / smem->wunit;
+	for (size_t i = first; i <= last && i < smem->wunits; i++)
+	{
+		if (smem->wear[i] < UINT16_MAX)
+			smem->wear[i]++;
+	}
+	smem->wdirty++;
+}
+
+/*
+ * @brief: Erase one unit, waiting for it with the lock released
+ * @retval: W25Q_OK or negative enum w25q_status
+ */
+static int erase(struct w25q_s *smem, uint32_t address, uint32_t unit)
+{
+	int ret;
+
+	if (lock_idle(smem))
+		return W25Q_ERR_BUSY;
+
+	cache_invalidate(smem, address, unit);
+	ret = w25q_erase_async(&smem->mem, address, unit, erase_done, smem);
+	if (ret == W25Q_OK)
+	{
+		wear_count(smem, address, unit);
+		smem->erasing = 1;
+		smem->resumed = xTaskGetTickCount();
+		xTimerStart(smem->poll, 0);
+	}
+	w25q_s_unlock(smem);
+
+	if (ret != W25Q_OK)
+		return ret;
+
+	if (xSemaphoreTake(smem->erased, DONE_TIMEOUT +
+			pdMS_TO_TICKS(smem->mem.timeout)) == pdFALSE)
+	{
+		if (w25q_s_lock(smem, portMAX_DELAY))
+			return W25Q_ERR_TIMEOUT;
+		if (smem->erasing)
+		{
+			w25q_abort(&smem->mem);
+			smem->erasing = 0;
+		}
+		// Completed right after the timeout
+		xSemaphoreTake(smem->erased, 0);
+		w25q_s_unlock(smem);
+		return W25Q_ERR_TIMEOUT;
+	}
+
+	return smem->erase_status;
+}
+
+/******************************************************************************/
+void w25q_s_init(struct w25q_s *smem, SPI_HandleTypeDef *spi,
+		GPIO_TypeDef *cs_port, uint16_t cs_pin)
+{
+	smem->locked = 0;
+	smem->nclients = 0;
+	smem->holder = NULL;
+	smem->boosted = 0;
+	smem->done = xSemaphoreCreateBinaryStatic(&smem->done_buf);
+	smem->erased = xSemaphoreCreateBinaryStatic(&smem->erased_buf);
+	smem->poll = xTimerCreateStatic("w25q", POLL_PERIOD, pdTRUE, smem, poll,
+			&smem->poll_buf);
+	smem->erasing = 0;
+	smem->resumed = 0;
+	smem->lines = NULL;
+	smem->cache = NULL;
+	smem->nlines = 0;
+	smem->stamp = 0;
+	smem->hits = 0;
+	smem->misses = 0;
+	smem->wear = NULL;
+	smem->wunits = 0;
+	smem->wdirty = 0;
+	smem->wsaving = 0;
+	w25q_init(&smem->mem, spi, cs_port, cs_pin);
+	w25q_probe(&smem->mem); // Winbond defaults on failure
+
+#ifdef W25Q_S_CACHE
+	w25q_s_cache(smem, W25Q_S_CACHE_LINES); // No cache on failure
+#endif /* W25Q_S_CACHE */
+
+#ifdef W25Q_S_WEAR
+	w25q_s_wear(smem, W25Q_S_WEAR_UNITS); // No counters on failure
+#endif /* W25Q_S_WEAR */
+}
+
+/******************************************************************************/
+int w25q_s_cache(struct w25q_s *smem, size_t lines)
+{
+	if (!lines || smem->lines)
+		return -1;
+
+	smem->lines = pvPortMalloc(lines * sizeof(struct w25q_s_line));
+	smem->cache = pvPortMalloc(lines * W25Q_PAGE_SIZE);
+	if (!smem->lines || !smem->cache)
+	{
+		vPortFree(smem->lines);
+		vPortFree(smem->cache);
+		smem->lines = NULL;
+		smem->cache = NULL;
+		return -1;
+	}
+
+	memset(smem->lines, 0, lines * sizeof(struct w25q_s_line));
+	smem->nlines = lines;
+	return 0;
+}
+
+/******************************************************************************/
+int w25q_s_lock(struct w25q_s *smem, TickType_t timeout)
+{
+	struct w25q_s_client *c;
+	int granted;
+
+	// Single task before the scheduler starts
+	if (!is_async())
+	{
+		if (smem->locked)
+			return -1;
+		smem->locked = 1;
+		return 0;
+	}
+
+	// Tasks that can wait are clients, also while the memory is free: a
+	// boosted holder gets back the priority of its registration
+	c = timeout ? client(smem) : NULL;
+
+	taskENTER_CRITICAL();
+	if (!smem->locked)
+	{
+		smem->locked = 1;
+		smem->holder = xTaskGetCurrentTaskHandle();
+		taskEXIT_CRITICAL();
+		return 0;
+	}
+	taskEXIT_CRITICAL();
+
+	if (!c)
+		return -1;
+
+	taskENTER_CRITICAL();
+	// Released meanwhile
+	if (!smem->locked)
+	{
+		smem->locked = 1;
+		smem->holder = c->task;
+		taskEXIT_CRITICAL();
+		return 0;
+	}
+	c->since = xTaskGetTickCount();
+	c->waiting = 1;
+	inherit(smem);
+	taskEXIT_CRITICAL();
+
+	if (xSemaphoreTake(c->grant, timeout) == pdTRUE)
+		return 0;
+
+	taskENTER_CRITICAL();
+	granted = !c->waiting;
+	c->waiting = 0;
+	taskEXIT_CRITICAL();
+
+	if (!granted)
+		return -1;
+
+	// Granted right after the timeout
+	xSemaphoreTake(c->grant, 0);
+	return 0;
+}
+
+/******************************************************************************/
+void w25q_s_unlock(struct w25q_s *smem)
+{
+	struct w25q_s_client *c;
+	UBaseType_t prio;
+	uint8_t boosted;
+
+	if (!is_async())
+	{
+		smem->locked = 0;
+		return;
+	}
+
+	service(smem);
+
+	// Handed over locked to the next client
+	taskENTER_CRITICAL();
+	boosted = smem->boosted;
+	prio = smem->holder_prio;
+	smem->boosted = 0;
+	c = next(smem);
+	if (c)
+	{
+		c->waiting = 0;
+		smem->holder = c->task;
+		inherit(smem);
+	}
+	else
+	{
+		smem->locked = 0;
+		smem->holder = NULL;
+	}
+	taskEXIT_CRITICAL();
+
+	if (c)
+		xSemaphoreGive(c->grant);
+
+	// Base priority back once the lock is handed over, not preempted before
+	if (boosted)
+		vTaskPrioritySet(NULL, prio);
+}
+
+/******************************************************************************/
+int w25q_s_client(struct w25q_s *smem, UBaseType_t prio)
+{
+	struct w25q_s_client *c = client(smem);
+
+	if (!c)
+		return -1;
+
+	c->prio = prio;
+	return 0;
+}
+
+/******************************************************************************/
+int w25q_s_wear(struct w25q_s *smem, size_t units)
+{
+	uint32_t capacity = smem->mem.geo.capacity;
+	uint32_t slot = smem->mem.geo.sector_size;
+	struct wear_tag tag;
+	uint32_t unit = slot;
+
+	if (!units || smem->wear || capacity < 2 * WEAR_SLOTS * slot)
+		return -1;
+
+	while (capacity / unit > units)
+		unit *= 2;
+	units = capacity / unit;
+	if (sizeof(tag) + units * sizeof(uint16_t) > slot)
+		return -1;
+
+	smem->wear = pvPortMalloc(units * sizeof(uint16_t));
+	if (!smem->wear)
+		return -1;
+
+	memset(smem->wear, 0, units * sizeof(uint16_t));
+	smem->wunits = units;
+	smem->wunit = unit;
+	smem->wbase = capacity - WEAR_SLOTS * slot;
+	smem->wseq = 0;
+
+	// The newest valid slot
+	for (uint32_t i = 0; i < WEAR_SLOTS; i++)
+	{
+		if (w25q_s_read_data(smem, smem->wbase + i * slot, (uint8_t *) &tag,
+				sizeof(tag)))
+			continue;
+		if (tag.seq != ~tag.nseq || tag.units != units || tag.unit != unit ||
+				(smem->wseq && (int32_t) (tag.seq - smem->wseq) < 0))
+			continue;
+
+		smem->wseq = tag.seq;
+		w25q_s_read_data(smem, smem->wbase + i * slot + sizeof(tag),
+				(uint8_t *) smem->wear, units * sizeof(uint16_t));
+	}
+
+	return 0;
+}
+
+/******************************************************************************/
+int w25q_s_wear_save(struct w25q_s *smem, int force)
+{
+	uint32_t slot = smem->mem.geo.sector_size;
+	struct wear_tag tag;
+	uint32_t address;
+	int ret;
+
+	if (!smem->wear || !smem->wdirty ||
+			(!force && smem->wdirty < W25Q_S_WEAR_SAVE))
+		return W25Q_OK;
+
+	taskENTER_CRITICAL();
+	ret = smem->wsaving;
+	smem->wsaving = 1;
+	taskEXIT_CRITICAL();
+	if (ret)
+		return W25Q_OK;
+
+	tag.seq = smem->wseq + 1;
+	tag.nseq = ~tag.seq;
+	tag.units = smem->wunits;
+	tag.unit = smem->wunit;
+	address = smem->wbase + tag.seq % WEAR_SLOTS * slot;
+	// Erases counted from now on are saved next time
+	smem->wdirty = 0;
+
+	ret = w25q_s_erase(smem, address, slot);
+	if (!ret)
+		ret = w25q_s_write_buffer(smem, address + sizeof(tag),
+				(uint8_t *) smem->wear, smem->wunits * sizeof(uint16_t));
+	if (!ret)
+		ret = w25q_s_write_buffer(smem, address, (uint8_t *) &tag,
+				sizeof(tag));
+
+	if (ret)
+		smem->wdirty += W25Q_S_WEAR_SAVE;
+	else
+		smem->wseq = tag.seq;
+	smem->wsaving = 0;
+
+	return ret;
+}
+
+/******************************************************************************/
+int w25q_s_get_wear(struct w25q_s *smem, uint32_t address)
+{
+	if (!smem->wear || address / smem->wunit >= smem->wunits)
+		return -1;
+	return smem->wear[address / smem->wunit];
+}
+
+/******************************************************************************/
+int w25q_s_get_wear_stats(struct w25q_s *smem,
+		struct w25q_s_wear_stats *stats)
+{
+	if (!smem->wear)
+		return -1;
+
+	stats->unit = smem->wunit;
+	stats->min = UINT16_MAX;
+	stats->max = 0;
+	stats->total = 0;
+	for (size_t i = 0; i < smem->wunits; i++)
+	{
+		if (smem->wear[i] < stats->min)
+			stats->min = smem->wear[i];
+		if (smem->wear[i] > stats->max)
+			stats->max = smem->wear[i];
+		stats->total += smem->wear[i];
+	}
+
+	return 0;
+}
+
+/******************************************************************************/
+uint32_t w25q_s_wear_least(struct w25q_s *smem, uint32_t address,
+		uint32_t area, uint32_t size, uint32_t align)
+{
+	uint32_t best = address;
+	uint32_t bsum = UINT32_MAX;
+	uint32_t sum;
+
+	if (!smem->wear || !area || !align || size > area ||
+			(address + area - 1) / smem->wunit >= smem->wunits)
+		return address;
+
+	for (uint32_t off = 0; off < area; off += align)
+	{
+		sum = 0;
+		for (uint32_t pos = 0; pos < size; pos += smem->wunit)
+			sum += smem->wear[(address + (off + pos) % area) / smem->wunit];
+		if (sum < bsum)
+		{
+			best = address + off;
+			bsum = sum;
+		}
+	}
+
+	return best;
+}
+
+/******************************************************************************/
+int w25q_s_get_cache_stats(struct w25q_s *smem, uint32_t *hits,
+		uint32_t *misses)
+{
+	if (w25q_s_lock(smem, W25Q_S_TIMEOUT))
+		return -1;
+
+	*hits = smem->hits;
+	*misses = smem->misses;
+	w25q_s_unlock(smem);
+	return 0;
+}
+
+/******************************************************************************/
+int w25q_s_sector_erase(struct w25q_s *smem, uint32_t address)
+{
+	return w25q_s_erase(smem, address, smem->mem.geo.sector_size);
+}
+
+/******************************************************************************/
+int w25q_s_erase(struct w25q_s *smem, uint32_t address, uint32_t size)
+{
+	uint32_t sector = smem->mem.geo.sector_size;
+	uint32_t end = address + size;
+	uint32_t unit;
+	int ret;
+
+	if (!is_async())
+	{
+		if (w25q_s_lock(smem, W25Q_S_OP_TIMEOUT))
+			return W25Q_ERR_BUSY;
+
+		cache_invalidate(smem, address - address % sector,
+				size + address % sector);
+		wear_count(smem, address - address % sector,
+				size + address % sector);
+		ret = w25q_erase_range(&smem->mem, address, size);
+		w25q_s_unlock(smem);
+		return ret;
+	}
+
+	// Every unit is a transaction of its own
+	address -= address % sector;
+	while (address < end)
+	{
+		unit = w25q_erase_unit(&smem->mem, address, end - address);
+		ret = erase(smem, address, unit);
+		if (ret)
+			return ret;
+
+		address += unit;
+	}
+
+	return W25Q_OK;
+}
+
+/******************************************************************************/
+int w25q_s_read_data(struct w25q_s *smem, uint32_t address,
+		uint8_t *data, uint16_t size)
+{
+	uint16_t len;
+	int ret = W25Q_OK;
+
+	if (w25q_s_lock(smem, W25Q_S_OP_TIMEOUT))
+		return W25Q_ERR_BUSY;
+
+	// Bulk reads bypass the cache
+	if (smem->lines && size < W25Q_PAGE_SIZE)
+	{
+		ret = cache_read(smem, address, data, size);
+		size = 0;
+	}
+
+	while (size)
+	{
+		len = size < W25Q_S_CHUNK ? size : W25Q_S_CHUNK;
+		ret = mem_read(smem, address, data, len);
+		if (ret)
+			break;
+
+		size -= len;
+		address += len;
+		data += len;
+
+		if (size && yield(smem))
+			return W25Q_ERR_BUSY;
+	}
+
+	w25q_s_unlock(smem);
+	return ret;
+}
+
+/******************************************************************************/
+int w25q_s_write_data(struct w25q_s *smem, uint32_t address,
+		uint8_t *data, uint16_t size)
+{
+	return w25q_s_write_buffer(smem, address, data, size);
+}
+
+/******************************************************************************/
+int w25q_s_write_buffer(struct w25q_s *smem, uint32_t address,
+		uint8_t *data, uint32_t size)
+{
+	TickType_t page_timeout = pdMS_TO_TICKS(smem->mem.geo.program_timeout);
+	uint32_t len;
+	int ret = W25Q_OK;
+
+	if (!size)
+		return W25Q_OK;
+
+	if (!is_async())
+	{
+		if (w25q_s_lock(smem, W25Q_S_OP_TIMEOUT))
+			return W25Q_ERR_BUSY;
+
+		cache_invalidate(smem, address, size);
+		w25q_write_buffer(&smem->mem, address, data, size);
+		w25q_s_unlock(smem);
+		return W25Q_OK;
+	}
+
+	if (lock_idle(smem))
+		return W25Q_ERR_BUSY;
+
+	while (size)
+	{
+		// Up to the chunk boundary, which is a page boundary
+		len = W25Q_S_CHUNK - address % W25Q_S_CHUNK;
+		if (len > size)
+			len = size;
+
+		// Readers may have cached it between the chunks
+		cache_invalidate(smem, address, len);
+		ret = w25q_write_buffer_async(&smem->mem, address, data, len, done,
+				smem);
+		ret = wait(smem, ret, 1, DONE_TIMEOUT +
+				(len / smem->mem.geo.page_size + 2) * page_timeout);
+		if (ret)
+			break;
+
+		size -= len;
+		address += len;
+		data += len;
+
+		if (size && yield_idle(smem))
+			return W25Q_ERR_BUSY;
+	}
+
+	w25q_s_unlock(smem);
+	return ret;
+}
+
+/******************************************************************************/
+int w25q_s_read_stream(struct w25q_s *smem, uint32_t address, uint32_t size,
+		uint8_t *buf, uint16_t chunk, w25q_s_stream_cb process,
+		void *context)
+{
+	uint8_t *cur = buf;
+	uint8_t *next = buf + chunk;
+	uint8_t *tmp;
+	uint16_t len;
+	uint16_t nlen;
+	int async;
+	int ret;
+
+	if (!size)
+		return W25Q_OK;
+
+	if (w25q_s_lock(smem, W25Q_S_OP_TIMEOUT))
+		return W25Q_ERR_BUSY;
+
+	len = size < chunk ? size : chunk;
+	ret = mem_read(smem, address, cur, len);
+	while (!ret)
+	{
+		address += len;
+		size -= len;
+		nlen = size < chunk ? size : chunk;
+
+		// The next chunk is in flight while this one is processed
+		async = nlen && is_async() && !smem->erasing;
+		if (async)
+			ret = w25q_read_data_async(&smem->mem, address, next, nlen,
+					done, smem);
+
+		process(cur, len, context);
+		if (!nlen)
+			break;
+
+		if (async)
+			ret = wait(smem, ret, 0, DONE_TIMEOUT);
+		else
+			ret = mem_read(smem, address, next, nlen);
+
+		tmp = cur;
+		cur = next;
+		next = tmp;
+		len = nlen;
+
+		if (!ret && yield(smem))
+			return W25Q_ERR_BUSY;
+	}
+
+	w25q_s_unlock(smem);
+	return ret;
+}
@@ -1,8 +1,8 @@
 /*
- * W25Q Serial FLASH memory with mutex lock
+ * W25Q Serial FLASH memory with a prioritized lock
  *
  * Dmitry Proshutinsky <dproshutinsky@gmail.com>
- * 2025
+ * 2025-2026
  */
 
 #ifndef W25Q_S_H_
@@ -10,75 +10,249 @@
 
 #include "cmsis_os.h"
 #include "semphr.h"
+#include "task.h"
+#include "timers.h"
 
 #include "w25q.h"
 
 #define W25Q_S_TIMEOUT pdMS_TO_TICKS(100)
+// Operations wait this long for their turn, then fail with W25Q_ERR_BUSY
+#define W25Q_S_OP_TIMEOUT pdMS_TO_TICKS(2000)
 
-struct w25q_s
+/*
+ * Scheduler: tasks waiting for the memory are served by client priority
+ * (the task priority unless set by w25q_s_client()), a waiting client gains
+ * a level per W25Q_S_AGING ticks, many chunk times, so aging only lifts a
+ * starved client. Reads and programs are split into W25Q_S_CHUNK byte
+ * transactions, giving way to waiting clients in between. The task holding
+ * the memory runs at least at the task priority of the waiting ones, then
+ * returns to its task priority at registration as a client (a task that
+ * locks with a timeout, or calls w25q_s_client()).
+ */
+#define W25Q_S_CLIENTS 8
+#define W25Q_S_CHUNK   1024
+#define W25Q_S_AGING   pdMS_TO_TICKS(1000)
+
+/*
+ * Read cache: W25Q_S_CACHE_LINES pages from the FreeRTOS heap, the least
+ * recently used page is replaced, writes and erases drop the pages they touch
+ */
+#define W25Q_S_CACHE
+#define W25Q_S_CACHE_LINES 4
+
+/*
+ * Wear counters: erases of W25Q_S_WEAR_UNITS equal parts of the memory (a
+ * sector or more) in RAM from the FreeRTOS heap, saved by w25q_s_wear_save()
+ * to one of two smallest erase units at the top of the memory in turn
+ */
+#define W25Q_S_WEAR
+#define W25Q_S_WEAR_UNITS 512
+#define W25Q_S_WEAR_SAVE  64 // Erases between two saves
+
+typedef void (*w25q_s_stream_cb)(const uint8_t *, uint32_t, void *);
+
+struct w25q_s_line
 {
-	SemaphoreHandle_t mutex;
-	struct w25q mem;
+	uint32_t page;
+	uint32_t used; // Last use stamp, 0 - empty
 };
 
+struct w25q_s_wear_stats
+{
+	uint32_t unit; // Counted part size
+	uint32_t min;
+	uint32_t max;
+	uint32_t total;
+};
 
-inline static void w25q_s_init(struct w25q_s *smem,
-		SPI_HandleTypeDef *spi, GPIO_TypeDef *cs_port, uint16_t cs_pin)
+struct w25q_s_client
 {
-	smem->mutex = xSemaphoreCreateMutex();
-	w25q_init(&smem->mem, spi,cs_port, cs_pin);
-}
+	TaskHandle_t task;
+	UBaseType_t prio;
+	UBaseType_t base; // Task priority at registration
+	volatile uint8_t waiting;
+	TickType_t since;
+	SemaphoreHandle_t grant;
+	StaticSemaphore_t grant_buf;
+};
 
-inline static void w25q_s_sector_erase(struct w25q_s *smem,
-		uint32_t address)
+struct w25q_s
 {
-	if (xSemaphoreTake(smem->mutex, W25Q_S_TIMEOUT) == pdFALSE)
-		return;
+	// Scheduler, see w25q_s_lock()
+	volatile uint8_t locked;
+	struct w25q_s_client clients[W25Q_S_CLIENTS];
+	size_t nclients;
+	TaskHandle_t holder;
+	UBaseType_t holder_prio; // Base priority of the boosted holder
+	uint8_t boosted;
 
-	w25q_sector_erase(&smem->mem, address);
-	xSemaphoreGive(smem->mutex);
-}
+	struct w25q mem;
 
-inline static void w25q_s_read_data(struct w25q_s *smem, uint32_t address,
-		uint8_t *data, uint16_t size)
-{
-	if (xSemaphoreTake(smem->mutex, W25Q_S_TIMEOUT) == pdFALSE)
-		return;
+	// Asynchronous completion
+	SemaphoreHandle_t done;
+	StaticSemaphore_t done_buf;
+	TimerHandle_t poll;
+	StaticTimer_t poll_buf;
+	volatile int status;
 
-	w25q_read_data(&smem->mem, address, data, size);
-	xSemaphoreGive(smem->mutex);
-}
+	// Erase in progress without the lock held, see w25q_s_erase()
+	SemaphoreHandle_t erased;
+	StaticSemaphore_t erased_buf;
+	volatile int erase_status;
+	volatile uint8_t erasing;
+	TickType_t resumed;
 
-inline static void w25q_s_write_data(struct w25q_s *smem,
-		uint32_t address, uint8_t *data, uint16_t size)
-{
-	if (xSemaphoreTake(smem->mutex, W25Q_S_TIMEOUT) == pdFALSE)
-		return;
+	// Read cache, see w25q_s_cache()
+	struct w25q_s_line *lines;
+	uint8_t *cache;
+	size_t nlines;
+	uint32_t stamp;
+	uint32_t hits;
+	uint32_t misses;
+
+	// Wear counters, see w25q_s_wear()
+	uint16_t *wear;
+	size_t wunits;
+	uint32_t wunit;
+	uint32_t wbase;
+	uint32_t wseq;
+	volatile uint32_t wdirty;
+	volatile uint8_t wsaving;
+};
 
-	w25q_write_data(&smem->mem, address, data, size);
-	xSemaphoreGive(smem->mutex);
-}
+
+void w25q_s_init(struct w25q_s *smem, SPI_HandleTypeDef *spi,
+		GPIO_TypeDef *cs_port, uint16_t cs_pin);
+
+/*
+ * @brief: Take the memory for a transaction. The lock is handed over to the
+ * next waiting client on unlock.
+ * @retval: 0 - locked, -1 - timeout or no free client slot
+ */
+int w25q_s_lock(struct w25q_s *smem, TickType_t timeout);
+void w25q_s_unlock(struct w25q_s *smem);
+
+/*
+ * @brief: Set the scheduling priority of the calling task
+ * @param prio: Task priority scale, e.g. osPriorityLow for bulk transfers
+ * @retval: 0 - success, -1 - no free client slot
+ */
+int w25q_s_client(struct w25q_s *smem, UBaseType_t prio);
+
+/*
+ * @brief: Enable the read cache, called by w25q_s_init() if W25Q_S_CACHE
+ * @param lines: Number of cached pages, W25Q_PAGE_SIZE bytes of heap each
+ * @retval: 0 - success, -1 - already enabled or no memory
+ */
+int w25q_s_cache(struct w25q_s *smem, size_t lines);
+int w25q_s_get_cache_stats(struct w25q_s *smem, uint32_t *hits,
+		uint32_t *misses);
+
+/*
+ * @brief: Enable the wear counters, called by w25q_s_init() if W25Q_S_WEAR.
+ * The top two smallest erase units are taken from w25q_s_get_capacity() for
+ * the saved table, counters saved before are loaded from it.
+ * @param units: Maximum number of counters, 2 bytes of heap each
+ * @retval: 0 - success, -1 - already enabled or no memory
+ */
+int w25q_s_wear(struct w25q_s *smem, size_t units);
+/*
+ * @brief: Save the counters if W25Q_S_WEAR_SAVE erases were counted since
+ * the last save or if forced. Counts since the last save are lost on reset.
+ * @retval: 0 - saved or nothing to do, negative enum w25q_status
+ */
+int w25q_s_wear_save(struct w25q_s *smem, int force);
+// Erases of the part containing address, -1 if not counted
+int w25q_s_get_wear(struct w25q_s *smem, uint32_t address);
+int w25q_s_get_wear_stats(struct w25q_s *smem,
+		struct w25q_s_wear_stats *stats);
+/*
+ * @brief: The least erased place for data that can be put anywhere in an
+ * area, e.g. a staged image. A place wraps around the end of the area.
+ * @param address: Area start, places start "align" bytes apart from it
+ * @param area: Area size
+ * @param size: Data size
+ * @retval: Start of the place with the lowest sum of the counters of its
+ * parts, the area start if the erases are not counted
+ */
+uint32_t w25q_s_wear_least(struct w25q_s *smem, uint32_t address,
+		uint32_t area, uint32_t size, uint32_t align);
+
+/*
+ * @brief: Synchronous wrappers. Once the scheduler is running, programs,
+ * erases and long reads are submitted asynchronously and the calling task
+ * sleeps until the completion instead of spinning on the busy bit.
+ * An erase is waited for with the lock released: reads issued meanwhile
+ * suspend it and the poll timer resumes it on its next tick, programs and
+ * other erases wait until it completes.
+ * @retval: W25Q_OK or negative enum w25q_status, W25Q_ERR_BUSY if the
+ * operation did not get its turn in W25Q_S_OP_TIMEOUT
+ */
+int w25q_s_sector_erase(struct w25q_s *smem, uint32_t address);
+// Sectors covering [address, address + size) with the fewest erase commands,
+// see struct w25q_geometry
+int w25q_s_erase(struct w25q_s *smem, uint32_t address, uint32_t size);
+int w25q_s_read_data(struct w25q_s *smem, uint32_t address,
+		uint8_t *data, uint16_t size);
+int w25q_s_write_data(struct w25q_s *smem, uint32_t address,
+		uint8_t *data, uint16_t size);
+// Any length and alignment, split on page boundaries
+int w25q_s_write_buffer(struct w25q_s *smem, uint32_t address,
+		uint8_t *data, uint32_t size);
+
+/*
+ * @brief: Read [address, address + size) in chunks, the next chunk is read
+ * by DMA while the callback processes the previous one
+ * @param buf: Two chunks, the callback gets them in turn
+ * @param chunk: Chunk size, every chunk is a transaction of its own
+ * @param process: Called with every chunk in order, its data is valid until
+ * the callback returns
+ * @retval: W25Q_OK or negative enum w25q_status
+ */
+int w25q_s_read_stream(struct w25q_s *smem, uint32_t address, uint32_t size,
+		uint8_t *buf, uint16_t chunk, w25q_s_stream_cb process,
+		void *context);
 
 inline static size_t w25q_s_get_capacity(struct w25q_s *smem)
 {
 	size_t cap;
-	if (xSemaphoreTake(smem->mutex, W25Q_S_TIMEOUT) == pdFALSE)
+	if (w25q_s_lock(smem, W25Q_S_TIMEOUT))
 		return 0;
 
 	cap = w25q_get_capacity(&smem->mem);
-	xSemaphoreGive(smem->mutex);
+	if (smem->wear)
+		cap = smem->wbase; // Wear table above
+	w25q_s_unlock(smem);
 	return cap;
 }
 
+// Read once by w25q_s_init(), no lock needed
+inline static void w25q_s_get_geometry(struct w25q_s *smem,
+		struct w25q_geometry *geo)
+{
+	w25q_get_geometry(&smem->mem, geo);
+}
+
 inline static uint8_t w25q_s_get_manufacturer_id(struct w25q_s *smem)
 {
 	uint8_t mid;
-	if (xSemaphoreTake(smem->mutex, W25Q_S_TIMEOUT) == pdFALSE)
+	if (w25q_s_lock(smem, W25Q_S_TIMEOUT))
 		return 0;
 
 	mid = w25q_get_manufacturer_id(&smem->mem);
-	xSemaphoreGive(smem->mutex);
+	w25q_s_unlock(smem);
 	return mid;
 }
 
+inline static int w25q_s_get_stats(struct w25q_s *smem,
+		struct w25q_stats *stats)
+{
+	if (w25q_s_lock(smem, W25Q_S_TIMEOUT))
+		return -1;
+
+	w25q_get_stats(&smem->mem, stats);
+	w25q_s_unlock(smem);
+	return 0;
+}
+
 #endif /* W25Q_S_H_ */
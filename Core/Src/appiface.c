@@ -59,6 +59,10 @@ static int parse(struct appiface *appif, const char *request, char *response)
 	jsmntok_t *tcmd = NULL;
 	jsmntok_t *tparam = NULL;
 	jsmntok_t *tvalue = NULL;
+	struct mfifo_usage usage;
+	struct w25q_s_wear_stats wear;
+	struct sim800l_linger_stats linger;
+	struct sim800l_rf_stats rf;
 	size_t len, tmplen;
 	uint32_t tmp;
 	int ret;
@@ -164,6 +168,96 @@ static int parse(struct appiface *appif, const char *request, char *response)
 			strjson_int(response, "angle", appif->actual->angle);
 			xSemaphoreGive(appif->actual->mutex);
 		}
+		else if (jsoneq(request, tparam, "erase_sync") == 0)
+			strjson_uint(response, "erase_sync", mqueue_erase_sync());
+		else if (jsoneq(request, tparam, "queue") == 0)
+		{
+			ret = mqueue_count(appif->samples);
+			if (ret < 0)
+				return -1;
+			strjson_uint(response, "queue", ret);
+		}
+		else if (jsoneq(request, tparam, "queue_free") == 0)
+		{
+			if (mqueue_usage(appif->samples, &usage))
+				return -1;
+			strjson_uint(response, "queue_free", usage.free);
+		}
+		else if (jsoneq(request, tparam, "wear_max") == 0)
+		{
+			if (w25q_s_get_wear_stats(appif->mem, &wear))
+				return -1;
+			strjson_uint(response, "wear_max", wear.max);
+		}
+		else if (jsoneq(request, tparam, "wear_min") == 0)
+		{
+			if (w25q_s_get_wear_stats(appif->mem, &wear))
+				return -1;
+			strjson_uint(response, "wear_min", wear.min);
+		}
+		else if (jsoneq(request, tparam, "wear_total") == 0)
+		{
+			if (w25q_s_get_wear_stats(appif->mem, &wear))
+				return -1;
+			strjson_uint(response, "wear_total", wear.total);
+		}
+		else if (jsoneq(request, tparam, "wear_unit") == 0)
+		{
+			if (w25q_s_get_wear_stats(appif->mem, &wear))
+				return -1;
+			strjson_uint(response, "wear_unit", wear.unit);
+		}
+		else if (jsoneq(request, tparam, "wear") == 0)
+		{
+			// Erases of the part at the address given as value
+			if (!tvalue)
+				return -1;
+			tmp = strtoul(request + tvalue->start, NULL, 10);
+			ret = w25q_s_get_wear(appif->mem, tmp);
+			if (ret < 0)
+				return -1;
+			strjson_uint(response, "wear", ret);
+		}
+		else if (jsoneq(request, tparam, "gprs_attach") == 0)
+		{
+			sim800l_get_linger_stats(appif->mod, &linger);
+			strjson_uint(response, "gprs_attach", linger.attach);
+		}
+		else if (jsoneq(request, tparam, "gprs_gap") == 0)
+		{
+			sim800l_get_linger_stats(appif->mod, &linger);
+			strjson_uint(response, "gprs_gap", linger.gap);
+		}
+		else if (jsoneq(request, tparam, "gprs_reuses") == 0)
+		{
+			sim800l_get_linger_stats(appif->mod, &linger);
+			strjson_uint(response, "gprs_reuses", linger.reuses);
+		}
+		else if (jsoneq(request, tparam, "gprs_saved") == 0)
+		{
+			sim800l_get_linger_stats(appif->mod, &linger);
+			strjson_uint(response, "gprs_saved", linger.saved);
+		}
+		else if (jsoneq(request, tparam, "rf_mode") == 0)
+		{
+			sim800l_get_rf_stats(appif->mod, &rf);
+			strjson_uint(response, "rf_mode", rf.mode);
+		}
+		else if (jsoneq(request, tparam, "rf_wake") == 0)
+		{
+			sim800l_get_rf_stats(appif->mod, &rf);
+			strjson_uint(response, "rf_wake", rf.wake);
+		}
+		else if (jsoneq(request, tparam, "rf_wake_off") == 0)
+		{
+			sim800l_get_rf_stats(appif->mod, &rf);
+			strjson_uint(response, "rf_wake_off", rf.wake_off);
+		}
+		else if (jsoneq(request, tparam, "rf_interval") == 0)
+		{
+			sim800l_get_rf_stats(appif->mod, &rf);
+			strjson_uint(response, "rf_interval", rf.interval);
+		}
 		else if (jsoneq(request, tparam, "tamper") == 0)
 			return -1; // TODO
 		else
@@ -249,6 +343,8 @@ static int parse(struct appiface *appif, const char *request, char *response)
 	}
 	else if (jsoneq(request, tcmd, "save") == 0)
 	{
+		mqueue_flush_all();
+
 		vTaskSuspendAll();
 		params_set(&appif->uparams);
 
@@ -256,6 +352,7 @@ static int parse(struct appiface *appif, const char *request, char *response)
 	}
 	else if (jsoneq(request, tcmd, "reset") == 0)
 	{
+		mqueue_flush_all();
 		NVIC_SystemReset(); // --> RESET
 	}
 
@@ -54,9 +54,7 @@
 /* Private define ------------------------------------------------------------*/
 /* USER CODE BEGIN PD */
 
-#define UART_BUFFER_SIZE \
-	(SIM800L_UART_BUFFER_SIZE > SIFACE_UART_BUFFER_SIZE ? \
-	SIM800L_UART_BUFFER_SIZE : SIFACE_UART_BUFFER_SIZE)
+#define UART_BUFFER_SIZE SIFACE_UART_BUFFER_SIZE
 
 #define STACK_COLOR_WORD 0xACACACAC
 
@@ -76,6 +74,8 @@ I2C_HandleTypeDef hi2c2;
 IWDG_HandleTypeDef hiwdg;
 
 SPI_HandleTypeDef hspi2;
+DMA_HandleTypeDef hdma_spi2_rx;
+DMA_HandleTypeDef hdma_spi2_tx;
 
 UART_HandleTypeDef huart2;
 DMA_HandleTypeDef hdma_usart2_rx;
@@ -97,7 +97,6 @@ TimerHandle_t hz_timer_handle;
 
 volatile uint32_t timestamp;
 
-uint8_t ub_mod[UART_BUFFER_SIZE];
 uint8_t ub_sif[UART_BUFFER_SIZE];
 
 params_t params;
@@ -113,6 +112,7 @@ struct counter cnt;
 struct avoltage avlt;
 struct appiface appif;
 
+mqueue_t *samples;
 struct actual actual;
 struct sensors sens;
 struct ecounter ecnt;
@@ -159,18 +159,17 @@ void usb_cdc_tx_callback(void)
 
 void HAL_UARTEx_RxEventCallback(UART_HandleTypeDef *huart, uint16_t size)
 {
-	if (HAL_UARTEx_GetRxEventType(huart) == HAL_UART_RXEVENT_HT)
-		return;
-
 //	if (huart == &huart1)
 //	{
+//		if (HAL_UARTEx_GetRxEventType(huart) == HAL_UART_RXEVENT_HT)
+//			return;
 //		siface_rx_irq(&siface, (const char *) ub_sif, size);
 //		HAL_UARTEx_ReceiveToIdle_DMA(huart, ub_sif, UART_BUFFER_SIZE);
 //	}
 	if (huart == &huart2)
 	{
-		sim800l_irq(&mod, (const char *) ub_mod, size);
-		HAL_UARTEx_ReceiveToIdle_DMA(huart, ub_mod, UART_BUFFER_SIZE);
+		// Circular DMA: all events, no restart
+		sim800l_irq(&mod, size);
 	}
 }
 
@@ -182,7 +181,7 @@ void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
 //	}
 	if (huart == &huart2)
 	{
-		HAL_UARTEx_ReceiveToIdle_DMA(huart, ub_mod, UART_BUFFER_SIZE);
+		sim800l_rx_start(&mod);
 	}
 }
 
@@ -194,6 +193,24 @@ void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
 //	}
 }
 
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	if (hspi == &hspi2)
+		w25q_spi_irq(&mem.mem, W25Q_OK);
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	if (hspi == &hspi2)
+		w25q_spi_irq(&mem.mem, W25Q_OK);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+	if (hspi == &hspi2)
+		w25q_spi_irq(&mem.mem, W25Q_ERR_SPI);
+}
+
 void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
 {
 	if (!init_done)
@@ -319,6 +336,8 @@ int main(void)
   appif.params = &params;
   appif.actual = &actual;
   appif.bl = &bl;
+  appif.mem = &mem;
+  appif.mod = &mod;
   memcpy(&appif.uparams, &params, sizeof(params));
 
   //
@@ -337,12 +356,12 @@ int main(void)
 
   //
   mqueue_init(&mem);
+  samples = mqueue_create_streams(SAMPLES_NUM, sizeof(struct item));
+  appif.samples = samples;
 
   // sens
   memset(&sens, 0, sizeof(sens));
-  sens.qtmp = mqueue_create(SENSORS_QUEUE_SECNUM);
-  sens.qhum = mqueue_create(SENSORS_QUEUE_SECNUM);
-  sens.qang = mqueue_create(SENSORS_QUEUE_SECNUM);
+  sens.samples = samples;
   sens.avlt = &avlt;
   sens.pot = &pot;
   sens.aht = &aht;
@@ -353,9 +372,7 @@ int main(void)
 
   // ecnt
   memset(&ecnt, 0, sizeof(ecnt));
-  ecnt.qec_avg = mqueue_create(SENSORS_QUEUE_SECNUM);
-  ecnt.qec_max = mqueue_create(SENSORS_QUEUE_SECNUM);
-  ecnt.qec_min = mqueue_create(SENSORS_QUEUE_SECNUM);
+  ecnt.samples = samples;
   ecnt.cnt = &cnt;
   ecnt.timestamp = &timestamp;
   ecnt.params = &params;
@@ -377,11 +394,12 @@ int main(void)
   sys.wdg = &hiwdg;
   sys.params = &params;
   sys.bl = &bl;
+  sys.mem = &mem;
 
   //
   /* todo: replace with USB */
   //HAL_UARTEx_ReceiveToIdle_DMA(&huart1, ub_sif, UART_BUFFER_SIZE);
-  HAL_UARTEx_ReceiveToIdle_DMA(&huart2, ub_mod, UART_BUFFER_SIZE);
+  sim800l_rx_start(&mod);
 
   /* USER CODE END 2 */
 
@@ -729,6 +747,12 @@ static void MX_DMA_Init(void)
   __HAL_RCC_DMA1_CLK_ENABLE();
 
   /* DMA interrupt init */
+  /* DMA1_Stream3_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Stream3_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Stream3_IRQn);
+  /* DMA1_Stream4_IRQn interrupt configuration */
+  HAL_NVIC_SetPriority(DMA1_Stream4_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Stream4_IRQn);
   /* DMA1_Stream5_IRQn interrupt configuration */
   HAL_NVIC_SetPriority(DMA1_Stream5_IRQn, 5, 0);
   HAL_NVIC_EnableIRQ(DMA1_Stream5_IRQn);
@@ -834,6 +858,12 @@ void task_default(void *argument)
   for(;;)
   {
     HAL_GPIO_TogglePin(LED_DB_GPIO_Port, LED_DB_Pin);
+
+    // Erase the next sectors of SPI FLASH queues in advance
+    mqueue_erase_ahead();
+    // Save the SPI FLASH wear counters every W25Q_S_WEAR_SAVE erases
+    w25q_s_wear_save(&mem, 0);
+
     osDelay(200);
   }
   /* USER CODE END 5 */
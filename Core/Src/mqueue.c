@@ -18,8 +18,6 @@ extern const uint32_t *_app_len;
 #define APP_LENGTH ((uint32_t) &_app_len)
 
 #define APP_END_ADDR (FWS_PAYLOAD_ADDR + APP_LENGTH)
-#define FIFO_SECTOR ((APP_END_ADDR + (W25Q_SECTOR_SIZE - 1)) / W25Q_SECTOR_SIZE)
-#define FIFO_ADDR (FIFO_SECTOR * W25Q_SECTOR_SIZE)
 
 static struct
 {
@@ -27,6 +25,8 @@ static struct
 	struct w25q_s *mem;
 	size_t address;
 	size_t msize;
+	struct w25q_geometry geo;
+	mqueue_t *list;
 } mqueue;
 
 
@@ -37,39 +37,57 @@ int mqueue_init(struct w25q_s *mem)
 	mqueue.mem = mem;
 	mqueue.mutex = xSemaphoreCreateMutex();
 
-	if (w25q_s_get_manufacturer_id(mqueue.mem) != FWS_WINBOND_MANUFACTURER_ID)
+	// Any memory with a known geometry (SFDP or a Winbond JEDEC ID)
+	w25q_s_get_geometry(mqueue.mem, &mqueue.geo);
+	if (!mqueue.geo.capacity)
 	{
 		mqueue.msize = 0;
 		return -1;
 	}
 
-	mqueue.address = FIFO_ADDR;
-	mqueue.msize = w25q_s_get_capacity(mqueue.mem);
+	// The first sector after the application
+	mqueue.address = APP_END_ADDR + mqueue.geo.sector_size - 1;
+	mqueue.address -= mqueue.address % mqueue.geo.sector_size;
+	mqueue.msize = w25q_s_get_capacity(mqueue.mem); // Without wear table
 
 	return 0;
 }
 
-inline static mqueue_t *create(size_t secnum)
+inline static mqueue_t *create(size_t secnum, size_t esize, size_t streams)
 {
-	size_t len = secnum * W25Q_SECTOR_SIZE;
+	size_t len = secnum * mqueue.geo.sector_size;
 	mqueue_t *q;
 	int ret;
 
-	if ((mqueue.address + len) > mqueue.msize)
+	if (!secnum || ((mqueue.address + len) > mqueue.msize))
 		return NULL;
 
-	q = pvPortMalloc(sizeof(mqueue_t));
+	// Stream cursors are placed right after the handle
+	q = pvPortMalloc(sizeof(mqueue_t) + streams * sizeof(struct mfifo_cursor));
 	if (!q)
 		return NULL;
 
-	ret = mfifo_init(&q->mfifo, mqueue.mem, W25Q_PAGE_SIZE, W25Q_SECTOR_SIZE,
-			sizeof(struct item), mqueue.address, secnum);
+	ret = mfifo_init(&q->mfifo, mqueue.mem, mqueue.geo.page_size,
+			mqueue.geo.sector_size, esize, mqueue.address, secnum);
 	if (ret)
 	{
 		vPortFree(q);
 		return NULL;
 	}
 
+	if (streams)
+		mfifo_streams(&q->mfifo, (struct mfifo_cursor *) (q + 1), streams);
+
+	// Keep data stored before reset (empty queue on failure)
+	mfifo_recover(&q->mfifo);
+
+#ifdef MQUEUE_WCACHE
+	mfifo_wcache(&q->mfifo, MQUEUE_WCACHE_AGE); // Direct writes on failure
+#endif /* MQUEUE_WCACHE */
+
+	q->next = mqueue.list;
+	mqueue.list = q;
+
 	mqueue.address += len;
 	return q;
 }
@@ -80,7 +98,37 @@ mqueue_t *mqueue_create(size_t secnum)
 	mqueue_t *q;
 
 	xSemaphoreTake(mqueue.mutex, portMAX_DELAY);
-	q = create(secnum);
+	q = create(secnum, sizeof(struct item), 0);
+	xSemaphoreGive(mqueue.mutex);
+
+	return q;
+}
+
+/******************************************************************************/
+mqueue_t *mqueue_create_records(size_t secnum, size_t len)
+{
+	mqueue_t *q;
+
+	xSemaphoreTake(mqueue.mutex, portMAX_DELAY);
+	q = create(secnum, MFIFO_RECORD_SIZE(len), 0);
+	xSemaphoreGive(mqueue.mutex);
+
+	return q;
+}
+
+/******************************************************************************/
+mqueue_t *mqueue_create_streams(size_t streams, size_t len)
+{
+	mqueue_t *q = NULL;
+
+	if (!streams)
+		return NULL;
+
+	// The rest of storage
+	xSemaphoreTake(mqueue.mutex, portMAX_DELAY);
+	if (mqueue.address < mqueue.msize)
+		q = create((mqueue.msize - mqueue.address) / mqueue.geo.sector_size,
+				MFIFO_RECORD_SIZE(len), streams);
 	xSemaphoreGive(mqueue.mutex);
 
 	return q;
@@ -94,6 +142,15 @@ int mqueue_set(mqueue_t *queue, const void *element)
 	return mfifo_set(&queue->mfifo, element);
 }
 
+/******************************************************************************/
+int mqueue_set_record(mqueue_t *queue, uint8_t type, const void *data,
+		size_t len)
+{
+	if (!queue)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+	return mfifo_set_record(&queue->mfifo, type, data, len);
+}
+
 /******************************************************************************/
 int mqueue_get(mqueue_t *queue, void *element)
 {
@@ -102,6 +159,55 @@ int mqueue_get(mqueue_t *queue, void *element)
 	return mfifo_get(&queue->mfifo, element);
 }
 
+/******************************************************************************/
+int mqueue_set_many(mqueue_t *queue, const void *elements, size_t num)
+{
+	if (!queue)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+	return mfifo_set_many(&queue->mfifo, elements, num);
+}
+
+/******************************************************************************/
+int mqueue_get_many(mqueue_t *queue, void *elements, size_t num)
+{
+	if (!queue)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+	return mfifo_get_many(&queue->mfifo, elements, num);
+}
+
+/******************************************************************************/
+int mqueue_peek(mqueue_t *queue, void *elements, size_t num)
+{
+	if (!queue)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+	return mfifo_peek(&queue->mfifo, elements, num);
+}
+
+/******************************************************************************/
+int mqueue_commit(mqueue_t *queue, size_t num)
+{
+	if (!queue)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+	return mfifo_commit(&queue->mfifo, num);
+}
+
+/******************************************************************************/
+int mqueue_peek_stream(mqueue_t *queue, uint8_t stream, void *records,
+		size_t num)
+{
+	if (!queue)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+	return mfifo_peek_stream(&queue->mfifo, stream, records, num);
+}
+
+/******************************************************************************/
+int mqueue_commit_stream(mqueue_t *queue, uint8_t stream, size_t num)
+{
+	if (!queue)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+	return mfifo_commit_stream(&queue->mfifo, stream, num);
+}
+
 /******************************************************************************/
 int mqueue_is_empty(mqueue_t *queue)
 {
@@ -109,3 +215,76 @@ int mqueue_is_empty(mqueue_t *queue)
 		return -MFIFO_ERR_INVALID_ARGUMENT;
 	return mfifo_is_empty(&queue->mfifo);
 }
+
+/******************************************************************************/
+int mqueue_count(mqueue_t *queue)
+{
+	if (!queue)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+	return mfifo_count(&queue->mfifo);
+}
+
+/******************************************************************************/
+int mqueue_count_stream(mqueue_t *queue, uint8_t stream)
+{
+	if (!queue)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+	return mfifo_count_stream(&queue->mfifo, stream);
+}
+
+/******************************************************************************/
+int mqueue_usage(mqueue_t *queue, struct mfifo_usage *usage)
+{
+	if (!queue)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+	return mfifo_usage(&queue->mfifo, usage);
+}
+
+/******************************************************************************/
+int mqueue_flush(mqueue_t *queue)
+{
+	if (!queue)
+		return -MFIFO_ERR_INVALID_ARGUMENT;
+	return mfifo_flush(&queue->mfifo);
+}
+
+/******************************************************************************/
+void mqueue_flush_all(void)
+{
+	for (mqueue_t *q = mqueue.list; q; q = q->next)
+		mfifo_flush(&q->mfifo);
+
+	// Before reset
+	w25q_s_wear_save(mqueue.mem, 1);
+}
+
+/******************************************************************************/
+void mqueue_flush_expired(void)
+{
+	for (mqueue_t *q = mqueue.list; q; q = q->next)
+		mfifo_flush_expired(&q->mfifo);
+}
+
+/******************************************************************************/
+// Erases one sector at most
+int mqueue_erase_ahead(void)
+{
+	for (mqueue_t *q = mqueue.list; q; q = q->next)
+	{
+		if (mfifo_erase_ahead(&q->mfifo) > 0)
+			return 1;
+	}
+
+	return 0;
+}
+
+/******************************************************************************/
+uint32_t mqueue_erase_sync(void)
+{
+	uint32_t num = 0;
+
+	for (mqueue_t *q = mqueue.list; q; q = q->next)
+		num += q->mfifo.erase_sync;
+
+	return num;
+}
@@ -20,7 +20,17 @@
 #include "mqueue.h"
 #include "ota.h"
 
-#define SENSORS_QUEUE_SECNUM 16
+// Sample record types, every type is a stream of the sample queue
+enum sample
+{
+	SAMPLE_COUNT = 0, // Counter [avg]
+	SAMPLE_COUNT_MIN,
+	SAMPLE_COUNT_MAX,
+	SAMPLE_TEMP,
+	SAMPLE_HUM,
+	SAMPLE_ANGLE,
+	SAMPLES_NUM
+};
 
 struct actual
 {
@@ -37,9 +47,7 @@ struct actual
 
 struct sensors
 {
-	mqueue_t *qtmp;
-	mqueue_t *qhum;
-	mqueue_t *qang;
+	mqueue_t *samples;
 
 	struct avoltage *avlt;
 	struct as5600 *pot;
@@ -53,9 +61,7 @@ struct sensors
 
 struct ecounter
 {
-	mqueue_t *qec_avg;
-	mqueue_t *qec_max;
-	mqueue_t *qec_min;
+	mqueue_t *samples;
 
 	struct counter *cnt;
 	volatile uint32_t *timestamp;
@@ -83,6 +89,7 @@ struct system
 
 	volatile struct bl_params *bl;
 	params_t *params;
+	struct w25q_s *mem;
 
 	size_t main_stack_size;
 };
@@ -28,7 +28,7 @@ extern struct logger logger;
 
 #define JSON_MAX_TOKENS 8
 
-#define MAX_QTY_FROM_QUEUE 4
+#define MAX_QTY_FROM_QUEUE 4 // Per stream
 
 #define NET_LEV_MIN -113
 
@@ -51,6 +51,13 @@ static const osThreadAttr_t attributes = {
   .priority = (osPriority_t) osPriorityNormal,
 };
 
+struct stream
+{
+	const char *key;
+	int num; // Items in the current request
+	struct item item[MAX_QTY_FROM_QUEUE];
+};
+
 struct netprms
 {
 	int32_t mcc;
@@ -60,6 +67,16 @@ struct netprms
 	int32_t lev;
 };
 
+// Sample streams (indexed by record type)
+static struct stream streams[SAMPLES_NUM] = {
+	[SAMPLE_COUNT] = {"count", 0}, /* Counter [avg] */
+	[SAMPLE_COUNT_MIN] = {"count_min", 0}, /* Counter [min] */
+	[SAMPLE_COUNT_MAX] = {"count_max", 0}, /* Counter [max] */
+	[SAMPLE_TEMP] = {"temp", 0}, /* Temperature */
+	[SAMPLE_HUM] = {"hum", 0}, /* Humidity */
+	[SAMPLE_ANGLE] = {"angle", 0}, /* Angle */
+};
+
 
 static void http_callback(int status, void *data)
 {
@@ -133,29 +150,49 @@ static int parse_json_time(const char *response, uint32_t *ts)
 	return 0;
 }
 
-static void sensor_base64(mqueue_t *queue, char *buf)
+/**
+ * @brief: Read stream records from queue (records stay in queue)
+ * @retval: Number of read records
+ */
+static int stream_read(mqueue_t *queue, uint8_t type, struct stream *stream)
 {
-	struct item item[MAX_QTY_FROM_QUEUE];
-	size_t enclen;
-	int i = 0;
+	uint8_t records[MAX_QTY_FROM_QUEUE * MQUEUE_RECORD_SIZE];
+	struct mfifo_record *record;
 	int ret;
 
-	for (;;)
-	{
-		if (i >= MAX_QTY_FROM_QUEUE)
-			break;
+	stream->num = 0;
 
-		ret = mqueue_get(queue, &item[i]);
-		if (ret == -MFIFO_ERR_INVALID_CRC)
+	// Nothing to read, storage is not scanned
+	if (mqueue_count_stream(queue, type) <= 0)
+		return 0;
+
+	// Records with invalid CRC are skipped
+	ret = mqueue_peek_stream(queue, type, records, MAX_QTY_FROM_QUEUE);
+	if (ret < 0)
+		ret = 0;
+
+	for (int i = 0; i < ret; i++)
+	{
+		record = (struct mfifo_record *) &records[i * MQUEUE_RECORD_SIZE];
+		if (record->len != sizeof(struct item))
 			continue;
-		if (ret)
-			break;
 
-		i++;
+		memcpy(&stream->item[stream->num], record->data, sizeof(struct item));
+		stream->num++;
 	}
 
-	base64_encode((unsigned char *) item, sizeof(struct item) * i, buf,
-			&enclen);
+	return ret;
+}
+
+/**
+ * @brief: Encode stream items
+ */
+static void sensor_base64(struct stream *stream, char *buf)
+{
+	size_t enclen;
+
+	base64_encode((unsigned char *) stream->item,
+			sizeof(struct item) * stream->num, buf, &enclen);
 	buf[enclen] = '\0';
 }
 
@@ -301,6 +338,7 @@ static void task(void *argument)
 	TickType_t period;
 	TickType_t updt;
 	TickType_t wake;
+	int taken[SAMPLES_NUM];
 	int voltage;
 	int avail;
 	int ret;
@@ -325,12 +363,14 @@ static void task(void *argument)
 	netscan.context = &netprms;
 
 	period = pdMS_TO_TICKS(app->params->period_app * 1000);
+	sim800l_rf_period(app->mod, app->params->period_app * 1000);
 	updt = xTaskGetTickCount();
 	wake = xTaskGetTickCount();
 
 	// >>>
 
 	// <- /api/time
+	sim800l_http_hint(app->mod, 0); // -> /api/info
 	while (proc_http_get_time(app, &get, hmac))
 		vTaskDelayUntil(&wake, period);
 
@@ -376,6 +416,7 @@ static void task(void *argument)
 	strjson_int(request, "cid", netprms.cid);
 	strjson_int(request, "lev", netprms.lev);
 
+	sim800l_http_hint(app->mod, 0); // -> /api/data
 	while (proc_http_post(app, &post, "/api/cnet"))
 		vTaskDelayUntil(&wake, period);
 
@@ -386,6 +427,7 @@ static void task(void *argument)
 			updt = xTaskGetTickCount();
 
 			// <- /api/time
+			sim800l_http_hint(app->mod, 0); // -> /api/data
 			while (proc_http_get_time(app, &get, hmac))
 				vTaskDelayUntil(&wake, period);
 		}
@@ -402,41 +444,31 @@ static void task(void *argument)
 		strjson_uint(request, "ticks", xTaskGetTickCount());
 		if (voltage)
 			strjson_int(request, "bat", voltage);
-		sensor_base64(app->ecnt->qec_avg, sensor); /* Counter [avg] */
-		if (*sensor)
-			strjson_str(request, "count", sensor);
-		sensor_base64(app->ecnt->qec_min, sensor); /* Counter [min] */
-		if (*sensor)
-			strjson_str(request, "count_min", sensor);
-		sensor_base64(app->ecnt->qec_max, sensor); /* Counter [max] */
-		if (*sensor)
-			strjson_str(request, "count_max", sensor);
-		sensor_base64(app->sens->qtmp, sensor); /* Temperature */
-		if (*sensor)
-			strjson_str(request, "temp", sensor);
-		sensor_base64(app->sens->qhum, sensor); /* Humidity */
-		if (*sensor)
-			strjson_str(request, "hum", sensor);
-		sensor_base64(app->sens->qang, sensor); /* Angle */
-		if (*sensor)
-			strjson_str(request, "angle", sensor);
+		for (int i = 0; i < SAMPLES_NUM; i++)
+		{
+			taken[i] = stream_read(app->sens->samples, i, &streams[i]);
+			sensor_base64(&streams[i], sensor);
+			if (*sensor)
+				strjson_str(request, streams[i].key, sensor);
+		}
 		strjson_int(request, "tamper", READ_TAMPER);
 
+		// Backlog is sent right away, otherwise in a period
+		ret = mqueue_count(app->sens->samples);
+		for (int i = 0; i < SAMPLES_NUM; i++)
+			ret -= taken[i];
+		sim800l_http_hint(app->mod,
+				ret > 0 ? 0 : app->params->period_app * 1000);
+
 		while (proc_http_post(app, &post, "/api/data"))
 			vTaskDelayUntil(&wake, period);
 
-		// Are all queues empty?
-		if (!mqueue_is_empty(app->ecnt->qec_avg))
-			continue;
-		if (!mqueue_is_empty(app->ecnt->qec_min))
-			continue;
-		if (!mqueue_is_empty(app->ecnt->qec_max))
-			continue;
-		if (!mqueue_is_empty(app->sens->qtmp))
-			continue;
-		if (!mqueue_is_empty(app->sens->qhum))
-			continue;
-		if (!mqueue_is_empty(app->sens->qang))
+		// Data was delivered: remove it from queue
+		for (int i = 0; i < SAMPLES_NUM; i++)
+			mqueue_commit_stream(app->sens->samples, i, taken[i]);
+
+		// Backlog: next request right away
+		if (mqueue_count(app->sens->samples) > 0)
 			continue;
 
 		blink();
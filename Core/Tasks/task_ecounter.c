@@ -70,7 +70,8 @@ static void task(void *argument)
 			// max
 			item.value = max;
 			item.timestamp = ts;
-			mqueue_set(ecnt->qec_max, &item);
+			mqueue_set_record(ecnt->samples, SAMPLE_COUNT_MAX, &item,
+					sizeof(item));
 
 			// min
 			if (min != COUNT_MIN_INIT)
@@ -78,7 +79,8 @@ static void task(void *argument)
 			else
 				item.value = 0;
 			item.timestamp = ts;
-			mqueue_set(ecnt->qec_min, &item);
+			mqueue_set_record(ecnt->samples, SAMPLE_COUNT_MIN, &item,
+					sizeof(item));
 
 			// avg
 			if (sumcnt)
@@ -86,7 +88,8 @@ static void task(void *argument)
 			else
 				item.value = 0;
 			item.timestamp = ts;
-			mqueue_set(ecnt->qec_avg, &item);
+			mqueue_set_record(ecnt->samples, SAMPLE_COUNT, &item,
+					sizeof(item));
 
 			min = COUNT_MIN_INIT;
 			max = 0;
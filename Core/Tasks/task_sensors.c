@@ -57,6 +57,8 @@ static void set_angle_offset(params_t *params, int32_t angle)
 
 	/* todo: log offset angle value */
 
+	mqueue_flush_all();
+
 	osDelay(500);
 	vTaskSuspendAll();
 	params_set(&uparams);
@@ -165,19 +167,22 @@ static void task(void *argument)
 		{
 			item.value = temperature;
 			item.timestamp = ts;
-			mqueue_set(sens->qtmp, &item);
+			mqueue_set_record(sens->samples, SAMPLE_TEMP, &item,
+					sizeof(item));
 		}
 		if (drdy & DRDY_HUM)
 		{
 			item.value = humidity;
 			item.timestamp = ts;
-			mqueue_set(sens->qhum, &item);
+			mqueue_set_record(sens->samples, SAMPLE_HUM, &item,
+					sizeof(item));
 		}
 		if (drdy & DRDY_ANG)
 		{
 			item.value = angle_wo;
 			item.timestamp = ts;
-			mqueue_set(sens->qang, &item);
+			mqueue_set_record(sens->samples, SAMPLE_ANGLE, &item,
+					sizeof(item));
 		}
 
 		if (sens->events)
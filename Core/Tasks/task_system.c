@@ -62,6 +62,38 @@ static void info_base(struct system *sys)
 
 	utoa(sys->params->offset_angle, temp, 10);
 	print_info_str(&logger, "PARAMS", "angle_offset", temp);
+
+	utoa(mqueue_erase_sync(), temp, 10);
+	print_info_str(&logger, "MQUEUE", "erase_sync", temp);
+}
+
+static void info_storage(struct system *sys)
+{
+	struct w25q_stats stats;
+	uint32_t hits, misses;
+	char temp[16];
+
+	if (w25q_s_get_stats(sys->mem, &stats))
+		return;
+	if (w25q_s_get_cache_stats(sys->mem, &hits, &misses))
+		return;
+
+	utoa(stats.reads, temp, 10);
+	print_info_str(&logger, "W25Q", "reads", temp);
+	utoa(stats.read_bytes, temp, 10);
+	print_info_str(&logger, "W25Q", "read_bytes", temp);
+	utoa(stats.programs, temp, 10);
+	print_info_str(&logger, "W25Q", "programs", temp);
+	utoa(stats.program_bytes, temp, 10);
+	print_info_str(&logger, "W25Q", "program_bytes", temp);
+	utoa(stats.erases, temp, 10);
+	print_info_str(&logger, "W25Q", "erases", temp);
+	utoa(stats.busy_ms, temp, 10);
+	print_info_str(&logger, "W25Q", "busy_ms", temp);
+	utoa(hits, temp, 10);
+	print_info_str(&logger, "W25Q", "cache_hits", temp);
+	utoa(misses, temp, 10);
+	print_info_str(&logger, "W25Q", "cache_misses", temp);
 }
 
 static void info_mem(void)
@@ -105,8 +137,12 @@ static void task(void *argument)
 			ticks = xTaskGetTickCount();
 			info_base(sys);
 			info_mem();
+			info_storage(sys);
 		}
 
+		// Write old items from RAM to SPI FLASH
+		mqueue_flush_expired();
+
 		// 32kHz / 128 / 4095 -> 16,38 seconds
 		HAL_IWDG_Refresh(sys->wdg);
 
@@ -0,0 +1,119 @@
+/*
+ * SIM800L response parsing throughput: synthetic transcripts of an HTTP GET
+ * response read and a 12-cell network scan, built in the SIM800L response
+ * format at start, delivered by the modem stand-in in random chunks, host
+ * CPU time per transcript pair
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "modem.h"
+
+#include "sim800l.c"
+
+#define ROUNDS 20000
+#define BODY   1000
+#define CELLS  12
+
+static struct sim800l mod;
+static UART_HandleTypeDef uart;
+static GPIO_TypeDef gpio;
+
+static char tr_read[2 * BODY];
+static char tr_scan[CELLS * 128];
+static int n_read;
+static int n_scan;
+
+
+static void scan_cb(int status, void *data)
+{
+}
+
+static double now_s(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static void clear(void)
+{
+	modem_drain();
+	mod.rxtail = mod.rxhead;
+	mod.llen = 0;
+	mod.payload = 0;
+}
+
+/*
+ * @brief: Build the transcripts: a 1000 B body of repeated JSON lines, cells
+ * with distinct levels and ids
+ */
+static void build(void)
+{
+	const char *line = "{\"ts\":1736163757,\"cfg\":[1,2,3]}\r\n";
+	char body[BODY + 1];
+
+	for (int i = 0; i < BODY; i++)
+		body[i] = line[i % strlen(line)];
+	body[BODY] = '\0';
+	n_read = sprintf(tr_read, "\r\n+HTTPREAD: %d\r\n%s\r\nOK\r\n", BODY, body);
+
+	for (int i = 0; i < CELLS; i++)
+		n_scan += sprintf(tr_scan + n_scan, "\r\nOperator:\"25001\",MCC:250,"
+				"MNC:01,Rxlev:%d,Cellid:%04X,Arfcn:%d,Lac:1D3F,Bsic:%d",
+				20 + i, 0x1A00 + i, 10 + i, i);
+	n_scan += sprintf(tr_scan + n_scan, "\r\n\r\nOK\r\n");
+}
+
+int main(void)
+{
+	const size_t chunks[] = {8, 32, 128};
+	struct sim800l_netscan scan;
+	struct sim800l_http http;
+	double bytes;
+	double t;
+
+	build();
+	sim800l_init(&mod, &uart, &gpio, 1, "apn");
+	modem_attach(&mod, &uart);
+	sim800l_rx_start(&mod);
+
+	printf("%d B +HTTPREAD and %d B CNETSCAN synthetic transcripts, "
+			"%d rounds:\n",
+			n_read, n_scan, ROUNDS);
+	for (size_t c = 0; c < sizeof(chunks) / sizeof(chunks[0]); c++)
+	{
+		modem.chunk = chunks[c];
+		srand(1);
+		bytes = 0;
+		t = now_s();
+
+		for (int k = 0; k < ROUNDS; k++)
+		{
+			memset(&http, 0, sizeof(http));
+			mod.task.data = &http;
+			clear();
+			modem_send(tr_read, n_read);
+			host_assert(parse_http_read(&mod, 1000000) == BODY);
+			vPortFree(http.response);
+
+			mod.task.data = &scan;
+			mod.task.callback = scan_cb;
+			clear();
+			modem_send(tr_scan, n_scan);
+			host_assert(!parse_net_scan(&mod, 1000000));
+
+			bytes += n_read + n_scan;
+		}
+
+		t = now_s() - t;
+		printf("  chunks up to %3zu B: %6.1f MB/s, %6.2f us per pair\n",
+				chunks[c], bytes / t / 1e6, t / ROUNDS * 1e6);
+	}
+	host_assert(!mod.overruns);
+
+	return 0;
+}
@@ -0,0 +1,332 @@
+/*
+ * Storage benchmark: elements stored, read and drained through mfifo and
+ * w25q_s on the emulated W25Q64JV, per element cost in SPI bytes, page
+ * programs, erases, busy polls and simulated time
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "host.h"
+#include "w25q_emu.h"
+#include "w25q_s.h"
+#include "mqueue.h"
+
+#define ELEMENTS  2000
+#define BATCH     16
+#define FIFO_ADDR 0x80000
+#define FIFO_SECS 16
+#define STREAMS   6
+#define PEEK_MAX  4 // Records per stream and request, see task_app.c
+#define PERIODS   100
+#define PERIOD_S  60 // Sensor period, samples of all streams come together
+#define IMAGE_ADDR 0x100000
+#define IMAGE_SIZE (480 * 1024) // _app_len
+#define IMAGE_PART 512          // FILE_PART_SIZE of ota.c
+#define IMAGE_OLD  128          // FLASH_WRITE_SIZE of ota.c before
+
+static struct w25q_emu emu;
+static struct w25q_s smem;
+static SPI_HandleTypeDef spi;
+static GPIO_TypeDef gpio;
+
+struct snap
+{
+	struct w25q_emu_stats stats;
+	uint64_t ns;
+};
+
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	w25q_spi_irq(&smem.mem, W25Q_OK);
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	w25q_spi_irq(&smem.mem, W25Q_OK);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+	w25q_spi_irq(&smem.mem, W25Q_ERR_SPI);
+}
+
+static void begin(struct snap *s)
+{
+	s->stats = emu.stats;
+	s->ns = host_ns();
+}
+
+static void report(const char *name, const struct snap *s, size_t n)
+{
+	const struct w25q_emu_stats *a = &s->stats;
+	const struct w25q_emu_stats *b = &emu.stats;
+
+	host_assert(n);
+	printf("%-22s %6zu %9.1f %8.3f %9.4f %8.2f %9.1f\n", name, n,
+			(double) (b->spi_bytes - a->spi_bytes) / n,
+			(double) (b->programs - a->programs) / n,
+			(double) (b->erases - a->erases) / n,
+			(double) (b->polls - a->polls) / n,
+			(double) (host_ns() - s->ns) / 1000 / n);
+}
+
+static void record(struct mfifo_record *r, uint8_t type, uint32_t v)
+{
+	struct item item = {.value = v, .timestamp = v * 60};
+
+	memset(r, 0xFF, MQUEUE_RECORD_SIZE);
+	r->type = type;
+	r->len = sizeof(item);
+	memcpy(r->data, &item, sizeof(item));
+}
+
+static uint32_t value(const uint8_t *r)
+{
+	struct item item;
+
+	memcpy(&item, ((const struct mfifo_record *) r)->data, sizeof(item));
+	return item.value;
+}
+
+static void fifo_init(struct mfifo *f)
+{
+	host_assert(!w25q_s_erase(&smem, FIFO_ADDR,
+			FIFO_SECS * W25Q_SECTOR_SIZE));
+	host_assert(!mfifo_init(f, &smem, W25Q_PAGE_SIZE, W25Q_SECTOR_SIZE,
+			MQUEUE_RECORD_SIZE, FIFO_ADDR, FIFO_SECS));
+	host_assert(!mfifo_recover(f));
+}
+
+static void bench_fifo(void)
+{
+	uint8_t buf[BATCH * MQUEUE_RECORD_SIZE];
+	struct snap s;
+	struct mfifo f;
+	uint32_t next = 0;
+	int ret;
+
+	fifo_init(&f);
+
+	begin(&s);
+	for (uint32_t i = 0; i < ELEMENTS; i++)
+	{
+		record((struct mfifo_record *) buf, 0, i);
+		host_assert(!mfifo_set(&f, buf));
+	}
+	report("mfifo_set", &s, ELEMENTS);
+
+	begin(&s);
+	for (uint32_t i = 0; i < ELEMENTS; i++)
+	{
+		host_assert(!mfifo_get(&f, buf));
+		host_assert(value(buf) == next++);
+	}
+	report("mfifo_get", &s, ELEMENTS);
+
+	begin(&s);
+	for (uint32_t i = 0; i < ELEMENTS; i += BATCH)
+	{
+		for (size_t j = 0; j < BATCH; j++)
+			record((struct mfifo_record *) &buf[j * MQUEUE_RECORD_SIZE], 0,
+					i + j);
+		host_assert(mfifo_set_many(&f, buf, BATCH) == BATCH);
+	}
+	report("mfifo_set_many(16)", &s, ELEMENTS);
+
+	next = 0;
+	begin(&s);
+	for (uint32_t i = 0; i < ELEMENTS; i += BATCH)
+	{
+		host_assert(mfifo_get_many(&f, buf, BATCH) == BATCH);
+		for (size_t j = 0; j < BATCH; j++)
+			host_assert(value(&buf[j * MQUEUE_RECORD_SIZE]) == next++);
+	}
+	report("mfifo_get_many(16)", &s, ELEMENTS);
+
+	for (uint32_t i = 0; i < ELEMENTS; i++)
+	{
+		record((struct mfifo_record *) buf, 0, i);
+		host_assert(!mfifo_set(&f, buf));
+	}
+
+	// Drain as uploads do: peek, send, commit
+	next = 0;
+	begin(&s);
+	while ((ret = mfifo_peek(&f, buf, BATCH)) > 0)
+	{
+		for (int j = 0; j < ret; j++)
+			host_assert(value(&buf[j * MQUEUE_RECORD_SIZE]) == next++);
+		host_assert(!mfifo_commit(&f, ret));
+	}
+	host_assert(next == ELEMENTS);
+	report("mfifo_peek+commit(16)", &s, ELEMENTS);
+}
+
+/*
+ * @brief: Sensor samples stored directly or through the write cache, the
+ * cache is flushed once its oldest record is older than "age" as
+ * task_system.c does every second
+ */
+static void bench_wcache(const char *name, TickType_t age)
+{
+	struct mfifo_cursor c[STREAMS];
+	uint8_t buf[PEEK_MAX * MQUEUE_RECORD_SIZE];
+	size_t staged = 0;
+	struct item item;
+	struct snap s;
+	struct mfifo f;
+	size_t n = 0;
+	int ret;
+
+	host_assert(!w25q_s_erase(&smem, FIFO_ADDR,
+			FIFO_SECS * W25Q_SECTOR_SIZE));
+	host_assert(!mfifo_init(&f, &smem, W25Q_PAGE_SIZE, W25Q_SECTOR_SIZE,
+			MQUEUE_RECORD_SIZE, FIFO_ADDR, FIFO_SECS));
+	host_assert(!mfifo_streams(&f, c, STREAMS));
+	host_assert(!mfifo_recover(&f));
+	if (age)
+		host_assert(!mfifo_wcache(&f, age));
+
+	begin(&s);
+	for (uint32_t p = 0; p < PERIODS; p++)
+	{
+		for (uint8_t st = 0; st < STREAMS; st++)
+		{
+			item.value = p;
+			item.timestamp = p * PERIOD_S;
+			host_assert(!mfifo_set_record(&f, st, &item, sizeof(item)));
+		}
+
+		for (uint32_t t = 0; t < PERIOD_S; t++)
+		{
+			if (f.staged > staged)
+				staged = f.staged;
+			osDelay(1000);
+			mfifo_flush_expired(&f);
+		}
+	}
+	// Time of the work only
+	s.ns += (uint64_t) PERIODS * PERIOD_S * 1000000000;
+	report(name, &s, PERIODS * STREAMS);
+	printf("%-22s %6zu records at most in RAM\n", "", staged);
+
+	for (uint8_t st = 0; st < STREAMS; st++)
+	{
+		while ((ret = mfifo_peek_stream(&f, st, buf, PEEK_MAX)) > 0)
+		{
+			host_assert(!mfifo_commit_stream(&f, st, ret));
+			n += ret;
+		}
+	}
+	host_assert(n == PERIODS * STREAMS);
+
+	vSemaphoreDelete(f.mutex);
+	vSemaphoreDelete(f.emutex);
+	vPortFree(f.buf);
+	vPortFree(f.wcbuf);
+}
+
+/*
+ * @brief: Store an OTA image as ota.c receives it, in parts
+ * @param piece: Size of one write call
+ */
+static void bench_image(const char *name, uint32_t piece)
+{
+	static uint8_t part[IMAGE_PART];
+	const struct w25q_emu_stats *b = &emu.stats;
+	struct snap s;
+
+	host_assert(!w25q_s_erase(&smem, IMAGE_ADDR, IMAGE_SIZE));
+	for (size_t i = 0; i < sizeof(part); i++)
+		part[i] = i ^ 0x5A;
+
+	begin(&s);
+	for (uint32_t addr = 0; addr < IMAGE_SIZE; addr += IMAGE_PART)
+	{
+		for (uint32_t off = 0; off < IMAGE_PART; off += piece)
+			host_assert(!w25q_s_write_buffer(&smem, IMAGE_ADDR + addr + off,
+					&part[off], piece));
+	}
+
+	printf("%-22s %6u programs %6u commands %6u polls %8.1f ms\n", name,
+			b->programs - s.stats.programs, b->commands - s.stats.commands,
+			b->polls - s.stats.polls, (double) (host_ns() - s.ns) / 1000000);
+	host_assert(!memcmp(&emu.mem[IMAGE_ADDR + IMAGE_SIZE - IMAGE_PART], part,
+			IMAGE_PART));
+}
+
+static void bench_mqueue(void)
+{
+	uint8_t buf[PEEK_MAX * MQUEUE_RECORD_SIZE];
+	uint32_t next[STREAMS] = {0};
+	struct item item;
+	struct snap s;
+	mqueue_t *q;
+	size_t n = 0;
+	int ret;
+
+	host_assert(!mqueue_init(&smem));
+	q = mqueue_create_streams(STREAMS, sizeof(struct item));
+	host_assert(q);
+
+	// One sample per stream and sensor period
+	begin(&s);
+	for (uint32_t i = 0; i < ELEMENTS; i++)
+	{
+		item.value = i / STREAMS;
+		item.timestamp = i;
+		host_assert(!mqueue_set_record(q, i % STREAMS, &item, sizeof(item)));
+	}
+	mqueue_flush(q);
+	report("mqueue_set_record", &s, ELEMENTS);
+
+	begin(&s);
+	for (uint8_t st = 0; st < STREAMS; st++)
+	{
+		while ((ret = mqueue_peek_stream(q, st, buf, PEEK_MAX)) > 0)
+		{
+			for (int j = 0; j < ret; j++)
+				host_assert(value(&buf[j * MQUEUE_RECORD_SIZE]) ==
+						next[st]++);
+			host_assert(!mqueue_commit_stream(q, st, ret));
+			n += ret;
+		}
+	}
+	host_assert(n == ELEMENTS);
+	report("mqueue_peek_stream(4)", &s, ELEMENTS);
+}
+
+static void task(void *arg)
+{
+	bench_fifo();
+	bench_wcache("set_record direct", 0);
+	bench_wcache("set_record wcache(5s)", pdMS_TO_TICKS(5000));
+	bench_mqueue();
+
+	printf("480 KB OTA image:\n");
+	bench_image("128 B writes (before)", IMAGE_OLD);
+	bench_image("512 B write_buffer", IMAGE_PART);
+}
+
+int main(void)
+{
+	w25q_emu_init(&emu, 8 * 1024 * 1024);
+	host_spi_attach(&spi, &emu);
+
+	// As main() does before the scheduler starts
+	w25q_s_init(&smem, &spi, &gpio, 0);
+
+	printf("%-22s %6s %9s %8s %9s %8s %9s\n", "operation", "n", "spi B/el",
+			"prog/el", "erase/el", "polls/el", "us/el");
+	host_task("bench", osPriorityNormal, task, NULL, 0);
+	host_run();
+
+	printf("driver errors: busy %u, no_wel %u, erase_reads %u\n",
+			emu.stats.busy, emu.stats.no_wel, emu.stats.erase_reads);
+	host_assert(!emu.stats.busy && !emu.stats.no_wel);
+
+	w25q_emu_free(&emu);
+	return 0;
+}
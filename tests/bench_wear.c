@@ -0,0 +1,260 @@
+/*
+ * Wear of the memory over the product life: the sample queue at the default
+ * sensor and application periods, monthly OTA updates and the saves of the
+ * wear table, simulated for DAYS and extrapolated to CYCLES erases of the
+ * most worn sector of every region. The OTA staging area is compared with
+ * and without wear leveling (FWS_PAYLOAD_SHIFT).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "w25q_emu.h"
+#include "w25q_s.h"
+#include "mqueue.h"
+#include "fws.h"
+
+#define CAPACITY (4 * 1024 * 1024)
+#define DAYS     180
+#define SENSOR_S 60  // period_sen
+#define APP_S    300 // period_app, the queue is read
+#define STREAMS  6   // SAMPLES_NUM, one record each per sensor period
+#define PEEK_MAX 8
+#define OTA_DAYS 30
+#define UPDATES  120 // Ten years of monthly updates
+#define CYCLES   100000
+
+#define PERIODS_DAY (24 * 60 * 60 / SENSOR_S)
+
+extern const uint32_t *_app_len;
+#define APP_LENGTH ((uint32_t) (uintptr_t) &_app_len)
+
+struct region
+{
+	const char *name;
+	uint32_t start;
+	uint32_t end;
+};
+
+static struct w25q_emu emu;
+static struct w25q_s smem;
+static SPI_HandleTypeDef spi;
+static GPIO_TypeDef gpio;
+
+// Image sizes of successive updates
+static const uint32_t images[] = {
+	236 * 1024, 284 * 1024, 312 * 1024, 352 * 1024,
+};
+
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	w25q_spi_irq(&smem.mem, W25Q_OK);
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	w25q_spi_irq(&smem.mem, W25Q_OK);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+	w25q_spi_irq(&smem.mem, W25Q_ERR_SPI);
+}
+
+/*
+ * @brief: Erase the header and the place of an image as ota_task() does
+ * @param level: Place the image as mem_place() with FWS_PAYLOAD_SHIFT, the
+ * payload wraps around the end of the staging area
+ */
+static void stage(struct w25q_s *s, uint32_t size, int level)
+{
+	uint32_t shift = 0;
+	uint32_t len;
+
+	if (level)
+		shift = w25q_s_wear_least(s, FWS_PAYLOAD_ADDR, APP_LENGTH, size,
+				FWS_SHIFT_UNIT) - FWS_PAYLOAD_ADDR;
+
+	size += (W25Q_SECTOR_SIZE - size % W25Q_SECTOR_SIZE) % W25Q_SECTOR_SIZE;
+	len = size < APP_LENGTH - shift ? size : APP_LENGTH - shift;
+	host_assert(!w25q_s_erase(s, FWS_PAYLOAD_ADDR + shift, len));
+	if (size > len)
+		host_assert(!w25q_s_erase(s, FWS_PAYLOAD_ADDR, size - len));
+	host_assert(!w25q_s_sector_erase(s, FWS_HEADER_ADDR));
+}
+
+static void wear_range(const struct w25q_emu *e, uint32_t start,
+		uint32_t end, uint32_t *min, uint32_t *max)
+{
+	*min = UINT32_MAX;
+	*max = 0;
+	for (uint32_t s = start / W25Q_SECTOR_SIZE; s < end / W25Q_SECTOR_SIZE;
+			s++)
+	{
+		if (e->wear[s] < *min)
+			*min = e->wear[s];
+		if (e->wear[s] > *max)
+			*max = e->wear[s];
+	}
+}
+
+/*
+ * @brief: OTA staging area after UPDATES updates, at the fixed address and
+ * at the least erased place
+ */
+static void bench_staging(void)
+{
+	static struct w25q_s s; // Its timer stays registered
+	struct w25q_emu e;
+	SPI_HandleTypeDef h;
+	uint32_t min;
+	uint32_t max;
+
+	printf("OTA staging, %u updates of %u..%u KB in %u KB:\n", UPDATES,
+			images[0] / 1024, images[3] / 1024, APP_LENGTH / 1024);
+	for (int level = 0; level < 2; level++)
+	{
+		w25q_emu_init(&e, CAPACITY);
+		host_spi_attach(&h, &e);
+		w25q_s_init(&s, &h, &gpio, 0);
+
+		for (uint32_t i = 0; i < UPDATES; i++)
+			stage(&s, images[i % 4], level);
+
+		wear_range(&e, FWS_PAYLOAD_ADDR, FWS_PAYLOAD_ADDR + APP_LENGTH,
+				&min, &max);
+		printf("  %-12s erases per sector min %4u max %4u\n",
+				level ? "least worn" : "fixed", min, max);
+		if (level)
+			host_assert(max < UPDATES);
+
+		w25q_emu_free(&e);
+	}
+}
+
+static void drain(mqueue_t *q)
+{
+	uint8_t buf[PEEK_MAX * MQUEUE_RECORD_SIZE];
+	int ret;
+
+	for (uint8_t st = 0; st < STREAMS; st++)
+	{
+		while ((ret = mqueue_peek_stream(q, st, buf, PEEK_MAX)) > 0)
+			host_assert(!mqueue_commit_stream(q, st, ret));
+		host_assert(ret == -MFIFO_ERR_EMPTY);
+	}
+}
+
+static void report(const struct region *r, const uint32_t *mid)
+{
+	uint32_t worst = r->start / W25Q_SECTOR_SIZE;
+	uint32_t total = 0;
+	double rate;
+
+	for (uint32_t s = r->start / W25Q_SECTOR_SIZE;
+			s < r->end / W25Q_SECTOR_SIZE; s++)
+	{
+		total += emu.wear[s];
+		if (emu.wear[s] > emu.wear[worst])
+			worst = s;
+	}
+
+	// Second half, after the queue went round
+	rate = (double) (emu.wear[worst] - mid[worst]) / (DAYS - DAYS / 2);
+	printf("%-12s %7u %8u %9u %11.3f", r->name,
+			(r->end - r->start) / W25Q_SECTOR_SIZE, total, emu.wear[worst],
+			rate);
+	if (rate > 0)
+		printf(" %12.0f\n", (CYCLES - emu.wear[worst]) / rate / 365);
+	else
+		printf(" %12s\n", "-");
+}
+
+/*
+ * @brief: The sample queue over the whole memory after the image
+ */
+static void bench_life(void *arg)
+{
+	uint32_t sectors = CAPACITY / W25Q_SECTOR_SIZE;
+	uint32_t *mid = calloc(sectors, sizeof(uint32_t));
+	struct w25q_s_wear_stats stats;
+	struct item item;
+	uint32_t updates = 0;
+	uint32_t queue;
+	mqueue_t *q;
+
+	host_assert(mid);
+	host_assert(!mqueue_init(&smem));
+	q = mqueue_create_streams(STREAMS, sizeof(struct item));
+	host_assert(q);
+
+	for (uint32_t p = 0; p < DAYS * PERIODS_DAY; p++)
+	{
+		if (p == DAYS / 2 * PERIODS_DAY)
+			memcpy(mid, emu.wear, sectors * sizeof(uint32_t));
+
+		for (uint8_t st = 0; st < STREAMS; st++)
+		{
+			item.value = p;
+			item.timestamp = p * SENSOR_S;
+			host_assert(!mqueue_set_record(q, st, &item, sizeof(item)));
+		}
+		if (p % (APP_S / SENSOR_S) == APP_S / SENSOR_S - 1)
+			drain(q);
+
+		// Default task
+		mqueue_erase_ahead();
+		w25q_s_wear_save(&smem, 0);
+
+		// Update and reset, the wear table is saved
+		if (p % (OTA_DAYS * PERIODS_DAY) == OTA_DAYS * PERIODS_DAY - 1)
+		{
+			stage(&smem, images[updates++ % 4], 1);
+			mqueue_flush_all();
+		}
+
+		vTaskDelay(pdMS_TO_TICKS(SENSOR_S * 1000));
+	}
+
+	queue = APP_LENGTH + FWS_PAYLOAD_ADDR;
+	queue += (W25Q_SECTOR_SIZE - queue % W25Q_SECTOR_SIZE) % W25Q_SECTOR_SIZE;
+	const struct region regions[] = {
+		{"header", FWS_HEADER_ADDR, FWS_PAYLOAD_ADDR},
+		{"staging", FWS_PAYLOAD_ADDR, FWS_PAYLOAD_ADDR + APP_LENGTH},
+		{"queue", queue, w25q_s_get_capacity(&smem)},
+		{"wear table", smem.wbase, CAPACITY},
+	};
+
+	printf("%u days, %u records of %u B per %u s, %u updates:\n", DAYS,
+			STREAMS, (unsigned) MQUEUE_RECORD_SIZE, SENSOR_S, updates);
+	printf("%-12s %7s %8s %9s %11s %12s\n", "region", "sectors", "erases",
+			"max", "max/day", "years to 100k");
+	for (size_t i = 0; i < sizeof(regions) / sizeof(regions[0]); i++)
+		report(&regions[i], mid);
+
+	// The counters of w25q_s agree with the memory
+	host_assert(!w25q_s_get_wear_stats(&smem, &stats));
+	printf("w25q_s counters: %u erases of %u B parts, max %u\n",
+			stats.total, stats.unit, stats.max);
+
+	free(mid);
+}
+
+int main(void)
+{
+	bench_staging();
+
+	w25q_emu_init(&emu, CAPACITY);
+	host_spi_attach(&spi, &emu);
+	w25q_s_init(&smem, &spi, &gpio, 0);
+
+	host_task("life", osPriorityNormal, bench_life, NULL, 0);
+	host_run();
+
+	host_assert(!emu.stats.busy && !emu.stats.no_wel);
+	w25q_emu_free(&emu);
+	return 0;
+}
@@ -0,0 +1,848 @@
+/*
+ * Host stand-ins for FreeRTOS and the STM32 HAL
+ */
+
+#include "host.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+
+#include "semphr.h"
+#include "timers.h"
+
+#include "w25q_emu.h"
+
+#define TASKS_MAX     16
+#define STACK_DEFAULT (256 * 1024)
+#define NO_TIME       UINT64_MAX
+
+enum task_state
+{
+	TASK_READY = 0,
+	TASK_BLOCKED,
+	TASK_DONE
+};
+
+struct host_task
+{
+	const char *name;
+	UBaseType_t prio;
+	UBaseType_t base; // Priority without inheritance
+	host_task_fn fn;
+	void *arg;
+	ucontext_t ctx;
+	void *stack;
+	int state;
+	uint64_t wake;
+	struct host_sem *sem; // Blocked on
+	int given;
+	uint64_t order;       // Ready or blocked since
+	int mutexes;          // Held
+};
+
+struct dma
+{
+	SPI_HandleTypeDef *spi;
+	int rx;
+	int active;
+	uint64_t at;
+};
+
+static struct
+{
+	uint64_t ns;
+	struct host_task *tasks[TASKS_MAX];
+	size_t ntasks;
+	struct host_task *current;
+	int running;
+	int stop;
+	ucontext_t sched;
+	int isr;
+	int crit;
+	int preempt;
+	uint64_t order;
+	struct host_timer *timers;
+	struct dma dma;
+	SPI_HandleTypeDef *spi;
+	struct w25q_emu *emu;
+	int spi_fail;
+} host;
+
+// Runs the code before the scheduler starts and the timer callbacks
+static struct host_task main_task = {.name = "main"};
+static struct host_task timer_task = {
+	.name = "Tmr Svc",
+	.prio = configTIMER_TASK_PRIORITY,
+	.base = configTIMER_TASK_PRIORITY
+};
+
+
+void host_fail(const char *file, int line, const char *what)
+{
+	fprintf(stderr, "%s:%d: %s (at %llu us)\n", file, line, what,
+			(unsigned long long) (host.ns / 1000));
+	abort();
+}
+
+uint64_t host_ns(void)
+{
+	return host.ns;
+}
+
+uint64_t host_us(void)
+{
+	return host.ns / 1000;
+}
+
+void host_advance(uint64_t ns)
+{
+	host.ns += ns;
+}
+
+static struct host_task *self(void)
+{
+	if (!host.running)
+		return &main_task;
+	if (host.current)
+		return host.current;
+	return &timer_task;
+}
+
+// Tasks blocked on timeouts wake up on tick boundaries
+static uint64_t deadline(TickType_t ticks)
+{
+	if (ticks == portMAX_DELAY)
+		return NO_TIME;
+	// The tick count wraps after 49.7 days, the virtual clock does not
+	return (host.ns / 1000000 + ticks) * 1000000;
+}
+
+/******************************************************************************/
+/* Scheduler                                                                  */
+/******************************************************************************/
+
+static void ready(struct host_task *t)
+{
+	t->state = TASK_READY;
+	t->sem = NULL;
+	t->order = ++host.order;
+}
+
+static struct host_task *pick(void)
+{
+	struct host_task *best = NULL;
+	struct host_task *t;
+
+	for (size_t i = 0; i < host.ntasks; i++)
+	{
+		t = host.tasks[i];
+		if (t->state != TASK_READY)
+			continue;
+		if (!best || t->prio > best->prio ||
+				(t->prio == best->prio && t->order < best->order))
+			best = t;
+	}
+
+	return best;
+}
+
+static void dma_fire(void)
+{
+	struct dma dma = host.dma;
+
+	host.dma.active = 0;
+	host.isr = 1;
+	if (dma.rx)
+		HAL_SPI_RxCpltCallback(dma.spi);
+	else
+		HAL_SPI_TxCpltCallback(dma.spi);
+	host.isr = 0;
+}
+
+static int dma_due(void)
+{
+	if (!host.dma.active || host.dma.at > host.ns)
+		return 0;
+
+	dma_fire();
+	return 1;
+}
+
+static void timeouts(void)
+{
+	struct host_task *t;
+
+	for (size_t i = 0; i < host.ntasks; i++)
+	{
+		t = host.tasks[i];
+		if (t->state == TASK_BLOCKED && t->wake <= host.ns)
+		{
+			t->given = 0;
+			ready(t);
+		}
+	}
+}
+
+// Timer callbacks due now, at the timer task priority
+static int timers_due(void)
+{
+	struct host_timer *tm;
+	int fired = 0;
+
+	for (tm = host.timers; tm; tm = tm->next)
+	{
+		if (!tm->active || tm->expiry > host.ns)
+			continue;
+
+		if (tm->reload)
+			tm->expiry += (uint64_t) tm->period * 1000000;
+		else
+			tm->active = 0;
+
+		host.current = &timer_task;
+		tm->callback(tm);
+		host.current = NULL;
+		fired = 1;
+	}
+
+	return fired;
+}
+
+static uint64_t next_event(void)
+{
+	uint64_t next = NO_TIME;
+	struct host_timer *tm;
+
+	if (host.dma.active)
+		next = host.dma.at;
+	for (tm = host.timers; tm; tm = tm->next)
+		if (tm->active && tm->expiry < next)
+			next = tm->expiry;
+	for (size_t i = 0; i < host.ntasks; i++)
+		if (host.tasks[i]->state == TASK_BLOCKED &&
+				host.tasks[i]->wake < next)
+			next = host.tasks[i]->wake;
+
+	return next;
+}
+
+static void deadlock(void)
+{
+	fprintf(stderr, "deadlock:");
+	for (size_t i = 0; i < host.ntasks; i++)
+		fprintf(stderr, " %s(%d)", host.tasks[i]->name,
+				host.tasks[i]->state);
+	fprintf(stderr, "\n");
+	host_fail(__FILE__, __LINE__, "no task can run");
+}
+
+static void trampoline(void)
+{
+	struct host_task *t = host.current;
+
+	t->fn(t->arg);
+	t->state = TASK_DONE;
+}
+
+static void switch_out(void)
+{
+	struct host_task *t = host.current;
+
+	swapcontext(&t->ctx, &host.sched);
+}
+
+/*
+ * @brief: Block the calling task until the semaphore is given to it or the
+ * wake time. Before the scheduler starts the clock runs to the next DMA
+ * completion instead.
+ * @retval: 1 - given, 0 - timeout
+ */
+static int block(struct host_sem *sem, uint64_t wake)
+{
+	struct host_task *t = host.current;
+	uint64_t next;
+
+	if (!host.running)
+	{
+		for (;;)
+		{
+			if (sem && sem->count)
+			{
+				sem->count--;
+				return 1;
+			}
+
+			next = host.dma.active ? host.dma.at : NO_TIME;
+			if (next > wake)
+			{
+				if (wake == NO_TIME)
+					host_fail(__FILE__, __LINE__, "blocked forever in main");
+				if (host.ns < wake)
+					host.ns = wake;
+				return 0;
+			}
+			if (host.ns < next)
+				host.ns = next;
+			dma_fire();
+		}
+	}
+
+	if (!t || t == &timer_task || host.isr)
+		host_fail(__FILE__, __LINE__, "blocking call outside of a task");
+
+	t->state = TASK_BLOCKED;
+	t->sem = sem;
+	t->wake = wake;
+	t->given = 0;
+	t->order = ++host.order;
+	switch_out();
+
+	return t->given;
+}
+
+static void preempt(struct host_task *woken)
+{
+	struct host_task *t = host.current;
+
+	if (!host.running || !t || t == &timer_task || host.isr ||
+			woken->prio <= t->prio)
+		return;
+
+	if (host.crit)
+	{
+		host.preempt = 1;
+		return;
+	}
+
+	ready(t);
+	switch_out();
+}
+
+void host_critical(int nest)
+{
+	host.crit += nest;
+	if (!host.crit && host.preempt && host.current &&
+			host.current != &timer_task)
+	{
+		host.preempt = 0;
+		ready(host.current);
+		switch_out();
+	}
+}
+
+/******************************************************************************/
+void host_reset(void)
+{
+	for (size_t i = 0; i < host.ntasks; i++)
+	{
+		free(host.tasks[i]->stack);
+		free(host.tasks[i]);
+	}
+
+	host.ns = 0;
+	host.ntasks = 0;
+	host.current = NULL;
+	host.running = 0;
+	host.isr = 0;
+	host.crit = 0;
+	host.preempt = 0;
+	host.timers = NULL;
+	host.dma.active = 0;
+}
+
+/******************************************************************************/
+TaskHandle_t host_task(const char *name, UBaseType_t prio, host_task_fn fn,
+		void *arg, size_t stack)
+{
+	struct host_task *t;
+
+	host_assert(host.ntasks < TASKS_MAX);
+
+	t = calloc(1, sizeof(*t));
+	host_assert(t);
+	t->name = name;
+	t->prio = prio;
+	t->base = prio;
+	t->fn = fn;
+	t->arg = arg;
+	if (!stack)
+		stack = STACK_DEFAULT;
+	t->stack = malloc(stack);
+	host_assert(t->stack);
+
+	getcontext(&t->ctx);
+	t->ctx.uc_stack.ss_sp = t->stack;
+	t->ctx.uc_stack.ss_size = stack;
+	t->ctx.uc_link = &host.sched;
+	makecontext(&t->ctx, trampoline, 0);
+
+	ready(t);
+	host.tasks[host.ntasks++] = t;
+	return t;
+}
+
+/******************************************************************************/
+void host_run(void)
+{
+	struct host_task *t;
+	uint64_t next;
+	size_t alive;
+
+	host.running = 1;
+	host.stop = 0;
+
+	while (!host.stop)
+	{
+		if (dma_due())
+			continue;
+		timeouts();
+
+		t = pick();
+		if ((!t || t->prio <= configTIMER_TASK_PRIORITY) && timers_due())
+			continue;
+
+		if (t)
+		{
+			host.current = t;
+			swapcontext(&host.sched, &t->ctx);
+			host.current = NULL;
+			continue;
+		}
+
+		alive = 0;
+		for (size_t i = 0; i < host.ntasks; i++)
+			if (host.tasks[i]->state != TASK_DONE)
+				alive++;
+		if (!alive)
+			break;
+
+		next = next_event();
+		if (next == NO_TIME)
+			deadlock();
+		if (host.ns < next)
+			host.ns = next;
+	}
+
+	for (size_t i = 0; i < host.ntasks; i++)
+	{
+		free(host.tasks[i]->stack);
+		free(host.tasks[i]);
+	}
+	host.ntasks = 0;
+	host.running = 0;
+	host.crit = 0;
+	host.preempt = 0;
+}
+
+/******************************************************************************/
+void host_stop(void)
+{
+	host.stop = 1;
+}
+
+/******************************************************************************/
+void host_spi_attach(SPI_HandleTypeDef *spi, struct w25q_emu *emu)
+{
+	host.spi = spi;
+	host.emu = emu;
+	host.dma.active = 0;
+}
+
+/******************************************************************************/
+void host_spi_fail(int fail)
+{
+	host.spi_fail = fail;
+}
+
+/******************************************************************************/
+/* FreeRTOS                                                                   */
+/******************************************************************************/
+
+BaseType_t xPortIsInsideInterrupt(void)
+{
+	return host.isr;
+}
+
+void *pvPortMalloc(size_t size)
+{
+	return malloc(size);
+}
+
+void vPortFree(void *ptr)
+{
+	free(ptr);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+	return host.ns / 1000000;
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+	return self();
+}
+
+BaseType_t xTaskGetSchedulerState(void)
+{
+	return host.running ? taskSCHEDULER_RUNNING : taskSCHEDULER_NOT_STARTED;
+}
+
+// 0 - yield to ready tasks of the same or a higher priority
+void vTaskDelay(TickType_t ticks)
+{
+	struct host_task *t = host.current;
+
+	if (ticks)
+	{
+		block(NULL, deadline(ticks));
+	}
+	else if (host.running && t && t != &timer_task && !host.isr &&
+			!host.crit)
+	{
+		ready(t);
+		switch_out();
+	}
+}
+
+osStatus_t osDelay(uint32_t ticks)
+{
+	vTaskDelay(ticks);
+	return osOK;
+}
+
+void vTaskSuspendAll(void)
+{
+	host_critical(1);
+}
+
+BaseType_t xTaskResumeAll(void)
+{
+	host_critical(-1);
+	return pdFALSE;
+}
+
+UBaseType_t uxTaskPriorityGet(TaskHandle_t task)
+{
+	return (task ? task : self())->prio;
+}
+
+void vTaskPrioritySet(TaskHandle_t task, UBaseType_t prio)
+{
+	struct host_task *t = task ? task : self();
+
+	// An inherited priority stays until the mutex is given, as in FreeRTOS
+	// only the base priority changes meanwhile
+	if (!t->mutexes || t->prio == t->base)
+		t->prio = prio;
+	t->base = prio;
+
+	// Lowered below a ready task
+	if (t == host.current && host.running && !host.isr)
+	{
+		struct host_task *r = pick();
+		if (r && r != t && r->prio > t->prio)
+		{
+			if (host.crit)
+			{
+				host.preempt = 1;
+				return;
+			}
+			ready(t);
+			switch_out();
+		}
+	}
+	else if (t->state == TASK_READY && host.current)
+	{
+		preempt(t);
+	}
+}
+
+/******************************************************************************/
+static struct host_sem *sem_init(struct host_sem *sem, UBaseType_t count,
+		UBaseType_t max, int mutex)
+{
+	if (!sem)
+		return NULL;
+
+	sem->count = count;
+	sem->max = max;
+	sem->mutex = mutex;
+	sem->holder = NULL;
+	return sem;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+	return sem_init(malloc(sizeof(struct host_sem)), 0, 1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buf)
+{
+	return sem_init(buf, 0, 1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+	return sem_init(malloc(sizeof(struct host_sem)), 1, 1, 1);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+	free(sem);
+}
+
+// A waiter timed out: the holder of this mutex only keeps the priority of the
+// remaining waiters
+static void inherit(struct host_sem *sem)
+{
+	struct host_task *h = sem->holder;
+	UBaseType_t prio;
+
+	if (!h || h->mutexes != 1)
+		return;
+
+	prio = h->base;
+	for (size_t i = 0; i < host.ntasks; i++)
+		if (host.tasks[i]->state == TASK_BLOCKED &&
+				host.tasks[i]->sem == sem && host.tasks[i]->prio > prio)
+			prio = host.tasks[i]->prio;
+	h->prio = prio;
+}
+
+static void hold(struct host_sem *sem, struct host_task *t)
+{
+	sem->holder = t;
+	t->mutexes++;
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t timeout)
+{
+	struct host_task *t = self();
+	int given;
+
+	if (sem->count)
+	{
+		sem->count--;
+		if (sem->mutex)
+			hold(sem, t);
+		return pdTRUE;
+	}
+
+	if (!timeout)
+		return pdFALSE;
+
+	if (sem->mutex && host.running && sem->holder &&
+			sem->holder->prio < t->prio)
+		sem->holder->prio = t->prio;
+
+	given = block(sem, deadline(timeout));
+	if (sem->mutex)
+	{
+		if (given && !host.running)
+			hold(sem, t);
+		else if (!given)
+			inherit(sem);
+	}
+
+	return given ? pdTRUE : pdFALSE;
+}
+
+static BaseType_t give(struct host_sem *sem, BaseType_t *woken)
+{
+	struct host_task *w = NULL;
+	struct host_task *t;
+
+	if (sem->mutex)
+	{
+		if (sem->holder)
+		{
+			sem->holder->mutexes--;
+			if (!sem->holder->mutexes)
+				sem->holder->prio = sem->holder->base;
+		}
+		sem->holder = NULL;
+	}
+
+	for (size_t i = 0; i < host.ntasks; i++)
+	{
+		t = host.tasks[i];
+		if (t->state != TASK_BLOCKED || t->sem != sem)
+			continue;
+		if (!w || t->prio > w->prio ||
+				(t->prio == w->prio && t->order < w->order))
+			w = t;
+	}
+
+	if (!w)
+	{
+		if (sem->count >= sem->max)
+			return pdFALSE;
+		sem->count++;
+		return pdTRUE;
+	}
+
+	w->given = 1;
+	ready(w);
+	if (sem->mutex)
+		hold(sem, w);
+	if (woken)
+		*woken = w->prio > self()->prio;
+	else
+		preempt(w);
+
+	return pdTRUE;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+	return give(sem, NULL);
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t *woken)
+{
+	BaseType_t w = pdFALSE;
+
+	return give(sem, woken ? woken : &w);
+}
+
+/******************************************************************************/
+TimerHandle_t xTimerCreateStatic(const char *name, TickType_t period,
+		UBaseType_t reload, void *id, TimerCallbackFunction_t callback,
+		StaticTimer_t *buf)
+{
+	struct host_timer *tm;
+
+	buf->period = period;
+	buf->reload = reload;
+	buf->id = id;
+	buf->callback = callback;
+	buf->active = 0;
+
+	for (tm = host.timers; tm; tm = tm->next)
+		if (tm == buf)
+			return buf;
+
+	buf->next = host.timers;
+	host.timers = buf;
+	return buf;
+}
+
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t timeout)
+{
+	timer->active = 1;
+	timer->expiry = deadline(timer->period);
+	return pdPASS;
+}
+
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t timeout)
+{
+	timer->active = 0;
+	return pdPASS;
+}
+
+void *pvTimerGetTimerID(TimerHandle_t timer)
+{
+	return timer->id;
+}
+
+/******************************************************************************/
+/* HAL                                                                        */
+/******************************************************************************/
+
+static uint64_t spi_ns(uint16_t size)
+{
+	return (uint64_t) size * 8 * 1000000000 / HOST_SPI_HZ;
+}
+
+uint32_t HAL_GetTick(void)
+{
+	return host.ns / 1000000;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state)
+{
+	if (host.emu)
+		w25q_emu_select(host.emu, state == GPIO_PIN_RESET);
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *spi, uint8_t *data,
+		uint16_t size, uint32_t timeout)
+{
+	if (spi != host.spi || host.dma.active || host.spi_fail)
+		return HAL_ERROR;
+
+	w25q_emu_xfer(host.emu, data, NULL, size);
+	host.ns += HOST_SPI_CALL_NS + spi_ns(size);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *spi, uint8_t *data,
+		uint16_t size, uint32_t timeout)
+{
+	if (spi != host.spi || host.dma.active || host.spi_fail)
+		return HAL_ERROR;
+
+	w25q_emu_xfer(host.emu, NULL, data, size);
+	host.ns += HOST_SPI_CALL_NS + spi_ns(size);
+	return HAL_OK;
+}
+
+static HAL_StatusTypeDef dma_start(SPI_HandleTypeDef *spi, uint8_t *data,
+		uint16_t size, int rx)
+{
+	if (spi != host.spi || host.dma.active)
+		return HAL_BUSY;
+	if (host.spi_fail)
+		return HAL_ERROR;
+
+	// Data moves now, the completion comes when the bytes are clocked out
+	if (rx)
+		w25q_emu_xfer(host.emu, NULL, data, size);
+	else
+		w25q_emu_xfer(host.emu, data, NULL, size);
+
+	host.ns += HOST_SPI_CALL_NS;
+	host.dma.spi = spi;
+	host.dma.rx = rx;
+	host.dma.at = host.ns + spi_ns(size);
+	host.dma.active = 1;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *spi, uint8_t *data,
+		uint16_t size)
+{
+	return dma_start(spi, data, size, 0);
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive_DMA(SPI_HandleTypeDef *spi, uint8_t *data,
+		uint16_t size)
+{
+	return dma_start(spi, data, size, 1);
+}
+
+HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef *spi)
+{
+	host.dma.active = 0;
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_DeInit(SPI_HandleTypeDef *spi)
+{
+	return HAL_OK;
+}
+
+__attribute__((weak)) void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *spi)
+{
+}
+
+__attribute__((weak)) void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *spi)
+{
+}
+
+__attribute__((weak)) void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *spi)
+{
+}
@@ -0,0 +1,72 @@
+/*
+ * Host stand-ins for FreeRTOS and the STM32 HAL
+ *
+ * Firmware sources run unchanged on the host over a virtual clock. Tasks are
+ * coroutines served by priority on one thread, so a run is deterministic:
+ * the running task is switched only when it blocks, or when it gives a
+ * semaphore to a higher priority task. The virtual clock advances by the
+ * time of every SPI transfer and, when all tasks are blocked, jumps to the
+ * next DMA completion, timer or timeout. Timer callbacks run at
+ * configTIMER_TASK_PRIORITY, DMA completions in interrupt context.
+ *
+ * Before host_run() the scheduler is not started, as in main() before
+ * osKernelStart(): code calling a blocking function runs on until its
+ * timeout with DMA completions served meanwhile.
+ */
+
+#ifndef HOST_H_
+#define HOST_H_
+
+#include <stdint.h>
+
+#include "stm32f4xx_hal.h"
+#include "cmsis_os.h"
+
+struct w25q_emu;
+
+// SPI2 of the board: APB1 42 MHz / 2
+#define HOST_SPI_HZ   21000000
+// HAL and driver time of a blocking SPI call
+#define HOST_SPI_CALL_NS 1000
+
+typedef void (*host_task_fn)(void *);
+
+// Virtual time since host_reset()
+uint64_t host_ns(void);
+uint64_t host_us(void);
+void host_advance(uint64_t ns);
+
+/*
+ * @brief: Drop all tasks, timers and pending transfers, restart the clock
+ */
+void host_reset(void);
+
+/*
+ * @brief: Create a task, it starts with host_run()
+ * @param prio: Task priority, e.g. osPriorityNormal
+ */
+TaskHandle_t host_task(const char *name, UBaseType_t prio, host_task_fn fn,
+		void *arg, size_t stack);
+
+/*
+ * @brief: Start the scheduler and return once every task has returned or
+ * host_stop() was called. Tasks still blocked are dropped.
+ */
+void host_run(void);
+void host_stop(void);
+
+/*
+ * @brief: Attach the memory emulator to an SPI handle, chip select writes to
+ * any pin go to it
+ */
+void host_spi_attach(SPI_HandleTypeDef *spi, struct w25q_emu *emu);
+// While set, SPI transfers fail with HAL_ERROR
+void host_spi_fail(int fail);
+
+// Abort with a message if the condition is false
+#define host_assert(cond) \
+	((cond) ? (void) 0 : host_fail(__FILE__, __LINE__, #cond))
+
+void host_fail(const char *file, int line, const char *what);
+
+#endif /* HOST_H_ */
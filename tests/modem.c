@@ -0,0 +1,397 @@
+/*
+ * SIM800L stand-in for the host tests of the driver
+ */
+
+#include "modem.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "queue.h"
+#include "semphr.h"
+
+#include "logger.h"
+
+struct host_queue
+{
+	UBaseType_t length;
+	UBaseType_t size;
+	UBaseType_t count;
+	UBaseType_t head;
+	uint8_t items[];
+};
+
+struct modem modem;
+struct logger logger;
+
+
+/*
+ * @brief: Pass time, modem_run() stops at its end
+ */
+static void advance(TickType_t ticks)
+{
+	modem.ticks += ticks;
+	if (modem.running && (int32_t) (modem.ticks - modem.end) >= 0)
+		longjmp(modem.stop, 1);
+}
+
+/******************************************************************************/
+void host_fail(const char *file, int line, const char *what)
+{
+	fprintf(stderr, "%s:%d: %s\n", file, line, what);
+	abort();
+}
+
+/******************************************************************************/
+void modem_attach(struct sim800l *mod, UART_HandleTypeDef *uart)
+{
+	modem.mod = mod;
+	modem.dma.Instance = &modem.stream;
+	uart->hdmarx = &modem.dma;
+	if (!modem.chunk)
+		modem.chunk = 64;
+}
+
+/******************************************************************************/
+void modem_send(const void *data, size_t len)
+{
+	modem.len = 0;
+	modem.sent = 0;
+	if (len > MODEM_OUT_SIZE)
+		len = MODEM_OUT_SIZE;
+	memcpy(modem.out, data, len);
+	modem.len = len;
+}
+
+/******************************************************************************/
+void modem_send_str(const char *str)
+{
+	modem_send(str, strlen(str));
+}
+
+/******************************************************************************/
+size_t modem_pending(void)
+{
+	return modem.len - modem.sent;
+}
+
+/*
+ * @brief: DMA transfer of n bytes to the ring with the half and full
+ * transfer events, NDTR is reloaded at the end of the ring
+ */
+static void dma(size_t n)
+{
+	struct sim800l *mod = modem.mod;
+	size_t half = SIM800L_RING_SIZE / 2;
+	size_t len;
+
+	while (n)
+	{
+		len = (modem.pos < half ? half : SIM800L_RING_SIZE) - modem.pos;
+		if (len > n)
+			len = n;
+
+		memcpy(&mod->ring[modem.pos], modem.out + modem.sent, len);
+		modem.sent += len;
+		modem.pos += len;
+		n -= len;
+
+		if (modem.pos == SIM800L_RING_SIZE)
+			modem.pos = 0;
+		modem.stream.NDTR = SIM800L_RING_SIZE - modem.pos;
+
+		if (modem.pos == half)
+			sim800l_irq(mod, half);
+		else if (!modem.pos)
+			sim800l_irq(mod, SIM800L_RING_SIZE);
+	}
+}
+
+/*
+ * @brief: Send a random chunk of the output, a tick passes
+ */
+static void chunk(void)
+{
+	size_t n = 1 + rand() % modem.chunk;
+
+	if (n > modem.len - modem.sent)
+		n = modem.len - modem.sent;
+
+	dma(n);
+	advance(1);
+
+	// Idle line, HAL reports the position (the ring end for 0)
+	if (modem.idle || modem.sent == modem.len)
+		sim800l_irq(modem.mod, modem.pos ? modem.pos : SIM800L_RING_SIZE);
+}
+
+/******************************************************************************/
+void modem_drain(void)
+{
+	while (modem.sent < modem.len)
+		chunk();
+}
+
+/******************************************************************************/
+void modem_set_ticks(TickType_t ticks)
+{
+	modem.ticks = ticks;
+}
+
+/******************************************************************************/
+void modem_at(const char *cmd, size_t len)
+{
+	static const char *ok[] = {
+		"ATE0", "AT+CREG=1", "AT+CMGDA=", "AT+CSCLK=", "AT+CFUN=0",
+		"AT+SAPBR=3,", "AT+SAPBR=0,", "AT+HTTPINIT", "AT+HTTPPARA=",
+		"AT+HTTPTERM", "AT+CNETSCAN=1",
+	};
+	char line[SIM800L_BUFFER_SIZE + 1];
+	char out[128];
+
+	memcpy(line, cmd, len);
+	line[len] = '\0';
+
+	if (!strcmp(line, "AT"))
+	{
+		modem_send_str("\r\nOK\r\n");
+	}
+	else if (!strcmp(line, "AT+CFUN=1"))
+	{
+		sprintf(out, "\r\nOK\r\n\r\n+CPIN: READY\r\n\r\nCall Ready\r\n"
+				"\r\nSMS Ready\r\n%s", modem.registered ?
+				"\r\n+CREG: 1\r\n" : "");
+		modem_send_str(out);
+	}
+	else if (!strcmp(line, "AT+CREG?"))
+	{
+		modem.polls++;
+		modem_send_str(modem.registered ? "\r\n+CREG: 1,1\r\n\r\nOK\r\n" :
+				"\r\n+CREG: 1,2\r\n\r\nOK\r\n");
+	}
+	else if (!strcmp(line, "AT+SAPBR=1,1"))
+	{
+		modem.attaches++;
+		modem_send_str("\r\nOK\r\n");
+	}
+	else if (!strcmp(line, "AT+SAPBR=2,1"))
+	{
+		modem_send_str("\r\n+SAPBR: 1,1,\"10.0.0.1\"\r\n\r\nOK\r\n");
+	}
+	else if (!strncmp(line, "AT+HTTPDATA=", 12))
+	{
+		modem_send_str("\r\nDOWNLOAD\r\n");
+	}
+	else if (!strncmp(line, "AT+HTTPACTION=", 14))
+	{
+		sprintf(out, "\r\nOK\r\n\r\n+HTTPACTION: %c,%d,2\r\n", line[14],
+				modem.http_status ? modem.http_status : 200);
+		modem_send_str(out);
+	}
+	else if (!strcmp(line, "AT+HTTPREAD"))
+	{
+		modem_send_str("\r\n+HTTPREAD: 2\r\n{}\r\nOK\r\n");
+	}
+	else if (!strcmp(line, "AT+HTTPSTATUS?"))
+	{
+		modem_send_str("\r\n+HTTPSTATUS: GET,0,0,0\r\n\r\nOK\r\n");
+	}
+	else if (!strcmp(line, "AT+CBC"))
+	{
+		modem_send_str("\r\n+CBC: 0,80,4000\r\n\r\nOK\r\n");
+	}
+	else if (!strcmp(line, "AT+CNETSCAN"))
+	{
+		modem_send_str("\r\nOperator:\"25001\",MCC:250,MNC:01,Rxlev:30,"
+				"Cellid:1A2B,Arfcn:10,Lac:0F0F,Bsic:1\r\n\r\nOK\r\n");
+	}
+	else
+	{
+		for (size_t i = 0; i < sizeof(ok) / sizeof(ok[0]); i++)
+		{
+			if (!strncmp(line, ok[i], strlen(ok[i])))
+			{
+				modem_send_str("\r\nOK\r\n");
+				return;
+			}
+		}
+
+		// The POST body after DOWNLOAD
+		modem_send_str(line[0] == '{' ? "\r\nOK\r\n" : "\r\nERROR\r\n");
+	}
+}
+
+/******************************************************************************/
+void modem_run(struct sim800l *mod, TickType_t ticks)
+{
+	modem.end = modem.ticks + ticks;
+	modem.running = 1;
+	if (!setjmp(modem.stop))
+		sim800l_task(mod);
+	modem.running = 0;
+}
+
+/******************************************************************************/
+/* FreeRTOS                                                                   */
+/******************************************************************************/
+void host_critical(int nest)
+{
+}
+
+void *pvPortMalloc(size_t size)
+{
+	return malloc(size);
+}
+
+void vPortFree(void *ptr)
+{
+	free(ptr);
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+	return modem.ticks;
+}
+
+osStatus_t osDelay(uint32_t ticks)
+{
+	advance(ticks);
+	return osOK;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+	struct host_sem *sem = calloc(1, sizeof(*sem));
+
+	if (sem)
+		sem->max = 1;
+	return sem;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+	if (sem->count >= sem->max)
+		return pdFALSE;
+	sem->count++;
+	return pdTRUE;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t *woken)
+{
+	return xSemaphoreGive(sem);
+}
+
+/*
+ * The driver blocks on its receive semaphore: the modem sends until an
+ * event gives it
+ */
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t timeout)
+{
+	if (modem.mod && sem == modem.mod->rxsem)
+		while (!sem->count && modem.sent < modem.len)
+			chunk();
+
+	if (sem->count)
+	{
+		sem->count--;
+		return pdTRUE;
+	}
+
+	if (timeout != portMAX_DELAY)
+		advance(timeout);
+	return pdFALSE;
+}
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t size)
+{
+	struct host_queue *q = calloc(1, sizeof(*q) + length * size);
+
+	if (q)
+	{
+		q->length = length;
+		q->size = size;
+	}
+	return q;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t q, void *item, TickType_t timeout)
+{
+	if (!q->count && modem.wait)
+		modem.wait(timeout);
+
+	if (!q->count)
+	{
+		if (timeout != portMAX_DELAY)
+			advance(timeout);
+		else if (modem.running)
+			longjmp(modem.stop, 1);
+		return pdFALSE;
+	}
+
+	memcpy(item, &q->items[q->head * q->size], q->size);
+	q->head = (q->head + 1) % q->length;
+	q->count--;
+	return pdTRUE;
+}
+
+BaseType_t xQueueSendToBack(QueueHandle_t q, const void *item,
+		TickType_t timeout)
+{
+	if (q->count == q->length)
+		return pdFALSE;
+
+	memcpy(&q->items[(q->head + q->count) % q->length * q->size], item,
+			q->size);
+	q->count++;
+	return pdTRUE;
+}
+
+UBaseType_t uxQueueMessagesWaiting(QueueHandle_t q)
+{
+	return q->count;
+}
+
+/******************************************************************************/
+/* HAL                                                                        */
+/******************************************************************************/
+void HAL_GPIO_WritePin(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state)
+{
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *uart,
+		const uint8_t *data, uint16_t size)
+{
+	if (modem.command && size)
+		modem.command((const char *) data, size - 1);
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *uart,
+		uint8_t *data, uint16_t size)
+{
+	modem.pos = 0;
+	modem.stream.NDTR = size;
+	return HAL_OK;
+}
+
+/******************************************************************************/
+/* Firmware                                                                   */
+/******************************************************************************/
+char *utoa(unsigned value, char *str, int base)
+{
+	sprintf(str, base == 16 ? "%x" : "%u", value);
+	return str;
+}
+
+int logger_add(struct logger *logger, const char *tag, bool full,
+		const char *buf, size_t len)
+{
+	return 0;
+}
+
+int logger_add_str(struct logger *logger, const char *tag, bool full,
+		const char *buf)
+{
+	return 0;
+}
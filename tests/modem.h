@@ -0,0 +1,107 @@
+/*
+ * SIM800L stand-in for the host tests of the driver
+ *
+ * The driver runs on the test thread (no host_run()), the tick count is
+ * virtual. Output queued by modem_send() is written into the ring by a
+ * simulated circular UART DMA whenever the driver blocks on its receive
+ * semaphore: a random chunk of up to modem.chunk bytes per block, with the
+ * half and full transfer events at the ring boundaries, as the interrupts
+ * come while the task does not run. The idle event follows when the output
+ * is sent, or after every chunk if modem.idle is set. Without output a
+ * block lasts its timeout.
+ *
+ * modem_run() runs sim800l_task() until it waits for a task with none
+ * queued, or for a given time.
+ *
+ * Tests include sim800l.c to reach its internals, host_assert() works
+ * without the rest of host.c.
+ */
+
+#ifndef MODEM_H_
+#define MODEM_H_
+
+#include <setjmp.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "stm32f4xx_hal.h"
+#include "cmsis_os.h"
+
+#include "host.h"
+#include "sim800l.h"
+
+#define MODEM_OUT_SIZE (16 * 1024)
+
+/*
+ * @param chunk: Largest DMA transfer between two blocks of the driver
+ * @param idle: Idle event after every chunk
+ * @param command: Called with every command sent by the driver (without
+ * '\r'), may queue the response
+ * @param wait: Called when the driver waits for a task with none queued,
+ * may advance the ticks and queue one. A wait without a timeout stops
+ * modem_run() if it does not.
+ */
+struct modem
+{
+	size_t chunk;
+	int idle;
+	void (*command)(const char *cmd, size_t len);
+	void (*wait)(TickType_t timeout);
+
+	// modem_at()
+	int registered;
+	int http_status; // Of AT+HTTPACTION, 0 - 200
+	uint32_t attaches; // AT+SAPBR=1,1
+	uint32_t polls; // AT+CREG?
+
+	// Internal
+	struct sim800l *mod;
+	uint8_t out[MODEM_OUT_SIZE];
+	size_t len;
+	size_t sent;
+	size_t pos; // DMA position in the ring
+	TickType_t ticks;
+	DMA_Stream_TypeDef stream;
+	DMA_HandleTypeDef dma;
+	int running;
+	TickType_t end;
+	jmp_buf stop;
+};
+
+extern struct modem modem;
+
+/*
+ * @brief: Attach the driver, its UART gets the DMA stand-in. Call before
+ * sim800l_rx_start().
+ */
+void modem_attach(struct sim800l *mod, UART_HandleTypeDef *uart);
+
+// Queue output of the modem, dropping what was not sent yet
+void modem_send(const void *data, size_t len);
+void modem_send_str(const char *str);
+
+// Bytes not written to the ring yet
+size_t modem_pending(void);
+
+/*
+ * @brief: Write all pending output to the ring as the driver blocks would
+ */
+void modem_drain(void);
+
+// Virtual tick count
+void modem_set_ticks(TickType_t ticks);
+
+/*
+ * @brief: modem.command of a SIM800L with a SIM card and an HTTP server
+ * answering GET and POST with "{}". Without modem.registered it searches
+ * for the network, AT+CFUN=1 reports registration by URC.
+ */
+void modem_at(const char *cmd, size_t len);
+
+/*
+ * @brief: Run sim800l_task() from its current state
+ * @param ticks: Stop after this time at the latest
+ */
+void modem_run(struct sim800l *mod, TickType_t ticks);
+
+#endif /* MODEM_H_ */
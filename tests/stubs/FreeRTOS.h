@@ -0,0 +1,41 @@
+/*
+ * Host stand-in for FreeRTOS, see tests/host.h
+ */
+
+#ifndef FREERTOS_H_
+#define FREERTOS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uint32_t TickType_t;
+typedef long BaseType_t;
+typedef unsigned long UBaseType_t;
+
+#define pdFALSE 0
+#define pdTRUE  1
+#define pdFAIL  pdFALSE
+#define pdPASS  pdTRUE
+
+#define configTICK_RATE_HZ        ((TickType_t) 1000)
+#define configMAX_PRIORITIES      56
+#define configTIMER_TASK_PRIORITY 2
+
+#define portMAX_DELAY      ((TickType_t) 0xFFFFFFFF)
+#define portTICK_PERIOD_MS ((TickType_t) 1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms) \
+	((TickType_t) (((uint64_t) (ms) * configTICK_RATE_HZ) / 1000))
+
+// The woken task runs once the interrupt returns
+#define portYIELD_FROM_ISR(woken) ((void) (woken))
+
+#define taskENTER_CRITICAL() host_critical(1)
+#define taskEXIT_CRITICAL()  host_critical(-1)
+
+void host_critical(int nest);
+
+BaseType_t xPortIsInsideInterrupt(void);
+void *pvPortMalloc(size_t size);
+void vPortFree(void *ptr);
+
+#endif /* FREERTOS_H_ */
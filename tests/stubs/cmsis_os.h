@@ -0,0 +1,36 @@
+/*
+ * Host stand-in for CMSIS-RTOS2 over FreeRTOS, see tests/host.h
+ */
+
+#ifndef CMSIS_OS_H_
+#define CMSIS_OS_H_
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+typedef enum
+{
+	osPriorityNone = 0,
+	osPriorityIdle = 1,
+	osPriorityLow = 8,
+	osPriorityBelowNormal = 16,
+	osPriorityNormal = 24,
+	osPriorityAboveNormal = 32,
+	osPriorityHigh = 40,
+	osPriorityRealtime = 48
+} osPriority_t;
+
+typedef enum
+{
+	osOK = 0,
+	osError = -1
+} osStatus_t;
+
+typedef TaskHandle_t osThreadId_t;
+
+osStatus_t osDelay(uint32_t ticks);
+
+// newlib extension used by the firmware
+char *utoa(unsigned value, char *str, int base);
+
+#endif /* CMSIS_OS_H_ */
@@ -0,0 +1,12 @@
+/*
+ * Host stand-in for FreeRTOS, see tests/host.h
+ */
+
+#ifndef EVENT_GROUPS_H_
+#define EVENT_GROUPS_H_
+
+#include "FreeRTOS.h"
+
+typedef struct host_events *EventGroupHandle_t;
+
+#endif /* EVENT_GROUPS_H_ */
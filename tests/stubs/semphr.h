@@ -0,0 +1,29 @@
+/*
+ * Host stand-in for FreeRTOS, see tests/host.h
+ */
+
+#ifndef SEMPHR_H_
+#define SEMPHR_H_
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+typedef struct host_sem
+{
+	UBaseType_t count;
+	UBaseType_t max;
+	uint8_t mutex;
+	TaskHandle_t holder;
+} StaticSemaphore_t;
+
+typedef struct host_sem *SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buf);
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+void vSemaphoreDelete(SemaphoreHandle_t sem);
+BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t timeout);
+BaseType_t xSemaphoreGive(SemaphoreHandle_t sem);
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t sem, BaseType_t *woken);
+
+#endif /* SEMPHR_H_ */
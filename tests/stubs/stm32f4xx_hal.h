@@ -0,0 +1,77 @@
+/*
+ * Host stand-in for the STM32F4 HAL, see tests/host.h
+ */
+
+#ifndef STM32F4XX_HAL_H_
+#define STM32F4XX_HAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum
+{
+	HAL_OK = 0,
+	HAL_ERROR,
+	HAL_BUSY,
+	HAL_TIMEOUT
+} HAL_StatusTypeDef;
+
+typedef enum
+{
+	GPIO_PIN_RESET = 0,
+	GPIO_PIN_SET
+} GPIO_PinState;
+
+typedef struct
+{
+	uint32_t ODR;
+} GPIO_TypeDef;
+
+typedef struct
+{
+	volatile uint32_t NDTR;
+} DMA_Stream_TypeDef;
+
+typedef struct
+{
+	DMA_Stream_TypeDef *Instance;
+} DMA_HandleTypeDef;
+
+typedef struct
+{
+	void *Instance;
+} SPI_HandleTypeDef;
+
+typedef struct
+{
+	void *Instance;
+	DMA_HandleTypeDef *hdmarx;
+} UART_HandleTypeDef;
+
+#define __HAL_DMA_GET_COUNTER(h) ((h)->Instance->NDTR)
+
+uint32_t HAL_GetTick(void);
+void HAL_GPIO_WritePin(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state);
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *spi, uint8_t *data,
+		uint16_t size, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *spi, uint8_t *data,
+		uint16_t size, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *spi, uint8_t *data,
+		uint16_t size);
+HAL_StatusTypeDef HAL_SPI_Receive_DMA(SPI_HandleTypeDef *spi, uint8_t *data,
+		uint16_t size);
+HAL_StatusTypeDef HAL_SPI_Abort(SPI_HandleTypeDef *spi);
+HAL_StatusTypeDef HAL_SPI_DeInit(SPI_HandleTypeDef *spi);
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *spi);
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *spi);
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *spi);
+
+HAL_StatusTypeDef HAL_UART_Transmit_DMA(UART_HandleTypeDef *uart,
+		const uint8_t *data, uint16_t size);
+HAL_StatusTypeDef HAL_UARTEx_ReceiveToIdle_DMA(UART_HandleTypeDef *uart,
+		uint8_t *data, uint16_t size);
+
+void NVIC_SystemReset(void);
+
+#endif /* STM32F4XX_HAL_H_ */
@@ -0,0 +1,12 @@
+/*
+ * Host stand-in for FreeRTOS, see tests/host.h
+ */
+
+#ifndef STREAM_BUFFER_H_
+#define STREAM_BUFFER_H_
+
+#include "FreeRTOS.h"
+
+typedef struct host_stream *StreamBufferHandle_t;
+
+#endif /* STREAM_BUFFER_H_ */
@@ -0,0 +1,31 @@
+/*
+ * Host stand-in for FreeRTOS, see tests/host.h
+ */
+
+#ifndef TIMERS_H_
+#define TIMERS_H_
+
+#include "FreeRTOS.h"
+
+typedef struct host_timer *TimerHandle_t;
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t);
+
+typedef struct host_timer
+{
+	TickType_t period;
+	UBaseType_t reload;
+	void *id;
+	TimerCallbackFunction_t callback;
+	uint8_t active;
+	uint64_t expiry; // ns
+	struct host_timer *next;
+} StaticTimer_t;
+
+TimerHandle_t xTimerCreateStatic(const char *name, TickType_t period,
+		UBaseType_t reload, void *id, TimerCallbackFunction_t callback,
+		StaticTimer_t *buf);
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t timeout);
+BaseType_t xTimerStop(TimerHandle_t timer, TickType_t timeout);
+void *pvTimerGetTimerID(TimerHandle_t timer);
+
+#endif /* TIMERS_H_ */
@@ -0,0 +1,146 @@
+/*
+ * Table-driven CRC (crc.h) against the bitwise loops it replaced: the crc6
+ * of mfifo.c and calc_crc8 of aht20.c, bit-exact results and host CPU time
+ */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "host.h"
+#include "crc.h"
+
+#define DATA_LEN 4096
+#define BENCH_MB 64
+
+static uint8_t data[DATA_LEN];
+
+
+// mfifo.c before the table
+static uint8_t crc6_bitwise(const uint8_t *data, size_t len)
+{
+	uint8_t crc = 0x00;
+
+	for (size_t i = 0; i < len; i++)
+	{
+		crc ^= data[i];
+		for (int j = 0; j < 8; j++)
+		{
+			if ((crc & 1) == 0)
+				crc >>= 1;
+			else
+				crc = (crc >> 1) ^ 0x30;
+		}
+	}
+
+	return crc & 0x3F;
+}
+
+// aht20.c before the table
+static uint8_t crc8_bitwise(const uint8_t *data, size_t size)
+{
+	uint8_t crc = 0xFF;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		crc ^= data[i];
+		for (uint8_t bit = 0; bit < 8; bit++)
+		{
+			if (crc & 0x80)
+				crc = (crc << 1) ^ 0x31;
+			else
+				crc = (crc << 1);
+		}
+	}
+
+	return crc;
+}
+
+static uint64_t cpu_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void test_equal(void)
+{
+	uint8_t b;
+
+	// Every single byte
+	for (int v = 0; v < 256; v++)
+	{
+		b = v;
+		host_assert(crc6(CRC6_INIT, &b, 1) == crc6_bitwise(&b, 1));
+		host_assert(crc8(CRC8_INIT, &b, 1) == crc8_bitwise(&b, 1));
+	}
+
+	// Every length and offset up to a page
+	for (size_t off = 0; off < 8; off++)
+	{
+		for (size_t len = 0; len <= 256; len++)
+		{
+			host_assert(crc6(CRC6_INIT, &data[off], len) ==
+					crc6_bitwise(&data[off], len));
+			host_assert(crc8(CRC8_INIT, &data[off], len) ==
+					crc8_bitwise(&data[off], len));
+		}
+	}
+
+	// Chained calls give the CRC of the whole buffer
+	host_assert(crc6(crc6(CRC6_INIT, data, 100), &data[100], 60) ==
+			crc6_bitwise(data, 160));
+	host_assert(crc8(crc8(CRC8_INIT, data, 3), &data[3], 3) ==
+			crc8_bitwise(data, 6));
+
+	// AHT20 datasheet check value
+	host_assert(crc8(CRC8_INIT, (const uint8_t *) "\xBE\xEF", 2) == 0x92);
+}
+
+static void bench(const char *name, uint8_t (*fn)(const uint8_t *, size_t),
+		size_t len)
+{
+	size_t n = (size_t) BENCH_MB * 1024 * 1024 / len;
+	volatile uint8_t sink = 0;
+	uint64_t t = cpu_ns();
+
+	for (size_t i = 0; i < n; i++)
+		sink ^= fn(&data[i % (DATA_LEN - len)], len);
+	t = cpu_ns() - t;
+
+	printf("%-14s %5zu B %8.2f ns/B\n", name, len, (double) t / n / len);
+}
+
+static uint8_t crc6_table(const uint8_t *data, size_t len)
+{
+	return crc6(CRC6_INIT, data, len);
+}
+
+static uint8_t crc8_table(const uint8_t *data, size_t len)
+{
+	return crc8(CRC8_INIT, data, len);
+}
+
+int main(void)
+{
+	uint32_t x = 1;
+
+	for (size_t i = 0; i < DATA_LEN; i++)
+	{
+		x = x * 1103515245 + 12345;
+		data[i] = x >> 16;
+	}
+
+	test_equal();
+
+	// mfifo elements (MQUEUE_RECORD_SIZE) and AHT20 measurements
+	printf("host CPU time:\n");
+	bench("crc6 bitwise", crc6_bitwise, 10);
+	bench("crc6 table", crc6_table, 10);
+	bench("crc6 bitwise", crc6_bitwise, 256);
+	bench("crc6 table", crc6_table, 256);
+	bench("crc8 bitwise", crc8_bitwise, 6);
+	bench("crc8 table", crc8_table, 6);
+
+	return 0;
+}
@@ -0,0 +1,262 @@
+/*
+ * mfifo reads with the write cache: staged elements are written before a
+ * read, a full fifo is still read, a failed write is returned. Stream mode
+ * recovery reads a few pages and leaves the counting to the first count.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "host.h"
+#include "w25q_emu.h"
+#include "w25q_s.h"
+#include "mqueue.h"
+
+#define FIFO_SECS 3
+#define ESIZE     60 // 4 elements per page
+#define BATCH     8
+
+typedef int (*read_fn)(struct mfifo *f, uint8_t *buf, size_t num);
+
+static struct w25q_emu emu;
+static struct w25q_s smem;
+static SPI_HandleTypeDef spi;
+static GPIO_TypeDef gpio;
+static struct mfifo_cursor cursor;
+
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	w25q_spi_irq(&smem.mem, W25Q_OK);
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	w25q_spi_irq(&smem.mem, W25Q_OK);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+	w25q_spi_irq(&smem.mem, W25Q_ERR_SPI);
+}
+
+
+static void element(uint8_t *e, uint32_t id)
+{
+	struct mfifo_record *r = (struct mfifo_record *) e;
+
+	memset(e, (uint8_t) id, ESIZE);
+	r->type = 0;
+	r->len = ESIZE - sizeof(*r);
+	memcpy(r->data, &id, sizeof(id));
+}
+
+static uint32_t id_of(const uint8_t *e)
+{
+	uint8_t ref[ESIZE];
+	uint32_t id;
+
+	memcpy(&id, ((const struct mfifo_record *) e)->data, sizeof(id));
+	element(ref, id);
+	host_assert(!memcmp(e, ref, ESIZE));
+	return id;
+}
+
+static void fifo_open(struct mfifo *f, int streams)
+{
+	host_assert(!w25q_s_erase(&smem, 0, FIFO_SECS * W25Q_SECTOR_SIZE));
+	host_assert(!mfifo_init(f, &smem, W25Q_PAGE_SIZE, W25Q_SECTOR_SIZE,
+			ESIZE, 0, FIFO_SECS));
+	if (streams)
+		host_assert(!mfifo_streams(f, &cursor, 1));
+	host_assert(!mfifo_recover(f));
+	host_assert(!mfifo_wcache(f, pdMS_TO_TICKS(60000)));
+}
+
+static void fifo_close(struct mfifo *f)
+{
+	vSemaphoreDelete(f->mutex);
+	vSemaphoreDelete(f->emutex);
+	vPortFree(f->buf);
+	vPortFree(f->wcbuf);
+}
+
+static int read_get(struct mfifo *f, uint8_t *buf, size_t num)
+{
+	int ret = mfifo_get(f, buf);
+
+	return ret < 0 ? ret : 1;
+}
+
+static int read_get_many(struct mfifo *f, uint8_t *buf, size_t num)
+{
+	return mfifo_get_many(f, buf, num);
+}
+
+static int read_peek(struct mfifo *f, uint8_t *buf, size_t num)
+{
+	int ret = mfifo_peek(f, buf, num);
+
+	if (ret > 0)
+		host_assert(!mfifo_commit(f, ret));
+	return ret;
+}
+
+static int read_peek_stream(struct mfifo *f, uint8_t *buf, size_t num)
+{
+	int ret = mfifo_peek_stream(f, 0, buf, num);
+
+	if (ret > 0)
+		host_assert(!mfifo_commit_stream(f, 0, ret));
+	return ret;
+}
+
+/*
+ * @brief: Fill the fifo until the cache can not be written, read it back
+ */
+static void test_full(const char *name, read_fn rd, int streams)
+{
+	uint8_t buf[BATCH * ESIZE];
+	struct mfifo f;
+	uint32_t n = 0;
+	uint32_t next = 0;
+	int ret;
+
+	fifo_open(&f, streams);
+
+	for (;;)
+	{
+		element(buf, n);
+		ret = mfifo_set(&f, buf);
+		if (ret == -MFIFO_ERR_NO_FREE_SPACE)
+			break;
+		host_assert(!ret);
+		n++;
+	}
+
+	while (next < n)
+	{
+		ret = rd(&f, buf, BATCH);
+		host_assert(ret > 0);
+		for (int i = 0; i < ret; i++)
+			host_assert(id_of(&buf[i * ESIZE]) == next++);
+	}
+	host_assert(!f.staged);
+	host_assert(rd(&f, buf, BATCH) == -MFIFO_ERR_EMPTY);
+
+	fifo_close(&f);
+	printf("%-18s full: %u elements read back\n", name, n);
+}
+
+/*
+ * @brief: Staged elements can not be written: the read fails and does not
+ * keep the lock, the elements are read once the memory works again
+ */
+static void test_io(const char *name, read_fn rd, int streams)
+{
+	uint8_t buf[BATCH * ESIZE];
+	struct mfifo f;
+	int ret;
+
+	fifo_open(&f, streams);
+
+	for (uint32_t i = 0; i < 2; i++)
+	{
+		element(buf, i);
+		host_assert(!mfifo_set(&f, buf));
+	}
+	host_assert(f.staged == 2);
+
+	host_spi_fail(1);
+	host_assert(rd(&f, buf, BATCH) == -MFIFO_ERR_IO);
+	host_spi_fail(0);
+
+	for (uint32_t next = 0; next < 2;)
+	{
+		ret = rd(&f, buf, BATCH);
+		host_assert(ret > 0);
+		for (int i = 0; i < ret; i++)
+			host_assert(id_of(&buf[i * ESIZE]) == next++);
+	}
+	host_assert(!f.staged);
+
+	fifo_close(&f);
+	printf("%-18s write error returned\n", name);
+}
+
+/*
+ * @brief: A backlog of two sectors with some records read: recovery stops
+ * at the first unread record, the first count reads the backlog once
+ */
+static void test_recover(void)
+{
+	uint8_t buf[BATCH * ESIZE];
+	struct mfifo f;
+	uint32_t n = 2 * 63;
+	uint32_t reads;
+
+	fifo_open(&f, 1);
+	for (uint32_t i = 0; i < n; i++)
+	{
+		element(buf, i);
+		host_assert(!mfifo_set(&f, buf));
+	}
+	host_assert(read_peek_stream(&f, buf, BATCH) == BATCH);
+	fifo_close(&f);
+
+	// Reset
+	host_assert(!mfifo_init(&f, &smem, W25Q_PAGE_SIZE, W25Q_SECTOR_SIZE,
+			ESIZE, 0, FIFO_SECS));
+	host_assert(!mfifo_streams(&f, &cursor, 1));
+	reads = emu.stats.reads;
+	host_assert(!mfifo_recover(&f));
+	reads = emu.stats.reads - reads;
+	host_assert(reads <= 8);
+
+	host_assert(mfifo_count_stream(&f, 0) == n - BATCH);
+	host_assert(mfifo_count(&f) == n - BATCH);
+	host_assert(read_peek_stream(&f, buf, BATCH) == BATCH);
+	host_assert(id_of(buf) == BATCH);
+	host_assert(mfifo_count_stream(&f, 0) == n - 2 * BATCH);
+
+	fifo_close(&f);
+	printf("%-18s recovery: %u reads for %u records\n", "mfifo_recover",
+			reads, n);
+}
+
+static void task(void *arg)
+{
+	static const struct
+	{
+		const char *name;
+		read_fn rd;
+		int streams;
+	} readers[] = {
+		{"mfifo_get", read_get, 0},
+		{"mfifo_get_many", read_get_many, 0},
+		{"mfifo_peek", read_peek, 0},
+		{"mfifo_peek_stream", read_peek_stream, 1},
+	};
+
+	for (size_t i = 0; i < sizeof(readers) / sizeof(readers[0]); i++)
+	{
+		test_full(readers[i].name, readers[i].rd, readers[i].streams);
+		test_io(readers[i].name, readers[i].rd, readers[i].streams);
+	}
+	test_recover();
+}
+
+int main(void)
+{
+	w25q_emu_init(&emu, 256 * 1024);
+	w25q_emu_sfdp(&emu);
+	host_spi_attach(&spi, &emu);
+
+	// Write errors are returned by the driver with the scheduler running
+	w25q_s_init(&smem, &spi, &gpio, 0);
+	host_task("test", osPriorityNormal, task, NULL, 0);
+	host_run();
+
+	w25q_emu_free(&emu);
+	return 0;
+}
@@ -0,0 +1,475 @@
+/*
+ * mfifo recovery after a power cut at every program and erase of a
+ * workload, with the interrupted operation left undone, half done and
+ * done. After mfifo_recover():
+ * - every stored element that was not taken is read back, in order
+ * - elements taken before the cut are not read again, only the elements
+ *   of the interrupted call may be
+ * - an element of the interrupted set is skipped for its checksum or, if
+ *   its torn content passes the 6-bit checksum, it is the last one read
+ * - the fifo keeps working
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+#include "w25q_emu.h"
+#include "w25q_s.h"
+#include "mqueue.h"
+
+#define CAPACITY  (256 * 1024)
+#define FIFO_SECS 3
+#define ESIZE     60 // 4 elements per page, 63 per sector
+#define STREAMS   2
+#define OPS       300
+#define MAX_IDS   2048
+
+enum op
+{
+	OP_SET = 0,
+	OP_SET_MANY,
+	OP_GET,
+	OP_GET_MANY,
+	OP_PEEK_COMMIT,
+	OP_NUM
+};
+
+/*
+ * Plain mode: ids [taken, stored) are stored and not taken. Stream mode:
+ * ids of stream s are ids[s][taken[s] .. n[s]). An interrupted call may have
+ * stored [stored, stored + maybe_set) or taken its maybe_take ids.
+ */
+struct model
+{
+	uint32_t stored;
+	uint32_t taken;
+	uint32_t maybe_set;
+	uint32_t maybe_take;
+
+	uint32_t ids[STREAMS][MAX_IDS];
+	size_t n[STREAMS];
+	size_t taken_s[STREAMS];
+	int maybe_stream;
+};
+
+static struct w25q_emu emu;
+static struct w25q_s smem;
+static SPI_HandleTypeDef spi;
+static GPIO_TypeDef gpio;
+static uint32_t rng;
+static uint32_t runs;
+static uint32_t skipped; // Interrupted elements with a wrong checksum
+static uint32_t torn;    // and with a right one
+
+
+static uint32_t rnd(uint32_t n)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 17;
+	rng ^= rng << 5;
+	return rng % n;
+}
+
+static void element(uint8_t *e, uint32_t id, uint8_t stream)
+{
+	struct mfifo_record *r = (struct mfifo_record *) e;
+
+	memset(e, (uint8_t) id, ESIZE);
+	r->type = stream;
+	r->len = ESIZE - sizeof(*r);
+	memcpy(r->data, &id, sizeof(id));
+}
+
+/*
+ * @retval: 0 - the element is torn: a partial program of the interrupted
+ * set that passed the 6-bit checksum (1 of 64)
+ */
+static int intact(const uint8_t *e, uint32_t *id)
+{
+	uint8_t ref[ESIZE];
+
+	memcpy(id, ((const struct mfifo_record *) e)->data, sizeof(*id));
+	element(ref, *id, e[0]);
+	return !memcmp(e, ref, ESIZE);
+}
+
+static uint32_t id_of(const uint8_t *e)
+{
+	uint32_t id;
+
+	host_assert(intact(e, &id));
+	return id;
+}
+
+static void mem_open(struct mfifo *f, int streams, struct mfifo_cursor *c)
+{
+	w25q_s_init(&smem, &spi, &gpio, 0);
+	host_assert(!mfifo_init(f, &smem, W25Q_PAGE_SIZE, W25Q_SECTOR_SIZE,
+			ESIZE, 0, FIFO_SECS));
+	if (streams)
+		host_assert(!mfifo_streams(f, c, STREAMS));
+	host_assert(!mfifo_recover(f));
+}
+
+static void mem_close(struct mfifo *f)
+{
+	vSemaphoreDelete(f->mutex);
+	vSemaphoreDelete(f->emutex);
+	vPortFree(f->buf);
+	vPortFree(smem.lines);
+	vPortFree(smem.cache);
+	vPortFree(smem.wear);
+}
+
+/*
+ * @retval: 1 - the power was cut during the call
+ */
+static int plain_op(struct mfifo *f, struct model *m)
+{
+	uint8_t buf[8 * ESIZE];
+	int op = rnd(OP_NUM);
+	uint32_t k = 1 + rnd(8);
+	uint32_t fill = m->stored - m->taken;
+	int ret;
+
+	// Keep the fill level moving between empty and full
+	if (fill > 100 && op < OP_GET)
+		op += OP_GET;
+
+	switch (op)
+	{
+	case OP_SET:
+		k = 1;
+		// fall through
+	case OP_SET_MANY:
+		for (uint32_t i = 0; i < k; i++)
+			element(&buf[i * ESIZE], m->stored + i, 0);
+		ret = k == 1 ? mfifo_set(f, buf) : mfifo_set_many(f, buf, k);
+		if (emu.dead)
+		{
+			m->maybe_set = k;
+			return 1;
+		}
+		if (k == 1 && !ret)
+			ret = 1;
+		if (ret > 0)
+			m->stored += ret;
+		else
+			host_assert(ret == -MFIFO_ERR_NO_FREE_SPACE);
+		break;
+	case OP_GET:
+		k = 1;
+		// fall through
+	case OP_GET_MANY:
+		if (k > fill)
+			k = fill;
+		if (!k)
+			break;
+		ret = k == 1 ? mfifo_get(f, buf) : mfifo_get_many(f, buf, k);
+		if (emu.dead)
+		{
+			m->maybe_take = k;
+			return 1;
+		}
+		if (k == 1 && !ret)
+			ret = 1;
+		host_assert(ret == (int) k);
+		for (uint32_t i = 0; i < k; i++)
+			host_assert(id_of(&buf[i * ESIZE]) == m->taken++);
+		break;
+	default:
+		ret = mfifo_peek(f, buf, k);
+		if (!fill)
+		{
+			host_assert(ret == -MFIFO_ERR_EMPTY);
+			break;
+		}
+		host_assert(ret == (int) (k < fill ? k : fill));
+		for (int i = 0; i < ret; i++)
+			host_assert(id_of(&buf[i * ESIZE]) == m->taken + i);
+		k = rnd(ret + 1);
+		ret = mfifo_commit(f, k);
+		if (emu.dead)
+		{
+			m->maybe_take = k;
+			return 1;
+		}
+		host_assert(!ret);
+		m->taken += k;
+		break;
+	}
+
+	return emu.dead;
+}
+
+static int stream_op(struct mfifo *f, struct model *m)
+{
+	uint8_t buf[8 * ESIZE];
+	uint8_t s = rnd(STREAMS);
+	uint32_t k = 1 + rnd(8);
+	size_t fill = 0;
+	int ret;
+
+	for (size_t i = 0; i < STREAMS; i++)
+		fill += m->n[i] - m->taken_s[i];
+
+	if (rnd(2) && fill < 100)
+	{
+		element(buf, m->stored, s);
+		ret = mfifo_set(f, buf);
+		if (emu.dead)
+		{
+			m->maybe_set = 1;
+			m->maybe_stream = s;
+			return 1;
+		}
+		if (ret == -MFIFO_ERR_NO_FREE_SPACE)
+			return 0;
+		host_assert(!ret);
+		m->ids[s][m->n[s]++] = m->stored++;
+		return 0;
+	}
+
+	fill = m->n[s] - m->taken_s[s];
+	ret = mfifo_peek_stream(f, s, buf, k);
+	if (!fill)
+	{
+		host_assert(ret == -MFIFO_ERR_EMPTY);
+		return emu.dead;
+	}
+	host_assert(ret == (int) (k < fill ? k : fill));
+	for (int i = 0; i < ret; i++)
+		host_assert(id_of(&buf[i * ESIZE]) == m->ids[s][m->taken_s[s] + i]);
+
+	k = rnd(ret + 1);
+	ret = mfifo_commit_stream(f, s, k);
+	if (emu.dead)
+	{
+		m->maybe_take = k;
+		m->maybe_stream = s;
+		return 1;
+	}
+	host_assert(!ret);
+	m->taken_s[s] += k;
+	return 0;
+}
+
+/*
+ * @brief: Read out ids [lo, hi) in order, the ones in [lo, must) and
+ * [must_hi, hi) may be missing
+ */
+static void check_ids(const uint32_t *got, size_t n, uint32_t lo,
+		uint32_t must, uint32_t must_hi, uint32_t hi)
+{
+	uint32_t next = must;
+
+	for (size_t i = 0; i < n; i++)
+	{
+		host_assert(got[i] >= lo && got[i] < hi);
+		host_assert(!i || got[i] > got[i - 1]);
+		if (got[i] < must)
+			continue;
+		if (next < must_hi)
+			host_assert(got[i] == next);
+		next = got[i] + 1;
+	}
+	host_assert(next >= must_hi);
+}
+
+static void plain_check(struct mfifo *f, struct model *m)
+{
+	static uint32_t got[MAX_IDS];
+	uint8_t buf[ESIZE];
+	size_t n = 0;
+	int skips = 0;
+	int last = 0;
+	int ret;
+
+	while ((ret = mfifo_get(f, buf)) != -MFIFO_ERR_EMPTY)
+	{
+		// A partially written element only
+		host_assert(!last);
+		if (ret == -MFIFO_ERR_INVALID_CRC)
+		{
+			host_assert(++skips <= 1);
+			skipped++;
+			continue;
+		}
+		host_assert(!ret && n < MAX_IDS);
+		if (!intact(buf, &got[n]))
+		{
+			host_assert(m->maybe_set);
+			last = 1;
+			torn++;
+			continue;
+		}
+		n++;
+	}
+
+	check_ids(got, n, m->taken, m->taken + m->maybe_take, m->stored,
+			m->stored + m->maybe_set);
+	host_assert(mfifo_count(f) == 0);
+
+	// Still working: a few laps of the area
+	for (uint32_t i = 0; i < 4 * FIFO_SECS * 63; i++)
+	{
+		element(buf, i, 0);
+		host_assert(!mfifo_set(f, buf));
+		if (i % 3 == 2)
+		{
+			for (uint32_t j = i - 2; j <= i; j++)
+			{
+				host_assert(!mfifo_get(f, buf));
+				host_assert(id_of(buf) == j);
+			}
+		}
+	}
+}
+
+static void stream_check(struct mfifo *f, struct model *m)
+{
+	static uint32_t idx[MAX_IDS];
+	uint8_t buf[4 * ESIZE];
+	uint32_t must, must_hi, hi;
+	int last;
+	size_t n;
+	int ret;
+
+	for (uint8_t s = 0; s < STREAMS; s++)
+	{
+		// Ids of the stream are mapped to their indexes
+		n = 0;
+		last = 0;
+		while ((ret = mfifo_peek_stream(f, s, buf, 4)) > 0)
+		{
+			for (int i = 0; i < ret; i++)
+			{
+				uint32_t id;
+				size_t j;
+
+				// A partially written record only
+				host_assert(!last);
+				if (!intact(&buf[i * ESIZE], &id))
+				{
+					host_assert(m->maybe_set && m->maybe_stream == s);
+					last = 1;
+					torn++;
+					continue;
+				}
+				for (j = 0; j < m->n[s] && m->ids[s][j] != id; j++)
+					;
+				if (j == m->n[s])
+				{
+					// The record of the interrupted set
+					host_assert(m->maybe_set && m->maybe_stream == s &&
+							id == m->stored);
+				}
+				host_assert(n < MAX_IDS);
+				idx[n++] = j;
+			}
+			host_assert(!mfifo_commit_stream(f, s, ret));
+		}
+		host_assert(ret == -MFIFO_ERR_EMPTY);
+
+		must = m->taken_s[s];
+		if (m->maybe_stream == s)
+			must += m->maybe_take;
+		must_hi = m->n[s];
+		hi = m->n[s] + (m->maybe_stream == s ? m->maybe_set : 0);
+		check_ids(idx, n, m->taken_s[s], must, must_hi, hi);
+	}
+
+	// Still working
+	for (uint32_t i = 0; i < 4 * FIFO_SECS * 63; i++)
+	{
+		element(buf, i, i % STREAMS);
+		host_assert(!mfifo_set(f, buf));
+		if (i % 2)
+		{
+			for (uint8_t s = 0; s < STREAMS; s++)
+			{
+				host_assert(mfifo_peek_stream(f, s, buf, 4) == 1);
+				host_assert(id_of(buf) == i - 1 + s);
+				host_assert(!mfifo_commit_stream(f, s, 1));
+			}
+		}
+	}
+}
+
+/*
+ * @brief: Run the workload, cut the power at the cut-th program or erase
+ * @retval: Programs and erases of the workload without a cut
+ */
+static uint32_t run(int streams, uint32_t seed, uint32_t cut, uint32_t keep)
+{
+	static struct model m;
+	struct mfifo_cursor c[STREAMS];
+	struct mfifo f;
+	uint32_t ops;
+	int dead = 0;
+
+	memset(&m, 0, sizeof(m));
+	m.maybe_stream = -1;
+	memset(emu.mem, 0xFF, emu.capacity);
+	w25q_emu_power_on(&emu);
+	rng = seed;
+
+	mem_open(&f, streams, c);
+	ops = emu.stats.programs + emu.stats.erases;
+	w25q_emu_cut(&emu, cut, keep);
+	for (int i = 0; i < OPS && !dead; i++)
+		dead = streams ? stream_op(&f, &m) : plain_op(&f, &m);
+	ops = emu.stats.programs + emu.stats.erases - ops;
+	mem_close(&f);
+
+	if (cut)
+		host_assert(dead);
+	w25q_emu_power_on(&emu);
+
+	mem_open(&f, streams, c);
+	if (streams)
+		stream_check(&f, &m);
+	else
+		plain_check(&f, &m);
+	mem_close(&f);
+
+	runs++;
+	return ops;
+}
+
+int main(void)
+{
+	static const uint32_t keep[] = {0, 128, 256};
+	uint32_t total;
+
+	w25q_emu_init(&emu, CAPACITY);
+	emu.timing.program_us = 1;
+	emu.timing.sector_us = 5;
+	emu.timing.block32_us = 10;
+	emu.timing.block64_us = 10;
+	w25q_emu_sfdp(&emu);
+	host_spi_attach(&spi, &emu);
+
+	for (int streams = 0; streams < 2; streams++)
+	{
+		for (uint32_t seed = 1; seed <= 2; seed++)
+		{
+			total = run(streams, seed, 0, 0);
+			for (uint32_t cut = 1; cut <= total; cut++)
+				for (size_t k = 0; k < sizeof(keep) / sizeof(keep[0]); k++)
+					run(streams, seed, cut, keep[k]);
+			printf("%s seed %u: %u cuts\n", streams ? "streams" : "plain",
+					seed, total);
+		}
+	}
+
+	printf("%u runs, interrupted elements: %u skipped, %u torn\n", runs,
+			skipped, torn);
+	printf("driver errors: busy %u, no_wel %u\n", emu.stats.busy,
+			emu.stats.no_wel);
+	host_assert(!emu.stats.busy && !emu.stats.no_wel);
+	w25q_emu_free(&emu);
+	return 0;
+}
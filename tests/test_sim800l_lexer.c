@@ -0,0 +1,165 @@
+/*
+ * SIM800L response lexer: the parsers over responses split at random chunk
+ * boundaries anywhere in the ring, +HTTPREAD payloads with CR, LF and "OK"
+ * inside, payloads the caller does not read
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modem.h"
+
+#include "sim800l.c"
+
+#define SEEDS 3000
+
+static struct sim800l mod;
+static UART_HandleTypeDef uart;
+static GPIO_TypeDef gpio;
+
+static int cells;
+static int scans;
+
+
+static void scan_cb(int status, void *data)
+{
+	if (status == SIM800L_NETSCAN_DONE)
+		scans++;
+	else
+		cells++;
+}
+
+static void clear(void)
+{
+	modem_drain();
+	mod.rxtail = mod.rxhead;
+	mod.llen = 0;
+	mod.payload = 0;
+}
+
+static void test_http_read(void)
+{
+	static char tr[2 * SIM800L_RING_SIZE];
+	static char payload[1000];
+	struct sim800l_http http = {0};
+	int len = 1 + rand() % sizeof(payload);
+	int n;
+
+	for (int i = 0; i < len; i++)
+		payload[i] = "\r\nOK+ab"[rand() % 7];
+
+	n = sprintf(tr, "\r\n+HTTPREAD: %d\r\n", len);
+	memcpy(tr + n, payload, len);
+	n += len;
+	n += sprintf(tr + n, "\r\nOK\r\n\r\n+CBC: 0,61,3895\r\n\r\nOK\r\n");
+	modem_send(tr, n);
+
+	mod.task.data = &http;
+	host_assert(parse_http_read(&mod, 1000) == len && http.rlen == len);
+	host_assert(!memcmp(http.response, payload, len));
+	vPortFree(http.response);
+
+	host_assert(parse_battery_charge(&mod, 100));
+	host_assert(mod.voltage == 3895 && mod.bcl == 61);
+}
+
+static void test_net_scan(void)
+{
+	struct sim800l_netscan scan = {0};
+
+	mod.task.data = &scan;
+	mod.task.callback = scan_cb;
+	cells = 0;
+	scans = 0;
+	modem_send_str("\r\nOperator:\"A\",MCC:250,MNC:01,Rxlev:30,Cellid:1A2B,"
+			"Arfcn:10,Lac:0F0F,Bsic:1\r\n"
+			"Operator:\"B\",MCC:250,MNC:02,Rxlev:20,Cellid:0001,Arfcn:11,"
+			"Lac:0001,Bsic:2\r\n\r\nOK\r\n");
+
+	host_assert(!parse_net_scan(&mod, 1000));
+	host_assert(cells == 2 && scans == 1);
+	host_assert(scan.mnc == 2 && scan.lac == 1 && scan.lev == -93);
+}
+
+static void test_http(void)
+{
+	struct sim800l_http http = {0};
+	int len = 0;
+
+	modem_send_str("\r\nOK\r\n\r\n+HTTPACTION: 1,200,16\r\n");
+	host_assert(parse_http_action(&mod, &len, 1000) == 200 && len == 16);
+
+	mod.task.data = &http;
+	modem_send_str("\r\n+HTTPHEAD: 224\r\nhttp/1.1 200 ok\r\n"
+			"server: nginx/1.18.0 (ubuntu)\r\ncontent-length: 32\r\n"
+			"authorization: 93bsl2iertjhmgypran0jhssj3lxke66shih2qx4hqg=\r\n"
+			"\r\n\r\nOK\r\n");
+	host_assert(parse_http_head_auth(&mod, 1000) == 44);
+	host_assert(!strcmp(http.res_auth,
+			"93bsl2iertjhmgypran0jhssj3lxke66shih2qx4hqg="));
+	vPortFree(http.res_auth);
+
+	modem_send_str("\r\n+HTTPSTATUS: GET,0,0,0\r\n\r\nOK\r\n");
+	host_assert(parse_http_status(&mod, 500) == 0);
+}
+
+static void test_final(void)
+{
+	// Echo before the result
+	modem_send_str("AT\r\r\nOK\r\n");
+	host_assert(expect(&mod, NULL, 500));
+
+	modem_send_str("\r\n+CREG: 0,1\r\n\r\nOK\r\n");
+	host_assert(expect(&mod, "+CREG: 0,1", 500));
+	modem_send_str("\r\n+CREG: 0,2\r\n\r\nOK\r\n");
+	host_assert(!expect(&mod, "+CREG: 0,1", 500));
+
+	modem_send_str("\r\n+CME ERROR: 58\r\n");
+	host_assert(wait_final(&mod, NULL, 500) == TOKEN_ERROR);
+
+	mod.flags = 0;
+	modem_send_str("\r\n+CPIN: READY\r\n\r\nOK\r\n\r\nSMS Ready\r\n");
+	host_assert(expect(&mod, NULL, 500));
+	host_assert(wait_flag(&mod, FLAG_SMS_READY, 500));
+
+	// The payload is skipped, its "OK" lines are data
+	modem_send_str("\r\n+HTTPREAD: 10\r\nOK\r\nOK\r\nX\r\nOK\r\n");
+	host_assert(wait_final(&mod, NULL, 500) == TOKEN_OK);
+	host_assert(!strcmp(mod.line, "OK") && !modem_pending());
+	host_assert(mod.rxtail == mod.rxhead);
+}
+
+int main(void)
+{
+	static char fill[SIM800L_RING_SIZE];
+
+	sim800l_init(&mod, &uart, &gpio, 1, "apn");
+	modem_attach(&mod, &uart);
+	sim800l_rx_start(&mod);
+	memset(fill, 'x', sizeof(fill));
+
+	for (int seed = 0; seed < SEEDS; seed++)
+	{
+		srand(seed);
+		modem.chunk = 1 + seed % 300;
+		modem.idle = seed & 1;
+
+		// Responses start anywhere in the ring
+		modem_send(fill, rand() % sizeof(fill));
+		clear();
+
+		test_http_read();
+		test_net_scan();
+		test_http();
+		test_final();
+	}
+	host_assert(!mod.overruns);
+
+	// Nothing received
+	modem_send_str("");
+	host_assert(!expect(&mod, NULL, 100));
+
+	printf("%d seeds, chunks up to 300 B\n", SEEDS);
+	return 0;
+}
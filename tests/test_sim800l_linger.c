@@ -0,0 +1,146 @@
+/*
+ * SIM800L bearer linger: the window after a request, the accounting of the
+ * gap between requests and of the attaches saved by a lingering bearer,
+ * also when the bearer turns out to be lost
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "modem.h"
+
+#include "sim800l.c"
+
+#define RUN_MS 600000
+
+static struct sim800l mod;
+static UART_HandleTypeDef uart;
+static GPIO_TypeDef gpio;
+
+static struct sim800l_http http[3];
+static int done;
+static int step;
+static int lost;
+
+
+static void http_cb(int status, void *data)
+{
+	host_assert(!status);
+	vPortFree(((struct sim800l_http *) data)->response);
+	done++;
+}
+
+static void request(struct sim800l_http *data)
+{
+	data->url = "http://example.com/cfg";
+	host_assert(!sim800l_http(&mod, data, http_cb, 60000));
+}
+
+/*
+ * @brief: The bearer was deactivated while lingering, the request fails
+ */
+static void command(const char *cmd, size_t len)
+{
+	if (lost && !strncmp(cmd, "AT+HTTPACTION=", 14))
+	{
+		lost = 0;
+		modem_send_str("\r\nOK\r\n\r\n+PDP: DEACT\r\n");
+		return;
+	}
+	modem_at(cmd, len);
+}
+
+// The next requests come 1 s after the previous ones
+static void wait(TickType_t timeout)
+{
+	if (step > 1)
+		return;
+
+	modem_set_ticks(xTaskGetTickCount() + pdMS_TO_TICKS(1000));
+	lost = !step;
+	request(&http[1 + step++]);
+}
+
+static void test_window(void)
+{
+	struct sim800l_linger_stats stats;
+
+	// Gap unknown
+	host_assert(mod.linger.attach == ATTACH_MS);
+	host_assert(linger_window(&mod) == pdMS_TO_TICKS(LINGER_MIN_MS));
+
+	// Hinted: until the request and the margin, at most 4 attaches
+	sim800l_http_hint(&mod, 0);
+	host_assert(linger_window(&mod) == pdMS_TO_TICKS(LINGER_MARGIN_MS));
+	host_assert(linger_window(&mod) == pdMS_TO_TICKS(LINGER_MIN_MS));
+	sim800l_http_hint(&mod, 10000);
+	host_assert(linger_window(&mod) == pdMS_TO_TICKS(12000));
+	sim800l_http_hint(&mod, 19000);
+	host_assert(linger_window(&mod) == pdMS_TO_TICKS(20000));
+	sim800l_http_hint(&mod, 25000);
+	host_assert(linger_window(&mod) == pdMS_TO_TICKS(LINGER_MIN_MS));
+
+	sim800l_linger(&mod, 0);
+	sim800l_http_hint(&mod, 0);
+	host_assert(linger_window(&mod) == pdMS_TO_TICKS(LINGER_MIN_MS));
+	sim800l_linger(&mod, SIM800L_LINGER_MS);
+
+	mod.linger.attach = 10000;
+	sim800l_http_hint(&mod, 25000);
+	host_assert(linger_window(&mod) == pdMS_TO_TICKS(27000));
+
+	// Average gap, accounted once per request
+	mod.http_end = 1000;
+	mod.task_ticks = 4000;
+	http_begin(&mod);
+	host_assert(mod.linger.gap == 3000);
+	mod.http_end = 10000;
+	mod.task_ticks = 17000;
+	http_begin(&mod);
+	http_begin(&mod);
+	host_assert(mod.linger.gap == 4000);
+	host_assert(linger_window(&mod) == pdMS_TO_TICKS(6000));
+
+	sim800l_get_linger_stats(&mod, &stats);
+	host_assert(stats.gap == 4000 && stats.attach == 10000);
+}
+
+/*
+ * @brief: The first reuse finds the bearer lost and attaches again, the
+ * second one is served by the lingering bearer
+ */
+static void test_reuse(void)
+{
+	struct sim800l_linger_stats stats;
+
+	sim800l_init(&mod, &uart, &gpio, 1, "apn");
+	modem_attach(&mod, &uart);
+	sim800l_rx_start(&mod);
+	modem.command = command;
+	modem.wait = wait;
+	modem.registered = 1;
+	mod.linger.gap = 1600;
+
+	request(&http[0]);
+	modem_run(&mod, pdMS_TO_TICKS(RUN_MS));
+
+	sim800l_get_linger_stats(&mod, &stats);
+	host_assert(done == 3 && modem.attaches == 2);
+	host_assert(stats.reuses == 1 && stats.saved == stats.attach);
+	// 1600 ms, then two gaps of 1000 ms
+	host_assert(stats.gap == ((3 * 1600 + 1000) / 4 * 3 + 1000) / 4);
+
+	printf("%d requests, %u attaches, %u reused, %u ms saved, gap %u ms\n",
+			done, modem.attaches, stats.reuses, stats.saved, stats.gap);
+}
+
+int main(void)
+{
+	sim800l_init(&mod, &uart, &gpio, 1, "apn");
+	modem_attach(&mod, &uart);
+	sim800l_rx_start(&mod);
+	test_window();
+
+	test_reuse();
+	return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * SIM800L radio policy between tasks: the decision, the wake-up latency
+ * accounting, and the wake-up after SIM800L_RF_OFF without coverage
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "modem.h"
+
+#include "sim800l.c"
+
+#define RUN_MS  1000000
+#define IDLE_MS 200000 // Between tasks, long enough for SIM800L_RF_OFF
+
+static struct sim800l mod;
+static UART_HandleTypeDef uart;
+static GPIO_TypeDef gpio;
+
+static struct sim800l_voltage voltage;
+static struct sim800l_http http;
+static int step;
+static int status[3];
+static TickType_t queued[3];
+static TickType_t done[3];
+static TickType_t poll_at;
+static int poll_errors;
+
+
+static void task_cb(int st, void *data)
+{
+	int i = data == &voltage ? 0 : step - 1;
+
+	if (data == &http && !st)
+		vPortFree(http.response);
+	status[i] = st;
+	done[i] = xTaskGetTickCount();
+}
+
+static void command(const char *cmd, size_t len)
+{
+	if (!poll_at && len == 8 && !strncmp(cmd, "AT+CREG?", len))
+	{
+		poll_at = xTaskGetTickCount();
+		poll_errors = mod.errors;
+	}
+	modem_at(cmd, len);
+}
+
+/*
+ * @brief: Voltage without coverage, HTTP without and with coverage
+ */
+static void wait(TickType_t timeout)
+{
+	if (timeout != portMAX_DELAY || step > 2)
+		return;
+
+	host_assert(mod.rf.mode == SIM800L_RF_OFF);
+	// Wake-ups without registration did not count
+	host_assert(mod.rf.wake_off == RF_WAKE_OFF_MS);
+	modem_set_ticks(xTaskGetTickCount() + pdMS_TO_TICKS(IDLE_MS));
+	queued[step] = xTaskGetTickCount();
+
+	if (!step)
+	{
+		host_assert(!sim800l_voltage(&mod, &voltage, task_cb, 10000));
+	}
+	else
+	{
+		modem.registered = step == 2;
+		http.url = "http://example.com/cfg";
+		host_assert(!sim800l_http(&mod, &http, task_cb, 60000));
+	}
+	step++;
+}
+
+static void test_policy(void)
+{
+	struct sim800l_rf_stats stats;
+
+	// Unknown interval
+	host_assert(rf_policy(&mod) == SIM800L_RF_OFF);
+	sim800l_rf_period(&mod, 300000);
+	host_assert(rf_policy(&mod) == SIM800L_RF_OFF);
+	sim800l_rf_period(&mod, 60000);
+	host_assert(rf_policy(&mod) == SIM800L_RF_SLEEP);
+	sim800l_rf_period(&mod, 1000);
+	host_assert(rf_policy(&mod) == SIM800L_RF_ON);
+	// The measured interval is shorter than the period
+	sim800l_rf_period(&mod, 300000);
+	mod.rf.interval = 20000;
+	host_assert(rf_policy(&mod) == SIM800L_RF_SLEEP);
+	mod.rf.interval = 0;
+
+	// Registered after SIM800L_RF_OFF
+	mod.rf.mode = SIM800L_RF_OFF;
+	mod.task_ticks = 100000;
+	modem_set_ticks(109000);
+	rf_wake(&mod, 1000, true);
+	host_assert(mod.rf.interval == 99000 && mod.rf.wake == 9000);
+	host_assert(mod.rf.wake_off == (3 * RF_WAKE_OFF_MS + 9000) / 4);
+
+	// Not registered: the latency is not the cost of the mode
+	mod.task_ticks = 200000;
+	modem_set_ticks(201000);
+	rf_wake(&mod, 101000, false);
+	host_assert(mod.rf.wake == 1000 && mod.rf.wake_off == 6000);
+
+	mod.rf.mode = SIM800L_RF_SLEEP;
+	mod.task_ticks = 300000;
+	modem_set_ticks(300200);
+	rf_wake(&mod, 200000, true);
+	host_assert(mod.rf.wake == 200 && mod.rf.wake_off == 6000);
+	host_assert(mod.rf.interval == (3 * 99000 + 100000) / 4);
+
+	sim800l_get_rf_stats(&mod, &stats);
+	host_assert(stats.wake == 200 && stats.mode == SIM800L_RF_SLEEP);
+
+	// "+CREG: <stat>" URC
+	modem_send_str("\r\n+CREG: 1\r\n");
+	host_assert(wait_flag(&mod, FLAG_NET_REG, 100));
+	modem_send_str("\r\n+CREG: 0\r\n\r\nOK\r\n");
+	host_assert(expect(&mod, NULL, 100) && !(mod.flags & FLAG_NET_REG));
+	modem_send_str("\r\n+CREG: 5\r\n");
+	host_assert(wait_flag(&mod, FLAG_NET_REG, 100));
+}
+
+static void test_wake(void)
+{
+	sim800l_init(&mod, &uart, &gpio, 1, "apn");
+	modem_attach(&mod, &uart);
+	sim800l_rx_start(&mod);
+	modem.command = command;
+	modem.wait = wait;
+
+	modem_run(&mod, pdMS_TO_TICKS(RUN_MS));
+	host_assert(step == 3);
+
+	// Voltage is measured without waiting for the network
+	host_assert(!status[0] && done[0] - queued[0] < pdMS_TO_TICKS(1000));
+
+	// HTTP waits for it once before the attempt fails
+	host_assert(status[1] == -1);
+	host_assert(poll_at - queued[1] >= pdMS_TO_TICKS(RF_REG_MS));
+	host_assert(poll_at - queued[1] < pdMS_TO_TICKS(RF_REG_MS + 1000));
+	host_assert(poll_errors == 1);
+
+	// Only the registered wake-up counts
+	host_assert(!status[2] && mod.rf.wake_off < RF_WAKE_OFF_MS);
+
+	printf("voltage in %u ms, HTTP failed in %u ms, wake_off %u ms\n",
+			(unsigned) (done[0] - queued[0]),
+			(unsigned) (done[1] - queued[1]), mod.rf.wake_off);
+}
+
+int main(void)
+{
+	sim800l_init(&mod, &uart, &gpio, 1, "apn");
+	modem_attach(&mod, &uart);
+	sim800l_rx_start(&mod);
+	test_policy();
+
+	test_wake();
+	return 0;
+}
@@ -0,0 +1,116 @@
+/*
+ * SIM800L receive ring: +HTTPREAD payloads with the modem running ahead of
+ * the driver by up to one and a half rings between two of its blocks.
+ * Overwritten data must be detected, a payload is either exact or dropped.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modem.h"
+
+#include "sim800l.c"
+
+#define SEEDS    20000
+#define PAYLOAD  1000
+#define TRAILER  "\r\n+CREG: 1\r\n"
+#define TRAILERS 40
+
+static struct sim800l mod;
+static UART_HandleTypeDef uart;
+static GPIO_TypeDef gpio;
+
+
+/*
+ * @brief: Drop everything received, the next data is at the DMA position
+ */
+static void clear(void)
+{
+	modem_drain();
+	mod.rxtail = mod.rxhead;
+	mod.llen = 0;
+	mod.payload = 0;
+}
+
+/*
+ * @retval: 1 - exact payload, 0 - overrun detected
+ */
+static int http_read(size_t max, int idle)
+{
+	static char tr[PAYLOAD * 2 + sizeof(TRAILER) * TRAILERS];
+	static uint8_t payload[PAYLOAD];
+	struct sim800l_http http = {0};
+	uint32_t overruns = mod.overruns;
+	size_t len = 1 + rand() % PAYLOAD;
+	int n;
+	int ret;
+
+	// Random start in the ring
+	modem.chunk = 64;
+	modem.idle = 1;
+	memset(tr, 'x', rand() % SIM800L_RING_SIZE);
+	modem_send(tr, rand() % SIM800L_RING_SIZE);
+	clear();
+
+	// Bytes of the next lap differ from those they overwrite
+	for (size_t i = 0; i < len; i++)
+		payload[i] = rand();
+	n = sprintf(tr, "\r\n+HTTPREAD: %u\r\n", (unsigned) len);
+	memcpy(tr + n, payload, len);
+	n += len;
+	n += sprintf(tr + n, "\r\nOK\r\n");
+	for (int i = 0; i < TRAILERS; i++)
+		n += sprintf(tr + n, TRAILER);
+
+	modem.chunk = max;
+	modem.idle = idle;
+	modem_send(tr, n);
+	mod.task.data = &http;
+	ret = parse_http_read(&mod, 10000);
+
+	if (ret < 0)
+	{
+		host_assert(!http.response && mod.overruns != overruns);
+		return 0;
+	}
+
+	host_assert(ret == len && http.rlen == len);
+	host_assert(!memcmp(http.response, payload, len));
+	vPortFree(http.response);
+	return 1;
+}
+
+int main(void)
+{
+	int exact = 0;
+	int dropped = 0;
+
+	sim800l_init(&mod, &uart, &gpio, 1, "apn");
+	modem_attach(&mod, &uart);
+	sim800l_rx_start(&mod);
+
+	// The driver keeps up with chunks of half a ring
+	for (int seed = 0; seed < SEEDS; seed++)
+	{
+		srand(seed);
+		host_assert(http_read(1 + seed % (SIM800L_RING_SIZE / 2), seed & 1));
+	}
+	host_assert(!mod.overruns);
+
+	// Up to one and a half rings, the last part without an event
+	for (int seed = 0; seed < SEEDS; seed++)
+	{
+		srand(seed);
+		if (http_read(1 + seed % (SIM800L_RING_SIZE * 3 / 2), 0))
+			exact++;
+		else
+			dropped++;
+	}
+	host_assert(dropped && mod.overruns >= dropped);
+
+	printf("half ring chunks: %d exact\n", SEEDS);
+	printf("1.5 ring chunks: %d exact, %d dropped, %u overruns\n", exact,
+			dropped, mod.overruns);
+	return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * SIM800L URC dispatcher: URCs interleaved with responses at random chunk
+ * boundaries are stripped and handled, URC text inside +HTTPREAD payloads
+ * is data, events abort waits at once and drive the state machine
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "modem.h"
+
+#include "sim800l.c"
+
+#define SEEDS 3000
+
+static struct sim800l mod;
+static UART_HandleTypeDef uart;
+static GPIO_TypeDef gpio;
+
+static int custom;
+
+
+static bool urc_custom(struct sim800l *m, const char *line, void *ctx)
+{
+	host_assert(ctx == &custom && !strncmp(line, "+CMTI:", 6));
+	custom++;
+	return true;
+}
+
+static void test_strip(void)
+{
+	uint32_t alarms = mod.voltage_alarms;
+	int calls = custom;
+
+	// "+CREG: <stat>" is a URC, "+CREG: <n>,<stat>" the response
+	modem_send_str("\r\n+CREG: 2\r\n\r\n+CMTI: \"SM\",1\r\n\r\n+CREG: 1,1\r\n"
+			"\r\nUNDER-VOLTAGE WARNNING\r\n\r\nOK\r\n");
+	host_assert(expect(&mod, "+CREG: 1,1", 500));
+	host_assert(mod.voltage_alarms == alarms + 1 && custom == calls + 1);
+	host_assert(!mod.events && !(mod.flags & FLAG_NET_REG));
+}
+
+static void test_payload(void)
+{
+	static const char payload[] = "RDY\r\nNORMAL POWER DOWN\r\n+PDP: DEACT\r\n";
+	struct sim800l_http http = {0};
+	char tr[128];
+
+	sprintf(tr, "\r\n+HTTPREAD: %d\r\n%s\r\nOK\r\n", (int) strlen(payload),
+			payload);
+	modem_send_str(tr);
+	mod.task.data = &http;
+	host_assert(parse_http_read(&mod, 1000) == strlen(payload));
+	host_assert(!strcmp(http.response, payload) && !mod.events);
+	vPortFree(http.response);
+}
+
+static void test_boot(void)
+{
+	mod.flags = 0;
+	modem_send_str("\r\nRDY\r\n\r\n+CFUN: 1\r\n\r\n+CPIN: READY\r\n"
+			"\r\nCall Ready\r\n\r\nSMS Ready\r\n");
+	host_assert(wait_flag(&mod, FLAG_SMS_READY, 3000));
+	host_assert((mod.flags & FLAG_SIM_READY) && !mod.events);
+
+	// Offline "+CREG: 0" (CFUN=0) is not an event
+	mod.flags = FLAG_INIT | FLAG_SIM_READY | FLAG_SMS_READY;
+	mod.state = STATE_IDLE;
+	modem_send_str("\r\n+CPIN: NOT READY\r\n\r\n+CREG: 0\r\n\r\nOK\r\n");
+	host_assert(expect(&mod, NULL, 10000) && !mod.events);
+	host_assert(!(mod.flags & (FLAG_SIM_READY | FLAG_SMS_READY)));
+}
+
+static void test_net_lost(void)
+{
+	TickType_t start;
+
+	// The bearer is lost during a request: no 30 s timeout
+	mod.state = STATE_GPRS_HTTP;
+	mod.flags = FLAG_INIT;
+	modem_send_str("\r\nOK\r\n\r\n+PDP: DEACT\r\n");
+	start = xTaskGetTickCount();
+	host_assert(!wait_line(&mod, "+HTTPACTION:", 30000));
+	host_assert(mod.events == EVENT_NET_LOST);
+	host_assert(xTaskGetTickCount() - start < 1000);
+
+	// The session is closed, the task repeated after CREG
+	state(&mod, STATE_GPRS_HTTP_TERM, STATUS_ERROR);
+	host_assert(mod.state == STATE_GPRS_HTTP_TERM && !mod.events);
+
+	mod.state = STATE_GPRS_INIT;
+	modem_send_str("\r\n+CREG: 3\r\n");
+	start = xTaskGetTickCount();
+	host_assert(!expect(&mod, NULL, 20000));
+	host_assert(mod.events == EVENT_NET_LOST);
+	host_assert(xTaskGetTickCount() - start < 1000);
+	mod.events = 0;
+}
+
+static void test_restart(void)
+{
+	TickType_t start;
+
+	mod.state = STATE_IDLE;
+	mod.flags = FLAG_INIT;
+	mod.errors = 0;
+	mod.task.issue = ISSUE_IDLE;
+	modem_send_str("\r\nUNDER-VOLTAGE POWER DOWN\r\n");
+	start = xTaskGetTickCount();
+	host_assert(!expect(&mod, NULL, 5000));
+	host_assert(xTaskGetTickCount() - start < 1000);
+
+	state(&mod, STATE_IDLE, STATUS_ERROR);
+	host_assert(mod.state == STATE_STARTUP && !mod.events);
+}
+
+static void test_stale(void)
+{
+	uint32_t alarms = mod.voltage_alarms;
+
+	// Flushed before a command, the URC is still handled
+	mod.state = STATE_IDLE;
+	modem_send_str("\r\nOK\r\n\r\nUNDER-VOLTAGE WARNNING\r\n");
+	modem_drain();
+	transmit(&mod, "AT");
+	host_assert(mod.voltage_alarms == alarms + 1);
+	host_assert(mod.rxtail == mod.rxhead && !mod.llen);
+}
+
+int main(void)
+{
+	sim800l_init(&mod, &uart, &gpio, 1, "apn");
+	modem_attach(&mod, &uart);
+	sim800l_rx_start(&mod);
+	host_assert(!sim800l_urc(&mod, "+CMTI:", urc_custom, &custom));
+
+	for (int seed = 0; seed < SEEDS; seed++)
+	{
+		srand(seed);
+		modem.chunk = 1 + seed % 40;
+		modem.idle = seed & 1;
+		mod.state = STATE_IDLE;
+		mod.flags = FLAG_INIT;
+		mod.events = 0;
+
+		test_strip();
+		test_payload();
+		test_boot();
+		test_net_lost();
+		test_restart();
+		test_stale();
+	}
+	host_assert(!mod.overruns);
+
+	printf("%d seeds, %d custom URCs\n", SEEDS, custom);
+	return 0;
+}
@@ -0,0 +1,413 @@
+/*
+ * W25Q driver on the emulated memory: asynchronous reads, programs and
+ * erases completed by the SPI DMA interrupt and w25q_poll(), erase
+ * suspend/resume, the synchronous w25q_s wrappers over them, erase timeouts,
+ * and the geometry from SFDP
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "host.h"
+#include "w25q_emu.h"
+#include "w25q_s.h"
+
+#define CAPACITY (1024 * 1024)
+#define ADDR     0x10000
+
+static struct w25q_emu emu;
+static struct w25q mem;
+static struct w25q_s smem;
+static struct w25q *irq_mem; // Gets the SPI interrupts
+static SPI_HandleTypeDef spi;
+static GPIO_TypeDef gpio;
+
+static uint8_t data[3 * W25Q_PAGE_SIZE];
+static uint8_t buf[3 * W25Q_PAGE_SIZE];
+
+struct done
+{
+	int calls;
+	int status;
+	uint8_t isr;
+};
+
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	w25q_spi_irq(irq_mem, W25Q_OK);
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	w25q_spi_irq(irq_mem, W25Q_OK);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+	w25q_spi_irq(irq_mem, W25Q_ERR_SPI);
+}
+
+static void callback(int status, void *context)
+{
+	struct done *d = context;
+
+	d->calls++;
+	d->status = status;
+	d->isr = xPortIsInsideInterrupt();
+}
+
+/*
+ * @brief: Sleep and poll every tick as the w25q_s poll timer does
+ * @retval: Time to the completion, us
+ */
+static uint64_t wait(struct done *d)
+{
+	uint64_t t = host_us();
+
+	while (!d->calls)
+	{
+		vTaskDelay(1);
+		w25q_poll(&mem);
+	}
+	host_assert(d->calls == 1);
+	host_assert(mem.state == W25Q_STATE_IDLE);
+
+	return host_us() - t;
+}
+
+static void test_read(void)
+{
+	struct done d = {0};
+
+	memcpy(&emu.mem[ADDR], data, sizeof(data));
+	memset(buf, 0, sizeof(buf));
+
+	host_assert(!w25q_read_data_async(&mem, ADDR + 3, buf, 500, callback,
+			&d));
+	host_assert(mem.state == W25Q_STATE_XFER);
+	// Another operation waits for this one
+	host_assert(w25q_read_data_async(&mem, ADDR, buf, 1, callback, &d) ==
+			W25Q_ERR_BUSY);
+	wait(&d);
+
+	host_assert(!d.status && d.isr);
+	host_assert(!memcmp(buf, &data[3], 500));
+	printf("read: 500 B, callback from the DMA interrupt\n");
+}
+
+static void test_program(void)
+{
+	uint32_t polls = emu.stats.polls;
+	uint32_t programs;
+	struct done d = {0};
+	uint64_t us;
+
+	host_assert(!w25q_sector_erase_async(&mem, ADDR, callback, &d));
+	us = wait(&d);
+	host_assert(!d.status && !d.isr);
+	host_assert(us >= emu.timing.sector_us);
+	// One status read per tick instead of spinning on the busy bit
+	host_assert(emu.stats.polls - polls <= us / 1000 + 1);
+	for (size_t i = 0; i < W25Q_SECTOR_SIZE; i++)
+		host_assert(emu.mem[ADDR + i] == 0xFF);
+	printf("sector erase: %llu us, %u polls\n", (unsigned long long) us,
+			emu.stats.polls - polls);
+
+	// One page
+	memset(&d, 0, sizeof(d));
+	host_assert(!w25q_write_data_async(&mem, ADDR, data, W25Q_PAGE_SIZE,
+			callback, &d));
+	us = wait(&d);
+	host_assert(!d.status);
+	host_assert(us >= emu.timing.program_us);
+	host_assert(!memcmp(&emu.mem[ADDR], data, W25Q_PAGE_SIZE));
+
+	// Unaligned over three pages: split on page boundaries
+	memset(&d, 0, sizeof(d));
+	programs = emu.stats.programs;
+	host_assert(!w25q_write_buffer_async(&mem, ADDR + W25Q_PAGE_SIZE + 100,
+			data, 2 * W25Q_PAGE_SIZE, callback, &d));
+	wait(&d);
+	host_assert(!d.status);
+	host_assert(emu.stats.programs - programs == 3);
+	host_assert(!memcmp(&emu.mem[ADDR + W25Q_PAGE_SIZE + 100], data,
+			2 * W25Q_PAGE_SIZE));
+	host_assert(!emu.stats.busy && !emu.stats.no_wel && !emu.stats.set_bits);
+	printf("program: 1 page, 3 pages unaligned\n");
+}
+
+static void test_errors(void)
+{
+	uint32_t program_us = emu.timing.program_us;
+	struct done d = {0};
+
+	// The header can not be sent
+	host_spi_fail(1);
+	host_assert(w25q_read_data_async(&mem, ADDR, buf, 100, callback, &d) ==
+			W25Q_ERR_SPI);
+	host_assert(w25q_sector_erase_async(&mem, ADDR, callback, &d) ==
+			W25Q_ERR_SPI);
+	host_spi_fail(0);
+	host_assert(mem.state == W25Q_STATE_IDLE && !d.calls);
+
+	// Not an erase unit
+	host_assert(w25q_erase_async(&mem, ADDR, 1000, callback, &d) ==
+			W25Q_ERR_ARG);
+
+	// The memory stays busy longer than the program timeout
+	emu.timing.program_us = (mem.geo.program_timeout + 10) * 1000;
+	host_assert(!w25q_write_data_async(&mem, ADDR + 2 * W25Q_SECTOR_SIZE,
+			data, 16, callback, &d));
+	wait(&d);
+	host_assert(d.status == W25Q_ERR_TIMEOUT);
+	emu.timing.program_us = program_us;
+	vTaskDelay(pdMS_TO_TICKS(20));
+	printf("errors: SPI, argument, timeout after %u ms\n",
+			(unsigned) mem.geo.program_timeout);
+}
+
+static void test_suspend(void)
+{
+	uint32_t suspends = emu.stats.suspends;
+	struct done d = {0};
+	uint64_t t = host_us();
+
+	memcpy(&emu.mem[ADDR + W25Q_SECTOR_SIZE], data, sizeof(data));
+
+	// Nothing to suspend
+	host_assert(w25q_suspend(&mem) == W25Q_ERR_BUSY);
+
+	host_assert(!w25q_sector_erase_async(&mem, ADDR, callback, &d));
+	vTaskDelay(1);
+	host_assert(!w25q_suspend(&mem));
+	host_assert(mem.suspended && emu.suspended);
+	host_assert(emu.stats.suspends - suspends == 1);
+
+	// Another sector is read while the erase waits
+	w25q_read_data(&mem, ADDR + W25Q_SECTOR_SIZE, buf, sizeof(data));
+	host_assert(!memcmp(buf, data, sizeof(data)));
+
+	// Suspended longer than the erase timeout: no completion, no timeout
+	for (uint32_t i = 0; i < mem.timeout + 10; i++)
+	{
+		vTaskDelay(1);
+		host_assert(w25q_poll(&mem));
+	}
+	host_assert(!d.calls);
+
+	w25q_resume(&mem);
+	host_assert(!mem.suspended && !emu.suspended);
+	wait(&d);
+	host_assert(!d.status);
+	host_assert(host_us() - t >= emu.timing.sector_us + mem.timeout * 1000);
+	for (size_t i = 0; i < W25Q_SECTOR_SIZE; i++)
+		host_assert(emu.mem[ADDR + i] == 0xFF);
+	host_assert(!memcmp(&emu.mem[ADDR + W25Q_SECTOR_SIZE], data,
+			sizeof(data)));
+	host_assert(!emu.stats.erase_reads);
+
+	// The erase finished before the suspend: completed by w25q_poll()
+	memset(&d, 0, sizeof(d));
+	host_assert(!w25q_sector_erase_async(&mem, ADDR, callback, &d));
+	vTaskDelay(pdMS_TO_TICKS(emu.timing.sector_us / 1000 + 1));
+	host_assert(!w25q_suspend(&mem));
+	host_assert(!mem.suspended);
+	host_assert(!w25q_poll(&mem));
+	host_assert(d.calls == 1 && !d.status);
+
+	printf("suspend: read during the erase, %u ms suspended without a "
+			"timeout\n", (unsigned) mem.timeout + 10);
+}
+
+static volatile int erased;
+
+static void eraser(void *arg)
+{
+	// A bulk client, as OTA
+	host_assert(!w25q_s_client(&smem, osPriorityLow));
+	host_assert(!w25q_s_erase(&smem, ADDR, W25Q_SECTOR_SIZE));
+	erased = 1;
+}
+
+static void test_suspend_s(void)
+{
+	static uint8_t rd[W25Q_PAGE_SIZE];
+	uint32_t suspends = emu.stats.suspends;
+	uint64_t worst = 0;
+	uint64_t t = host_us();
+	uint64_t r;
+	int reads = 0;
+
+	memcpy(&emu.mem[ADDR + W25Q_SECTOR_SIZE], data, sizeof(data));
+	erased = 0;
+	host_task("eraser", osPriorityLow, eraser, NULL, 0);
+
+	// Reads of another sector do not wait for the erase
+	while (!erased)
+	{
+		vTaskDelay(2);
+		r = host_us();
+		host_assert(!w25q_s_read_data(&smem, ADDR + W25Q_SECTOR_SIZE +
+				reads % 3 * W25Q_PAGE_SIZE, rd, sizeof(rd)));
+		host_assert(!memcmp(rd, &data[reads % 3 * W25Q_PAGE_SIZE],
+				sizeof(rd)));
+		r = host_us() - r;
+		if (r > worst)
+			worst = r;
+		reads++;
+	}
+
+	host_assert(emu.stats.suspends - suspends > 0);
+	host_assert(worst < 2000);
+	host_assert(!emu.stats.erase_reads);
+	for (size_t i = 0; i < W25Q_SECTOR_SIZE; i++)
+		host_assert(emu.mem[ADDR + i] == 0xFF);
+
+	printf("w25q_s suspend: %d reads during a %llu us erase, %u suspends, "
+			"worst read %llu us\n", reads,
+			(unsigned long long) (host_us() - t),
+			emu.stats.suspends - suspends, (unsigned long long) worst);
+}
+
+static void test_sync(void)
+{
+	static uint8_t rd[W25Q_SECTOR_SIZE];
+	uint32_t polls = emu.stats.polls;
+	uint64_t t = host_us();
+
+	// The caller sleeps until the poll timer sees the completion
+	host_assert(!w25q_s_erase(&smem, ADDR + W25Q_SECTOR_SIZE,
+			W25Q_SECTOR_SIZE));
+	host_assert(host_us() - t >= emu.timing.sector_us);
+	host_assert(emu.stats.polls - polls <= (host_us() - t) / 1000 + 2);
+
+	host_assert(!w25q_s_write_buffer(&smem, ADDR + W25Q_SECTOR_SIZE + 7,
+			data, sizeof(data)));
+	host_assert(!w25q_s_read_data(&smem, ADDR + W25Q_SECTOR_SIZE, rd,
+			sizeof(rd)));
+	host_assert(!memcmp(&rd[7], data, sizeof(data)));
+	host_assert(!memcmp(&emu.mem[ADDR + W25Q_SECTOR_SIZE + 7], data,
+			sizeof(data)));
+	printf("w25q_s: erase, write and read wrappers\n");
+}
+
+/*
+ * @brief: Probe a memory with a BFPT of "dwords" length
+ */
+static void probe(struct w25q_emu *e, struct w25q *m, uint32_t capacity,
+		uint32_t dwords)
+{
+	w25q_emu_init(e, capacity);
+	e->addr4 = capacity > 16 * 1024 * 1024;
+	e->sfdp_dwords = dwords;
+	w25q_emu_sfdp(e);
+	host_spi_attach(&spi, e);
+
+	w25q_init(m, &spi, &gpio, 0);
+	host_assert(!w25q_probe(m));
+	host_assert(m->geo.capacity == capacity);
+}
+
+static void test_sfdp(void)
+{
+	static const uint32_t old[] = {9, 0};
+	struct w25q_emu e;
+	struct w25q m;
+
+	// JESD216A: erase and program timings of the table
+	probe(&e, &m, CAPACITY, 16);
+	host_assert(m.geo.sfdp);
+	host_assert(m.geo.program_timeout < 1000);
+	host_assert(m.geo.erase[2].size == W25Q_SECTOR_SIZE &&
+			m.geo.erase[2].timeout < 1000);
+	w25q_emu_free(&e);
+
+	// JESD216 has no timings, older tables and no table: Winbond defaults
+	// with the JEDEC ID capacity
+	for (size_t i = 0; i < sizeof(old) / sizeof(old[0]); i++)
+	{
+		probe(&e, &m, CAPACITY, old[i]);
+		host_assert(!m.geo.sfdp);
+		host_assert(m.geo.program_timeout == 1000);
+		host_assert(m.geo.erase[0].size == W25Q_BLOCK_SIZE);
+		w25q_emu_free(&e);
+	}
+
+	// The size must be an erase type of the memory at that address
+	probe(&e, &m, 32 * 1024 * 1024, 16);
+	host_assert(m.geo.addr == W25Q_ADDR_3_4);
+	host_assert(w25q_block32_erase(&m, 0) == W25Q_OK);
+	host_assert(w25q_sector_erase(&m, 16 * 1024 * 1024) == W25Q_OK);
+	host_assert(w25q_block_erase(&m, 16 * 1024 * 1024) == W25Q_OK);
+	// 32 KB erase has no 4-byte address command
+	host_assert(w25q_block32_erase(&m, 16 * 1024 * 1024) == W25Q_ERR_ARG);
+	host_assert(w25q_erase(&m, 0, 1000) == W25Q_ERR_ARG);
+	host_assert(e.stats.erases == 3);
+	w25q_emu_free(&e);
+
+	printf("sfdp: JESD216A table used, JESD216 and none fall back, "
+			"erase sizes checked\n");
+}
+
+/*
+ * @brief: Synchronous erases before the scheduler: an erase still busy after
+ * the timeout of its type fails, the range stops there
+ */
+static void test_erase_timeout(void)
+{
+	static struct w25q_s s; // Its timer stays registered
+	struct w25q_emu e;
+
+	probe(&e, &s.mem, CAPACITY, 16);
+	w25q_s_init(&s, &spi, &gpio, 0);
+	e.timing.sector_us = (s.mem.geo.erase[2].timeout + 10) * 1000;
+
+	host_assert(w25q_s_erase(&s, 0, 2 * W25Q_SECTOR_SIZE) ==
+			W25Q_ERR_TIMEOUT);
+	host_assert(e.stats.erases == 1 && !e.stats.busy);
+
+	vPortFree(s.lines);
+	vPortFree(s.cache);
+	vPortFree(s.wear);
+	w25q_emu_free(&e);
+	printf("erase timeout: returned after %u ms, range stopped\n",
+			(unsigned) s.mem.geo.erase[2].timeout);
+}
+
+static void task(void *arg)
+{
+	irq_mem = &mem;
+	test_read();
+	test_program();
+	test_errors();
+	test_suspend();
+
+	irq_mem = &smem.mem;
+	test_sync();
+	test_suspend_s();
+}
+
+int main(void)
+{
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = i * 7 + 1;
+
+	test_sfdp();
+	test_erase_timeout();
+
+	w25q_emu_init(&emu, CAPACITY);
+	w25q_emu_sfdp(&emu);
+	host_spi_attach(&spi, &emu);
+
+	w25q_init(&mem, &spi, &gpio, 0);
+	host_assert(!w25q_probe(&mem));
+	w25q_s_init(&smem, &spi, &gpio, 0);
+
+	host_task("test", osPriorityNormal, task, NULL, 0);
+	host_run();
+
+	host_assert(!emu.stats.busy && !emu.stats.no_wel);
+	w25q_emu_free(&emu);
+	return 0;
+}
@@ -0,0 +1,206 @@
+/*
+ * w25q_s scheduler: priority inheritance of the task holding the memory,
+ * also over a kernel mutex it holds, and aging of waiting clients
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "host.h"
+#include "w25q_emu.h"
+#include "w25q_s.h"
+
+#define ADDR     0x10000
+#define RUN_MS   500
+#define BULK     (32 * 1024)
+#define HOG_MS   10 // Busy, then sleeping as long
+
+static struct w25q_emu emu;
+static struct w25q_s smem;
+static struct w25q_s fair; // Clients of its own for the aging scenario
+static struct w25q_s base; // and for the kernel mutex scenario
+static SPI_HandleTypeDef spi;
+static GPIO_TypeDef gpio;
+
+static volatile int stop;
+static TaskHandle_t bulk_task;
+static char order[4];
+static size_t norder;
+static SemaphoreHandle_t mutex;
+static UBaseType_t owner_prio[3];
+
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	w25q_spi_irq(&smem.mem, W25Q_OK);
+}
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+{
+	w25q_spi_irq(&smem.mem, W25Q_OK);
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+{
+	w25q_spi_irq(&smem.mem, W25Q_ERR_SPI);
+}
+
+/*
+ * @brief: Image check of OTA: long reads at osPriorityLow
+ */
+static void bulk(void *arg)
+{
+	static uint8_t buf[BULK];
+
+	host_assert(!w25q_s_client(&smem, osPriorityLow));
+	while (!stop)
+	{
+		host_assert(!w25q_s_read_data(&smem, ADDR, buf, sizeof(buf)));
+		host_assert(uxTaskPriorityGet(NULL) == osPriorityLow);
+		vTaskDelay(1);
+	}
+}
+
+/*
+ * @brief: Computation at osPriorityNormal, preemptible every 50 us
+ */
+static void hog(void *arg)
+{
+	uint64_t end;
+
+	while (!stop)
+	{
+		end = host_ns() + HOG_MS * 1000000ULL;
+		while (host_ns() < end)
+		{
+			host_advance(50000);
+			taskYIELD();
+		}
+		vTaskDelay(pdMS_TO_TICKS(HOG_MS));
+	}
+}
+
+/*
+ * @brief: A high priority task reads while the bulk reader holds the
+ * memory and the hog is busy. Without inheritance it waits for the hog.
+ */
+static void test_inherit(void *arg)
+{
+	uint8_t buf[64];
+	uint64_t worst = 0;
+	uint64_t t;
+	int reads = 0;
+
+	while (host_us() < RUN_MS * 1000)
+	{
+		vTaskDelay(pdMS_TO_TICKS(3));
+		t = host_us();
+		host_assert(!w25q_s_read_data(&smem, ADDR + BULK +
+				reads % 16 * W25Q_PAGE_SIZE, buf, sizeof(buf)));
+		t = host_us() - t;
+		if (t > worst)
+			worst = t;
+		reads++;
+	}
+	stop = 1;
+
+	// A 1 KB chunk and a page read at most
+	host_assert(worst < 1000);
+	printf("inheritance: %d reads, worst %llu us\n", reads,
+			(unsigned long long) worst);
+}
+
+static void holder(void *arg)
+{
+	host_assert(!w25q_s_lock(&fair, W25Q_S_TIMEOUT));
+	order[norder++] = 'H';
+	vTaskDelay(pdMS_TO_TICKS(300));
+	w25q_s_unlock(&fair);
+}
+
+static void waiter(void *arg)
+{
+	const char *name = arg;
+
+	vTaskDelay(pdMS_TO_TICKS(name[0] == 'L' ? 10 : 290));
+	if (name[0] == 'L')
+		host_assert(!w25q_s_client(&fair, osPriorityLow));
+	host_assert(!w25q_s_lock(&fair, W25Q_S_OP_TIMEOUT));
+	order[norder++] = name[0];
+	w25q_s_unlock(&fair);
+}
+
+/*
+ * @brief: mfifo task: holds its mutex, inherited by a high priority task,
+ * when it takes the memory and a realtime client waits for it
+ */
+static void owner(void *arg)
+{
+	// Registered at its own priority
+	host_assert(!w25q_s_lock(&base, W25Q_S_TIMEOUT));
+	w25q_s_unlock(&base);
+
+	host_assert(xSemaphoreTake(mutex, portMAX_DELAY) == pdTRUE);
+	vTaskDelay(pdMS_TO_TICKS(10));
+	owner_prio[0] = uxTaskPriorityGet(NULL);
+
+	host_assert(!w25q_s_lock(&base, W25Q_S_TIMEOUT));
+	vTaskDelay(pdMS_TO_TICKS(10));
+	host_assert(base.boosted);
+	w25q_s_unlock(&base);
+	owner_prio[1] = uxTaskPriorityGet(NULL);
+
+	xSemaphoreGive(mutex);
+	owner_prio[2] = uxTaskPriorityGet(NULL);
+}
+
+static void contender(void *arg)
+{
+	vTaskDelay(pdMS_TO_TICKS(5));
+	host_assert(xSemaphoreTake(mutex, portMAX_DELAY) == pdTRUE);
+	xSemaphoreGive(mutex);
+}
+
+static void urgent(void *arg)
+{
+	vTaskDelay(pdMS_TO_TICKS(15));
+	host_assert(!w25q_s_lock(&base, W25Q_S_OP_TIMEOUT));
+	w25q_s_unlock(&base);
+}
+
+int main(void)
+{
+	w25q_emu_init(&emu, 1024 * 1024);
+	host_spi_attach(&spi, &emu);
+	w25q_s_init(&smem, &spi, &gpio, 0);
+	w25q_s_init(&fair, &spi, &gpio, 0);
+	w25q_s_init(&base, &spi, &gpio, 0);
+	mutex = xSemaphoreCreateMutex();
+
+	bulk_task = host_task("bulk", osPriorityLow, bulk, NULL, 0);
+	host_task("hog", osPriorityNormal, hog, NULL, 0);
+	host_task("reader", osPriorityHigh, test_inherit, NULL, 0);
+	host_run();
+
+	// A low priority client waiting 280 ms does not pass a normal one
+	host_task("holder", osPriorityNormal, holder, NULL, 0);
+	host_task("low", osPriorityLow, waiter, "L", 0);
+	host_task("normal", osPriorityNormal, waiter, "N", 0);
+	host_run();
+	host_assert(!memcmp(order, "HNL", 3));
+	printf("aging: served %.3s\n", order);
+
+	// The boost ends at the registered priority, not at the inherited one
+	host_task("owner", osPriorityNormal, owner, NULL, 0);
+	host_task("contender", osPriorityHigh, contender, NULL, 0);
+	host_task("urgent", osPriorityRealtime, urgent, NULL, 0);
+	host_run();
+	host_assert(owner_prio[0] == osPriorityHigh);
+	host_assert(owner_prio[1] == osPriorityHigh);
+	host_assert(owner_prio[2] == osPriorityNormal);
+	printf("base priority: %u with the mutex, %u after it\n",
+			(unsigned) owner_prio[1], (unsigned) owner_prio[2]);
+
+	w25q_emu_free(&emu);
+	return 0;
+}
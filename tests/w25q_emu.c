@@ -0,0 +1,581 @@
+/*
+ * W25Q Serial FLASH memory emulator
+ */
+
+#include "w25q_emu.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "host.h"
+
+#define CMD_WRITE_ENABLE   0x06
+#define CMD_WRITE_DISABLE  0x04
+#define CMD_READ_SR1       0x05
+#define CMD_READ_SR2       0x35
+#define CMD_READ_SR3       0x15
+#define CMD_JEDEC_ID       0x9F
+#define CMD_RELEASE_PD     0xAB
+#define CMD_POWER_DOWN     0xB9
+#define CMD_READ           0x03
+#define CMD_FAST_READ      0x0B
+#define CMD_FAST_READ_4B   0x0C
+#define CMD_PROGRAM        0x02
+#define CMD_PROGRAM_4B     0x12
+#define CMD_SECTOR_ERASE   0x20
+#define CMD_SECTOR_ERASE_4B 0x21
+#define CMD_BLOCK32_ERASE  0x52
+#define CMD_BLOCK_ERASE    0xD8
+#define CMD_BLOCK_ERASE_4B 0xDC
+#define CMD_CHIP_ERASE     0xC7
+#define CMD_CHIP_ERASE_ALT 0x60
+#define CMD_SUSPEND        0x75
+#define CMD_RESUME         0x7A
+#define CMD_READ_SFDP      0x5A
+
+#define CMD_IGNORED 0x00 // Rest of the transaction is ignored
+
+#define SR1_BUSY 0x01
+#define SR1_WEL  0x02
+#define SR2_SUS  0x80
+
+#define SFDP_BFPT 0x80
+
+#define US 1000ULL
+#define MS 1000000ULL
+
+
+static uint64_t now(void)
+{
+	return host_ns();
+}
+
+/*
+ * @brief: SFDP typical time field: count - 1 and the unit index of the
+ * smallest unit the time fits in with 5 bits
+ */
+static uint32_t sfdp_time(uint32_t t, const uint32_t *units, size_t n)
+{
+	uint32_t count;
+
+	for (size_t i = 0; i < n; i++)
+	{
+		count = (t + units[i] - 1) / units[i];
+		if (count <= 32 || i == n - 1)
+		{
+			if (count > 32)
+				count = 32;
+			if (!count)
+				count = 1;
+			return (count - 1) | i << 5;
+		}
+	}
+
+	return 0;
+}
+
+/******************************************************************************/
+void w25q_emu_sfdp(struct w25q_emu *emu)
+{
+	static const uint32_t erase_units[] = {1, 16, 128, 1000};    // ms
+	static const uint32_t chip_units[] = {16, 256, 4000, 64000}; // ms
+	uint32_t dw[16];
+	uint32_t n = emu->sfdp_dwords;
+	uint32_t bits = emu->capacity * 8;
+	uint32_t v;
+
+	memset(emu->sfdp, 0xFF, sizeof(emu->sfdp));
+	if (!n)
+		return;
+	if (n > 16)
+		n = 16;
+
+	// SFDP 1.5 header, one parameter header: the BFPT
+	memcpy(emu->sfdp, "SFDP", 4);
+	emu->sfdp[4] = 5;
+	emu->sfdp[5] = 1;
+	emu->sfdp[6] = 0;
+	emu->sfdp[7] = 0xFF;
+	emu->sfdp[8] = 0x00;
+	emu->sfdp[9] = 5;
+	emu->sfdp[10] = 1;
+	emu->sfdp[11] = n;
+	emu->sfdp[12] = SFDP_BFPT;
+	emu->sfdp[13] = 0;
+	emu->sfdp[14] = 0;
+	emu->sfdp[15] = 0xFF;
+
+	memset(dw, 0xFF, sizeof(dw));
+	dw[0] = (0xFFF920E5 & ~(3UL << 17)) | (uint32_t) emu->addr4 << 17;
+	if (emu->capacity <= 256 * 1024 * 1024)
+		dw[1] = bits - 1;
+	else
+		dw[1] = 0x80000000 | (__builtin_ctz(emu->capacity) + 3);
+	dw[2] = 0x6B08EB44;
+	dw[3] = 0x3B42BB42;
+	dw[4] = 0xFFFFFFFE;
+	dw[5] = 0xFFFFFFFF;
+	dw[6] = 0xEB40FFFF;
+	// 4 KB, 32 KB and 64 KB erase types
+	dw[7] = 0x520F200C;
+	dw[8] = 0x0000D810;
+
+	// Maximum is 2 * (3 + 1) = 8 times typical
+	dw[9] = 3;
+	v = sfdp_time(emu->timing.sector_us / 1000, erase_units, 4);
+	dw[9] |= v << 4;
+	v = sfdp_time(emu->timing.block32_us / 1000, erase_units, 4);
+	dw[9] |= v << 11;
+	v = sfdp_time(emu->timing.block64_us / 1000, erase_units, 4);
+	dw[9] |= v << 18;
+
+	dw[10] = 3 | 8 << 4; // 256 byte pages
+	if (emu->timing.program_us <= 32 * 8)
+		v = (emu->timing.program_us + 7) / 8 - 1;
+	else
+		v = ((emu->timing.program_us + 63) / 64 - 1) | 1 << 5;
+	if (!emu->timing.program_us)
+		v = 0;
+	dw[10] |= (v & 0x3F) << 8;
+	dw[10] |= 0x02 << 14 | 0x01 << 19; // Byte program, not used
+	dw[10] |= sfdp_time(emu->timing.chip_ms, chip_units, 4) << 24;
+
+	memcpy(&emu->sfdp[SFDP_BFPT], dw, n * sizeof(uint32_t));
+}
+
+/******************************************************************************/
+void w25q_emu_init(struct w25q_emu *emu, uint32_t capacity)
+{
+	memset(emu, 0, sizeof(*emu));
+	emu->capacity = capacity;
+	emu->mem = malloc(capacity);
+	emu->wear = calloc(capacity / W25Q_EMU_SECTOR, sizeof(uint32_t));
+	host_assert(emu->mem && emu->wear);
+	memset(emu->mem, 0xFF, capacity);
+
+	emu->jedec_id = 0xEF4000 | (__builtin_ctz(capacity) - 17 + 0x11);
+	emu->addr4 = capacity > 16 * 1024 * 1024 ? 1 : 0;
+	emu->sfdp_dwords = 16;
+	emu->timing.program_us = 400;
+	emu->timing.sector_us = 45000;
+	emu->timing.block32_us = 120000;
+	emu->timing.block64_us = 150000;
+	emu->timing.chip_ms = 20000;
+	emu->timing.suspend_us = 20;
+	w25q_emu_sfdp(emu);
+}
+
+/******************************************************************************/
+void w25q_emu_free(struct w25q_emu *emu)
+{
+	free(emu->mem);
+	free(emu->wear);
+	emu->mem = NULL;
+	emu->wear = NULL;
+}
+
+/******************************************************************************/
+void w25q_emu_cut(struct w25q_emu *emu, uint32_t n, uint32_t keep)
+{
+	emu->cut = n;
+	emu->keep = keep > 256 ? 256 : keep;
+}
+
+/******************************************************************************/
+void w25q_emu_power_on(struct w25q_emu *emu)
+{
+	emu->dead = 0;
+	emu->cut = 0;
+	emu->selected = 0;
+	emu->wel = 0;
+	emu->pd = 0;
+	emu->busy_until = 0;
+	emu->erasing = 0;
+	emu->suspended = 0;
+}
+
+static void erase_apply(struct w25q_emu *emu, uint32_t addr, uint32_t size)
+{
+	memset(&emu->mem[addr], 0xFF, size);
+	for (uint32_t s = addr / W25Q_EMU_SECTOR;
+			s < (addr + size) / W25Q_EMU_SECTOR; s++)
+		emu->wear[s]++;
+}
+
+/******************************************************************************/
+void w25q_emu_update(struct w25q_emu *emu)
+{
+	if (emu->erasing && !emu->suspended && now() >= emu->busy_until)
+	{
+		erase_apply(emu, emu->eaddr, emu->esize);
+		emu->erasing = 0;
+	}
+}
+
+/******************************************************************************/
+int w25q_emu_busy(struct w25q_emu *emu)
+{
+	w25q_emu_update(emu);
+	return now() < emu->busy_until;
+}
+
+/*
+ * @retval: 1 - the power is cut during this operation
+ */
+static int cut_now(struct w25q_emu *emu)
+{
+	if (!emu->cut || --emu->cut)
+		return 0;
+
+	emu->dead = 1;
+	return 1;
+}
+
+static void program(struct w25q_emu *emu)
+{
+	uint32_t base = emu->addr - emu->addr % W25Q_EMU_PAGE;
+	uint32_t done = W25Q_EMU_PAGE;
+	uint32_t n = 0;
+	uint8_t *p;
+
+	if (!emu->wel)
+	{
+		emu->stats.no_wel++;
+		return;
+	}
+	emu->wel = 0;
+
+	if (cut_now(emu))
+		done = emu->keep;
+
+	// Bytes are programmed in the order they were sent
+	for (uint32_t i = 0; i < W25Q_EMU_PAGE; i++)
+	{
+		uint32_t off = (emu->addr + i) % W25Q_EMU_PAGE;
+
+		if (!emu->pset[off])
+			continue;
+		if (n++ >= done * emu->plen / W25Q_EMU_PAGE && done < W25Q_EMU_PAGE)
+			break;
+
+		p = &emu->mem[(base + off) % emu->capacity];
+		if (emu->page[off] & ~*p)
+			emu->stats.set_bits++;
+		*p &= emu->page[off];
+	}
+
+	emu->stats.programs++;
+	emu->stats.program_bytes += emu->plen;
+	emu->stats.busy_us += emu->timing.program_us;
+	emu->busy_until = now() + emu->timing.program_us * US;
+}
+
+static void erase(struct w25q_emu *emu, uint32_t size, uint64_t ns)
+{
+	if (!emu->wel)
+	{
+		emu->stats.no_wel++;
+		return;
+	}
+	emu->wel = 0;
+
+	emu->eaddr = (emu->addr % emu->capacity) & ~(size - 1);
+	emu->esize = size;
+
+	if (cut_now(emu))
+	{
+		// A part of the range is erased, the rest keeps its data
+		memset(&emu->mem[emu->eaddr], 0xFF,
+				(uint64_t) size * emu->keep / W25Q_EMU_PAGE);
+		return;
+	}
+
+	emu->erasing = 1;
+	emu->suspended = 0;
+	emu->started = now();
+	emu->stats.erases++;
+	emu->stats.busy_us += ns / US;
+	emu->busy_until = now() + ns;
+}
+
+static void suspend(struct w25q_emu *emu)
+{
+	if (!emu->erasing || emu->suspended)
+		return;
+
+	emu->remaining = emu->busy_until - now();
+	emu->suspended = 1;
+	emu->busy_until = now() + emu->timing.suspend_us * US;
+	emu->stats.suspends++;
+}
+
+static void resume(struct w25q_emu *emu)
+{
+	if (!emu->suspended)
+		return;
+
+	emu->suspended = 0;
+	emu->busy_until = now() + emu->remaining;
+}
+
+/******************************************************************************/
+void w25q_emu_select(struct w25q_emu *emu, int selected)
+{
+	if (selected == emu->selected)
+		return;
+	emu->selected = selected;
+
+	if (selected)
+	{
+		emu->pos = 0;
+		emu->cmd = CMD_IGNORED;
+		emu->addr = 0;
+		emu->plen = 0;
+		memset(emu->pset, 0, sizeof(emu->pset));
+		return;
+	}
+
+	if (emu->dead || !emu->pos)
+		return;
+
+	// Executed on the chip select rising edge
+	switch (emu->cmd)
+	{
+	case CMD_PROGRAM:
+	case CMD_PROGRAM_4B:
+		if (emu->plen)
+			program(emu);
+		break;
+	case CMD_SECTOR_ERASE:
+	case CMD_SECTOR_ERASE_4B:
+		erase(emu, W25Q_EMU_SECTOR, emu->timing.sector_us * US);
+		break;
+	case CMD_BLOCK32_ERASE:
+		erase(emu, 32 * 1024, emu->timing.block32_us * US);
+		break;
+	case CMD_BLOCK_ERASE:
+	case CMD_BLOCK_ERASE_4B:
+		erase(emu, 64 * 1024, emu->timing.block64_us * US);
+		break;
+	case CMD_CHIP_ERASE:
+	case CMD_CHIP_ERASE_ALT:
+		emu->addr = 0;
+		erase(emu, emu->capacity, emu->timing.chip_ms * MS);
+		break;
+	case CMD_POWER_DOWN:
+		emu->pd = 1;
+		break;
+	case CMD_SUSPEND:
+		suspend(emu);
+		break;
+	case CMD_RESUME:
+		resume(emu);
+		break;
+	default:
+		break;
+	}
+}
+
+static uint32_t addr_len(struct w25q_emu *emu, uint8_t cmd)
+{
+	switch (cmd)
+	{
+	case CMD_FAST_READ_4B:
+	case CMD_PROGRAM_4B:
+	case CMD_SECTOR_ERASE_4B:
+	case CMD_BLOCK_ERASE_4B:
+		return 4;
+	default:
+		return emu->addr4 == 2 ? 4 : 3;
+	}
+}
+
+// Commands accepted while busy or suspended
+static int allowed(struct w25q_emu *emu, uint8_t cmd)
+{
+	switch (cmd)
+	{
+	case CMD_READ_SR1:
+	case CMD_READ_SR2:
+	case CMD_READ_SR3:
+		return 1;
+	case CMD_SUSPEND:
+		return emu->erasing && !emu->suspended;
+	default:
+		break;
+	}
+
+	if (now() < emu->busy_until && !(emu->erasing && emu->suspended))
+		return 0;
+	if (emu->erasing && !emu->suspended)
+		return 0;
+
+	// Suspended erase: reads, ID and resume
+	if (emu->suspended)
+	{
+		switch (cmd)
+		{
+		case CMD_READ:
+		case CMD_FAST_READ:
+		case CMD_FAST_READ_4B:
+		case CMD_READ_SFDP:
+		case CMD_JEDEC_ID:
+		case CMD_RESUME:
+			return now() >= emu->busy_until;
+		default:
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static uint8_t start(struct w25q_emu *emu, uint8_t cmd)
+{
+	emu->stats.commands++;
+	w25q_emu_update(emu);
+
+	if (emu->pd && cmd != CMD_RELEASE_PD)
+		return 0xFF;
+
+	// A suspend racing the end of the erase is ignored as by the memory
+	if (cmd == CMD_SUSPEND && !emu->erasing)
+		return 0xFF;
+
+	if (!allowed(emu, cmd))
+	{
+		emu->stats.busy++;
+		return 0xFF;
+	}
+
+	emu->cmd = cmd;
+	switch (cmd)
+	{
+	case CMD_WRITE_ENABLE:
+		emu->wel = 1;
+		break;
+	case CMD_WRITE_DISABLE:
+		emu->wel = 0;
+		break;
+	case CMD_RELEASE_PD:
+		emu->pd = 0;
+		break;
+	case CMD_READ_SR1:
+		emu->stats.polls++;
+		break;
+	default:
+		break;
+	}
+
+	return 0xFF;
+}
+
+static uint8_t data(struct w25q_emu *emu, uint8_t in)
+{
+	uint32_t alen = addr_len(emu, emu->cmd);
+	uint32_t pos = emu->pos;
+	uint32_t dummy = 0;
+	uint8_t out;
+
+	switch (emu->cmd)
+	{
+	case CMD_READ_SR1:
+		return (now() < emu->busy_until || (emu->erasing &&
+				!emu->suspended) ? SR1_BUSY : 0) | (emu->wel ? SR1_WEL : 0);
+	case CMD_READ_SR2:
+		return emu->suspended ? SR2_SUS : 0;
+	case CMD_READ_SR3:
+		return 0;
+	case CMD_JEDEC_ID:
+		return pos <= 3 ? emu->jedec_id >> (8 * (3 - pos)) : 0xFF;
+	case CMD_FAST_READ:
+	case CMD_FAST_READ_4B:
+	case CMD_READ_SFDP:
+		dummy = 1;
+		// fall through
+	case CMD_READ:
+		if (emu->cmd == CMD_READ_SFDP)
+			alen = 3;
+		if (pos <= alen)
+		{
+			emu->addr = emu->addr << 8 | in;
+			return 0xFF;
+		}
+		if (pos <= alen + dummy)
+			return 0xFF;
+
+		if (emu->cmd == CMD_READ_SFDP)
+			return emu->addr < sizeof(emu->sfdp) ? emu->sfdp[emu->addr++] :
+					0xFF;
+
+		emu->addr %= emu->capacity;
+		if (pos == alen + dummy + 1)
+		{
+			emu->stats.reads++;
+			if (emu->suspended && emu->addr >= emu->eaddr &&
+					emu->addr < emu->eaddr + emu->esize)
+				emu->stats.erase_reads++;
+		}
+		emu->stats.read_bytes++;
+		out = emu->mem[emu->addr];
+		// Undefined data of the sector being erased
+		if (emu->suspended && emu->addr >= emu->eaddr &&
+				emu->addr < emu->eaddr + emu->esize)
+			out ^= 0x5A;
+		emu->addr = (emu->addr + 1) % emu->capacity;
+		return out;
+	case CMD_PROGRAM:
+	case CMD_PROGRAM_4B:
+		if (pos <= alen)
+		{
+			emu->addr = emu->addr << 8 | in;
+			return 0xFF;
+		}
+		// Wraps around the page
+		emu->page[(emu->addr + emu->plen) % W25Q_EMU_PAGE] = in;
+		emu->pset[(emu->addr + emu->plen) % W25Q_EMU_PAGE] = 1;
+		if (emu->plen < W25Q_EMU_PAGE)
+			emu->plen++;
+		return 0xFF;
+	case CMD_SECTOR_ERASE:
+	case CMD_SECTOR_ERASE_4B:
+	case CMD_BLOCK32_ERASE:
+	case CMD_BLOCK_ERASE:
+	case CMD_BLOCK_ERASE_4B:
+		if (pos <= alen)
+			emu->addr = emu->addr << 8 | in;
+		return 0xFF;
+	default:
+		return 0xFF;
+	}
+}
+
+/******************************************************************************/
+void w25q_emu_xfer(struct w25q_emu *emu, const uint8_t *tx, uint8_t *rx,
+		size_t size)
+{
+	uint8_t in;
+	uint8_t out;
+
+	for (size_t i = 0; i < size; i++)
+	{
+		in = tx ? tx[i] : 0xFF;
+		emu->stats.spi_bytes++;
+
+		if (!emu->selected)
+			out = 0xFF;
+		else if (emu->dead)
+			out = 0x00;
+		else if (!emu->pos)
+			out = start(emu, in);
+		else if (emu->cmd == CMD_IGNORED)
+			out = 0xFF;
+		else
+			out = data(emu, in);
+
+		if (emu->selected)
+			emu->pos++;
+		if (rx)
+			rx[i] = out;
+	}
+}
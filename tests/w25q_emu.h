@@ -0,0 +1,122 @@
+/*
+ * W25Q Serial FLASH memory emulator
+ *
+ * RAM-backed command decoder behind the host SPI (see host.h). Programs only
+ * clear bits, erases set whole sectors or blocks to 0xFF, both keep the
+ * memory busy for the configured time of the virtual clock. Erase
+ * suspend/resume, SFDP (JESD216A Basic Flash Parameter Table), power-down and
+ * a power cut in the middle of a program or erase are modeled. Protocol
+ * errors of the driver are counted, not fatal.
+ */
+
+#ifndef W25Q_EMU_H_
+#define W25Q_EMU_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define W25Q_EMU_PAGE   256
+#define W25Q_EMU_SECTOR 4096
+
+/*
+ * Typical times of W25Q64JV, the memory is busy that long
+ */
+struct w25q_emu_timing
+{
+	uint32_t program_us;  // tPP
+	uint32_t sector_us;   // tSE, 4 KB
+	uint32_t block32_us;  // tBE1, 32 KB
+	uint32_t block64_us;  // tBE2, 64 KB
+	uint32_t chip_ms;     // tCE
+	uint32_t suspend_us;  // tSUS
+};
+
+struct w25q_emu_stats
+{
+	uint32_t commands;
+	uint64_t spi_bytes;    // Both directions, command headers included
+	uint32_t reads;
+	uint64_t read_bytes;
+	uint32_t programs;
+	uint64_t program_bytes;
+	uint32_t erases;
+	uint32_t polls;        // Status register reads
+	uint32_t suspends;
+	uint64_t busy_us;      // Time spent programming and erasing
+
+	// Driver errors
+	uint32_t busy;         // Commands ignored while busy
+	uint32_t no_wel;       // Program or erase without write enable
+	uint32_t set_bits;     // Programmed bytes trying to set a 0 bit
+	uint32_t erase_reads;  // Reads of the range of a suspended erase
+};
+
+struct w25q_emu
+{
+	uint8_t *mem;
+	uint32_t capacity;
+	uint32_t jedec_id;
+	uint32_t sfdp_dwords;  // BFPT length, 0 - no SFDP
+	uint8_t addr4;         // 0 - 3-byte, 1 - 3 or 4-byte, 2 - 4-byte only
+	struct w25q_emu_timing timing;
+	struct w25q_emu_stats stats;
+	uint32_t *wear;        // Erases of every sector
+
+	// Power cut: the cut-th program or erase from now is interrupted after
+	// "keep" parts of 256 are done, the memory is dead until power-on
+	uint32_t cut;
+	uint32_t keep;
+	uint8_t dead;
+
+	// Transaction
+	uint8_t selected;
+	uint8_t cmd;
+	uint32_t pos;
+	uint32_t addr;
+	uint8_t page[W25Q_EMU_PAGE];
+	uint32_t plen;
+	uint8_t pset[W25Q_EMU_PAGE];
+
+	// Device state
+	uint8_t wel;
+	uint8_t pd;            // Powered down
+	uint64_t busy_until;   // ns
+	uint8_t erasing;
+	uint32_t eaddr;
+	uint32_t esize;
+	uint8_t suspended;
+	uint64_t remaining;    // ns of a suspended erase
+	uint64_t started;      // ns
+	uint8_t sfdp[256];
+};
+
+/*
+ * @brief: W25Q64JV (8 MB) defaults: erased memory, SFDP, typical timings
+ */
+void w25q_emu_init(struct w25q_emu *emu, uint32_t capacity);
+void w25q_emu_free(struct w25q_emu *emu);
+
+/*
+ * @brief: Rebuild the SFDP table after changing capacity, addr4, timing or
+ * sfdp_dwords
+ */
+void w25q_emu_sfdp(struct w25q_emu *emu);
+
+/*
+ * @brief: Interrupt the n-th program or erase from now (1 - the next one)
+ * @param keep: Done part of the interrupted operation, 0..256 of 256
+ */
+void w25q_emu_cut(struct w25q_emu *emu, uint32_t n, uint32_t keep);
+// Power on after a cut: the memory keeps its content, the state is reset
+void w25q_emu_power_on(struct w25q_emu *emu);
+
+// Complete the operation in progress if its time has passed
+void w25q_emu_update(struct w25q_emu *emu);
+int w25q_emu_busy(struct w25q_emu *emu);
+
+// SPI side, called by the host HAL
+void w25q_emu_select(struct w25q_emu *emu, int selected);
+void w25q_emu_xfer(struct w25q_emu *emu, const uint8_t *tx, uint8_t *rx,
+		size_t size);
+
+#endif /* W25Q_EMU_H_ */